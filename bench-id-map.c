@@ -0,0 +1,122 @@
+/*
+	Copyright (C) 2010 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of Spacenerds In Space.
+
+	Spacenerds in Space is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	Spacenerds in Space is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Spacenerds in Space; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+/*
+ * Compares finding objects by id with snis_id_map against searching go[] as
+ * lookup_by_id() in snis_server.c used to, with go[] full (MAXGAMEOBJS) and
+ * with it as full as it usually is, the ids in go[] having been churned
+ * by objects dying and being replaced.
+ *
+ *	make O=1 bench-id-map && ./bench-id-map [lookups]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "snis_id_map.h"
+
+/* As in snis.h, which can't be included without the OpenGL headers */
+#define MAXGAMEOBJS 5000
+
+/* about the size of struct snis_entity, so the search strides memory as it would */
+struct thing {
+	uint32_t id;
+	unsigned char rest[2708];
+};
+
+static struct thing go[MAXGAMEOBJS];
+static int highest;
+
+static int linear_lookup(uint32_t id)
+{
+	int i;
+
+	for (i = 0; i <= highest; i++) {
+		if (go[i].id == id)
+			return i;
+	}
+	return -1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(int nobjs, int nlookups)
+{
+	struct snis_id_map *map = snis_id_map_new(MAXGAMEOBJS);
+	uint32_t next_id = 0, *want;
+	double start, linear, hashed;
+	long sum_linear = 0, sum_hashed = 0;
+	int i, j;
+
+	srand(1234);
+	for (i = 0; i < MAXGAMEOBJS; i++)
+		go[i].id = (uint32_t) -1;
+	for (i = 0; i < nobjs; i++) {
+		go[i].id = next_id++;
+		snis_id_map_add(map, go[i].id, i);
+	}
+	highest = nobjs - 1;
+	for (i = 0; i < 10 * nobjs; i++) {
+		j = rand() % nobjs;
+		snis_id_map_remove(map, go[j].id);
+		go[j].id = next_id++;
+		snis_id_map_add(map, go[j].id, j);
+	}
+	/* mostly live ids, as the server mostly looks up, some stale ones */
+	want = malloc(sizeof(*want) * nlookups);
+	for (i = 0; i < nlookups; i++)
+		want[i] = (i % 10) ? go[rand() % nobjs].id : (uint32_t) (rand() % next_id);
+
+	start = now();
+	for (i = 0; i < nlookups; i++)
+		sum_linear += linear_lookup(want[i]);
+	linear = now() - start;
+	start = now();
+	for (i = 0; i < nlookups; i++)
+		sum_hashed += snis_id_map_lookup(map, want[i]);
+	hashed = now() - start;
+
+	printf("%5d objects: linear %9.1f nsec, id map %6.1f nsec per lookup%s\n",
+		nobjs, linear * 1e9 / nlookups, hashed * 1e9 / nlookups,
+		sum_linear == sum_hashed ? "" : " MISMATCH");
+	free(want);
+	snis_id_map_free(map);
+}
+
+int main(int argc, char *argv[])
+{
+	int nlookups = 100000;
+
+	if (argc > 1)
+		nlookups = atoi(argv[1]);
+	run(MAXGAMEOBJS, nlookups);
+	run(1000, nlookups);
+	run(100, nlookups);
+	return 0;
+}
@@ -0,0 +1,266 @@
+/*
+	Copyright (C) 2010 Stephen M. Cameron
+	Author: Stephen M. Cameron
+
+	This file is part of Spacenerds In Space.
+
+	Spacenerds in Space is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	Spacenerds in Space is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Spacenerds in Space; if not, write to the Free Software
+	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Compares the hashed 3D grid in space-part.c with the 40x40 grid of linked
+ * lists on the x/z plane which it replaced, for a universe laid out like the
+ * one snis_server makes, and for a denser one.  Each simulated tick moves the
+ * ships and has each ship look around itself a few times, as ship_move() and
+ * ai_brain() do.
+ *
+ *	make O=1 bench-space-part && ./bench-space-part [ticks]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "space-part.h"
+
+/* As in snis.h, which can't be included without the OpenGL headers */
+#define XKNOWN_DIM 600000.0
+#define YKNOWN_DIM 120000.0
+#define ZKNOWN_DIM XKNOWN_DIM
+#define UNIVERSE_LIMIT (XKNOWN_DIM * 2.0)
+#define NASTEROIDS 200
+#define NASTEROID_CLUSTERS 10
+#define ASTEROID_CLUSTER_RADIUS 20000.0
+#define NESHIPS 250
+#define NOTHER_OBJECTS 90 /* bases, derelicts, nebulae and planets */
+
+#define QUERIES_PER_SHIP 4
+#define NEIGHBORHOOD 30000.0
+
+struct old_entry {
+	struct old_entry *next, *prev;
+	int cell;
+};
+
+struct thing {
+	double x, y, z, vx, vz;
+	int is_ship;
+	struct space_partition_entry e;
+	struct old_entry old;
+};
+
+/* The old grid, cut down to what the benchmark needs */
+#define OLD_DIM 40
+static struct old_entry *old_cell[OLD_DIM * OLD_DIM], *old_common;
+
+static int old_cell_of(double x, double z)
+{
+	int cx = ((x + UNIVERSE_LIMIT) / (2.0 * UNIVERSE_LIMIT)) * OLD_DIM;
+	int cz = ((z + UNIVERSE_LIMIT) / (2.0 * UNIVERSE_LIMIT)) * OLD_DIM;
+
+	if (cx < 0 || cx >= OLD_DIM || cz < 0 || cz >= OLD_DIM)
+		return -1;
+	return cx * OLD_DIM + cz;
+}
+
+static struct old_entry **old_head(int cell)
+{
+	return cell < 0 ? &old_common : &old_cell[cell];
+}
+
+static void old_update(struct thing *t)
+{
+	struct old_entry *e = &t->old, **head;
+	int cell = old_cell_of(t->x, t->z);
+
+	if (e->cell == cell)
+		return;
+	head = old_head(e->cell);
+	if (*head == e)
+		*head = e->next;
+	if (e->prev)
+		e->prev->next = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	head = old_head(cell);
+	e->cell = cell;
+	e->prev = NULL;
+	e->next = *head;
+	if (*head)
+		(*head)->prev = e;
+	*head = e;
+}
+
+static void old_process(struct thing *t, void *context, space_partition_function fn)
+{
+	double cw = 2.0 * UNIVERSE_LIMIT / OLD_DIM, cx, cz;
+	int cell[4], i, xo, zo, common_done = 0;
+	struct old_entry *e;
+
+	cx = floor((t->x + UNIVERSE_LIMIT) / cw) * cw + 0.5 * cw - UNIVERSE_LIMIT;
+	cz = floor((t->z + UNIVERSE_LIMIT) / cw) * cw + 0.5 * cw - UNIVERSE_LIMIT;
+	xo = t->x < cx ? -OLD_DIM : OLD_DIM;
+	zo = t->z < cz ? -1 : 1;
+	cell[0] = t->old.cell;
+	cell[1] = t->old.cell + xo;
+	cell[2] = t->old.cell + zo;
+	cell[3] = t->old.cell + xo + zo;
+	for (i = 0; i < 4; i++) {
+		if (cell[i] < 0 || cell[i] >= OLD_DIM * OLD_DIM) {
+			if (common_done)
+				continue;
+			common_done = 1;
+			cell[i] = -1;
+		}
+		for (e = *old_head(cell[i]); e; e = e->next)
+			fn(context, (unsigned char *) e - offsetof(struct thing, old));
+	}
+}
+
+struct look_context {
+	struct thing *me;
+	long visits, near;
+};
+
+static void look(void *context, void *entity)
+{
+	struct look_context *lc = context;
+	struct thing *t = entity;
+	double dx = t->x - lc->me->x, dy = t->y - lc->me->y, dz = t->z - lc->me->z;
+
+	lc->visits++;
+	if (dx * dx + dy * dy + dz * dz < NEIGHBORHOOD * NEIGHBORHOOD)
+		lc->near++;
+}
+
+static double randd(double limit)
+{
+	return limit * (rand() / (RAND_MAX + 1.0));
+}
+
+/* ships anywhere, the rest in asteroid field like clusters */
+static struct thing *make_universe(int nships, int nclustered, int nclusters)
+{
+	struct thing *t = calloc(nships + nclustered, sizeof(*t));
+	double cx = 0, cy = 0, cz = 0, a, a2, r;
+	int i, j;
+
+	srand(1234);
+	for (i = 0; i < nships; i++) {
+		t[i].x = randd(XKNOWN_DIM);
+		t[i].y = randd(YKNOWN_DIM) - YKNOWN_DIM / 2.0;
+		t[i].z = randd(ZKNOWN_DIM);
+		t[i].vx = randd(200.0) - 100.0;
+		t[i].vz = randd(200.0) - 100.0;
+		t[i].is_ship = 1;
+	}
+	for (i = 0; i < nclustered; i++) {
+		if (i % (nclustered / nclusters) == 0) {
+			cx = randd(XKNOWN_DIM);
+			cy = randd(YKNOWN_DIM) - YKNOWN_DIM / 2.0;
+			cz = randd(ZKNOWN_DIM);
+		}
+		a = randd(2.0 * M_PI);
+		a2 = randd(2.0 * M_PI);
+		r = randd(ASTEROID_CLUSTER_RADIUS);
+		t[nships + i].x = cx + r * sin(a);
+		t[nships + i].y = cy + r * cos(a2);
+		t[nships + i].z = cz + r * cos(a);
+	}
+	/* park some ships in the clusters, where the queries are expensive */
+	for (i = 0; i < nships / 4; i++) {
+		j = nships + (i * 7) % nclustered;
+		t[i].x = t[j].x;
+		t[i].y = t[j].y;
+		t[i].z = t[j].z;
+	}
+	return t;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *label, int nships, int nclustered, int ticks, double cell_size)
+{
+	struct thing *t = make_universe(nships, nclustered, NASTEROID_CLUSTERS);
+	struct space_partition *sp = NULL;
+	struct look_context lc = { 0 };
+	int n = nships + nclustered, i, j, q;
+	double start, elapsed;
+
+	memset(old_cell, 0, sizeof(old_cell));
+	old_common = NULL;
+	if (cell_size > 0)
+		sp = space_partition_init(cell_size, NEIGHBORHOOD, offsetof(struct thing, e));
+	for (i = 0; i < n; i++) {
+		t[i].old.cell = -2;
+		if (sp)
+			space_partition_update(sp, &t[i], t[i].x, t[i].y, t[i].z);
+		else
+			old_update(&t[i]);
+	}
+	start = now();
+	for (j = 0; j < ticks; j++) {
+		for (i = 0; i < nships; i++) {
+			t[i].x += t[i].vx;
+			t[i].z += t[i].vz;
+			if (sp)
+				space_partition_update(sp, &t[i], t[i].x, t[i].y, t[i].z);
+			else
+				old_update(&t[i]);
+			lc.me = &t[i];
+			for (q = 0; q < QUERIES_PER_SHIP; q++) {
+				if (sp)
+					space_partition_process(sp, t[i].x, t[i].y, t[i].z, &lc, look);
+				else
+					old_process(&t[i], &lc, look);
+			}
+		}
+	}
+	elapsed = now() - start;
+	if (sp)
+		printf("%-8s hashed 3D, cell %6.0f: %8.1f usec/tick, %6.1f visited, %5.1f near per query\n",
+			label, cell_size, elapsed * 1e6 / ticks,
+			(double) lc.visits / (ticks * nships * QUERIES_PER_SHIP),
+			(double) lc.near / (ticks * nships * QUERIES_PER_SHIP));
+	else
+		printf("%-8s old 40x40 2D grid:    %8.1f usec/tick, %6.1f visited, %5.1f near per query\n",
+			label, elapsed * 1e6 / ticks,
+			(double) lc.visits / (ticks * nships * QUERIES_PER_SHIP),
+			(double) lc.near / (ticks * nships * QUERIES_PER_SHIP));
+	space_partition_free(sp);
+	free(t);
+}
+
+int main(int argc, char *argv[])
+{
+	static const double cell_size[] = { 0, 10000, 15000, 20000, 30000, 60000 };
+	int ticks = 100, i;
+
+	if (argc > 1)
+		ticks = atoi(argv[1]);
+	for (i = 0; i < (int) (sizeof(cell_size) / sizeof(cell_size[0])); i++)
+		run("default", NESHIPS, NASTEROIDS + NOTHER_OBJECTS, ticks, cell_size[i]);
+	for (i = 0; i < (int) (sizeof(cell_size) / sizeof(cell_size[0])); i++)
+		run("dense", 4 * NESHIPS, 20 * NASTEROIDS, ticks, cell_size[i]);
+	return 0;
+}
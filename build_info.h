@@ -0,0 +1,8 @@
+#ifndef __BUILD_INFO
+#define __BUILD_INFO
+
+/* This file is machine generated */
+#define BUILD_INFO_STRING1 "v. " SNIS_VERSION " - 64-bit little-endian x86_64 GNU/Linux"
+#define BUILD_INFO_STRING2 "2026-10-17 10:11:26 5793a17aaa94f45504ac89220b32ad4bf14eb819 + 3639"
+
+#endif
@@ -853,7 +853,7 @@ static void update_entity_child_state(struct entity *e)
 
 void render_entities(struct entity_context *cx)
 {
-	int i, j, n;
+	int i, j;
 	struct camera_info *c = &cx->camera;
 
 	sng_set_3d_viewport(cx->window_offset_x, cx->window_offset_y, c->xvpixels, c->yvpixels);
@@ -901,15 +901,10 @@ void render_entities(struct entity_context *cx)
 		struct frustum *f = &rendering_pass[pass];
 
 		/* find all entities in view frustum and sort them by distance */
-		n = snis_object_pool_highest_object(cx->entity_pool);
-
 		cx->nnear_to_far_entity_depth = 0;
 		cx->nfar_to_near_entity_depth = 0;
 
-		for (j = 0; j <= n; j++) {
-			if (!snis_object_pool_is_allocated(cx->entity_pool, j))
-				continue;
-
+		for_each_allocated_object(cx->entity_pool, j) {
 			struct entity *e = &cx->entity_list[j];
 
 			if (e->m == NULL)
@@ -26,7 +26,18 @@
 #include "docking_port.h"
 #include "space-part.h"
 
-#define SNIS_PROTOCOL_VERSION "SNIS001"
+#define SNIS_PROTOCOL_VERSION "SNIS002"
+#define SNIS_PROTOCOL_VERSION_1 "SNIS001" /* predates capability negotiation */
+
+/* Capabilities negotiated at connect time.  The client follows the protocol
+ * version with a uint32_t of the capabilities it would like, and the server
+ * replies with those it agrees to.
+ */
+#define SNIS_CAP_COMPRESSION (1 << 0) /* zlib stream compression, both ways */
+#define SNIS_CAP_DELTA_UPDATES (1 << 1) /* client understands OPCODE_UPDATE_DELTA */
+#define SNIS_CAP_COMPACT_UPDATES (1 << 2) /* client understands OPCODE_UPDATE_COMPACT */
+#define SNIS_CAP_UDP (1 << 3) /* client takes object state updates by UDP, see snis_udp.h */
+#define SNIS_CAP_COMPRESSION_STATS (1 << 4) /* OPCODE_UPDATE_NETSTATS ends with compression figures */
 #define COMMON_MTWIST_SEED 97872
 /* dimensions of the "known" universe */
 #define XKNOWN_DIM 600000.0
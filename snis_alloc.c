@@ -32,15 +32,25 @@
 
 /* borrowed heavily from Word War vi (wordwarvi.c, http://wordwarvi.sf.net ) */
 
+/*
+ * One bit per object, set if the object is allocated, 64 to a block.  Free
+ * and allocated objects are found a block at a time by counting trailing or
+ * leading zeroes, rather than testing bits one by one.
+ */
 struct snis_object_pool {
 	int nbitblocks;
 	int highest_object_number;
+	int lowest_free_block; /* no block below this one has a free bit */
 	int maxobjs;
-	uint32_t *free_obj_bitmap;
+	uint64_t *free_obj_bitmap;
 };
 
+#define BLOCK(id) ((id) >> 6)
+#define BIT(id) ((uint64_t) 1 << ((id) & 63))
+#define FULL_BLOCK (~(uint64_t) 0)
+
 #define BITISSET(pool, id) \
-        ((pool)->free_obj_bitmap[(id) >> 5] & (1 << ((id) % 32)))
+        ((pool)->free_obj_bitmap[BLOCK(id)] & BIT(id))
 
 void snis_object_pool_setup(struct snis_object_pool **pool, int maxobjs)
 {
@@ -49,63 +59,43 @@ void snis_object_pool_setup(struct snis_object_pool **pool, int maxobjs)
 	*pool = malloc(sizeof(**pool));
 	p = *pool;
 	p->maxobjs = maxobjs;
-	p->nbitblocks = ((maxobjs >> 5) + 1);  /* 5, 2^5 = 32, 32 bits per int. */
+	p->nbitblocks = BLOCK(maxobjs) + 1;
 	p->highest_object_number = -1;
-	p->free_obj_bitmap = malloc(sizeof(p->free_obj_bitmap) * p->nbitblocks);
+	p->lowest_free_block = 0;
+	p->free_obj_bitmap = malloc(sizeof(*p->free_obj_bitmap) * p->nbitblocks);
 	memset(p->free_obj_bitmap, 0, sizeof(*p->free_obj_bitmap) * p->nbitblocks);
 }
 
 int snis_object_pool_use_obj(struct snis_object_pool *pool, int id)
 {
-	if (id < 0 || id > pool->maxobjs)
+	if (id < 0 || id >= pool->maxobjs)
 		return -1;
         if (BITISSET(pool, id)) /* bit already set? */
 		printf("bit already set in snis_object_pool_use_obj, id = %d\n", id);
-        pool->free_obj_bitmap[id >> 5] &= (1 << (id % 32)); /* set the proper bit. */ 
+        pool->free_obj_bitmap[BLOCK(id)] |= BIT(id); /* set the proper bit. */
+	if (id > pool->highest_object_number)
+		pool->highest_object_number = id;
 	return id;
 }
 
 int snis_object_pool_alloc_obj(struct snis_object_pool *pool)
 {
-	int i, j, answer;
-	unsigned int block;
-
-	/* this might be optimized by find_first_zero_bit, or whatever */
-	/* it's called that's in the linux kernel.  But, it's pretty */
-	/* fast as is, and this is portable without writing asm code. */
-	/* Er, portable, except for assuming an int is 32 bits. */
+	int i, answer;
+	uint64_t block;
 
-	for (i = 0; i < pool->nbitblocks; i++) {
-		if (pool->free_obj_bitmap[i] == 0xffffffff) /* is this block full?  continue. */
+	for (i = pool->lowest_free_block; i < pool->nbitblocks; i++) {
+		block = pool->free_obj_bitmap[i];
+		if (block == FULL_BLOCK)
 			continue;
-
-		/* I tried doing a preliminary binary search using bitmasks to figure */
-		/* which byte in block contains a free slot so that the for loop only */
-		/* compared 8 bits, rather than up to 32.  This resulted in a performance */
-		/* drop, (according to the gprof) perhaps contrary to intuition.  My guess */
-		/* is branch misprediction hurt performance in that case.  Just a guess though. */
-
-		/* undoubtedly the best way to find the first empty bit in an array of ints */
-		/* is some custom ASM code.  But, this is portable, and seems fast enough. */
-		/* profile says we spend about 3.8% of time in here. */
-	
-		/* Not full. There is an empty slot in this block, find it. */
-		block = pool->free_obj_bitmap[i];			
-		for (j = 0; j < 32; j++) {
-			if (block & 0x01) {	/* is bit j set? */
-				block = block >> 1;
-				continue;	/* try the next bit. */
-			}
-
-			/* Found free bit, bit j.  Set it, marking it non free.  */
-			pool->free_obj_bitmap[i] |= (1 << j);
-			answer = (i * 32 + j);	/* return the corresponding array index, if in bounds. */
-			if (answer >= pool->maxobjs)
-				goto allocation_failure;
-			if (answer > pool->highest_object_number)
-				pool->highest_object_number = answer;
-			return answer;
-		}
+		/* the lowest clear bit is the lowest set bit of the complement */
+		answer = i * 64 + __builtin_ctzll(~block);
+		pool->lowest_free_block = i;
+		if (answer >= pool->maxobjs)
+			goto allocation_failure;
+		pool->free_obj_bitmap[i] |= BIT(answer);
+		if (answer > pool->highest_object_number)
+			pool->highest_object_number = answer;
+		return answer;
 	}
 
 allocation_failure:
@@ -117,20 +107,20 @@ allocation_failure:
 
 void snis_object_pool_free_object(struct snis_object_pool *pool, int i)
 {
-	int j;
+	uint64_t block;
 
-        pool->free_obj_bitmap[i >> 5] &= ~(1 << (i % 32)); /* clear the proper bit. */ 
+        pool->free_obj_bitmap[BLOCK(i)] &= ~BIT(i); /* clear the proper bit. */
+	if (BLOCK(i) < pool->lowest_free_block)
+		pool->lowest_free_block = BLOCK(i);
 	if (i != pool->highest_object_number)
 		return;
 
-	for (i = pool->nbitblocks - 1; i >= 0; i--) {
-		if (pool->free_obj_bitmap[i] == 0)
-			continue;
-		for (j = 31 ; j >= 0; j--) {
-			if (pool->free_obj_bitmap[i] & (1 << j)) {
-				pool->highest_object_number = (i << 5) + j;
-				return;
-			}
+	/* nothing above i is allocated, so look down from i's block */
+	for (i = BLOCK(i); i >= 0; i--) {
+		block = pool->free_obj_bitmap[i];
+		if (block) {
+			pool->highest_object_number = i * 64 + 63 - __builtin_clzll(block);
+			return;
 		}
 	}
 	pool->highest_object_number = -1;
@@ -139,6 +129,7 @@ void snis_object_pool_free_object(struct snis_object_pool *pool, int i)
 void snis_object_pool_free_all_objects(struct snis_object_pool* pool)
 {
 	pool->highest_object_number = -1;
+	pool->lowest_free_block = 0;
 	memset(pool->free_obj_bitmap, 0, sizeof(*pool->free_obj_bitmap) * pool->nbitblocks);
 }
 
@@ -154,6 +145,145 @@ void snis_object_pool_free(struct snis_object_pool *pool)
 
 int snis_object_pool_is_allocated(struct snis_object_pool *pool, int id)
 {
-        return BITISSET(pool, id);
+        return BITISSET(pool, id) != 0;
+}
+
+int snis_object_pool_next_allocated(struct snis_object_pool *pool, int i)
+{
+	int b, last;
+	uint64_t block;
+
+	if (i < 0)
+		i = 0;
+	if (i > pool->highest_object_number)
+		return -1;
+	b = BLOCK(i);
+	last = BLOCK(pool->highest_object_number);
+	block = pool->free_obj_bitmap[b] & (FULL_BLOCK << (i & 63));
+	while (!block) {
+		/* can't run off the end, highest_object_number is allocated */
+		if (++b > last)
+			return -1;
+		block = pool->free_obj_bitmap[b];
+	}
+	return b * 64 + __builtin_ctzll(block);
 }
 
+#ifdef TEST_SNIS_ALLOC
+#define TEST_MAXOBJS 5000
+
+/* Checks the pool against a plain array of flags */
+static int check_pool(struct snis_object_pool *pool, const char *allocated)
+{
+	int i, j, highest = -1;
+
+	for (i = 0; i < TEST_MAXOBJS; i++) {
+		if (!!snis_object_pool_is_allocated(pool, i) != allocated[i]) {
+			printf("FAIL: object %d allocated is %d, expected %d\n", i,
+				snis_object_pool_is_allocated(pool, i), allocated[i]);
+			return 1;
+		}
+		if (allocated[i])
+			highest = i;
+	}
+	if (snis_object_pool_highest_object(pool) != highest) {
+		printf("FAIL: highest object %d, expected %d\n",
+			snis_object_pool_highest_object(pool), highest);
+		return 1;
+	}
+	j = 0;
+	for_each_allocated_object(pool, i) {
+		for (; j < i; j++)
+			if (allocated[j]) {
+				printf("FAIL: for_each_allocated_object skipped %d\n", j);
+				return 1;
+			}
+		if (!allocated[i]) {
+			printf("FAIL: for_each_allocated_object visited free object %d\n", i);
+			return 1;
+		}
+		j = i + 1;
+	}
+	for (; j < TEST_MAXOBJS; j++)
+		if (allocated[j]) {
+			printf("FAIL: for_each_allocated_object stopped before %d\n", j);
+			return 1;
+		}
+	return 0;
+}
+
+static int test_against_array(void)
+{
+	static char allocated[TEST_MAXOBJS];
+	struct snis_object_pool *pool;
+	int i, j, round;
+
+	snis_object_pool_setup(&pool, TEST_MAXOBJS);
+	if (check_pool(pool, allocated))
+		return 1;
+	for (i = 0; i < TEST_MAXOBJS; i++) {
+		if (snis_object_pool_alloc_obj(pool) != i) {
+			printf("FAIL: objects not allocated lowest first\n");
+			return 1;
+		}
+		allocated[i] = 1;
+	}
+	printf("An allocation failure and stack trace should follow:\n");
+	if (snis_object_pool_alloc_obj(pool) != -1) {
+		printf("FAIL: allocated more than maxobjs\n");
+		return 1;
+	}
+	for (round = 0; round < 100000; round++) {
+		i = rand() % TEST_MAXOBJS;
+		if (round % 3 == 0)
+			i = snis_object_pool_highest_object(pool);
+		if (i >= 0 && allocated[i]) {
+			snis_object_pool_free_object(pool, i);
+			allocated[i] = 0;
+		}
+		if (rand() % 2) {
+			for (j = 0; j < TEST_MAXOBJS && allocated[j]; j++)
+				;
+			i = snis_object_pool_alloc_obj(pool);
+			if (i != j) {
+				printf("FAIL: allocated %d, expected %d\n", i, j);
+				return 1;
+			}
+			allocated[i] = 1;
+		}
+		if (round % 997 == 0 && check_pool(pool, allocated))
+			return 1;
+	}
+	if (check_pool(pool, allocated))
+		return 1;
+
+	/* freeing objects while visiting them */
+	for_each_allocated_object(pool, i) {
+		snis_object_pool_free_object(pool, i);
+		allocated[i] = 0;
+	}
+	if (check_pool(pool, allocated))
+		return 1;
+	if (snis_object_pool_use_obj(pool, 4321) != 4321 || snis_object_pool_alloc_obj(pool) != 0)
+		return 1;
+	allocated[4321] = allocated[0] = 1;
+	if (check_pool(pool, allocated))
+		return 1;
+	snis_object_pool_free_all_objects(pool);
+	memset(allocated, 0, sizeof(allocated));
+	if (check_pool(pool, allocated))
+		return 1;
+	snis_object_pool_free(pool);
+	free(pool);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+
+	rc = test_against_array();
+	printf("test_against_array %s\n", rc ? "failed" : "passed");
+	return rc;
+}
+#endif
@@ -38,4 +38,14 @@ GLOBAL int snis_object_pool_highest_object(struct snis_object_pool *pool);
 GLOBAL void snis_object_pool_free(struct snis_object_pool *pool);
 GLOBAL int snis_object_pool_is_allocated(struct snis_object_pool *pool, int id);
 
+/* Returns the lowest allocated object at or above i, or -1 if there is none */
+GLOBAL int snis_object_pool_next_allocated(struct snis_object_pool *pool, int i);
+
+/* Visits each allocated object in turn, lowest first.  The object visited may
+ * be freed, and objects allocated above it will be visited.
+ */
+#define for_each_allocated_object(pool, i) \
+	for ((i) = snis_object_pool_next_allocated((pool), 0); (i) >= 0; \
+		(i) = snis_object_pool_next_allocated((pool), (i) + 1))
+
 #endif
@@ -83,6 +83,9 @@
 #include "snis_text_window.h"
 #include "snis_text_input.h"
 #include "snis_socket_io.h"
+#include "snis_udp.h"
+#include "snis_id_map.h"
+#include "snis_tick_profile.h"
 #include "ssgl/ssgl.h"
 #include "snis_marshal.h"
 #include "snis_packet.h"
@@ -239,6 +242,8 @@ struct client_network_stats {
 	uint32_t nobjects, nships;
 	uint32_t elapsed_seconds;
 	uint32_t faction_population[5];
+	uint64_t bytes_deflated_in, bytes_deflated_out;
+	uint64_t compression_usec;
 } netstats;
 
 int nframes = 0;
@@ -261,6 +266,23 @@ int have_packets_for_server = 0;
 
 int lobby_socket = -1;
 int gameserver_sock = -1;
+static struct snis_socket_reader *gameserver_input;
+static struct snis_deflater *gameserver_deflater; /* if SNIS_CAP_COMPRESSION was agreed */
+static uint32_t gameserver_capabilities; /* SNIS_CAP_*, as agreed by the server */
+#define GAMESERVER_INPUT_BUFFER_SIZE (64 * 1024)
+static char *record_file = NULL; /* --record, what the server sends us is copied here */
+static char *replay_file = NULL; /* --replay, read this instead of connecting to a server */
+static int replay_realtime = 0; /* --replay-realtime, replay at the recorded pace */
+
+/* Where the time goes when replaying a recording, in seconds */
+static struct replay_stats {
+	double start;
+	uint64_t opcodes;
+	double decode_time; /* reading and expanding updates */
+	double process_time; /* everything done per opcode, decode_time included */
+	int frames;
+	double frame_time, max_frame_time;
+} replay_stats;
 int lobby_count = 0;
 char lobbyerror[200];
 char *lobbyhost = "localhost";
@@ -524,11 +546,12 @@ static int damconscreeny0 = 80;
 
 static struct snis_entity go[MAXGAMEOBJS];
 #define go_index(snis_entity_ptr) ((snis_entity_ptr) - &go[0])
+static struct snis_id_map *id_map; /* object id to index in go[] */
 static struct snis_damcon_entity dco[MAXDAMCONENTITIES];
 static struct snis_object_pool *sparkpool;
 static struct snis_entity spark[MAXSPARKS];
 #define spark_index(snis_entity_ptr) ((snis_entity_ptr) - &spark[0])
-static pthread_mutex_t universe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t universe_mutex; /* recursive, see init_universe_mutex() */
 
 static double quat_to_heading(const union quat *q)
 {
@@ -554,6 +577,7 @@ static int add_generic_object(uint32_t id, uint32_t timestamp, double x, double
 
 	memset(&go[i], 0, sizeof(go[i]));
 	go[i].id = id;
+	snis_id_map_add(id_map, id, i);
 	go[i].nupdates = 1;
 	go[i].updatetime[0] = t;
 	go[i].o[0] = *orientation;
@@ -620,12 +644,7 @@ static void update_generic_object(int index, uint32_t timestamp, double x, doubl
 
 static int lookup_object_by_id(uint32_t id)
 {
-	int i;
-
-	for (i = 0; i <= snis_object_pool_highest_object(pool); i++)
-		if (go[i].id == id)
-			return i;
-	return -1;
+	return snis_id_map_lookup(id_map, id);
 }
 
 static struct snis_entity *lookup_entity_by_id(uint32_t id)
@@ -1737,7 +1756,7 @@ static void move_sparks(void)
 {
 	int i;
 
-	for (i = 0; i <= snis_object_pool_highest_object(sparkpool); i++)
+	for_each_allocated_object(sparkpool, i)
 		if (spark[i].alive)
 			spark[i].move(&spark[i]);
 }
@@ -2016,11 +2035,9 @@ static void move_objects(void)
 	int i;
 	double timestamp = universe_timestamp();
 
-	for (i = 0; i <= snis_object_pool_highest_object(pool); i++) {
+	for_each_allocated_object(pool, i) {
 		struct snis_entity *o = &go[i];
 
-		if (!snis_object_pool_is_allocated(pool, i))
-			continue;
 		switch (o->type) {
 		case OBJTYPE_SHIP1:
 		case OBJTYPE_SHIP2:
@@ -3638,7 +3655,7 @@ static int process_update_power_data(void)
 	struct power_model_data pmd;
 	unsigned char buffer[sizeof(pmd) + sizeof(uint32_t)];
 
-	rc = snis_readsocket(gameserver_sock, buffer, sizeof(pmd) + sizeof(uint32_t));
+	rc = snis_socket_reader_read(gameserver_input, buffer, sizeof(pmd) + sizeof(uint32_t));
 	if (rc != 0)
 		return rc;
 	packed_buffer_init(&pb, buffer, sizeof(buffer));
@@ -3658,7 +3675,7 @@ static int process_update_coolant_data(void)
 	struct ship_damage_data temperature_data;
 	unsigned char buffer[sizeof(pmd) + sizeof(temperature_data) + sizeof(uint32_t)];
 
-	rc = snis_readsocket(gameserver_sock, buffer, sizeof(buffer));
+	rc = snis_socket_reader_read(gameserver_input, buffer, sizeof(buffer));
 	if (rc != 0)
 		return rc;
 	packed_buffer_init(&pb, buffer, sizeof(buffer));
@@ -3682,107 +3699,78 @@ static struct navigation_ui {
 	int gauge_radius;
 } nav_ui;
 
-static int process_update_ship_packet(uint8_t opcode)
+static void save_delta_baseline(int index, unsigned char *record);
+
+/* record is the complete update, opcode included */
+static int apply_update_ship_packet(unsigned char *record)
 {
 	int i;
-	unsigned char buffer[144];
-	struct packed_buffer pb;
-	uint16_t alive;
-	uint32_t id, timestamp, torpedoes, power;
-	uint32_t fuel, victim_id;
-	double dx, dy, dz, dyawvel, dpitchvel, drollvel;
-	double dgunyawvel, dsheading, dbeamwidth;
+	uint8_t opcode = record[0];
+	struct update_ship_packer_values v;
+	uint8_t tloading, tloaded;
 	int rc;
 	int type = opcode == OPCODE_UPDATE_SHIP ? OBJTYPE_SHIP1 : OBJTYPE_SHIP2;
-	uint8_t tloading, tloaded, throttle, rpm, temp, scizoom, weapzoom, navzoom,
-		mainzoom, warpdrive, requested_warpdrive,
-		requested_shield, phaser_charge, phaser_wavelength, shiptype,
-		reverse, trident, in_secure_area, docking_magnets;
-	union quat orientation, sciball_orientation, weap_orientation;
 	union euler ypr;
 	struct entity *e;
 	struct snis_entity *o;
 
-	assert(sizeof(buffer) > sizeof(struct update_ship_packet) - sizeof(uint8_t));
-	rc = snis_readsocket(gameserver_sock, buffer, sizeof(struct update_ship_packet) - sizeof(uint8_t));
-	/* printf("process_update_ship_packet, snis_readsocket returned %d\n", rc); */
-	if (rc != 0)
-		return rc;
-	packed_buffer_init(&pb, buffer, sizeof(buffer));
-	packed_buffer_extract(&pb, "wwhSSS", &id, &timestamp, &alive,
-				&dx, (int32_t) UNIVERSE_DIM, &dy, (int32_t) UNIVERSE_DIM,
-				&dz, (int32_t) UNIVERSE_DIM);
-	packed_buffer_extract(&pb, "RRRwwRRR",
-				&dyawvel,
-				&dpitchvel,
-				&drollvel,
-				&torpedoes, &power,
-				&dgunyawvel,
-				&dsheading,
-				&dbeamwidth);
-	packed_buffer_extract(&pb, "bbbwbbbbbbbbbbbbbwQQQbb",
-			&tloading, &throttle, &rpm, &fuel, &temp,
-			&scizoom, &weapzoom, &navzoom, &mainzoom,
-			&warpdrive, &requested_warpdrive,
-			&requested_shield, &phaser_charge, &phaser_wavelength, &shiptype,
-			&reverse, &trident, &victim_id, &orientation.vec[0],
-			&sciball_orientation.vec[0], &weap_orientation.vec[0], &in_secure_area,
-			&docking_magnets);
+	update_ship_packer_unpack(record, &v);
+	tloading = v.torpedoes_loading;
 	tloaded = (tloading >> 4) & 0x0f;
 	tloading = tloading & 0x0f;
-	quat_to_euler(&ypr, &orientation);	
+	quat_to_euler(&ypr, &v.orientation);	
 	pthread_mutex_lock(&universe_mutex);
 
 	/* Now update the ship... do it inline here instead of a function because
 	 * such a function would require 8 million params.
 	 */
 
-	i = lookup_object_by_id(id);
+	i = lookup_object_by_id(v.id);
 	if (i < 0) {
-		if (id == my_ship_id)
-			e = add_entity(ecx, NULL, dx, dy, dz, SHIP_COLOR);
+		if (v.id == my_ship_id)
+			e = add_entity(ecx, NULL, v.x, v.y, v.z, SHIP_COLOR);
 		else {
-			e = add_entity(ecx, ship_mesh_map[shiptype % nshiptypes],
-					dx, dy, dz, SHIP_COLOR);
+			e = add_entity(ecx, ship_mesh_map[v.shiptype % nshiptypes],
+					v.x, v.y, v.z, SHIP_COLOR);
 			if (e)
-				add_ship_thrust_entities(NULL, NULL, ecx, e, shiptype, 36);
+				add_ship_thrust_entities(NULL, NULL, ecx, e, v.shiptype, 36);
 		}
-		i = add_generic_object(id, timestamp, dx, dy, dz, 0.0, 0.0, 0.0, &orientation, type, alive, e);
+		i = add_generic_object(v.id, v.timestamp, v.x, v.y, v.z, 0.0, 0.0, 0.0, &v.orientation, type, v.alive, e);
 		if (i < 0) {
 			rc = i;
 			goto out;
 		}
 	} else {
-		update_generic_object(i, timestamp, dx, dy, dz, 0.0, 0.0, 0.0, &orientation, alive);
+		update_generic_object(i, v.timestamp, v.x, v.y, v.z, 0.0, 0.0, 0.0, &v.orientation, v.alive);
 	}
 	o = &go[i];
-	o->tsd.ship.yaw_velocity = dyawvel;
-	o->tsd.ship.pitch_velocity = dpitchvel;
-	o->tsd.ship.roll_velocity = drollvel;
-	o->tsd.ship.torpedoes = torpedoes;
-	o->tsd.ship.power = power;
-	o->tsd.ship.gun_yaw_velocity = dgunyawvel;
-	o->tsd.ship.sci_heading = dsheading;
-	o->tsd.ship.sci_beam_width = dbeamwidth;
+	o->tsd.ship.yaw_velocity = v.yaw_velocity;
+	o->tsd.ship.pitch_velocity = v.pitch_velocity;
+	o->tsd.ship.roll_velocity = v.roll_velocity;
+	o->tsd.ship.torpedoes = v.torpedoes;
+	o->tsd.ship.power = v.power;
+	o->tsd.ship.gun_yaw_velocity = v.gun_yaw_velocity;
+	o->tsd.ship.sci_heading = v.sci_heading;
+	o->tsd.ship.sci_beam_width = v.sci_beam_width;
 	o->tsd.ship.torpedoes_loaded = tloaded;
 	o->tsd.ship.torpedoes_loading = tloading;
-	o->tsd.ship.throttle = throttle;
-	o->tsd.ship.rpm = rpm;
-	o->tsd.ship.fuel = fuel;
-	o->tsd.ship.temp = temp;
-	o->tsd.ship.scizoom = scizoom;
-	o->tsd.ship.weapzoom = weapzoom;
-	o->tsd.ship.navzoom = navzoom;
-	o->tsd.ship.mainzoom = mainzoom;
-	o->tsd.ship.requested_warpdrive = requested_warpdrive;
-	o->tsd.ship.requested_shield = requested_shield;
-	o->tsd.ship.warpdrive = warpdrive;
-	o->tsd.ship.phaser_charge = phaser_charge;
-	o->tsd.ship.phaser_wavelength = phaser_wavelength;
+	o->tsd.ship.throttle = v.throttle;
+	o->tsd.ship.rpm = v.rpm;
+	o->tsd.ship.fuel = v.fuel;
+	o->tsd.ship.temp = v.temp;
+	o->tsd.ship.scizoom = v.scizoom;
+	o->tsd.ship.weapzoom = v.weapzoom;
+	o->tsd.ship.navzoom = v.navzoom;
+	o->tsd.ship.mainzoom = v.mainzoom;
+	o->tsd.ship.requested_warpdrive = v.requested_warpdrive;
+	o->tsd.ship.requested_shield = v.requested_shield;
+	o->tsd.ship.warpdrive = v.warpdrive;
+	o->tsd.ship.phaser_charge = v.phaser_charge;
+	o->tsd.ship.phaser_wavelength = v.phaser_wavelength;
 	o->tsd.ship.damcon = NULL;
-	o->tsd.ship.shiptype = shiptype;
-	o->tsd.ship.in_secure_area = in_secure_area;
-	o->tsd.ship.docking_magnets = docking_magnets;
+	o->tsd.ship.shiptype = v.shiptype;
+	o->tsd.ship.in_secure_area = v.in_secure_area;
+	o->tsd.ship.docking_magnets = v.docking_magnets;
 
 	/* shift old updates to make room for this one */
 	int j;
@@ -3790,28 +3778,153 @@ static int process_update_ship_packet(uint8_t opcode)
 		o->tsd.ship.sciball_o[j] = o->tsd.ship.sciball_o[j-1];
 		o->tsd.ship.weap_o[j] = o->tsd.ship.weap_o[j-1];
 	}
-	o->tsd.ship.sciball_o[0] = sciball_orientation;
-	o->tsd.ship.weap_o[0] = weap_orientation;
+	o->tsd.ship.sciball_o[0] = v.sciball_orientation;
+	o->tsd.ship.weap_o[0] = v.weap_orientation;
 
-	if (!o->tsd.ship.reverse && reverse)
+	if (!o->tsd.ship.reverse && v.reverse)
 		wwviaudio_add_sound(REVERSE_SOUND);
-	o->tsd.ship.reverse = reverse;
-	o->tsd.ship.trident = trident;
-	snis_button_set_label(nav_ui.trident_button, trident ? "ABSOLUTE" : "RELATIVE");
-	o->tsd.ship.ai[0].u.attack.victim_id = victim_id;
+	o->tsd.ship.reverse = v.reverse;
+	o->tsd.ship.trident = v.trident;
+	snis_button_set_label(nav_ui.trident_button, v.trident ? "ABSOLUTE" : "RELATIVE");
+	o->tsd.ship.ai[0].u.attack.victim_id = v.victim_id;
+	save_delta_baseline(i, record);
 	rc = 0;
 out:
 	pthread_mutex_unlock(&universe_mutex);
 	return (rc < 0);
 }
 
+/* A clock for replay timing which stops while waiting on the recording */
+static double replay_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9 -
+		(double) snis_socket_reader_replay_wait_usec(gameserver_input) * 1e-6;
+}
+
+static void print_replay_stats(void)
+{
+	struct replay_stats *rs = &replay_stats;
+	double elapsed = replay_clock() - rs->start;
+	double apply = rs->process_time - rs->decode_time;
+	double per = rs->opcodes ? 1e6 / (double) rs->opcodes : 0.0;
+
+	printf("replay of %s: %llu opcodes in %.3f seconds (not waiting on the recording)\n",
+		replay_file, (unsigned long long) rs->opcodes, elapsed);
+	printf("  decode %.3f ms (%.3f us/opcode), apply %.3f ms (%.3f us/opcode)\n",
+		rs->decode_time * 1000.0, rs->decode_time * per, apply * 1000.0, apply * per);
+	printf("  %d frames, average frame time %.3f ms, max %.3f ms\n", rs->frames,
+		rs->frames ? rs->frame_time * 1000.0 / rs->frames : 0.0, rs->max_frame_time * 1000.0);
+}
+
+/*
+ * Compact updates (OPCODE_UPDATE_COMPACT) are expanded back into the normal
+ * form of the update, which the usual process_update_*() function then reads
+ * in place of the socket.
+ */
+
+/* Per thread, as updates come both from the socket and, with SNIS_UDP, by UDP */
+static __thread int32_t update_origin[3]; /* as sent by OPCODE_UPDATE_ORIGIN */
+static __thread unsigned char expanded_update[sizeof(struct update_ship_packet)];
+static __thread int expanded_update_len, expanded_update_pos;
+
+/* Read the next len bytes of the update being processed */
+static int read_update_bytes(void *buffer, int len)
+{
+	double start = replay_file ? replay_clock() : 0.0;
+	int rc = 0;
+
+	/* While an expanded update is being applied, reading past its end is an
+	 * error, never a read from the stream, which may be another thread's.
+	 */
+	if (expanded_update_len) {
+		if (len > expanded_update_len - expanded_update_pos) {
+			rc = -1;
+		} else {
+			memcpy(buffer, expanded_update + expanded_update_pos, len);
+			expanded_update_pos += len;
+		}
+	} else {
+		rc = snis_socket_reader_read(gameserver_input, buffer, len);
+	}
+	if (replay_file)
+		replay_stats.decode_time += replay_clock() - start;
+	return rc;
+}
+
+/* Read the rest of an update, record[0] being its opcode */
+static int read_update_record(unsigned char *record, uint8_t opcode, int size)
+{
+	record[0] = opcode;
+	return read_update_bytes(record + 1, size - 1);
+}
+
+/* Expand the compact update in buffer, returns the opcode of the update */
+static int expand_compact_bytes(unsigned char *buffer, int len, uint8_t *opcode)
+{
+	const struct compact_update_format *f;
+	struct packed_buffer pb;
+	int rc;
+
+	if (len < 1)
+		return -1;
+	f = lookup_compact_update_format(buffer[0]);
+	if (!f) {
+		fprintf(stderr, "snis_client: bad compact opcode %hhu\n", buffer[0]);
+		return -1;
+	}
+	packed_buffer_init(&pb, buffer, len);
+	rc = packed_buffer_expand(expanded_update, sizeof(expanded_update), f->format,
+					&pb, f->compact_format, update_origin);
+	if (rc || pb.buffer_cursor != len)
+		return -1;
+	*opcode = buffer[0];
+	expanded_update_pos = 1; /* the opcode has been read */
+	expanded_update_len = calculate_buffer_size(f->format);
+	return 0;
+}
+
+/* Read a compact update and expand it, returns the opcode of the update */
+static int expand_compact_update(uint8_t *opcode)
+{
+	unsigned char buffer[UINT8_MAX];
+	uint8_t len;
+	int rc;
+
+	rc = snis_socket_reader_read(gameserver_input, &len, sizeof(len));
+	if (rc)
+		return rc;
+	rc = snis_socket_reader_read(gameserver_input, buffer, len);
+	if (rc)
+		return -1;
+	return expand_compact_bytes(buffer, len, opcode);
+}
+
+static int process_update_origin_packet(void)
+{
+	unsigned char buffer[3 * sizeof(uint32_t)];
+	uint32_t x, y, z;
+	int rc;
+
+	rc = snis_socket_reader_read(gameserver_input, buffer, sizeof(buffer));
+	if (rc)
+		return rc;
+	rc = packed_buffer_unpack(buffer, "www", &x, &y, &z);
+	update_origin[0] = (int32_t) x;
+	update_origin[1] = (int32_t) y;
+	update_origin[2] = (int32_t) z;
+	return rc;
+}
+
 static int read_and_unpack_buffer(unsigned char *buffer, char *format, ...)
 {
         va_list ap;
         struct packed_buffer pb;
         int rc, size = calculate_buffer_size(format);
 
-	rc = snis_readsocket(gameserver_sock, buffer, size);
+	rc = read_update_bytes(buffer, size);
 	if (rc != 0)
 		return rc;
         packed_buffer_init(&pb, buffer, size);
@@ -3906,26 +4019,35 @@ static int process_mainscreen_view_mode(void)
 	return 0;
 }
 
+static int apply_econ_update_ship_packet(unsigned char *record);
+
 static int process_update_econ_ship_packet(uint8_t opcode)
+{
+	unsigned char record[sizeof(struct update_econ_ship_packet) + 16];
+	int rc;
+
+	assert(sizeof(record) >= calculate_buffer_size(UPDATE_ECON_SHIP_PACKET_FORMAT));
+	record[0] = opcode;
+	rc = read_update_bytes(record + 1,
+			calculate_buffer_size(UPDATE_ECON_SHIP_PACKET_FORMAT) - sizeof(uint8_t));
+	if (rc != 0)
+		return rc;
+	return apply_econ_update_ship_packet(record);
+}
+
+/* record is the complete update, opcode included */
+static int apply_econ_update_ship_packet(unsigned char *record)
 {
 	unsigned char buffer[200];
-	uint16_t alive;
-	uint32_t id, timestamp, victim_id;
-	double dx, dy, dz, px, py, pz;
-	union quat orientation;
-	uint8_t shiptype, ai[MAX_AI_STACK_ENTRIES], npoints;
+	uint8_t opcode = record[0];
+	struct update_econ_ship_packer_values v;
+	double px, py, pz;
+	uint8_t ai[MAX_AI_STACK_ENTRIES], npoints;
 	union vec3 patrol[MAX_PATROL_POINTS];
 	double threat_level;
 	int rc;
 
-	assert(sizeof(buffer) > sizeof(struct update_econ_ship_packet) - sizeof(uint8_t));
-	rc = read_and_unpack_buffer(buffer, "wwhSSSQwb", &id, &timestamp, &alive,
-				&dx, (int32_t) UNIVERSE_DIM, &dy, (int32_t) UNIVERSE_DIM, 
-				&dz, (int32_t) UNIVERSE_DIM,
-				&orientation,
-				&victim_id, &shiptype);
-	if (rc != 0)
-		return rc;
+	update_econ_ship_packer_unpack(record, &v);
 	if (opcode != OPCODE_ECON_UPDATE_SHIP_DEBUG_AI) {
 		memset(ai, 0, 5);
 		npoints = 0;
@@ -3933,7 +4055,7 @@ static int process_update_econ_ship_packet(uint8_t opcode)
 		goto done;
 	}
 	BUILD_ASSERT(MAX_AI_STACK_ENTRIES == 5);
-	rc = read_and_unpack_buffer(buffer, "bbbbbSb",
+	rc = read_and_unpack_buffer(buffer, UPDATE_ECON_SHIP_DEBUG_AI_FORMAT,
 			&ai[0], &ai[1], &ai[2], &ai[3], &ai[4],
 			&threat_level, (int32_t) UNIVERSE_DIM, &npoints);
 	if (rc != 0)
@@ -3944,7 +4066,8 @@ static int process_update_econ_ship_packet(uint8_t opcode)
 
 	memset(patrol, 0, sizeof(patrol));
 	for (int i = 0; i < npoints; i++) {
-		rc = read_and_unpack_buffer(buffer + 6 + i * sizeof(uint32_t) * 3, "SSS",
+		rc = read_and_unpack_buffer(buffer + 6 + i * sizeof(uint32_t) * 3,
+			UPDATE_ECON_SHIP_DEBUG_AI_POINT_FORMAT,
 			&px, (int32_t) UNIVERSE_DIM,
 			&py, (int32_t) UNIVERSE_DIM,
 			&pz, (int32_t) UNIVERSE_DIM);
@@ -3957,30 +4080,127 @@ static int process_update_econ_ship_packet(uint8_t opcode)
 
 done:
 	pthread_mutex_lock(&universe_mutex);
-	rc = update_econ_ship(id, timestamp, dx, dy, dz, &orientation, alive, victim_id,
-				shiptype, ai, threat_level, npoints, patrol);
+	rc = update_econ_ship(v.id, v.timestamp, v.x, v.y, v.z, &v.orientation, v.alive,
+				v.victim_id, v.shiptype, ai, threat_level, npoints, patrol);
+	if (rc == 0 && opcode == OPCODE_ECON_UPDATE_SHIP)
+		save_delta_baseline(lookup_object_by_id(v.id), record);
 	pthread_mutex_unlock(&universe_mutex);
 	return (rc < 0);
-} 
+}
+
+/*
+ * Delta encoded updates (OPCODE_UPDATE_DELTA) carry only the fields of an
+ * update which changed since the last update of that object we received.
+ * We keep the last complete update of each object around to patch.
+ */
+static struct delta_update_format {
+	uint8_t opcode;
+	const char *format;
+	struct packed_buffer_delta_format df;
+	int (*apply)(unsigned char *record);
+} delta_update_format[] = {
+	{ OPCODE_UPDATE_SHIP, UPDATE_SHIP_PACKET_FORMAT, { 0 }, apply_update_ship_packet, },
+	{ OPCODE_ECON_UPDATE_SHIP, UPDATE_ECON_SHIP_PACKET_FORMAT, { 0 },
+		apply_econ_update_ship_packet, },
+};
+
+static unsigned char *delta_baseline[MAXGAMEOBJS];
+
+static struct delta_update_format *lookup_delta_format(uint8_t opcode)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(delta_update_format); i++) {
+		struct delta_update_format *f = &delta_update_format[i];
+
+		if (f->opcode != opcode)
+			continue;
+		if (f->df.nfields == 0 && packed_buffer_delta_format_init(&f->df, f->format))
+			return NULL;
+		return f;
+	}
+	return NULL;
+}
+
+/* Remember the complete update of go[index], assumes universe lock held */
+static void save_delta_baseline(int index, unsigned char *record)
+{
+	struct delta_update_format *f;
+	int size;
+
+	if (index < 0)
+		return;
+	f = lookup_delta_format(record[0]);
+	if (!f)
+		return;
+	size = f->df.offset[f->df.nfields];
+	if (!delta_baseline[index])
+		delta_baseline[index] = malloc(sizeof(struct update_ship_packet));
+	assert(size <= sizeof(struct update_ship_packet));
+	memcpy(delta_baseline[index], record, size);
+}
+
+static int process_update_delta_packet(void)
+{
+	unsigned char buffer[sizeof(struct update_ship_packet)];
+	unsigned char record[sizeof(struct update_ship_packet)];
+	unsigned char *mask = buffer + 5;
+	struct delta_update_format *f;
+	uint32_t id;
+	int i, rc, payload_len;
+
+	/* original opcode, id, then the mask */
+	rc = snis_socket_reader_read(gameserver_input, buffer, 5);
+	if (rc)
+		return rc;
+	f = lookup_delta_format(buffer[0]);
+	if (!f) {
+		fprintf(stderr, "snis_client: bad delta opcode %hhu\n", buffer[0]);
+		return -1;
+	}
+	rc = snis_socket_reader_read(gameserver_input, mask, f->df.mask_bytes);
+	if (rc)
+		return rc;
+	payload_len = packed_buffer_delta_payload_length(&f->df, mask);
+	if (5 + f->df.mask_bytes + payload_len > sizeof(buffer))
+		return -1;
+	rc = snis_socket_reader_read(gameserver_input, mask + f->df.mask_bytes, payload_len);
+	if (rc)
+		return rc;
+
+	memcpy(&id, buffer + 1, sizeof(id));
+	id = ntohl(id);
+	pthread_mutex_lock(&universe_mutex);
+	i = lookup_object_by_id(id);
+	if (i < 0 || !delta_baseline[i] || delta_baseline[i][0] != buffer[0] ||
+		memcmp(delta_baseline[i] + 1, buffer + 1, 4) != 0) {
+		/* We don't have what this delta is relative to.  Drop it, the server
+		 * will send a complete update again before long.
+		 */
+		pthread_mutex_unlock(&universe_mutex);
+		return 0;
+	}
+	memcpy(record, delta_baseline[i], f->df.offset[f->df.nfields]);
+	pthread_mutex_unlock(&universe_mutex);
+	packed_buffer_apply_delta(&f->df, record, mask, mask + f->df.mask_bytes);
+	return f->apply(record);
+}
 
 static int process_update_torpedo_packet(void)
 {
-	unsigned char buffer[100];
-	uint32_t id, timestamp, ship_id;
-	double dx, dy, dz;
+	unsigned char record[update_torpedo_packer_size];
+	struct update_torpedo_packer_values v;
 	int rc;
 
-	assert(sizeof(buffer) > sizeof(struct update_torpedo_packet) - sizeof(uint8_t));
-	rc = read_and_unpack_buffer(buffer, "wwwSSS", &id, &timestamp, &ship_id,
-				&dx, (int32_t) UNIVERSE_DIM, &dy, (int32_t) UNIVERSE_DIM,
-				&dz, (int32_t) UNIVERSE_DIM);
+	rc = read_update_record(record, OPCODE_UPDATE_TORPEDO, sizeof(record));
 	if (rc != 0)
 		return rc;
+	update_torpedo_packer_unpack(record, &v);
 	pthread_mutex_lock(&universe_mutex);
-	rc = update_torpedo(id, timestamp, dx, dy, dz, ship_id);
+	rc = update_torpedo(v.id, v.timestamp, v.x, v.y, v.z, v.ship_id);
 	pthread_mutex_unlock(&universe_mutex);
 	return (rc < 0);
-} 
+}
 
 static int process_warp_limbo_packet(void)
 {
@@ -4018,26 +4238,19 @@ static int process_wormhole_limbo_packet(void)
 
 static int process_update_laser_packet(void)
 {
-	unsigned char buffer[100];
-	uint32_t id, timestamp, ship_id;
-	uint8_t power;
-	double dx, dy, dz;
-	union quat orientation;
+	unsigned char record[update_laser_packer_size];
+	struct update_laser_packer_values v;
 	int rc;
 
-	assert(sizeof(buffer) > sizeof(struct update_laser_packet) - sizeof(uint8_t));
-	rc = read_and_unpack_buffer(buffer, "wwwbSSSQ", &id, &timestamp, &ship_id, &power,
-				&dx, (int32_t) UNIVERSE_DIM,
-				&dy, (int32_t) UNIVERSE_DIM,
-				&dz, (int32_t) UNIVERSE_DIM,
-				&orientation);
+	rc = read_update_record(record, OPCODE_UPDATE_LASER, sizeof(record));
 	if (rc != 0)
 		return rc;
+	update_laser_packer_unpack(record, &v);
 	pthread_mutex_lock(&universe_mutex);
-	rc = update_laser(id, timestamp, power, dx, dy, dz, &orientation, ship_id);
+	rc = update_laser(v.id, v.timestamp, v.power, v.x, v.y, v.z, &v.orientation, v.ship_id);
 	pthread_mutex_unlock(&universe_mutex);
 	return (rc < 0);
-} 
+}
 
 static int process_update_spacemonster(void)
 {
@@ -4103,7 +4316,7 @@ static int process_load_skybox(void)
 	rc = read_and_unpack_buffer(buffer, "b", &length);
 	if (rc != 0)
 		return rc;
-	rc = snis_readsocket(gameserver_sock, string, length);
+	rc = snis_socket_reader_read(gameserver_input, string, length);
 	if (rc != 0)
 		return rc;
 
@@ -4378,11 +4591,35 @@ static void delete_object(uint32_t id)
 	go[i].entity = NULL;
 	free_spacemonster_data(&go[i]);
 	free_laserbeam_data(&go[i]);
+	snis_id_map_remove(id_map, go[i].id);
 	go[i].id = -1;
 	snis_object_pool_free_object(pool, i);
 }
 
 static void demon_deselect(uint32_t id);
+/*
+ * Objects recently deleted.  An update sent by UDP may arrive after the
+ * OPCODE_DELETE_OBJECT which followed it by TCP, and would bring the object
+ * back to life.  Object ids are never reused, so updates of these objects are
+ * just ignored.  udp_apply_mutex keeps a delete from getting in between that
+ * check and the update.
+ */
+#define RECENTLY_DELETED_IDS 512
+static uint32_t recently_deleted_id[RECENTLY_DELETED_IDS];
+static int nrecently_deleted_ids, next_recently_deleted_id;
+static pthread_mutex_t udp_apply_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Assumes udp_apply_mutex held */
+static int recently_deleted(uint32_t id)
+{
+	int i;
+
+	for (i = 0; i < nrecently_deleted_ids; i++)
+		if (recently_deleted_id[i] == id)
+			return 1;
+	return 0;
+}
+
 static int process_delete_object_packet(void)
 {
 	unsigned char buffer[10];
@@ -4393,10 +4630,16 @@ static int process_delete_object_packet(void)
 	rc = read_and_unpack_buffer(buffer, "w", &id);
 	if (rc != 0)
 		return rc;
+	pthread_mutex_lock(&udp_apply_mutex);
 	pthread_mutex_lock(&universe_mutex);
 	demon_deselect(id);
 	delete_object(id);
 	pthread_mutex_unlock(&universe_mutex);
+	recently_deleted_id[next_recently_deleted_id] = id;
+	next_recently_deleted_id = (next_recently_deleted_id + 1) % RECENTLY_DELETED_IDS;
+	if (nrecently_deleted_ids < RECENTLY_DELETED_IDS)
+		nrecently_deleted_ids++;
+	pthread_mutex_unlock(&udp_apply_mutex);
 	return 0;
 }
 
@@ -4424,7 +4667,7 @@ static int process_ship_sdata_packet(void)
 	char name[NAMESIZE];
 
 	assert(sizeof(buffer) > sizeof(struct ship_sdata_packet) - sizeof(uint8_t));
-	rc = snis_readsocket(gameserver_sock, buffer, sizeof(struct ship_sdata_packet) - sizeof(uint8_t));
+	rc = snis_socket_reader_read(gameserver_input, buffer, sizeof(struct ship_sdata_packet) - sizeof(uint8_t));
 	if (rc != 0)
 		return rc;
 	packed_buffer_unpack(buffer, "wbbbbbbbr",&id, &subclass, &shstrength, &shwavelength,
@@ -4591,6 +4834,53 @@ static int process_update_netstats(void)
 				&netstats.faction_population[4]);
 	if (rc != 0)
 		return rc;
+	if (!(gameserver_capabilities & SNIS_CAP_COMPRESSION_STATS))
+		return 0;
+	rc = read_and_unpack_buffer(buffer, "qqq", &netstats.bytes_deflated_in,
+				&netstats.bytes_deflated_out,
+				&netstats.compression_usec);
+	if (rc != 0)
+		return rc;
+	return 0;
+}
+
+/* Where the server's tick time goes, from the demon screen's PROFILE command */
+#define MAX_TICK_PROFILE_ENTRIES 64
+static struct tick_profile_entry {
+	char name[24];
+	uint32_t calls, usec, max_usec, p50_usec, p90_usec, p99_usec;
+} tick_profile[MAX_TICK_PROFILE_ENTRIES];
+static int ntick_profile_entries;
+
+static int process_tick_profile(void)
+{
+	unsigned char buffer[6 * sizeof(uint32_t)];
+	struct tick_profile_entry e;
+	char name[256];
+	uint8_t n, length;
+	int i, rc;
+
+	rc = read_and_unpack_buffer(buffer, "b", &n);
+	if (rc != 0)
+		return rc;
+	ntick_profile_entries = 0;
+	for (i = 0; i < n; i++) {
+		rc = read_and_unpack_buffer(buffer, "b", &length);
+		if (rc != 0)
+			return rc;
+		rc = snis_socket_reader_read(gameserver_input, name, length);
+		if (rc != 0)
+			return rc;
+		name[length] = '\0';
+		rc = read_and_unpack_buffer(buffer, TICK_PROFILE_ENTRY_FORMAT, &e.calls, &e.usec,
+				&e.max_usec, &e.p50_usec, &e.p90_usec, &e.p99_usec);
+		if (rc != 0)
+			return rc;
+		if (ntick_profile_entries >= MAX_TICK_PROFILE_ENTRIES)
+			continue;
+		snprintf(e.name, sizeof(e.name), "%s", name);
+		tick_profile[ntick_profile_entries++] = e;
+	}
 	return 0;
 }
 
@@ -4658,7 +4948,7 @@ static int process_comm_transmission(void)
 	rc = read_and_unpack_buffer(buffer, "b", &length);
 	if (rc != 0)
 		return rc;
-	rc = snis_readsocket(gameserver_sock, string, length);
+	rc = snis_socket_reader_read(gameserver_input, string, length);
 	string[79] = '\0';
 	string[length] = '\0';
 	text_window_add_text(comms_ui.tw, string);
@@ -4676,7 +4966,7 @@ static int process_ship_damage_packet(int do_damage_limbo)
 	int rc, i;
 	struct ship_damage_data damage;
 
-	rc = snis_readsocket(gameserver_sock, buffer,
+	rc = snis_socket_reader_read(gameserver_input, buffer,
 			sizeof(struct ship_damage_packet) - sizeof(uint8_t));
 	if (rc != 0)
 		return rc;
@@ -4700,243 +4990,189 @@ static int process_ship_damage_packet(int do_damage_limbo)
 
 static int process_update_docking_port_packet(void)
 {
-	unsigned char buffer[100];
-	uint32_t id, timestamp;
-	double dx, dy, dz, scale;
-	union quat orientation;
+	unsigned char record[update_docking_port_packer_size];
+	struct update_docking_port_packer_values v;
 	int rc;
-	uint8_t model;
 
-	rc = read_and_unpack_buffer(buffer, "wwSSSSQb", &id, &timestamp,
-			&scale, (int32_t) 1000,
-			&dx, (int32_t) UNIVERSE_DIM,
-			&dy, (int32_t) UNIVERSE_DIM,
-			&dz, (int32_t) UNIVERSE_DIM,
-			&orientation, &model);
+	rc = read_update_record(record, OPCODE_UPDATE_DOCKING_PORT, sizeof(record));
 	if (rc != 0)
 		return rc;
+	update_docking_port_packer_unpack(record, &v);
 	pthread_mutex_lock(&universe_mutex);
-	rc = update_docking_port(id, timestamp, scale, dx, dy, dz, &orientation, model);
+	rc = update_docking_port(v.id, v.timestamp, v.scale, v.x, v.y, v.z, &v.orientation, v.model);
 	pthread_mutex_unlock(&universe_mutex);
 	return (rc < 0);
 }
 
 static int process_update_asteroid_packet(void)
 {
-	unsigned char buffer[100];
-	uint32_t id, timestamp;
-	double dx, dy, dz, dvx, dvy, dvz;
+	unsigned char record[update_asteroid_packer_size];
+	struct update_asteroid_packer_values v;
 	int rc;
-	uint8_t carbon, nickeliron, silicates, preciousmetals;
 
-	assert(sizeof(buffer) > sizeof(struct update_asteroid_packet) - sizeof(uint8_t));
-	rc = read_and_unpack_buffer(buffer, "wwSSSSSSbbbb", &id, &timestamp,
-			&dx, (int32_t) UNIVERSE_DIM,
-			&dy,(int32_t) UNIVERSE_DIM,
-			&dz, (int32_t) UNIVERSE_DIM,
-			&dvx, (int32_t) UNIVERSE_DIM,
-			&dvy, (int32_t) UNIVERSE_DIM,
-			&dvz, (int32_t) UNIVERSE_DIM,
-			&carbon, &nickeliron, &silicates, &preciousmetals);
+	rc = read_update_record(record, OPCODE_UPDATE_ASTEROID, sizeof(record));
 	if (rc != 0)
 		return rc;
+	update_asteroid_packer_unpack(record, &v);
 	pthread_mutex_lock(&universe_mutex);
-	rc = update_asteroid(id, timestamp, dx, dy, dz, dvx, dvy, dvz,
-				carbon, nickeliron, silicates, preciousmetals);
+	rc = update_asteroid(v.id, v.timestamp, v.x, v.y, v.z, v.vx, v.vy, v.vz,
+				v.carbon, v.nickeliron, v.silicates, v.preciousmetals);
 	pthread_mutex_unlock(&universe_mutex);
 	return (rc < 0);
-} 
+}
 
 static int process_update_cargo_container_packet(void)
 {
-	unsigned char buffer[100];
-	uint32_t id, timestamp;
-	double dx, dy, dz;
+	unsigned char record[update_position_packer_size];
+	struct update_position_packer_values v;
 	int rc;
 
-	assert(sizeof(buffer) > sizeof(struct update_cargo_container_packet) - sizeof(uint8_t));
-	rc = read_and_unpack_buffer(buffer, "wwSSS", &id, &timestamp,
-			&dx, (int32_t) UNIVERSE_DIM,
-			&dy,(int32_t) UNIVERSE_DIM,
-			&dz, (int32_t) UNIVERSE_DIM);
+	rc = read_update_record(record, OPCODE_UPDATE_CARGO_CONTAINER, sizeof(record));
 	if (rc != 0)
 		return rc;
+	update_position_packer_unpack(record, &v);
 	pthread_mutex_lock(&universe_mutex);
-	rc = update_cargo_container(id, timestamp, dx, dy, dz);
+	rc = update_cargo_container(v.id, v.timestamp, v.x, v.y, v.z);
 	pthread_mutex_unlock(&universe_mutex);
 	return (rc < 0);
-} 
+}
 
 static int process_update_derelict_packet(void)
 {
-	unsigned char buffer[100];
-	uint32_t id, timestamp;
-	double dx, dy, dz;
-	uint8_t shiptype;
+	unsigned char record[update_derelict_packer_size];
+	struct update_derelict_packer_values v;
 	int rc;
 
-	assert(sizeof(buffer) > sizeof(struct update_asteroid_packet) - sizeof(uint8_t));
-	rc = read_and_unpack_buffer(buffer, "wwSSSb", &id, &timestamp,
-			&dx, (int32_t) UNIVERSE_DIM,
-			&dy,(int32_t) UNIVERSE_DIM,
-			&dz, (int32_t) UNIVERSE_DIM, &shiptype);
+	rc = read_update_record(record, OPCODE_UPDATE_DERELICT, sizeof(record));
 	if (rc != 0)
 		return rc;
+	update_derelict_packer_unpack(record, &v);
 	pthread_mutex_lock(&universe_mutex);
-	rc = update_derelict(id, timestamp, dx, dy, dz, shiptype);
+	rc = update_derelict(v.id, v.timestamp, v.x, v.y, v.z, v.shiptype);
 	pthread_mutex_unlock(&universe_mutex);
 	return (rc < 0);
-} 
+}
 
 static int process_update_planet_packet(void)
 {
-	unsigned char buffer[100];
-	uint32_t id, timestamp;
-	double dr, dx, dy, dz, atm_scale;
-	uint8_t government, tech_level, economy, security, atm_r, atm_g, atm_b;
-	uint32_t dseed;
+	unsigned char record[update_planet_packer_size];
+	struct update_planet_packer_values v;
+	double dr;
 	int hasring;
-	uint16_t contraband;
 	int rc;
 
-	assert(sizeof(buffer) > sizeof(struct update_asteroid_packet) - sizeof(uint8_t));
-	rc = read_and_unpack_buffer(buffer, "wwSSSSwbbbbhbbbS", &id, &timestamp,
-			&dx, (int32_t) UNIVERSE_DIM,
-			&dy,(int32_t) UNIVERSE_DIM,
-			&dz, (int32_t) UNIVERSE_DIM,
-			&dr, (int32_t) UNIVERSE_DIM,
-			&dseed, &government, &tech_level, &economy, &security,
-			&contraband, &atm_r, &atm_b, &atm_g, &atm_scale, (int32_t) UNIVERSE_DIM);
+	rc = read_update_record(record, OPCODE_UPDATE_PLANET, sizeof(record));
 	if (rc != 0)
 		return rc;
+	update_planet_packer_unpack(record, &v);
+	dr = v.radius;
 	hasring = (dr < 0);
 	if (hasring)
 		dr = -dr;
 	pthread_mutex_lock(&universe_mutex);
-	rc = update_planet(id, timestamp, dx, dy, dz, dr, government, tech_level,
-				economy, dseed, hasring, security, contraband,
-				atm_r, atm_b, atm_g, atm_scale);
+	rc = update_planet(v.id, v.timestamp, v.x, v.y, v.z, dr, v.government, v.tech_level,
+				v.economy, v.description_seed, hasring, v.security, v.contraband,
+				v.atmosphere_r, v.atmosphere_g, v.atmosphere_b, v.atmosphere_scale);
 	pthread_mutex_unlock(&universe_mutex);
 	return (rc < 0);
-} 
+}
 
 static int process_update_wormhole_packet(void)
 {
-	unsigned char buffer[100];
-	uint32_t id, timestamp;
-	double dx, dy, dz;
+	unsigned char record[update_position_packer_size];
+	struct update_position_packer_values v;
 	int rc;
 
-	assert(sizeof(buffer) > sizeof(struct update_wormhole_packet) - sizeof(uint8_t));
-	rc = read_and_unpack_buffer(buffer, "wwSSS", &id, &timestamp,
-			&dx, (int32_t) UNIVERSE_DIM,
-			&dy, (int32_t) UNIVERSE_DIM,
-			&dz, (int32_t) UNIVERSE_DIM);
+	rc = read_update_record(record, OPCODE_UPDATE_WORMHOLE, sizeof(record));
 	if (rc != 0)
 		return rc;
+	update_position_packer_unpack(record, &v);
 	pthread_mutex_lock(&universe_mutex);
-	rc = update_wormhole(id, timestamp, dx, dy, dz);
+	rc = update_wormhole(v.id, v.timestamp, v.x, v.y, v.z);
 	pthread_mutex_unlock(&universe_mutex);
 	return (rc < 0);
-} 
+}
 
 static int process_update_starbase_packet(void)
 {
-	unsigned char buffer[100];
-	uint32_t id, timestamp;
-	double dx, dy, dz;
-	union quat orientation;
+	unsigned char record[update_starbase_packer_size];
+	struct update_starbase_packer_values v;
 	int rc;
 
-	rc = read_and_unpack_buffer(buffer, "wwSSSQ", &id, &timestamp,
-			&dx, (int32_t) UNIVERSE_DIM,
-			&dy, (int32_t) UNIVERSE_DIM,
-			&dz, (int32_t) UNIVERSE_DIM,
-			&orientation);
+	rc = read_update_record(record, OPCODE_UPDATE_STARBASE, sizeof(record));
 	if (rc != 0)
 		return rc;
+	update_starbase_packer_unpack(record, &v);
 	pthread_mutex_lock(&universe_mutex);
-	rc = update_starbase(id, timestamp, dx, dy, dz, &orientation);
+	rc = update_starbase(v.id, v.timestamp, v.x, v.y, v.z, &v.orientation);
 	pthread_mutex_unlock(&universe_mutex);
 	return (rc < 0);
-} 
+}
 
 static int process_update_nebula_packet(void)
 {
-	unsigned char buffer[100];
-	uint32_t id, timestamp;
-	double dx, dy, dz, r;
-	union quat av, uo;
+	unsigned char record[update_nebula_packer_size];
+	struct update_nebula_packer_values v;
 	float avx, avy, avz, ava;
-	double phase_angle, phase_speed;
 	int rc;
 
-	assert(sizeof(buffer) > sizeof(struct update_nebula_packet) - sizeof(uint8_t));
-	rc = read_and_unpack_buffer(buffer, "wwSSSSQQSS", &id, &timestamp,
-			&dx, (int32_t) UNIVERSE_DIM,
-			&dy, (int32_t) UNIVERSE_DIM,
-			&dz, (int32_t) UNIVERSE_DIM,
-			&r, (int32_t) UNIVERSE_DIM,
-			&av, &uo, &phase_angle, (int32_t) 360,
-			&phase_speed, (int32_t) 100);
+	rc = read_update_record(record, OPCODE_UPDATE_NEBULA, sizeof(record));
 	if (rc != 0)
 		return rc;
-	quat_to_axis(&av, &avx, &avy, &avz, &ava);
+	update_nebula_packer_unpack(record, &v);
+	quat_to_axis(&v.angular_velocity, &avx, &avy, &avz, &ava);
 	pthread_mutex_lock(&universe_mutex);
-	rc = update_nebula(id, timestamp, dx, dy, dz, r, avx, avy, avz, ava,
-				&uo, phase_angle, phase_speed);
+	rc = update_nebula(v.id, v.timestamp, v.x, v.y, v.z, v.r, avx, avy, avz, ava,
+				&v.unrotated_orientation, v.phase_angle, v.phase_speed);
 	pthread_mutex_unlock(&universe_mutex);
 	return (rc < 0);
-} 
+}
 
 static int process_update_laserbeam(void)
 {
-	unsigned char buffer[100];
-	uint32_t id, timestamp, origin, target;
+	unsigned char record[update_laserbeam_packer_size];
+	struct update_laserbeam_packer_values v;
 	int rc;
 
-	rc = read_and_unpack_buffer(buffer, "wwww", &id, &timestamp, &origin, &target);
+	rc = read_update_record(record, OPCODE_UPDATE_LASERBEAM, sizeof(record));
 	if (rc != 0)
 		return rc;
+	update_laserbeam_packer_unpack(record, &v);
 	pthread_mutex_lock(&universe_mutex);
-	rc = update_laserbeam(id, timestamp, origin, target);
+	rc = update_laserbeam(v.id, v.timestamp, v.origin, v.target);
 	pthread_mutex_unlock(&universe_mutex);
 	return (rc < 0);
-} 
+}
 
 static int process_update_tractorbeam(void)
 {
-	unsigned char buffer[100];
-	uint32_t id, timestamp, origin, target;
+	unsigned char record[update_laserbeam_packer_size];
+	struct update_laserbeam_packer_values v;
 	int rc;
 
-	rc = read_and_unpack_buffer(buffer, "wwww", &id, &timestamp, &origin, &target);
+	rc = read_update_record(record, OPCODE_UPDATE_TRACTORBEAM, sizeof(record));
 	if (rc != 0)
 		return rc;
+	update_laserbeam_packer_unpack(record, &v);
 	pthread_mutex_lock(&universe_mutex);
-	rc = update_tractorbeam(id, timestamp, origin, target);
+	rc = update_tractorbeam(v.id, v.timestamp, v.origin, v.target);
 	pthread_mutex_unlock(&universe_mutex);
 	return (rc < 0);
-} 
+}
 
 static int process_update_explosion_packet(void)
 {
-	unsigned char buffer[sizeof(struct update_explosion_packet)];
-	uint32_t id, timestamp;
-	double dx, dy, dz;
-	uint16_t nsparks, velocity, time;
-	uint8_t victim_type;
+	unsigned char record[update_explosion_packer_size];
+	struct update_explosion_packer_values v;
 	int rc;
 
-	assert(sizeof(buffer) > sizeof(struct update_explosion_packet) - sizeof(uint8_t));
-	rc = read_and_unpack_buffer(buffer, "wwSSShhhb", &id, &timestamp,
-		&dx, (int32_t) UNIVERSE_DIM, &dy, (int32_t) UNIVERSE_DIM,
-		&dz, (int32_t) UNIVERSE_DIM,
-		&nsparks, &velocity, &time, &victim_type);
+	rc = read_update_record(record, OPCODE_UPDATE_EXPLOSION, sizeof(record));
 	if (rc != 0)
 		return rc;
+	update_explosion_packer_unpack(record, &v);
 	pthread_mutex_lock(&universe_mutex);
-	rc = update_explosion(id, timestamp, dx, dy, dz, nsparks, velocity, time, victim_type);
+	rc = update_explosion(v.id, v.timestamp, v.x, v.y, v.z, v.nsparks, v.velocity, v.time,
+				v.victim_type);
 	pthread_mutex_unlock(&universe_mutex);
 	return (rc < 0);
 }
@@ -4956,87 +5192,339 @@ static int process_client_id_packet(void)
 	return 0;
 }
 
+/*
+ * The UDP channel, if asked for with SNIS_UDP=1 and the server agrees.  Object
+ * state updates arrive by UDP as well as by the socket, see snis_udp.h.  This
+ * thread has its own expanded_update and update_origin, the latter from each
+ * datagram's header.
+ */
+static int udp_sock = -1;
+static uint32_t udp_token;
+static struct sockaddr_in gameserver_addr;
+static int message_length[256]; /* see init_message_lengths(), set by the reader thread */
+static int udp_update_size[256]; /* full updates which may come by UDP, opcode included */
+
+static void init_udp_update_sizes(void)
+{
+	const struct compact_update_format *f;
+
+	for (f = compact_update_format; f->format; f++)
+		udp_update_size[f->opcode] = 1 + message_length[f->opcode];
+	udp_update_size[OPCODE_UPDATE_SHIP] = 1 + message_length[OPCODE_UPDATE_SHIP];
+	udp_update_size[OPCODE_UPDATE_EXPLOSION] = 0; /* always by TCP */
+}
+
+/* Apply the update in expanded_update, from a datagram or staged by the reader */
+static int apply_expanded_update(uint8_t opcode)
+{
+	switch (opcode) {
+	case OPCODE_UPDATE_SHIP:
+	case OPCODE_UPDATE_SHIP2:
+		expanded_update_pos = expanded_update_len;
+		return apply_update_ship_packet(expanded_update);
+	case OPCODE_ECON_UPDATE_SHIP:
+		expanded_update_pos = expanded_update_len;
+		return apply_econ_update_ship_packet(expanded_update);
+	case OPCODE_UPDATE_ASTEROID:
+		return process_update_asteroid_packet();
+	case OPCODE_UPDATE_DOCKING_PORT:
+		return process_update_docking_port_packet();
+	case OPCODE_UPDATE_CARGO_CONTAINER:
+		return process_update_cargo_container_packet();
+	case OPCODE_UPDATE_DERELICT:
+		return process_update_derelict_packet();
+	case OPCODE_UPDATE_PLANET:
+		return process_update_planet_packet();
+	case OPCODE_UPDATE_STARBASE:
+		return process_update_starbase_packet();
+	case OPCODE_UPDATE_WORMHOLE:
+		return process_update_wormhole_packet();
+	case OPCODE_UPDATE_NEBULA:
+		return process_update_nebula_packet();
+	case OPCODE_UPDATE_LASERBEAM:
+		return process_update_laserbeam();
+	case OPCODE_UPDATE_TRACTORBEAM:
+		return process_update_tractorbeam();
+	case OPCODE_UPDATE_LASER:
+		return process_update_laser_packet();
+	case OPCODE_UPDATE_TORPEDO:
+		return process_update_torpedo_packet();
+	case OPCODE_UPDATE_EXPLOSION:
+		return process_update_explosion_packet();
+	default:
+		return -1;
+	}
+}
+
+/* Apply the updates in a datagram, unless they are older than ones already applied */
+static int process_udp_datagram(struct snis_udp_freshness *fresh, unsigned char *buffer, int len)
+{
+	int pos = SNIS_UDP_HEADER_SIZE, n, rc;
+	uint8_t opcode;
+	uint32_t seq, id;
+
+	if (snis_udp_header_unpack(buffer, len, &seq, update_origin))
+		return -1;
+	while (pos < len) {
+		opcode = buffer[pos];
+		if (opcode == OPCODE_UPDATE_COMPACT) {
+			if (pos + 2 > len)
+				return -1;
+			n = 2 + buffer[pos + 1];
+			if (pos + n > len || expand_compact_bytes(buffer + pos + 2, n - 2, &opcode))
+				return -1;
+		} else {
+			n = udp_update_size[opcode];
+			if (!n || pos + n > len || n > sizeof(expanded_update))
+				return -1;
+			memcpy(expanded_update, buffer + pos, n);
+			expanded_update_pos = 1;
+			expanded_update_len = n;
+		}
+		pos += n;
+		memcpy(&id, expanded_update + 1, sizeof(id));
+		id = ntohl(id);
+		rc = 0;
+		pthread_mutex_lock(&udp_apply_mutex);
+		if (snis_udp_fresh(fresh, id, seq) && !recently_deleted(id)) {
+			rc = apply_expanded_update(opcode);
+			/* the whole of the update should have been used */
+			if (expanded_update_pos != expanded_update_len)
+				rc = -1;
+		}
+		pthread_mutex_unlock(&udp_apply_mutex);
+		expanded_update_len = expanded_update_pos = 0;
+		if (rc)
+			return -1;
+	}
+	return 0;
+}
+
+static void *udp_reader(__attribute__((unused)) void *arg)
+{
+	struct snis_udp_shim *shim = snis_udp_shim_new(getenv("SNIS_UDP_SHIM"));
+	struct snis_udp_freshness *fresh = snis_udp_freshness_new(MAXGAMEOBJS * 2);
+	unsigned char buffer[SNIS_UDP_DATAGRAM_MAX], hello[SNIS_UDP_HELLO_SIZE];
+	double next_hello = 0.0;
+	int n, heard = 0;
+
+	if (!fresh)
+		return NULL;
+	snis_udp_hello_pack(hello, udp_token);
+	while (gameserver_sock >= 0) {
+		/* Keep saying hello until the server hears, and now and then after */
+		if (time_now_double() >= next_hello) {
+			if (send(udp_sock, hello, sizeof(hello), 0) < 0 && errno != ECONNREFUSED)
+				fprintf(stderr, "snis_client: UDP hello failed: %s\n", strerror(errno));
+			next_hello = time_now_double() + (heard ? 5.0 : 0.5);
+		}
+		n = snis_udp_recv(udp_sock, shim, buffer, sizeof(buffer), 100);
+		if (n < 0 && errno != ECONNREFUSED)
+			break;
+		if (n <= 0)
+			continue;
+		if (!heard)
+			printf("UDP channel open\n");
+		heard = 1;
+		if (process_udp_datagram(fresh, buffer, n))
+			fprintf(stderr, "snis_client: bad UDP datagram\n");
+		expanded_update_len = expanded_update_pos = 0;
+	}
+	snis_udp_freshness_free(fresh);
+	snis_udp_shim_free(shim);
+	close(udp_sock);
+	udp_sock = -1;
+	return NULL;
+}
+
+static int process_udp_channel_packet(void)
+{
+	unsigned char buffer[sizeof(uint16_t) + sizeof(uint32_t)];
+	struct sockaddr_in addr = gameserver_addr;
+	pthread_attr_t attr;
+	pthread_t thread;
+	uint16_t port;
+	int rc;
+
+	rc = read_and_unpack_buffer(buffer, "hw", &port, &udp_token);
+	if (rc)
+		return rc;
+	if (replay_file || udp_sock >= 0) /* replaying, or already have one */
+		return 0;
+	init_udp_update_sizes();
+	addr.sin_port = htons(port);
+	udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (udp_sock < 0)
+		goto error;
+	if (connect(udp_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		goto error;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&thread, &attr, udp_reader, NULL);
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		errno = rc;
+		goto error;
+	}
+	return 0;
+
+error:
+	/* Not fatal, everything still comes over TCP until the server hears from us */
+	fprintf(stderr, "snis_client: can't open UDP channel: %s\n", strerror(errno));
+	if (udp_sock >= 0)
+		close(udp_sock);
+	udp_sock = -1;
+	return 0;
+}
+
+/*
+ * Updates from the socket are staged, already expanded, and applied a batch
+ * at a time under one hold of universe_mutex, rather than each taking it in
+ * turn with the render thread.  The batch is applied when it is full, before
+ * anything other than a staged update is processed, and as soon as the next
+ * update isn't already buffered, so nothing staged waits on the network and
+ * the order of everything from the server is kept.
+ */
+#define UPDATE_BATCH_MAX 64
+#define UPDATE_BATCH_LOOKAHEAD (2 + UINT8_MAX) /* opcode, length, largest compact update */
+static struct update_batch {
+	int n;
+	uint8_t opcode[UPDATE_BATCH_MAX];
+	int len[UPDATE_BATCH_MAX];
+	unsigned char record[UPDATE_BATCH_MAX][sizeof(struct update_ship_packet)];
+} update_batch;
+static int staged_update_size[256]; /* updates which are staged, opcode included */
+
+static void init_staged_update_sizes(void)
+{
+	const struct compact_update_format *f;
+	int i;
+
+	BUILD_ASSERT(sizeof(struct update_ship_packet) < UPDATE_BATCH_LOOKAHEAD);
+	init_message_lengths(message_length, gameserver_capabilities);
+	for (f = compact_update_format; f->format; f++)
+		staged_update_size[f->opcode] = 1 + message_length[f->opcode];
+	staged_update_size[OPCODE_UPDATE_SHIP] = 1 + message_length[OPCODE_UPDATE_SHIP];
+	staged_update_size[OPCODE_UPDATE_SHIP2] = 1 + message_length[OPCODE_UPDATE_SHIP2];
+	for (i = 0; i < 256; i++)
+		assert(staged_update_size[i] <= (int) sizeof(update_batch.record[0]));
+}
+
+/* Add the update to the batch, from expanded_update if it came compact */
+static int stage_update(uint8_t opcode)
+{
+	struct update_batch *b = &update_batch;
+	int len = staged_update_size[opcode];
+	unsigned char *record = b->record[b->n];
+
+	if (expanded_update_len) {
+		if (expanded_update_len != len)
+			return -1;
+		memcpy(record, expanded_update, len);
+		expanded_update_len = expanded_update_pos = 0;
+	} else {
+		record[0] = opcode;
+		if (snis_socket_reader_read(gameserver_input, record + 1, len - 1))
+			return -1;
+	}
+	b->opcode[b->n] = opcode;
+	b->len[b->n] = len;
+	b->n++;
+	return 0;
+}
+
+static int apply_staged_updates(void)
+{
+	struct update_batch *b = &update_batch;
+	int i, rc = 0;
+
+	if (!b->n)
+		return 0;
+	pthread_mutex_lock(&universe_mutex);
+	for (i = 0; i < b->n && !rc; i++) {
+		memcpy(expanded_update, b->record[i], b->len[i]);
+		expanded_update_pos = 1;
+		expanded_update_len = b->len[i];
+		rc = apply_expanded_update(b->opcode[i]);
+		/* the whole of the update should have been used */
+		if (expanded_update_pos != expanded_update_len)
+			rc = -1;
+	}
+	pthread_mutex_unlock(&universe_mutex);
+	expanded_update_len = expanded_update_pos = 0;
+	b->n = 0;
+	return rc;
+}
+
 static void *gameserver_reader(__attribute__((unused)) void *arg)
 {
 	static uint32_t successful_opcodes;
 	uint8_t previous_opcode;
 	uint8_t last_opcode = 0x00;
 	uint8_t opcode = 0xff;
+	double replay_start = 0.0;
 	int rc = 0;
 
 	printf("gameserver reader thread\n");
+	init_staged_update_sizes();
 	while (1) {
 		previous_opcode = last_opcode;
 		last_opcode = opcode;
 		/* printf("Client reading from game server %d bytes...\n", sizeof(opcode)); */
-		rc = snis_readsocket(gameserver_sock, &opcode, sizeof(opcode));
+		rc = snis_socket_reader_read(gameserver_input, &opcode, sizeof(opcode));
 
 		/* grab time as close to when we got the packet as possible */
 		double update_time = time_now_double();
 
 		if (rc != 0) {
-			fprintf(stderr, "snis_readsocket returns %d, errno  %s\n",
+			if (replay_file) { /* end of the recording */
+				print_replay_stats();
+				exit(0);
+			}
+			fprintf(stderr, "snis_socket_reader_read returns %d, errno  %s\n",
 				rc, strerror(errno));
 			goto protocol_error;
 		}
+		if (replay_file)
+			replay_start = replay_clock();
+		if (opcode == OPCODE_UPDATE_COMPACT) {
+			if (expand_compact_update(&opcode))
+				goto protocol_error;
+			if (replay_file)
+				replay_stats.decode_time += replay_clock() - replay_start;
+		}
+		if (staged_update_size[opcode]) { /* these are applied by apply_expanded_update() */
+			rc = stage_update(opcode);
+			if (!rc && (update_batch.n == UPDATE_BATCH_MAX ||
+				snis_socket_reader_buffered(gameserver_input) < UPDATE_BATCH_LOOKAHEAD))
+				rc = apply_staged_updates();
+			goto processed;
+		}
+		rc = apply_staged_updates();
+		if (rc)
+			break;
 		/* printf("got opcode %hhu\n", opcode); */
 		switch (opcode)	{
-		case OPCODE_UPDATE_SHIP:
-		case OPCODE_UPDATE_SHIP2:
-			/* printf("processing update ship...\n"); */
-			rc = process_update_ship_packet(opcode);
-			break;
 		case OPCODE_UPDATE_POWER_DATA:
 			rc = process_update_power_data();
 			break;
 		case OPCODE_UPDATE_COOLANT_DATA:
 			rc = process_update_coolant_data();
 			break;
-		case OPCODE_ECON_UPDATE_SHIP:
 		case OPCODE_ECON_UPDATE_SHIP_DEBUG_AI:
 			rc = process_update_econ_ship_packet(opcode);
 			break;
-		case OPCODE_ID_CLIENT_SHIP:
-			rc = process_client_id_packet();
-			break;
-		case OPCODE_UPDATE_ASTEROID:
-			rc = process_update_asteroid_packet();
-			break;
-		case OPCODE_UPDATE_DOCKING_PORT:
-			rc = process_update_docking_port_packet();
-			break;
-		case OPCODE_UPDATE_CARGO_CONTAINER:
-			rc = process_update_cargo_container_packet();
-			break;
-		case OPCODE_UPDATE_DERELICT:
-			rc = process_update_derelict_packet();
-			break;
-		case OPCODE_UPDATE_PLANET:
-			rc = process_update_planet_packet();
+		case OPCODE_UPDATE_DELTA:
+			rc = process_update_delta_packet();
 			break;
-		case OPCODE_UPDATE_STARBASE:
-			rc = process_update_starbase_packet();
+		case OPCODE_UPDATE_ORIGIN:
+			rc = process_update_origin_packet();
 			break;
-		case OPCODE_UPDATE_WORMHOLE:
-			rc = process_update_wormhole_packet();
+		case OPCODE_UDP_CHANNEL:
+			rc = process_udp_channel_packet();
 			break;
-		case OPCODE_UPDATE_NEBULA:
-			rc = process_update_nebula_packet();
-			break;
-		case OPCODE_UPDATE_LASERBEAM:
-			rc = process_update_laserbeam();
-			break;
-		case OPCODE_UPDATE_TRACTORBEAM:
-			rc = process_update_tractorbeam();
-			break;
-		case OPCODE_UPDATE_EXPLOSION:
-			rc = process_update_explosion_packet();
-			break;
-		case OPCODE_UPDATE_LASER:
-			rc = process_update_laser_packet();
-			break;
-		case OPCODE_UPDATE_TORPEDO:
-			rc = process_update_torpedo_packet();
+		case OPCODE_ID_CLIENT_SHIP:
+			rc = process_client_id_packet();
 			break;
 		case OPCODE_WARP_LIMBO:
 			rc = process_warp_limbo_packet();
@@ -5089,6 +5577,9 @@ static void *gameserver_reader(__attribute__((unused)) void *arg)
 		case OPCODE_UPDATE_NETSTATS:
 			rc = process_update_netstats();
 			break;
+		case OPCODE_TICK_PROFILE:
+			rc = process_tick_profile();
+			break;
 		case OPCODE_DAMCON_OBJ_UPDATE:
 			rc = process_update_damcon_object();
 			break;
@@ -5142,9 +5633,20 @@ static void *gameserver_reader(__attribute__((unused)) void *arg)
 		default:
 			goto protocol_error;
 		}
+processed:
+		if (expanded_update_len) {
+			/* the whole of an expanded update should have been used */
+			if (expanded_update_pos != expanded_update_len)
+				rc = -1;
+			expanded_update_len = expanded_update_pos = 0;
+		}
 		if (rc) /* protocol error */
 			break;
 		successful_opcodes++;
+		if (replay_file) {
+			replay_stats.process_time += replay_clock() - replay_start;
+			replay_stats.opcodes++;
+		}
 	}
 
 protocol_error:
@@ -5152,6 +5654,10 @@ protocol_error:
 	snis_print_last_buffer(gameserver_sock);	
 	printf("last opcode was %hhu, before that %hhu\n", last_opcode, previous_opcode);
 	printf("total successful opcodes = %u\n", successful_opcodes);
+	if (gameserver_input) {
+		snis_socket_reader_free(gameserver_input);
+		gameserver_input = NULL;
+	}
 	close(gameserver_sock);
 	gameserver_sock = -1;
 	return NULL;
@@ -5173,6 +5679,20 @@ static void wait_for_serverbound_packets(void)
 	pthread_mutex_unlock(&to_server_queue_event_mutex);
 }
 
+/* Write to the game server, compressing if that was agreed on. */
+static int write_to_gameserver(void *buffer, int buflen)
+{
+	unsigned char *out;
+	int len;
+
+	if (!gameserver_deflater)
+		return snis_writesocket(gameserver_sock, buffer, buflen);
+	if (snis_deflate(gameserver_deflater, buffer, buflen, 1))
+		return -1;
+	out = snis_deflater_take_output(gameserver_deflater, &len);
+	return snis_writesocket(gameserver_sock, out, len);
+}
+
 static void write_queued_packets_to_server(void)
 {
 	struct packed_buffer *buffer;
@@ -5181,7 +5701,7 @@ static void write_queued_packets_to_server(void)
 	pthread_mutex_lock(&to_server_queue_event_mutex);
 	buffer = packed_buffer_queue_combine(&to_server_queue, &to_server_queue_mutex);
 	if (buffer) {
-		rc = snis_writesocket(gameserver_sock, buffer->buffer, buffer->buffer_size);
+		rc = write_to_gameserver(buffer->buffer, buffer->buffer_size);
 		packed_buffer_free(buffer);
 		if (rc) {
 			printf("Failed to write to gameserver\n");
@@ -5274,6 +5794,41 @@ static void send_build_info_to_server(void)
 	queue_to_server(pb);
 }
 
+/* Rather than connecting to a server, play back a recording made with --record,
+ * as fast as it can be processed, or at the pace it was recorded.
+ */
+static void start_replay(void)
+{
+	int rc;
+
+	gameserver_input = snis_socket_reader_replay_new(replay_file, replay_realtime,
+						GAMESERVER_INPUT_BUFFER_SIZE);
+	if (!gameserver_input) {
+		fprintf(stderr, "snis_client: can't replay %s: %s\n", replay_file, strerror(errno));
+		exit(1);
+	}
+	/* Recordings are made by clients like us, which always ask for these */
+	gameserver_capabilities = SNIS_CAP_COMPRESSION_STATS;
+	/* Requests the UI makes just accumulate, nothing is listening */
+	pthread_mutex_init(&to_server_queue_mutex, NULL);
+	pthread_mutex_init(&to_server_queue_event_mutex, NULL);
+	packed_buffer_queue_init(&to_server_queue);
+
+	done_with_lobby = 1;
+	displaymode = role_to_displaymode(role);
+	memset(&replay_stats, 0, sizeof(replay_stats));
+	replay_stats.start = replay_clock();
+
+	pthread_attr_init(&gameserver_reader_attr);
+	pthread_attr_setdetachstate(&gameserver_reader_attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&read_from_gameserver_thread, &gameserver_reader_attr, gameserver_reader, NULL);
+	if (rc) {
+		fprintf(stderr, "Failed to create gameserver reader thread: %d '%s', '%s'\n",
+			rc, strerror(rc), strerror(errno));
+		exit(1);
+	}
+}
+
 static void *connect_to_gameserver_thread(__attribute__((unused)) void *arg)
 {
 	int rc;
@@ -5288,6 +5843,8 @@ static void *connect_to_gameserver_thread(__attribute__((unused)) void *arg)
 	unsigned char *x = (unsigned char *) &lobby_game_server[lobby_selected_server].ipaddr;
 	struct add_player_packet app;
 	int flag = 1;
+	uint32_t capabilities;
+	char *compress, *udp;
 
 	sprintf(portstr, "%d", ntohs(lobby_game_server[lobby_selected_server].port));
 	sprintf(hoststr, "%d.%d.%d.%d", x[0], x[1], x[2], x[3]);
@@ -5321,18 +5878,58 @@ static void *connect_to_gameserver_thread(__attribute__((unused)) void *arg)
 	rc = connect(gameserver_sock, i->ai_addr, i->ai_addrlen);
 	if (rc < 0)
 		goto error;
+	memcpy(&gameserver_addr, i->ai_addr, sizeof(gameserver_addr));
 
 	rc = setsockopt(gameserver_sock, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
 	if (rc)
 		fprintf(stderr, "setsockopt(TCP_NODELAY) failed.\n");
 
+	/* Compression costs CPU on both ends, so only ask for it when told to,
+	 * e.g. for stations on the far end of a slow link.
+	 */
+	compress = getenv("SNIS_COMPRESSION");
+	capabilities = SNIS_CAP_DELTA_UPDATES | SNIS_CAP_COMPACT_UPDATES | SNIS_CAP_COMPRESSION_STATS;
+	if (compress && strcmp(compress, "0") != 0)
+		capabilities |= SNIS_CAP_COMPRESSION;
+	/* Likewise UDP, which only pays off where a lost packet would otherwise
+	 * hold up everything behind it.
+	 */
+	udp = getenv("SNIS_UDP");
+	if (udp && strcmp(udp, "0") != 0)
+		capabilities |= SNIS_CAP_UDP;
+	capabilities = htonl(capabilities);
 	rc = snis_writesocket(gameserver_sock, SNIS_PROTOCOL_VERSION, strlen(SNIS_PROTOCOL_VERSION));
+	if (rc == 0)
+		rc = snis_writesocket(gameserver_sock, &capabilities, sizeof(capabilities));
+	if (rc == 0)
+		rc = snis_readsocket(gameserver_sock, &capabilities, sizeof(capabilities));
 	if (rc < 0) {
 		shutdown(gameserver_sock, SHUT_RDWR);
 		close(gameserver_sock);
 		gameserver_sock = -1;
 		goto error;
 	}
+	capabilities = ntohl(capabilities);
+	printf("Server agreed to capabilities 0x%08x\n", capabilities);
+	gameserver_capabilities = capabilities;
+
+	gameserver_input = snis_socket_reader_new(gameserver_sock, GAMESERVER_INPUT_BUFFER_SIZE);
+	if (!gameserver_input)
+		goto error;
+	if (record_file) {
+		struct snis_stream_recorder *rec = snis_stream_recorder_new(record_file);
+
+		if (rec)
+			snis_socket_reader_record(gameserver_input, rec);
+		else
+			fprintf(stderr, "snis_client: can't record to %s: %s\n",
+				record_file, strerror(errno));
+	}
+	if (capabilities & SNIS_CAP_COMPRESSION) {
+		gameserver_deflater = snis_deflater_new();
+		if (!gameserver_deflater || snis_socket_reader_inflate(gameserver_input))
+			goto error;
+	}
 
 	displaymode = DISPLAYMODE_CONNECTED;
 	done_with_lobby = 1;
@@ -5348,7 +5945,7 @@ static void *connect_to_gameserver_thread(__attribute__((unused)) void *arg)
 	strncpy((char *) app.password, password, 19);
 
 	printf("Notifying server, opcode update player\n");
-	if (snis_writesocket(gameserver_sock, &app, sizeof(app)) < 0) {
+	if (write_to_gameserver(&app, sizeof(app)) < 0) {
 		fprintf(stderr, "Initial write to gameserver failed.\n");
 		shutdown(gameserver_sock, SHUT_RDWR);
 		close(gameserver_sock);
@@ -9955,6 +10552,11 @@ static void toggle_demon_safe_mode(void)
 	queue_to_server(packed_buffer_new("b", OPCODE_TOGGLE_DEMON_SAFE_MODE));
 }
 
+static void request_tick_profile(void)
+{
+	queue_to_server(packed_buffer_new("b", OPCODE_REQUEST_TICK_PROFILE));
+}
+
 static int ux_to_usersx(double ux, float x1, float x2)
 {
 	return ((ux - x1) / (x2 - x1)) * SCREEN_WIDTH;
@@ -10434,8 +11036,10 @@ static struct demon_cmd_def {
 	{ "SAFEMODE", "TOGGLES SAFE MODE (prevents enemies from attacking)" },
 	{ "HELP", "PRINT THIS HELP INFORMATION" },
 	{ "ENSCRIPT", "SAVE (PARTIALLY) UNIVERSE STATE TO LUA SCRIPT" },
+	{ "PROFILE", "SHOW WHERE THE SERVER'S TIME GOES EACH TICK" },
 };
 static int demon_help_mode = 0;
+static int demon_profile_mode = 0;
 #define DEMON_CMD_DELIM " ,"
 
 static void show_cmd_help(GtkWidget *w, struct demon_cmd_def cmd[], int nitems)
@@ -10459,6 +11063,35 @@ static void demon_cmd_help(GtkWidget *w)
 	show_cmd_help(w, demon_cmd, ARRAYSIZE(demon_cmd));
 }
 
+static void demon_tick_profile(GtkWidget *w)
+{
+	int i, y;
+	char title[20], buffer[100];
+
+	if (!demon_profile_mode)
+		return;
+	sng_set_foreground(UI_COLOR(help_text));
+	if (ntick_profile_entries == 0) {
+		sng_abs_xy_draw_string("WAITING FOR TICK PROFILE", NANO_FONT, 85, 60);
+		return;
+	}
+	sprintf(title, "LAST %d TICKS", SNIS_TICK_PROFILE_WINDOW);
+	sprintf(buffer, "%-16s %8s %8s %7s %7s %7s %7s", title,
+		"CALLS", "USEC", "MAX", "P50", "P90", "P99");
+	sng_abs_xy_draw_string(buffer, NANO_FONT, 85, 60);
+	for (i = 0; i < ntick_profile_entries; i++) {
+		struct tick_profile_entry *e = &tick_profile[i];
+
+		y = i * 15 + 78;
+		if (y > SCREEN_HEIGHT - 40)
+			break;
+		sprintf(buffer, "%-16s %8u %8u %7u %7u %7u %7u", e->name, e->calls, e->usec,
+			e->max_usec, e->p50_usec, e->p90_usec, e->p99_usec);
+		uppercase(buffer);
+		sng_abs_xy_draw_string(buffer, NANO_FONT, 85, y);
+	}
+}
+
 static struct demon_group {
 	char name[100];
 	uint16_t id[MAX_DEMON_SELECTABLE];
@@ -10702,6 +11335,11 @@ static int construct_demon_command(char *input,
 		case 13:
 			send_enscript_packet_to_server(saveptr);
 			break;
+		case 14:
+			ntick_profile_entries = 0;
+			demon_profile_mode = 1;
+			request_tick_profile();
+			break;
 		default: /* unknown */
 			sprintf(errmsg, "Unknown ver number %d\n", v);
 			return -1;
@@ -10731,6 +11369,7 @@ static void demon_exec_button_pressed(void *x)
 	int rc;
 
 	demon_help_mode = 0;
+	demon_profile_mode = 0;
 	if (strlen(demon_ui.input) == 0)
 		return;
 	clear_empty_demon_variables();
@@ -11074,6 +11713,12 @@ static void show_demon(GtkWidget *w)
 			netstats.faction_population[3],
 			netstats.faction_population[4]);
 	sng_abs_xy_draw_string(buffer, NANO_FONT, 10, SCREEN_HEIGHT - 10);
+	if (netstats.elapsed_seconds && netstats.bytes_deflated_out) {
+		sprintf(buffer, "COMPRESSION %.1f:1 CPU %.2f%%",
+			(double) netstats.bytes_deflated_in / (double) netstats.bytes_deflated_out,
+			netstats.compression_usec / (netstats.elapsed_seconds * 10000.0));
+		sng_abs_xy_draw_string(buffer, NANO_FONT, 10, SCREEN_HEIGHT - 20);
+	}
 
 	if (demon_ui.selectmode) {
 		int x1, y1, x2, y2;
@@ -11090,6 +11735,7 @@ static void show_demon(GtkWidget *w)
 	}
 	show_demon_groups(w);
 	demon_cmd_help(w);
+	demon_tick_profile(w);
 	show_common_screen(w, "DEMON");
 }
 
@@ -11948,6 +12594,14 @@ end_of_drawing:
 		frame_index = (frame_index+1) % FRAME_INDEX_MAX;
 		last_frame_time = start_time;
 	}
+	if (replay_file) {
+		double frame_time = time_now_double() - start_time;
+
+		replay_stats.frames++;
+		replay_stats.frame_time += frame_time;
+		if (frame_time > replay_stats.max_frame_time)
+			replay_stats.max_frame_time = frame_time;
+	}
 	return 0;
 }
 
@@ -12560,7 +13214,8 @@ void really_quit(void)
 static void usage(void)
 {
 	fprintf(stderr, "usage: snis_client [--aspect-ratio x,y] --lobbyhost lobbyhost \\\n"
-			"                    --starship starshipname --pw password\n");
+			"                    --starship starshipname --pw password [--record file]\n");
+	fprintf(stderr, "       snis_client [--aspect-ratio x,y] --replay file [--replay-realtime]\n");
 	fprintf(stderr, "       Example: ./snis_client --lobbyhost localhost --starship Enterprise --pw tribbles\n");
 	exit(1);
 }
@@ -13344,6 +13999,20 @@ static void figure_aspect_ratio(int requested_x, int requested_y,
 	}
 }
 
+/* The universe mutex is recursive, so that a batch of updates can be applied
+ * under a single acquisition even though each update takes the mutex itself,
+ * see apply_staged_updates().
+ */
+static void init_universe_mutex(void)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&universe_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
 static void init_colors(void)
 {
 	char color_file[PATH_MAX];
@@ -13442,6 +14111,24 @@ int main(int argc, char *argv[])
 			fullscreen = 1;
 			continue;
 		}
+		if (strcmp(argv[i], "--record") == 0) {
+			if ((i + 1) >= argc)
+				usage();
+			record_file = argv[i + 1];
+			i++;
+			continue;
+		}
+		if (strcmp(argv[i], "--replay") == 0) {
+			if ((i + 1) >= argc)
+				usage();
+			replay_file = argv[i + 1];
+			i++;
+			continue;
+		}
+		if (strcmp(argv[i], "--replay-realtime") == 0) {
+			replay_realtime = 1;
+			continue;
+		}
 		if (strcmp(argv[i], "--aspect-ratio") == 0) {
 			int rc, x, y;
 			printf("argc = %d, i = %d\n", argc, i);
@@ -13464,7 +14151,9 @@ int main(int argc, char *argv[])
 	override_asset_dir();
 
 	memset(&main_screen_text, 0, sizeof(main_screen_text));
+	init_universe_mutex();
 	snis_object_pool_setup(&pool, MAXGAMEOBJS);
+	id_map = snis_id_map_new(MAXGAMEOBJS);
 	snis_object_pool_setup(&sparkpool, MAXSPARKS);
 	snis_object_pool_setup(&damcon_pool, MAXDAMCONENTITIES);
 	memset(dco, 0, sizeof(dco));
@@ -13492,7 +14181,7 @@ int main(int argc, char *argv[])
 	memset(ship_mesh_map, 0, sizeof(*ship_mesh_map) * nshiptypes);
 	memset(derelict_mesh, 0, sizeof(*derelict_mesh) * nshiptypes);
 
-	if (displaymode != DISPLAYMODE_NETWORK_SETUP || quickstartmode) {
+	if (!replay_file && (displaymode != DISPLAYMODE_NETWORK_SETUP || quickstartmode)) {
 		connect_to_lobby();
 		if (quickstartmode)
 			displaymode = DISPLAYMODE_LOBBYSCREEN;
@@ -13644,6 +14333,9 @@ int main(int argc, char *argv[])
 	if (fullscreen)
 		gtk_window_fullscreen(GTK_WINDOW(window));
 
+	if (replay_file)
+		start_replay();
+
 	gtk_main ();
         wwviaudio_cancel_all_sounds();
         wwviaudio_stop_portaudio();
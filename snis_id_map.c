@@ -0,0 +1,210 @@
+/*
+        Copyright (C) 2010 Stephen M. Cameron
+        Author: Stephen M. Cameron
+
+        This file is part of Spacenerds In Space.
+
+        Spacenerds in Space is free software; you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+        (at your option) any later version.
+
+        Spacenerds in Space is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with Spacenerds in Space; if not, write to the Free Software
+        Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DEFINE_SNIS_ID_MAP_GLOBALS
+#include "snis_id_map.h"
+
+struct id_slot {
+	uint32_t id;
+	int index;	/* -1 if the slot is empty */
+};
+
+struct snis_id_map {
+	int maxobjs, count;
+	int shift;	/* 32 - log2(nslots) */
+	uint32_t mask;	/* nslots - 1 */
+	struct id_slot *slot;
+};
+
+struct snis_id_map *snis_id_map_new(int maxobjs)
+{
+	struct snis_id_map *map;
+	int bits = 1;
+
+	/* at least twice as many slots as ids, to keep the probes short */
+	while (bits < 30 && (1 << bits) < 2 * maxobjs)
+		bits++;
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return NULL;
+	map->maxobjs = maxobjs;
+	map->shift = 32 - bits;
+	map->mask = (1u << bits) - 1;
+	map->slot = malloc(sizeof(*map->slot) << bits);
+	if (!map->slot) {
+		free(map);
+		return NULL;
+	}
+	snis_id_map_clear(map);
+	return map;
+}
+
+void snis_id_map_free(struct snis_id_map *map)
+{
+	if (!map)
+		return;
+	free(map->slot);
+	free(map);
+}
+
+void snis_id_map_clear(struct snis_id_map *map)
+{
+	uint32_t i;
+
+	for (i = 0; i <= map->mask; i++)
+		map->slot[i].index = -1;
+	map->count = 0;
+}
+
+/* Fibonacci hashing, ids being mostly consecutive */
+static inline uint32_t home_slot(struct snis_id_map *map, uint32_t id)
+{
+	return (id * 2654435769u) >> map->shift;
+}
+
+/* The slot holding id, or the empty slot where it would go */
+static inline uint32_t find_slot(struct snis_id_map *map, uint32_t id)
+{
+	uint32_t i = home_slot(map, id);
+
+	while (map->slot[i].index >= 0 && map->slot[i].id != id)
+		i = (i + 1) & map->mask;
+	return i;
+}
+
+int snis_id_map_lookup(struct snis_id_map *map, uint32_t id)
+{
+	return map->slot[find_slot(map, id)].index;
+}
+
+int snis_id_map_add(struct snis_id_map *map, uint32_t id, int index)
+{
+	uint32_t i = find_slot(map, id);
+
+	if (map->slot[i].index < 0) {
+		if (map->count >= map->maxobjs)
+			return -1;
+		map->count++;
+		map->slot[i].id = id;
+	}
+	map->slot[i].index = index;
+	return 0;
+}
+
+void snis_id_map_remove(struct snis_id_map *map, uint32_t id)
+{
+	uint32_t i, j, home;
+
+	i = find_slot(map, id);
+	if (map->slot[i].index < 0)
+		return;
+	map->count--;
+
+	/*
+	 * Rather than leave a tombstone, move back into the hole any later id
+	 * in the same run of full slots whose home slot doesn't lie (cyclically)
+	 * between the hole and where it is, since it would not then be found.
+	 */
+	j = i;
+	for (;;) {
+		map->slot[i].index = -1;
+		do {
+			j = (j + 1) & map->mask;
+			if (map->slot[j].index < 0)
+				return;
+			home = home_slot(map, map->slot[j].id);
+		} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+		map->slot[i] = map->slot[j];
+		i = j;
+	}
+}
+
+#ifdef TEST_ID_MAP
+#define TEST_MAXOBJS 5000
+
+static int check(const char *what, uint32_t id, int index, int expected)
+{
+	if (index == expected)
+		return 0;
+	printf("FAIL: %s %u gave %d, expected %d\n", what, id, index, expected);
+	return 1;
+}
+
+/* The way the server uses it: ids handed out in order, objects dying at random */
+static int test_against_array(void)
+{
+	static uint32_t id_at[TEST_MAXOBJS];
+	struct snis_id_map *map;
+	uint32_t next_id = 0, id;
+	int i, j, errors = 0, round;
+
+	map = snis_id_map_new(TEST_MAXOBJS);
+	for (i = 0; i < TEST_MAXOBJS; i++) {
+		id_at[i] = next_id;
+		errors += check("add", next_id, snis_id_map_add(map, next_id, i), 0);
+		next_id++;
+	}
+	errors += check("add past maxobjs", next_id, snis_id_map_add(map, next_id, 0), -1);
+	for (round = 0; round < 200000 && !errors; round++) {
+		i = rand() % TEST_MAXOBJS;
+		snis_id_map_remove(map, id_at[i]);
+		errors += check("lookup removed", id_at[i], snis_id_map_lookup(map, id_at[i]), -1);
+		id_at[i] = next_id++;
+		if (round % 5 == 0) {
+			/* not in order, and never clashing with next_id */
+			id_at[i] = 0x80000000u | (uint32_t) rand();
+			for (j = 0; j < TEST_MAXOBJS; j++)
+				if (id_at[j] == id_at[i] && j != i)
+					id_at[i] = next_id++;
+		}
+		errors += check("add", id_at[i], snis_id_map_add(map, id_at[i], i), 0);
+		if (round % 1000 == 0)
+			for (j = 0; j < TEST_MAXOBJS; j++)
+				errors += check("lookup", id_at[j],
+						snis_id_map_lookup(map, id_at[j]), j);
+	}
+	for (j = 0; j < TEST_MAXOBJS; j++)
+		errors += check("final lookup", id_at[j], snis_id_map_lookup(map, id_at[j]), j);
+	id = next_id + 12345;
+	errors += check("lookup never added", id, snis_id_map_lookup(map, id), -1);
+	errors += check("move", id_at[0], snis_id_map_add(map, id_at[0], 17), 0);
+	errors += check("lookup moved", id_at[0], snis_id_map_lookup(map, id_at[0]), 17);
+	snis_id_map_clear(map);
+	errors += check("lookup cleared", id_at[1], snis_id_map_lookup(map, id_at[1]), -1);
+	errors += check("add cleared", id_at[1], snis_id_map_add(map, id_at[1], 1), 0);
+	snis_id_map_free(map);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+
+	rc = test_against_array();
+	printf("test_against_array %s\n", rc ? "failed" : "passed");
+	return rc;
+}
+#endif
@@ -0,0 +1,55 @@
+#ifndef __SNIS_ID_MAP_H__
+#define __SNIS_ID_MAP_H__
+/*
+        Copyright (C) 2010 Stephen M. Cameron
+        Author: Stephen M. Cameron
+
+        This file is part of Spacenerds In Space.
+
+        Spacenerds in Space is free software; you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+        (at your option) any later version.
+
+        Spacenerds in Space is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with Spacenerds in Space; if not, write to the Free Software
+        Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Maps object ids to where the objects are in an array such as go[], so an
+ * object can be found by id without searching the array.  It's a hash table
+ * with open addressing, sized when made for at most maxobjs ids at once.
+ * The caller does any locking.
+ */
+
+#ifdef DEFINE_SNIS_ID_MAP_GLOBALS
+#define GLOBAL
+#else
+#define GLOBAL extern
+#endif
+
+#include <stdint.h>
+
+struct snis_id_map;
+
+GLOBAL struct snis_id_map *snis_id_map_new(int maxobjs);
+GLOBAL void snis_id_map_free(struct snis_id_map *map);
+
+/* Returns 0, or -1 if the map already holds maxobjs ids.  An id already
+ * in the map is moved to the new index.
+ */
+GLOBAL int snis_id_map_add(struct snis_id_map *map, uint32_t id, int index);
+GLOBAL void snis_id_map_remove(struct snis_id_map *map, uint32_t id);
+GLOBAL void snis_id_map_clear(struct snis_id_map *map);
+
+/* Returns the index for id, or -1 if id isn't in the map */
+GLOBAL int snis_id_map_lookup(struct snis_id_map *map, uint32_t id);
+
+#undef GLOBAL
+#endif
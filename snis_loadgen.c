@@ -0,0 +1,801 @@
+/*
+        Copyright (C) 2010 Stephen M. Cameron
+        Author: Stephen M. Cameron
+
+        This file is part of Spacenerds In Space.
+
+        Spacenerds in Space is free software; you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+        (at your option) any later version.
+
+        Spacenerds in Space is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with Spacenerds in Space; if not, write to the Free Software
+        Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * snis_loadgen: synthetic, headless clients for load testing snis_server.
+ *
+ * Each client connects and logs in just as snis_client does, then sends a
+ * plausible mix of bridge input (throttle, yaw, torpedoes, science
+ * selections) at a fixed rate, while reading, framing and counting
+ * everything the server sends it, without rendering any of it.  Message
+ * and byte rates are reported periodically, so the number of stations at
+ * which the server stops keeping up can be found by adding clients.
+ * With --udp, clients take object state updates by UDP as well; the
+ * SNIS_UDP_SHIM environment variable (see snis_udp.h) adds loss and delay.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "quat.h"
+#include "snis.h"
+#include "snis_marshal.h"
+#include "snis_packet.h"
+#include "snis_socket_io.h"
+#include "snis_udp.h"
+#include "mathutils.h"
+#include "ssgl/ssgl.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+#define MAX_LOADGEN_CLIENTS 1000
+#define LOADGEN_INPUT_BUFFER_SIZE (64 * 1024)
+#define MAX_KNOWN_IDS 64
+
+static int message_length[256];
+
+static struct packed_buffer_delta_format ship_delta, econ_ship_delta;
+
+static char *host = "localhost";
+static char *lobbyhost = NULL;
+static char *gameinstance = NULL;
+static int port = -1;
+static int nclients = 4;
+static int duration = 30; /* seconds, 0 means forever */
+static double input_rate = 5.0; /* requests per second per client */
+static double report_interval = 1.0;
+static int clients_per_ship = 1;
+static int all_roles = 0;
+static uint32_t capabilities = SNIS_CAP_DELTA_UPDATES | SNIS_CAP_COMPACT_UPDATES;
+static struct network_stats netstats;
+static struct sockaddr_in server_addr;
+static char *udp_shim_spec;
+
+static struct loadgen_client {
+	int index;
+	int sock;
+	uint32_t capabilities; /* as agreed by the server */
+	struct snis_socket_reader *input;
+	struct snis_deflater *deflater;
+	pthread_t reader, writer;
+	pthread_mutex_t lock; /* protects my_ship_id and known_id[] */
+	uint32_t my_ship_id;
+	uint32_t known_id[MAX_KNOWN_IDS]; /* ships seen, as targets for the science station */
+	int nknown_ids, next_known_id;
+	unsigned int seed; /* used only by the writer thread */
+	volatile int alive;
+	/* Written only by this client's threads, read unlocked for reports */
+	uint64_t messages[256];
+	uint64_t stream_bytes;
+	uint64_t requests;
+	/* The UDP channel, if the server offered one; counters written only by udp_reader */
+	int udp_sock;
+	uint32_t udp_token;
+	pthread_t udp_reader;
+	uint64_t udp_datagrams, udp_messages, udp_bytes, udp_stale;
+	uint32_t udp_first_seq, udp_last_seq; /* lowest and highest seen */
+} client[MAX_LOADGEN_CLIENTS];
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: snis_loadgen [options]\n");
+	fprintf(stderr, "   -H, --host host: snis_server host, default localhost\n");
+	fprintf(stderr, "   -p, --port port: snis_server port\n");
+	fprintf(stderr, "   -l, --lobbyhost host: find the server through the lobby instead of --port\n");
+	fprintf(stderr, "   -g, --gameinstance name: which server the lobby should give us\n");
+	fprintf(stderr, "   -n, --clients n: number of clients, default %d\n", nclients);
+	fprintf(stderr, "   -s, --stations n: clients sharing each ship, default %d\n", clients_per_ship);
+	fprintf(stderr, "   -a, --allroles: every client takes every role, rather than one each\n");
+	fprintf(stderr, "   -r, --rate hz: input requests per second per client, default %g\n", input_rate);
+	fprintf(stderr, "   -d, --duration seconds: how long to run, 0 is forever, default %d\n", duration);
+	fprintf(stderr, "   -i, --interval seconds: how often to report, default %g\n", report_interval);
+	fprintf(stderr, "   -c, --capabilities mask: SNIS_CAP_* to ask for, default 0x%x\n", capabilities);
+	fprintf(stderr, "   -z, --compress: also ask for stream compression\n");
+	fprintf(stderr, "   -u, --udp: also ask for object state updates by UDP\n");
+	fprintf(stderr, "Example:\n");
+	fprintf(stderr, "   ./snis_loadgen --lobbyhost localhost --clients 24 --stations 6 --rate 10\n");
+	exit(1);
+}
+
+static struct option long_options[] = {
+	{ "host", required_argument, NULL, 'H' },
+	{ "port", required_argument, NULL, 'p' },
+	{ "lobbyhost", required_argument, NULL, 'l' },
+	{ "gameinstance", required_argument, NULL, 'g' },
+	{ "clients", required_argument, NULL, 'n' },
+	{ "stations", required_argument, NULL, 's' },
+	{ "allroles", no_argument, NULL, 'a' },
+	{ "rate", required_argument, NULL, 'r' },
+	{ "duration", required_argument, NULL, 'd' },
+	{ "interval", required_argument, NULL, 'i' },
+	{ "capabilities", required_argument, NULL, 'c' },
+	{ "compress", no_argument, NULL, 'z' },
+	{ "udp", no_argument, NULL, 'u' },
+	{ "help", no_argument, NULL, 'h' },
+	{ 0, 0, 0, 0 },
+};
+
+static void process_int_option(char *option_name, char *option_value, int *value)
+{
+	int tmp;
+
+	if (sscanf(option_value, "%i", &tmp) == 1) {
+		*value = tmp;
+	} else {
+		fprintf(stderr, "Bad %s option '%s'\n", option_name, option_value);
+		usage();
+	}
+}
+
+static void process_double_option(char *option_name, char *option_value, double *value)
+{
+	double tmp;
+
+	if (sscanf(option_value, "%lf", &tmp) == 1) {
+		*value = tmp;
+	} else {
+		fprintf(stderr, "Bad %s option '%s'\n", option_name, option_value);
+		usage();
+	}
+}
+
+static void process_options(int argc, char *argv[])
+{
+	int c, caps;
+
+	while (1) {
+		int option_index;
+		c = getopt_long(argc, argv, "ac:d:g:hH:i:l:n:p:r:s:uz", long_options, &option_index);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'a':
+			all_roles = 1;
+			break;
+		case 'c':
+			process_int_option("capabilities", optarg, &caps);
+			capabilities = (capabilities & (SNIS_CAP_COMPRESSION | SNIS_CAP_UDP)) |
+					(uint32_t) caps;
+			break;
+		case 'd':
+			process_int_option("duration", optarg, &duration);
+			break;
+		case 'g':
+			gameinstance = optarg;
+			break;
+		case 'H':
+			host = optarg;
+			break;
+		case 'i':
+			process_double_option("interval", optarg, &report_interval);
+			break;
+		case 'l':
+			lobbyhost = optarg;
+			break;
+		case 'n':
+			process_int_option("clients", optarg, &nclients);
+			break;
+		case 'p':
+			process_int_option("port", optarg, &port);
+			break;
+		case 'r':
+			process_double_option("rate", optarg, &input_rate);
+			break;
+		case 's':
+			process_int_option("stations", optarg, &clients_per_ship);
+			break;
+		case 'u':
+			capabilities |= SNIS_CAP_UDP;
+			break;
+		case 'z':
+			capabilities |= SNIS_CAP_COMPRESSION;
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+	if (nclients < 1 || nclients > MAX_LOADGEN_CLIENTS) {
+		fprintf(stderr, "snis_loadgen: clients must be between 1 and %d\n", MAX_LOADGEN_CLIENTS);
+		usage();
+	}
+	if (clients_per_ship < 1)
+		clients_per_ship = 1;
+	if (report_interval <= 0.0)
+		report_interval = 1.0;
+	if (port < 0 && !lobbyhost) {
+		fprintf(stderr, "snis_loadgen: need --port or --lobbyhost\n");
+		usage();
+	}
+}
+
+static void init_message_framing(void)
+{
+	/* the netstats have the compression figures, which the clients always ask for */
+	init_message_lengths(message_length, SNIS_CAP_COMPRESSION_STATS);
+	if (packed_buffer_delta_format_init(&ship_delta, UPDATE_SHIP_PACKET_FORMAT) ||
+		packed_buffer_delta_format_init(&econ_ship_delta, UPDATE_ECON_SHIP_PACKET_FORMAT)) {
+		fprintf(stderr, "snis_loadgen: bad delta update format\n");
+		exit(1);
+	}
+}
+
+/* Remember a ship we've heard about, for the science station to select */
+static void note_ship(struct loadgen_client *c, const unsigned char *id_bytes)
+{
+	uint32_t id;
+	int i;
+
+	memcpy(&id, id_bytes, sizeof(id));
+	id = ntohl(id);
+	pthread_mutex_lock(&c->lock);
+	for (i = 0; i < c->nknown_ids; i++)
+		if (c->known_id[i] == id)
+			break;
+	if (i == c->nknown_ids) {
+		c->known_id[c->next_known_id] = id;
+		c->next_known_id = (c->next_known_id + 1) % MAX_KNOWN_IDS;
+		if (c->nknown_ids < MAX_KNOWN_IDS)
+			c->nknown_ids++;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* Read one message (the opcode already read) into buffer, which must hold
+ * at least UINT16_MAX bytes.  Returns its length, or -1 on error.
+ */
+static int read_message(struct loadgen_client *c, uint8_t opcode, unsigned char *buffer)
+{
+	struct packed_buffer_delta_format *df;
+	uint8_t len;
+	int n;
+
+	n = message_length[opcode];
+	if (n >= 0) {
+		if (n && snis_socket_reader_read(c->input, buffer, n))
+			return -1;
+		return n;
+	}
+	if (n == MESSAGE_LENGTH_UNKNOWN) {
+		fprintf(stderr, "snis_loadgen: client %d: unknown opcode %hhu\n", c->index, opcode);
+		return -1;
+	}
+	switch (opcode) {
+	case OPCODE_UPDATE_DELTA:
+		/* original opcode, id, the mask, then the changed fields */
+		if (snis_socket_reader_read(c->input, buffer, 5))
+			return -1;
+		if (buffer[0] == OPCODE_UPDATE_SHIP)
+			df = &ship_delta;
+		else if (buffer[0] == OPCODE_ECON_UPDATE_SHIP)
+			df = &econ_ship_delta;
+		else
+			return -1;
+		if (snis_socket_reader_read(c->input, buffer + 5, df->mask_bytes))
+			return -1;
+		n = packed_buffer_delta_payload_length(df, buffer + 5);
+		if (snis_socket_reader_read(c->input, buffer + 5 + df->mask_bytes, n))
+			return -1;
+		return 5 + df->mask_bytes + n;
+	case OPCODE_ECON_UPDATE_SHIP_DEBUG_AI:
+		/* an econ ship update, the AI stack, then the patrol points */
+		n = message_length[OPCODE_ECON_UPDATE_SHIP] +
+			calculate_buffer_size(UPDATE_ECON_SHIP_DEBUG_AI_FORMAT);
+		if (snis_socket_reader_read(c->input, buffer, n))
+			return -1;
+		len = buffer[n - 1];
+		if (snis_socket_reader_read(c->input, buffer + n,
+				len * calculate_buffer_size(UPDATE_ECON_SHIP_DEBUG_AI_POINT_FORMAT)))
+			return -1;
+		return n + len * calculate_buffer_size(UPDATE_ECON_SHIP_DEBUG_AI_POINT_FORMAT);
+	case OPCODE_UPDATE_COMPACT:
+	case OPCODE_COMMS_TRANSMISSION:
+	case OPCODE_LOAD_SKYBOX:
+		/* a length byte, then that many bytes */
+		if (snis_socket_reader_read(c->input, &len, sizeof(len)))
+			return -1;
+		if (snis_socket_reader_read(c->input, buffer, len))
+			return -1;
+		return 1 + len;
+	default:
+		return -1;
+	}
+}
+
+/* Frame the updates in a datagram the same way as those read from the socket,
+ * counting those the client would ignore as older than one already applied.
+ */
+static int count_udp_messages(struct loadgen_client *c, struct snis_udp_freshness *fresh,
+				uint32_t seq, unsigned char *buffer, int len)
+{
+	struct packed_buffer pb;
+	int pos = SNIS_UDP_HEADER_SIZE, n;
+	uint8_t opcode;
+	uint32_t id;
+
+	while (pos < len) {
+		opcode = buffer[pos++];
+		if (opcode == OPCODE_UPDATE_COMPACT) {
+			/* length, original opcode, then the id as a varint */
+			if (pos + 2 >= len)
+				return -1;
+			n = 1 + buffer[pos];
+			packed_buffer_init(&pb, buffer + pos + 2, len - pos - 2);
+			if (packed_buffer_extract_varint(&pb, &id))
+				return -1;
+		} else {
+			n = message_length[opcode];
+			if (n < 4 || pos + n > len)
+				return -1;
+			memcpy(&id, buffer + pos, sizeof(id));
+			id = ntohl(id);
+			if (opcode == OPCODE_UPDATE_SHIP || opcode == OPCODE_UPDATE_SHIP2)
+				note_ship(c, buffer + pos);
+		}
+		pos += n;
+		c->udp_messages++;
+		if (!snis_udp_fresh(fresh, id, seq))
+			c->udp_stale++;
+	}
+	return pos == len ? 0 : -1;
+}
+
+static void *udp_reader(void *arg)
+{
+	struct loadgen_client *c = arg;
+	struct snis_udp_shim *shim = snis_udp_shim_new(udp_shim_spec);
+	struct snis_udp_freshness *fresh = snis_udp_freshness_new(MAXGAMEOBJS);
+	unsigned char buffer[SNIS_UDP_DATAGRAM_MAX], hello[SNIS_UDP_HELLO_SIZE];
+	double next_hello = 0.0;
+	int32_t origin[3];
+	uint32_t seq;
+	int n;
+
+	snis_udp_hello_pack(hello, c->udp_token);
+	while (c->alive) {
+		/* Keep saying hello until the server hears, and now and then after */
+		if (time_now_double() >= next_hello) {
+			if (send(c->udp_sock, hello, sizeof(hello), 0) < 0)
+				fprintf(stderr, "snis_loadgen: client %d: UDP hello failed: %s\n",
+					c->index, strerror(errno));
+			next_hello = time_now_double() + (c->udp_datagrams ? 5.0 : 0.5);
+		}
+		n = snis_udp_recv(c->udp_sock, shim, buffer, sizeof(buffer), 100);
+		if (n < 0 && errno != ECONNREFUSED) /* refused, until the server binds */
+			break;
+		if (n <= 0)
+			continue;
+		if (snis_udp_header_unpack(buffer, n, &seq, origin)) {
+			fprintf(stderr, "snis_loadgen: client %d: bad UDP datagram\n", c->index);
+			continue;
+		}
+		if (count_udp_messages(c, fresh, seq, buffer, n)) {
+			fprintf(stderr, "snis_loadgen: client %d: bad UDP message framing\n", c->index);
+			break;
+		}
+		if (!c->udp_datagrams || snis_udp_seq_after(c->udp_first_seq, seq))
+			c->udp_first_seq = seq;
+		if (!c->udp_datagrams || snis_udp_seq_after(seq, c->udp_last_seq))
+			c->udp_last_seq = seq;
+		c->udp_datagrams++;
+		c->udp_bytes += n;
+	}
+	snis_udp_freshness_free(fresh);
+	snis_udp_shim_free(shim);
+	return NULL;
+}
+
+/* The server offered a UDP channel: port and token */
+static int open_udp_channel(struct loadgen_client *c, unsigned char *buffer)
+{
+	struct sockaddr_in addr = server_addr;
+	uint16_t udp_port;
+
+	if (c->udp_sock >= 0) /* already have one */
+		return 0;
+	if (packed_buffer_unpack(buffer, "hw", &udp_port, &c->udp_token))
+		return -1;
+	addr.sin_port = htons(udp_port);
+	c->udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (c->udp_sock < 0)
+		return -1;
+	if (connect(c->udp_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+		pthread_create(&c->udp_reader, NULL, udp_reader, c)) {
+		close(c->udp_sock);
+		c->udp_sock = -1;
+		return -1;
+	}
+	pthread_detach(c->udp_reader);
+	return 0;
+}
+
+static void *loadgen_reader(void *arg)
+{
+	struct loadgen_client *c = arg;
+	unsigned char buffer[UINT16_MAX];
+	uint8_t opcode;
+	uint32_t id;
+	int n;
+
+	while (c->alive) {
+		if (snis_socket_reader_read(c->input, &opcode, sizeof(opcode)))
+			break;
+		n = read_message(c, opcode, buffer);
+		if (n < 0) {
+			fprintf(stderr, "snis_loadgen: client %d: protocol error, opcode %hhu\n",
+				c->index, opcode);
+			break;
+		}
+		c->messages[opcode]++;
+		c->stream_bytes += 1 + n;
+		switch (opcode) {
+		case OPCODE_ID_CLIENT_SHIP:
+			memcpy(&id, buffer, sizeof(id));
+			pthread_mutex_lock(&c->lock);
+			c->my_ship_id = ntohl(id);
+			pthread_mutex_unlock(&c->lock);
+			break;
+		case OPCODE_UPDATE_SHIP:
+		case OPCODE_UPDATE_SHIP2:
+			note_ship(c, buffer);
+			break;
+		case OPCODE_UPDATE_DELTA:
+			if (buffer[0] == OPCODE_UPDATE_SHIP)
+				note_ship(c, buffer + 1);
+			break;
+		case OPCODE_UDP_CHANNEL:
+			if (open_udp_channel(c, buffer))
+				fprintf(stderr, "snis_loadgen: client %d: can't open UDP channel: %s\n",
+					c->index, strerror(errno));
+			break;
+		default:
+			break;
+		}
+	}
+	c->alive = 0;
+	return NULL;
+}
+
+static int send_to_server(struct loadgen_client *c, void *buffer, int len)
+{
+	unsigned char *out;
+
+	c->requests++;
+	if (!c->deflater)
+		return snis_writesocket(c->sock, buffer, len);
+	if (snis_deflate(c->deflater, buffer, len, 1))
+		return -1;
+	out = snis_deflater_take_output(c->deflater, &len);
+	return snis_writesocket(c->sock, out, len);
+}
+
+static int send_packed_buffer(struct loadgen_client *c, struct packed_buffer *pb)
+{
+	int rc;
+
+	if (!pb)
+		return -1;
+	rc = send_to_server(c, pb->buffer, pb->buffer_cursor);
+	packed_buffer_free(pb);
+	return rc;
+}
+
+/* Something a bridge crew might plausibly do */
+static int send_random_input(struct loadgen_client *c)
+{
+	uint32_t my_ship_id, target = 0;
+	int r = rand_r(&c->seed) % 100;
+
+	pthread_mutex_lock(&c->lock);
+	my_ship_id = c->my_ship_id;
+	if (c->nknown_ids)
+		target = c->known_id[rand_r(&c->seed) % c->nknown_ids];
+	pthread_mutex_unlock(&c->lock);
+
+	if (r < 40 || my_ship_id == (uint32_t) -1) /* steer */
+		return send_packed_buffer(c, packed_buffer_new("bb", OPCODE_REQUEST_YAW,
+						(uint8_t) (rand_r(&c->seed) % 4)));
+	if (r < 60)
+		return send_packed_buffer(c, packed_buffer_new("bwb", OPCODE_REQUEST_THROTTLE,
+						my_ship_id, (uint8_t) (rand_r(&c->seed) % 256)));
+	if (r < 75) {
+		if (send_packed_buffer(c, packed_buffer_new("b", OPCODE_LOAD_TORPEDO)))
+			return -1;
+		return send_packed_buffer(c, packed_buffer_new("b", OPCODE_REQUEST_TORPEDO));
+	}
+	if (!target) /* haven't seen any ships yet */
+		return 0;
+	return send_packed_buffer(c, packed_buffer_new("bw", OPCODE_SCI_SELECT_TARGET, target));
+}
+
+static void *loadgen_writer(void *arg)
+{
+	struct loadgen_client *c = arg;
+	double next = time_now_double();
+
+	while (c->alive) {
+		if (input_rate > 0.0 && time_now_double() >= next) {
+			if (send_random_input(c))
+				break;
+			next += 1.0 / input_rate;
+		}
+		sleep_double(input_rate > 0.0 ? 0.5 / input_rate : 0.1);
+	}
+	c->alive = 0;
+	return NULL;
+}
+
+static const uint32_t station_role[] = {
+	ROLE_NAVIGATION, ROLE_WEAPONS, ROLE_ENGINEERING, ROLE_SCIENCE, ROLE_COMMS, ROLE_MAIN,
+};
+
+/* Connect and log in the way snis_client does.  Returns 0, or -1 on error. */
+static int connect_client(struct loadgen_client *c, struct sockaddr_in *addr)
+{
+	struct add_player_packet app;
+	uint32_t caps;
+	int flag = 1;
+
+	c->sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (c->sock < 0)
+		return -1;
+	if (connect(c->sock, (struct sockaddr *) addr, sizeof(*addr)) < 0)
+		goto error;
+	if (setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(flag)))
+		fprintf(stderr, "snis_loadgen: setsockopt(TCP_NODELAY) failed\n");
+
+	/* message_length[] expects the compression figures in the netstats */
+	caps = htonl(capabilities | SNIS_CAP_COMPRESSION_STATS);
+	if (snis_writesocket(c->sock, SNIS_PROTOCOL_VERSION, strlen(SNIS_PROTOCOL_VERSION)) ||
+		snis_writesocket(c->sock, &caps, sizeof(caps)) ||
+		snis_readsocket(c->sock, &caps, sizeof(caps)))
+		goto error;
+	c->capabilities = ntohl(caps);
+
+	c->input = snis_socket_reader_new(c->sock, LOADGEN_INPUT_BUFFER_SIZE);
+	if (!c->input)
+		goto error;
+	if (c->capabilities & SNIS_CAP_COMPRESSION) {
+		c->deflater = snis_deflater_new();
+		if (!c->deflater || snis_socket_reader_inflate(c->input))
+			goto error;
+	}
+
+	memset(&app, 0, sizeof(app));
+	app.opcode = OPCODE_UPDATE_PLAYER;
+	if (all_roles)
+		app.role = htonl(ROLE_ALL);
+	else
+		app.role = htonl(station_role[(c->index % clients_per_ship) % ARRAY_SIZE(station_role)]);
+	snprintf((char *) app.shipname, sizeof(app.shipname), "loadgen%d", c->index / clients_per_ship);
+	snprintf((char *) app.password, sizeof(app.password), "loadgen");
+	if (send_to_server(c, &app, sizeof(app)))
+		goto error;
+	return 0;
+
+error:
+	fprintf(stderr, "snis_loadgen: client %d failed to connect: %s\n", c->index, strerror(errno));
+	close(c->sock);
+	c->sock = -1;
+	return -1;
+}
+
+/* Ask the lobby where the game server is */
+static int find_server_through_lobby(struct sockaddr_in *addr)
+{
+	struct ssgl_game_server *game_server = NULL;
+	struct ssgl_client_filter filter;
+	int i, sock, rc, count = 0;
+
+	sock = ssgl_gameclient_connect_to_lobby(lobbyhost);
+	if (sock < 0) {
+		fprintf(stderr, "snis_loadgen: can't connect to lobby on %s\n", lobbyhost);
+		return -1;
+	}
+	memset(&filter, 0, sizeof(filter));
+	strcpy(filter.game_type, "SNIS");
+	rc = ssgl_recv_game_servers(sock, &game_server, &count, &filter);
+	close(sock);
+	if (rc) {
+		fprintf(stderr, "snis_loadgen: ssgl_recv_game_servers failed: %s\n", strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < count; i++)
+		if (!gameinstance || strcmp(game_server[i].game_instance, gameinstance) == 0)
+			break;
+	if (i == count) {
+		fprintf(stderr, "snis_loadgen: lobby knows of no such game server\n");
+		free(game_server);
+		return -1;
+	}
+	addr->sin_addr.s_addr = game_server[i].ipaddr;
+	addr->sin_port = game_server[i].port;
+	free(game_server);
+	return 0;
+}
+
+static int lookup_server(struct sockaddr_in *addr)
+{
+	struct addrinfo hints, *info;
+	int rc;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	if (lobbyhost)
+		return find_server_through_lobby(addr);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	rc = getaddrinfo(host, NULL, &hints, &info);
+	if (rc) {
+		fprintf(stderr, "snis_loadgen: %s: %s\n", host, gai_strerror(rc));
+		return -1;
+	}
+	addr->sin_addr = ((struct sockaddr_in *) info->ai_addr)->sin_addr;
+	addr->sin_port = htons(port);
+	freeaddrinfo(info);
+	return 0;
+}
+
+struct loadgen_totals {
+	int alive;
+	uint64_t messages, stream_bytes, requests;
+	uint64_t udp_datagrams, udp_messages, udp_bytes, udp_stale, udp_sent;
+};
+
+static void sum_clients(struct loadgen_totals *t)
+{
+	int i, j;
+
+	memset(t, 0, sizeof(*t));
+	for (i = 0; i < nclients; i++) {
+		struct loadgen_client *c = &client[i];
+
+		t->alive += c->alive;
+		t->stream_bytes += c->stream_bytes;
+		t->requests += c->requests;
+		for (j = 0; j < 256; j++)
+			t->messages += c->messages[j];
+		t->udp_datagrams += c->udp_datagrams;
+		t->udp_messages += c->udp_messages;
+		t->udp_bytes += c->udp_bytes;
+		t->udp_stale += c->udp_stale;
+		if (c->udp_datagrams) /* as numbered by the server, so this includes those lost */
+			t->udp_sent += c->udp_last_seq - c->udp_first_seq + 1;
+	}
+}
+
+static void print_opcode_counts(double elapsed)
+{
+	uint64_t count[256];
+	int i, j, best;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < nclients; i++)
+		for (j = 0; j < 256; j++)
+			count[j] += client[i].messages[j];
+	printf("busiest opcodes (messages/sec across all clients):\n");
+	for (i = 0; i < 10; i++) {
+		best = 0;
+		for (j = 1; j < 256; j++)
+			if (count[j] > count[best])
+				best = j;
+		if (!count[best])
+			break;
+		printf("  %3d: %10.1f\n", best, (double) count[best] / elapsed);
+		count[best] = 0;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr;
+	struct loadgen_totals last, now;
+	double start, last_time, t;
+	uint64_t last_wire = 0;
+	int i, nconnected = 0;
+
+	process_options(argc, argv);
+	udp_shim_spec = getenv("SNIS_UDP_SHIM");
+	ignore_sigpipe();
+	snis_protocol_debugging(0);
+	init_message_framing();
+	snis_collect_netstats(&netstats);
+	if (lookup_server(&addr))
+		return 1;
+	server_addr = addr;
+	printf("snis_loadgen: %d clients, %d per ship, to %s:%d, capabilities 0x%x\n",
+		nclients, clients_per_ship, inet_ntoa(addr.sin_addr), ntohs(addr.sin_port),
+		capabilities);
+
+	for (i = 0; i < nclients; i++) {
+		struct loadgen_client *c = &client[i];
+
+		c->index = i;
+		c->my_ship_id = (uint32_t) -1;
+		c->seed = (unsigned int) i * 2654435761u + 1;
+		c->udp_sock = -1;
+		pthread_mutex_init(&c->lock, NULL);
+		if (connect_client(c, &addr))
+			continue;
+		c->alive = 1;
+		if (pthread_create(&c->reader, NULL, loadgen_reader, c) ||
+			pthread_create(&c->writer, NULL, loadgen_writer, c)) {
+			fprintf(stderr, "snis_loadgen: can't create client threads\n");
+			return 1;
+		}
+		pthread_detach(c->reader);
+		pthread_detach(c->writer);
+		nconnected++;
+	}
+	if (!nconnected)
+		return 1;
+
+	start = last_time = time_now_double();
+	sum_clients(&last);
+	printf("%8s %6s %10s %12s %12s %10s %10s\n", "time", "alive", "msgs/s", "stream kB/s",
+		"wire kB/s", "udp kB/s", "reqs/s");
+	do {
+		sleep_double(report_interval);
+		t = time_now_double();
+		sum_clients(&now);
+		printf("%8.1f %6d %10.1f %12.1f %12.1f %10.1f %10.1f\n", t - start, now.alive,
+			(double) (now.messages + now.udp_messages - last.messages - last.udp_messages) /
+				(t - last_time),
+			(double) (now.stream_bytes - last.stream_bytes) / 1024.0 / (t - last_time),
+			(double) (netstats.bytes_recd - last_wire) / 1024.0 / (t - last_time),
+			(double) (now.udp_bytes - last.udp_bytes) / 1024.0 / (t - last_time),
+			(double) (now.requests - last.requests) / (t - last_time));
+		fflush(stdout);
+		last = now;
+		last_wire = netstats.bytes_recd;
+		last_time = t;
+	} while (now.alive && (duration == 0 || t - start < duration));
+
+	t = time_now_double() - start;
+	printf("total: %llu messages, %llu stream bytes, %llu wire bytes in %.1f seconds,"
+		" %d of %d clients still connected\n",
+		(unsigned long long) now.messages, (unsigned long long) now.stream_bytes,
+		(unsigned long long) netstats.bytes_recd, t, now.alive, nclients);
+	if (capabilities & SNIS_CAP_UDP)
+		printf("udp: %llu datagrams holding %llu messages (%llu stale), %llu bytes, %llu lost\n",
+			(unsigned long long) now.udp_datagrams, (unsigned long long) now.udp_messages,
+			(unsigned long long) now.udp_stale, (unsigned long long) now.udp_bytes,
+			(unsigned long long) (now.udp_sent > now.udp_datagrams ?
+				now.udp_sent - now.udp_datagrams : 0));
+	print_opcode_counts(t);
+	return 0;
+}
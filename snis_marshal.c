@@ -5,6 +5,7 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <errno.h>
 
@@ -246,11 +247,254 @@ int packed_buffer_extract_raw(struct packed_buffer *pb, char *buffer, unsigned s
 	return 0;
 }
 
+/*
+ * Packed buffers and queue entries are allocated and freed at a high rate
+ * (thousands per tick on the server), so they come from a simple pool.
+ * Small packed buffers are allocated as a single chunk, the struct followed
+ * immediately by the data, in one of a few size classes.  Queue entries
+ * have a class of their own.  Each thread keeps a cache of free chunks per
+ * class, and trades them in batches with a global, mutex protected, free
+ * list, so that buffers allocated on one thread (e.g. the main loop) and
+ * freed on another (e.g. a client writer) keep circulating without malloc.
+ */
+#define POOL_QUEUE_ENTRY_CLASS (POOL_NCLASSES - 1)
+#define POOL_THREAD_CACHE_MAX 256
+#define POOL_BATCH 64
+#define POOL_GLOBAL_MAX 8192
+static const int pool_data_size[POOL_NCLASSES - 1] = { 32, 64, 128, 256, 512, 1024, 2048 };
+
+struct pool_chunk {
+	struct pool_chunk *next;
+};
+
+static struct pool_global {
+	pthread_mutex_t mutex;
+	struct pool_chunk *free;
+	int count;
+} pool_global[POOL_NCLASSES] = {
+#define POOL_GLOBAL_INIT { PTHREAD_MUTEX_INITIALIZER, NULL, 0 }
+	POOL_GLOBAL_INIT, POOL_GLOBAL_INIT, POOL_GLOBAL_INIT, POOL_GLOBAL_INIT,
+	POOL_GLOBAL_INIT, POOL_GLOBAL_INIT, POOL_GLOBAL_INIT, POOL_GLOBAL_INIT,
+#undef POOL_GLOBAL_INIT
+};
+
+struct pool_thread_cache {
+	struct pool_chunk *free[POOL_NCLASSES];
+	int count[POOL_NCLASSES];
+	struct packed_buffer_pool_stats stats;
+	struct pool_thread_cache *next;
+};
+
+static __thread struct pool_thread_cache *pool_cache;
+static pthread_key_t pool_cache_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_cache_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_thread_cache *pool_cache_list;
+static struct packed_buffer_pool_stats pool_retired_stats; /* from exited threads */
+
+static size_t pool_chunk_size(int class)
+{
+	if (class == POOL_QUEUE_ENTRY_CLASS)
+		return sizeof(struct packed_buffer_queue_entry);
+	return sizeof(struct packed_buffer) + pool_data_size[class];
+}
+
+static int pool_class(int size)
+{
+	int i;
+
+	for (i = 0; i < POOL_NCLASSES - 1; i++)
+		if (size <= pool_data_size[i])
+			return i;
+	return -1;
+}
+
+static void pool_global_put(int class, struct pool_chunk *list)
+{
+	struct pool_global *g = &pool_global[class];
+	struct pool_chunk *next;
+
+	pthread_mutex_lock(&g->mutex);
+	while (list && g->count < POOL_GLOBAL_MAX) {
+		next = list->next;
+		list->next = g->free;
+		g->free = list;
+		g->count++;
+		list = next;
+	}
+	pthread_mutex_unlock(&g->mutex);
+	for (; list; list = next) { /* global list is full, really free the rest */
+		next = list->next;
+		free(list);
+	}
+}
+
+static void pool_thread_exit(void *arg)
+{
+	struct pool_thread_cache *tc = arg;
+	struct pool_thread_cache **i;
+	int class;
+
+	pool_cache = NULL;
+	for (class = 0; class < POOL_NCLASSES; class++)
+		pool_global_put(class, tc->free[class]);
+
+	pthread_mutex_lock(&pool_cache_list_mutex);
+	for (i = &pool_cache_list; *i; i = &(*i)->next)
+		if (*i == tc) {
+			*i = tc->next;
+			break;
+		}
+	for (class = 0; class < POOL_NCLASSES; class++) {
+		pool_retired_stats.hits[class] += tc->stats.hits[class];
+		pool_retired_stats.misses[class] += tc->stats.misses[class];
+	}
+	pool_retired_stats.unpooled += tc->stats.unpooled;
+	pthread_mutex_unlock(&pool_cache_list_mutex);
+	free(tc);
+}
+
+static void pool_init(void)
+{
+	pthread_key_create(&pool_cache_key, pool_thread_exit);
+}
+
+static struct pool_thread_cache *pool_thread_cache(void)
+{
+	struct pool_thread_cache *tc = pool_cache;
+
+	if (tc)
+		return tc;
+	pthread_once(&pool_once, pool_init);
+	tc = calloc(1, sizeof(*tc));
+	pthread_setspecific(pool_cache_key, tc);
+	pthread_mutex_lock(&pool_cache_list_mutex);
+	tc->next = pool_cache_list;
+	pool_cache_list = tc;
+	pthread_mutex_unlock(&pool_cache_list_mutex);
+	pool_cache = tc;
+	return tc;
+}
+
+static void *pool_alloc(int class)
+{
+	struct pool_thread_cache *tc = pool_thread_cache();
+	struct pool_global *g;
+	struct pool_chunk *c;
+	int n;
+
+	if (!tc->free[class]) {
+		/* refill thread cache from the global free list */
+		g = &pool_global[class];
+		pthread_mutex_lock(&g->mutex);
+		for (n = 0; g->free && n < POOL_BATCH; n++) {
+			c = g->free;
+			g->free = c->next;
+			c->next = tc->free[class];
+			tc->free[class] = c;
+		}
+		g->count -= n;
+		pthread_mutex_unlock(&g->mutex);
+		tc->count[class] = n;
+		if (!n) {
+			tc->stats.misses[class]++;
+			return malloc(pool_chunk_size(class));
+		}
+	}
+	tc->stats.hits[class]++;
+	c = tc->free[class];
+	tc->free[class] = c->next;
+	tc->count[class]--;
+	return c;
+}
+
+static void pool_free(int class, void *p)
+{
+	struct pool_thread_cache *tc = pool_thread_cache();
+	struct pool_chunk *c = p, *list;
+	int n;
+
+	c->next = tc->free[class];
+	tc->free[class] = c;
+	tc->count[class]++;
+	if (tc->count[class] <= POOL_THREAD_CACHE_MAX)
+		return;
+
+	/* Thread cache is full, give a batch back to the global free list */
+	list = tc->free[class];
+	c = list;
+	for (n = 1; n < POOL_BATCH; n++)
+		c = c->next;
+	tc->free[class] = c->next;
+	c->next = NULL;
+	tc->count[class] -= POOL_BATCH;
+	pool_global_put(class, list);
+}
+
+void packed_buffer_pool_stats(struct packed_buffer_pool_stats *stats)
+{
+	struct pool_thread_cache *tc;
+	int class;
+
+	pthread_mutex_lock(&pool_cache_list_mutex);
+	*stats = pool_retired_stats;
+	for (tc = pool_cache_list; tc; tc = tc->next) {
+		for (class = 0; class < POOL_NCLASSES; class++) {
+			stats->hits[class] += tc->stats.hits[class];
+			stats->misses[class] += tc->stats.misses[class];
+		}
+		stats->unpooled += tc->stats.unpooled;
+	}
+	pthread_mutex_unlock(&pool_cache_list_mutex);
+}
+
+void packed_buffer_pool_print_stats(FILE *f)
+{
+	struct packed_buffer_pool_stats stats;
+	int class;
+
+	packed_buffer_pool_stats(&stats);
+	for (class = 0; class < POOL_NCLASSES; class++) {
+		if (class == POOL_QUEUE_ENTRY_CLASS)
+			fprintf(f, "packed buffer pool: queue entries: ");
+		else
+			fprintf(f, "packed buffer pool: %4d bytes: ", pool_data_size[class]);
+		fprintf(f, "%llu hits, %llu misses\n",
+			(unsigned long long) stats.hits[class],
+			(unsigned long long) stats.misses[class]);
+	}
+	fprintf(f, "packed buffer pool: %llu unpooled allocations\n",
+			(unsigned long long) stats.unpooled);
+}
+
+static struct packed_buffer_queue_entry *queue_entry_alloc(void)
+{
+	return pool_alloc(POOL_QUEUE_ENTRY_CLASS);
+}
+
+static void queue_entry_free(struct packed_buffer_queue_entry *entry)
+{
+	pool_free(POOL_QUEUE_ENTRY_CLASS, entry);
+}
+
 struct packed_buffer * packed_buffer_allocate(int size)
 {
 	struct packed_buffer *pb;
+	int class = size ? pool_class(size) : -1;
+
+	if (class >= 0) {
+		pb = pool_alloc(class);
+		pb->buffer = (unsigned char *) (pb + 1);
+		memset(pb->buffer, 0, size);
+		pb->buffer_size = size;
+		pb->buffer_cursor = 0;
+		pb->refcount = 1;
+		return pb;
+	}
+	pool_thread_cache()->stats.unpooled++;
 	pb = malloc(sizeof(*pb));
 	memset(pb, 0, sizeof(*pb));	
+	pb->refcount = 1;
 	if (size != 0) {
 		pb->buffer = malloc(size);
 		memset(pb->buffer, 0, size);
@@ -260,8 +504,23 @@ struct packed_buffer * packed_buffer_allocate(int size)
 	return pb;
 }
 
+/* Take an additional reference to a packed buffer, e.g. to queue the same
+ * buffer to several clients.  Each reference is dropped by packed_buffer_free().
+ */
+struct packed_buffer *packed_buffer_get(struct packed_buffer *pb)
+{
+	__sync_fetch_and_add(&pb->refcount, 1);
+	return pb;
+}
+
 void packed_buffer_free(struct packed_buffer *pb)
 {
+	if (pb->refcount > 1 && __sync_sub_and_fetch(&pb->refcount, 1) > 0)
+		return;
+	if (pb->buffer == (unsigned char *) (pb + 1)) {
+		pool_free(pool_class(pb->buffer_size), pb);
+		return;
+	}
 	free(pb->buffer);
 	free(pb);
 }
@@ -304,6 +563,7 @@ struct packed_buffer *packed_buffer_queue_combine(struct packed_buffer_queue *pb
 	answer->buffer = buf;
 	answer->buffer_size = totalbytes;
 	answer->buffer_cursor = 0;
+	answer->refcount = 1;
 
 	/* combine the buffers, freeing as we go. */
 	for (i = pbq->head; i; i = pbq->head) {
@@ -313,7 +573,7 @@ struct packed_buffer *packed_buffer_queue_combine(struct packed_buffer_queue *pb
 			answer->buffer_cursor += i->buffer->buffer_cursor;
 			packed_buffer_free(i->buffer);
 			pbq->head = i->next;
-			free(i);
+			queue_entry_free(i);
 		}
 	}
 	pbq->head = NULL;
@@ -322,12 +582,41 @@ struct packed_buffer *packed_buffer_queue_combine(struct packed_buffer_queue *pb
 	return answer;
 }
 
+/* Take the entire contents of the queue, leaving the queue empty.  The caller
+ * owns the returned list, and should release it via packed_buffer_queue_entries_free()
+ * when done with it.
+ */
+struct packed_buffer_queue_entry *packed_buffer_queue_detach(struct packed_buffer_queue *pbq,
+	pthread_mutex_t *mutex)
+{
+	struct packed_buffer_queue_entry *list;
+
+	lockmutex(mutex);
+	list = pbq->head;
+	pbq->head = NULL;
+	pbq->tail = NULL;
+	unlockmutex(mutex);
+	return list;
+}
+
+/* Free a list of queue entries (as from packed_buffer_queue_detach) and their buffers. */
+void packed_buffer_queue_entries_free(struct packed_buffer_queue_entry *list)
+{
+	struct packed_buffer_queue_entry *next;
+
+	for (; list; list = next) {
+		next = list->next;
+		packed_buffer_free(list->buffer);
+		queue_entry_free(list);
+	}
+}
+
 void packed_buffer_queue_add(struct packed_buffer_queue *pbq, struct packed_buffer *pb,
 		pthread_mutex_t *mutex)
 {
 	struct packed_buffer_queue_entry *entry;
 
-	entry = malloc(sizeof(*entry));
+	entry = queue_entry_alloc();
 	entry->next = NULL;
 	entry->buffer = pb;
 
@@ -349,7 +638,7 @@ void packed_buffer_queue_prepend(struct packed_buffer_queue *pbq, struct packed_
 {
 	struct packed_buffer_queue_entry *entry;
 
-	entry = malloc(sizeof(*entry));
+	entry = queue_entry_alloc();
 	entry->buffer = pb;
 
 	lockmutex(mutex);
@@ -404,6 +693,7 @@ void packed_buffer_init(struct packed_buffer * pb, void *buffer, int size)
 	pb->buffer = buffer;
 	pb->buffer_size = size;
 	pb->buffer_cursor = 0;
+	pb->refcount = 1;
 }
 
 uint32_t dtou32(double d, uint32_t scale)
@@ -486,6 +776,144 @@ void packed_buffer_extract_quat(struct packed_buffer *pb, float q[])
 	}
 }
 
+int packed_buffer_append_varint(struct packed_buffer *pb, uint32_t value)
+{
+	do {
+		uint8_t b = value & 0x7f;
+
+		value >>= 7;
+		if (value)
+			b |= 0x80;
+		if (pb->buffer_cursor >= pb->buffer_size)
+			return -1; /* no room */
+		pb->buffer[pb->buffer_cursor++] = b;
+	} while (value);
+	return 0;
+}
+
+int packed_buffer_extract_varint(struct packed_buffer *pb, uint32_t *value)
+{
+	int shift;
+	uint8_t b;
+
+	*value = 0;
+	for (shift = 0; shift < 35; shift += 7) {
+		if (pb->buffer_cursor >= pb->buffer_size)
+			return -1; /* ran off the end */
+		b = pb->buffer[pb->buffer_cursor++];
+		*value |= (uint32_t) (b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 0;
+	}
+	return -1; /* more than 5 bytes, not something we wrote */
+}
+
+uint32_t zigzag_encode(int32_t value)
+{
+	return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+int32_t zigzag_decode(uint32_t value)
+{
+	return (int32_t) ((value >> 1) ^ -(value & 1));
+}
+
+int packed_buffer_append_relative(struct packed_buffer *pb, int32_t value, int32_t origin)
+{
+	int64_t offset = ((int64_t) value - origin + (1 << (PACKED_POSITION_SHIFT - 1)))
+				>> PACKED_POSITION_SHIFT;
+
+	if (offset > INT16_MIN && offset <= INT16_MAX) {
+		if (pb->buffer_cursor + 2 > pb->buffer_size)
+			return -1;
+		return packed_buffer_append_u16(pb, (uint16_t) (int16_t) offset);
+	}
+	if (pb->buffer_cursor + 6 > pb->buffer_size)
+		return -1;
+	packed_buffer_append_u16(pb, PACKED_POSITION_ESCAPE);
+	return packed_buffer_append_u32(pb, (uint32_t) value);
+}
+
+int packed_buffer_extract_relative(struct packed_buffer *pb, int32_t origin, int32_t *value)
+{
+	int64_t v;
+	uint16_t h;
+
+	if (pb->buffer_cursor + 2 > pb->buffer_size)
+		return -1;
+	h = packed_buffer_extract_u16(pb);
+	if (h == PACKED_POSITION_ESCAPE) {
+		if (pb->buffer_cursor + 4 > pb->buffer_size)
+			return -1;
+		*value = (int32_t) packed_buffer_extract_u32(pb);
+		return 0;
+	}
+	v = (int64_t) origin + (int64_t) (int16_t) h * (1 << PACKED_POSITION_SHIFT);
+	if (v > INT32_MAX)
+		v = INT32_MAX;
+	if (v < INT32_MIN)
+		v = INT32_MIN;
+	*value = (int32_t) v;
+	return 0;
+}
+
+/* Smallest three quaternion encoding.  Since q and -q are the same rotation,
+ * flip the sign so the largest element is positive, then send the other three,
+ * each of which must lie within +/- 1/sqrt(2), and which element was dropped.
+ * The receiver recovers the dropped element from the quaternion being unit length.
+ */
+#define QUAT3_BITS 10
+#define QUAT3_MAX ((1 << (QUAT3_BITS - 1)) - 1)
+
+int packed_buffer_append_quat3(struct packed_buffer *pb, float q[])
+{
+	int i, largest = 0;
+	float sign;
+	uint32_t v;
+	int32_t e;
+
+	if (pb->buffer_cursor + 4 > pb->buffer_size)
+		return -1; /* no room */
+	for (i = 1; i < 4; i++)
+		if (fabsf(q[i]) > fabsf(q[largest]))
+			largest = i;
+	sign = q[largest] < 0 ? -1.0 : 1.0;
+	v = largest;
+	for (i = 0; i < 4; i++) {
+		if (i == largest)
+			continue;
+		e = (int32_t) lrintf(sign * q[i] * (float) M_SQRT2 * QUAT3_MAX);
+		if (e > QUAT3_MAX)
+			e = QUAT3_MAX;
+		if (e < -QUAT3_MAX)
+			e = -QUAT3_MAX;
+		v = (v << QUAT3_BITS) | (uint32_t) (e + QUAT3_MAX);
+	}
+	return packed_buffer_append_u32(pb, v);
+}
+
+int packed_buffer_extract_quat3(struct packed_buffer *pb, float q[])
+{
+	int i, largest;
+	uint32_t v;
+	float sum = 0.0;
+
+	if (pb->buffer_cursor + 4 > pb->buffer_size)
+		return -1;
+	v = packed_buffer_extract_u32(pb);
+	largest = v >> (3 * QUAT3_BITS);
+	for (i = 3; i >= 0; i--) {
+		if (i == largest)
+			continue;
+		q[i] = ((float) (v & ((1 << QUAT3_BITS) - 1)) - QUAT3_MAX) /
+				(QUAT3_MAX * (float) M_SQRT2);
+		sum += q[i] * q[i];
+		v >>= QUAT3_BITS;
+	}
+	q[largest] = sum < 1.0 ? sqrtf(1.0 - sum) : 0.0;
+	return 0;
+}
+
 int packed_buffer_append_va(struct packed_buffer *pb, const char *format, va_list ap)
 {
 	uint8_t b;
@@ -498,10 +926,10 @@ int packed_buffer_append_va(struct packed_buffer *pb, const char *format, va_lis
 	unsigned char *s;
 	unsigned short len;
 	int rc = 0;
-	double d;
+	double d, origin;
 	float *quaternion;
 
-	while (*format) {	
+	while (*format && !rc) {
 		switch(*format++) {
 		case 'b':
 			b = (uint8_t) va_arg(ap, int);
@@ -555,6 +983,25 @@ int packed_buffer_append_va(struct packed_buffer *pb, const char *format, va_lis
 			quaternion = va_arg(ap, float *);
 			packed_buffer_append_quat(pb, quaternion);
 			break;
+		case 'v':
+			w = va_arg(ap, uint32_t);
+			rc = packed_buffer_append_varint(pb, w);
+			break;
+		case 'z':
+			w = zigzag_encode(va_arg(ap, int32_t));
+			rc = packed_buffer_append_varint(pb, w);
+			break;
+		case 'P':
+			d = va_arg(ap, double);
+			origin = va_arg(ap, double);
+			sscale = va_arg(ap, int32_t);
+			rc = packed_buffer_append_relative(pb, dtos32(d, sscale),
+							dtos32(origin, sscale));
+			break;
+		case 'C':
+			quaternion = va_arg(ap, float *);
+			rc = packed_buffer_append_quat3(pb, quaternion);
+			break;
 		default:
 			rc = -EINVAL;
 			break;
@@ -575,6 +1022,7 @@ int packed_buffer_append_va(struct packed_buffer *pb, const char *format, va_lis
  * "Q" = 4 32-bit signed integer encoded floats representing a quaternion axis + angle
  * "R" = 32-bit signed integer encoded double radians representing an angle
  *       (-2 * M_PI <= angle <= 2 * M_PI must hold.)
+ * "v", "z", "P", "C" = compact codes, see snis_marshal.h
  */
 
 int packed_buffer_append(struct packed_buffer *pb, const char *format, ...)
@@ -615,6 +1063,16 @@ int calculate_buffer_size(const char *format)
 		case 'Q':
 			size += 16;
 			break;
+		case 'v':
+		case 'z':
+			size += 5;
+			break;
+		case 'P':
+			size += 6;
+			break;
+		case 'C':
+			size += 4;
+			break;
 		default:
 			return -1;
 		}
@@ -655,10 +1113,12 @@ int packed_buffer_extract_va(struct packed_buffer *pb, const char *format, va_li
 	unsigned short len;
 	int ilen;
 	int rc = 0;
-	double *d;
+	double *d, origin;
 	float *quaternion;
+	int32_t *i, i32;
+	uint32_t u;
 
-	while (*format) {	
+	while (*format && !rc) {
 		switch(*format++) {
 		case 'b':
 			b = va_arg(ap, uint8_t *);
@@ -709,6 +1169,26 @@ int packed_buffer_extract_va(struct packed_buffer *pb, const char *format, va_li
 			quaternion = va_arg(ap, float *);
 			packed_buffer_extract_quat(pb, quaternion);
 			break;
+		case 'v':
+			w = va_arg(ap, uint32_t *);
+			rc = packed_buffer_extract_varint(pb, w);
+			break;
+		case 'z':
+			i = va_arg(ap, int32_t *);
+			rc = packed_buffer_extract_varint(pb, &u);
+			*i = zigzag_decode(u);
+			break;
+		case 'P':
+			d = va_arg(ap, double *);
+			origin = va_arg(ap, double);
+			sscale = va_arg(ap, int32_t);
+			rc = packed_buffer_extract_relative(pb, dtos32(origin, sscale), &i32);
+			*d = s32tod(i32, sscale);
+			break;
+		case 'C':
+			quaternion = va_arg(ap, float *);
+			rc = packed_buffer_extract_quat3(pb, quaternion);
+			break;
 		default:
 			rc = -EINVAL;
 			break;
@@ -760,12 +1240,514 @@ int packed_buffer_length(struct packed_buffer *pb)
 	return pb->buffer_cursor;
 }
 
+/* Field sizes for the fixed size format codes, or -1 */
+static int format_field_size(char code)
+{
+	switch (code) {
+	case 'b':
+		return 1;
+	case 'h':
+		return 2;
+	case 'w':
+	case 'S':
+	case 'U':
+	case 'R':
+		return 4;
+	case 'd':
+		return sizeof(double);
+	case 'q':
+		return 8;
+	case 'Q':
+		return 16;
+	default:
+		return -1;
+	}
+}
+
+int packed_buffer_compact(struct packed_buffer *pb, const char *compact_format,
+		const unsigned char *record, const char *format, const int32_t origin[3])
+{
+	struct packed_buffer in;
+	int i, size, naxis = 0, rc = 0;
+	uint32_t w;
+	float q[4];
+
+	size = calculate_buffer_size(format);
+	if (size < 0 || strlen(format) != strlen(compact_format))
+		return -1;
+	packed_buffer_init(&in, (void *) record, size);
+	for (i = 0; format[i] && !rc; i++) {
+		char code = compact_format[i];
+
+		if (code == format[i]) {
+			size = format_field_size(code);
+			if (size < 0)
+				return -1;
+			rc = packed_buffer_append_raw(pb, (char *) record + in.buffer_cursor, size);
+			in.buffer_cursor += size;
+			continue;
+		}
+		switch (code) {
+		case 'v':
+			if (format[i] != 'w')
+				return -1;
+			rc = packed_buffer_append_varint(pb, packed_buffer_extract_u32(&in));
+			break;
+		case 'z':
+			if (format[i] != 'w' && format[i] != 'S' && format[i] != 'U' && format[i] != 'R')
+				return -1;
+			w = packed_buffer_extract_u32(&in);
+			rc = packed_buffer_append_varint(pb, zigzag_encode((int32_t) w));
+			break;
+		case 'P':
+			if (format[i] != 'S')
+				return -1;
+			w = packed_buffer_extract_u32(&in);
+			rc = packed_buffer_append_relative(pb, (int32_t) w, origin[naxis++ % 3]);
+			break;
+		case 'C':
+			if (format[i] != 'Q')
+				return -1;
+			packed_buffer_extract_quat(&in, q);
+			rc = packed_buffer_append_quat3(pb, q);
+			break;
+		default:
+			return -1;
+		}
+	}
+	return rc;
+}
+
+int packed_buffer_expand(unsigned char *record, int recordsize, const char *format,
+		struct packed_buffer *pb, const char *compact_format, const int32_t origin[3])
+{
+	struct packed_buffer out;
+	int i, size, naxis = 0, rc = 0;
+	uint32_t w;
+	int32_t s;
+	float q[4];
+
+	size = calculate_buffer_size(format);
+	if (size < 0 || size > recordsize || strlen(format) != strlen(compact_format))
+		return -1;
+	packed_buffer_init(&out, record, recordsize);
+	for (i = 0; format[i] && !rc; i++) {
+		char code = compact_format[i];
+
+		if (code == format[i]) {
+			size = format_field_size(code);
+			if (size < 0 || pb->buffer_cursor + size > pb->buffer_size)
+				return -1;
+			packed_buffer_extract_raw(pb, (char *) record + out.buffer_cursor, size);
+			out.buffer_cursor += size;
+			continue;
+		}
+		switch (code) {
+		case 'v':
+			if (format[i] != 'w')
+				return -1;
+			rc = packed_buffer_extract_varint(pb, &w);
+			packed_buffer_append_u32(&out, w);
+			break;
+		case 'z':
+			if (format[i] != 'w' && format[i] != 'S' && format[i] != 'U' && format[i] != 'R')
+				return -1;
+			rc = packed_buffer_extract_varint(pb, &w);
+			packed_buffer_append_u32(&out, (uint32_t) zigzag_decode(w));
+			break;
+		case 'P':
+			if (format[i] != 'S')
+				return -1;
+			rc = packed_buffer_extract_relative(pb, origin[naxis++ % 3], &s);
+			packed_buffer_append_u32(&out, (uint32_t) s);
+			break;
+		case 'C':
+			if (format[i] != 'Q')
+				return -1;
+			rc = packed_buffer_extract_quat3(pb, q);
+			packed_buffer_append_quat(&out, q);
+			break;
+		default:
+			return -1;
+		}
+	}
+	return rc;
+}
+
+int packed_buffer_delta_format_init(struct packed_buffer_delta_format *df, const char *format)
+{
+	int i, size, offset = 0;
+
+	for (i = 0; format[i]; i++) {
+		size = format_field_size(format[i]);
+		if (size < 0 || i >= PACKED_BUFFER_MAX_DELTA_FIELDS)
+			return -1;
+		df->offset[i] = offset;
+		offset += size;
+	}
+	df->offset[i] = offset;
+	df->nfields = i;
+	df->mask_bytes = (i + 7) / 8;
+	return 0;
+}
+
+/* Compute which fields differ between two records, returns size of the delta
+ * (mask plus changed fields) in bytes.
+ */
+int packed_buffer_delta_mask(struct packed_buffer_delta_format *df,
+		const unsigned char *old, const unsigned char *new, unsigned char *mask)
+{
+	int i, size = df->mask_bytes;
+
+	memset(mask, 0, df->mask_bytes);
+	for (i = 0; i < df->nfields; i++) {
+		int len = df->offset[i + 1] - df->offset[i];
+
+		if (memcmp(old + df->offset[i], new + df->offset[i], len) == 0)
+			continue;
+		mask[i / 8] |= 1 << (i % 8);
+		size += len;
+	}
+	return size;
+}
+
+int packed_buffer_append_delta(struct packed_buffer *pb, struct packed_buffer_delta_format *df,
+		const unsigned char *mask, const unsigned char *new)
+{
+	int i, len;
+
+	if (packed_buffer_append_raw(pb, (const char *) mask, df->mask_bytes))
+		return -1;
+	for (i = 0; i < df->nfields; i++) {
+		if (!(mask[i / 8] & (1 << (i % 8))))
+			continue;
+		len = df->offset[i + 1] - df->offset[i];
+		if (packed_buffer_append_raw(pb, (const char *) new + df->offset[i], len))
+			return -1;
+	}
+	return 0;
+}
+
+/* Number of bytes of changed fields which follow the mask */
+int packed_buffer_delta_payload_length(struct packed_buffer_delta_format *df,
+		const unsigned char *mask)
+{
+	int i, size = 0;
+
+	for (i = 0; i < df->nfields; i++)
+		if (mask[i / 8] & (1 << (i % 8)))
+			size += df->offset[i + 1] - df->offset[i];
+	return size;
+}
+
+void packed_buffer_apply_delta(struct packed_buffer_delta_format *df, unsigned char *record,
+		const unsigned char *mask, const unsigned char *payload)
+{
+	int i, len;
+
+	for (i = 0; i < df->nfields; i++) {
+		if (!(mask[i / 8] & (1 << (i % 8))))
+			continue;
+		len = df->offset[i + 1] - df->offset[i];
+		memcpy(record + df->offset[i], payload, len);
+		payload += len;
+	}
+}
+
 #ifdef TEST_MARSHALL
+static struct packed_buffer_queue test_queue;
+static pthread_mutex_t test_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define TEST_POOL_BUFFERS 100000
+#define TEST_POOL_IN_FLIGHT 1000 /* about as many as a client's queue holds */
+
+/* Free buffers on a different thread than they were allocated on, as the server does */
+static void *test_pool_consumer(void *arg)
+{
+	struct packed_buffer_queue_entry *list;
+	int *count = arg;
+
+	while (*count > 0) {
+		list = packed_buffer_queue_detach(&test_queue, &test_queue_mutex);
+		while (list) {
+			struct packed_buffer_queue_entry *next = list->next;
+
+			if (list->buffer->buffer_cursor != 1 + 4 + list->buffer->buffer[0] * 4)
+				printf("FAIL: pooled buffer corrupted\n");
+			list->next = NULL;
+			packed_buffer_queue_entries_free(list);
+			__sync_fetch_and_sub(count, 1);
+			list = next;
+		}
+	}
+	return NULL;
+}
+
+/* Pass TEST_POOL_BUFFERS buffers to the consumer, never more than
+ * TEST_POOL_IN_FLIGHT ahead of it.
+ */
+static void test_pool_round(void)
+{
+	struct packed_buffer *pb;
+	pthread_t thread;
+	int i, j, n, count = TEST_POOL_BUFFERS;
+
+	pthread_create(&thread, NULL, test_pool_consumer, &count);
+	for (i = 0; i < TEST_POOL_BUFFERS; i++) {
+		while (i - (TEST_POOL_BUFFERS - __sync_fetch_and_add(&count, 0)) >= TEST_POOL_IN_FLIGHT)
+			sched_yield();
+		n = i % 100;
+		pb = packed_buffer_allocate(1 + 4 + n * 4);
+		packed_buffer_append(pb, "bw", (uint8_t) n, (uint32_t) i);
+		for (j = 0; j < n; j++)
+			packed_buffer_append(pb, "w", (uint32_t) j);
+		packed_buffer_queue_add(&test_queue, pb, &test_queue_mutex);
+	}
+	pthread_join(thread, NULL);
+}
+
+static int test_packed_buffer_pool(void)
+{
+	struct packed_buffer_pool_stats before, after;
+	uint64_t hits = 0, misses = 0;
+	int i;
+
+	/* The first round fills the pool, after which it should hardly miss */
+	test_pool_round();
+	packed_buffer_pool_stats(&before);
+	test_pool_round();
+	packed_buffer_pool_print_stats(stdout);
+	packed_buffer_pool_stats(&after);
+	for (i = 0; i < POOL_NCLASSES; i++) {
+		hits += after.hits[i] - before.hits[i];
+		misses += after.misses[i] - before.misses[i];
+	}
+	if (hits + misses != 2 * TEST_POOL_BUFFERS || misses > hits / 100) {
+		printf("FAIL: packed buffer pool, %llu hits, %llu misses after warming up\n",
+			(unsigned long long) hits, (unsigned long long) misses);
+		return -1;
+	}
+	return 0;
+}
+
+static int test_delta_encoding(void)
+{
+	struct packed_buffer_delta_format df;
+	struct packed_buffer *old, *new, *delta;
+	unsigned char mask[PACKED_BUFFER_MAX_DELTA_FIELDS / 8];
+	unsigned char record[64];
+	float q[4] = { 1.0, 0.0, 0.0, 0.0 };
+	const char *format = "bwwhSSSQwb";
+	int size;
+
+	if (packed_buffer_delta_format_init(&df, format) || df.nfields != 10 ||
+		df.offset[df.nfields] != calculate_buffer_size(format)) {
+		printf("FAIL: delta format\n");
+		return -1;
+	}
+	old = packed_buffer_new(format, 1, 2, 3, 4, 5.0, 100, 6.0, 100, 7.0, 100, q, 8, 9);
+	new = packed_buffer_new(format, 1, 2, 4, 4, 5.0, 100, 6.5, 100, 7.0, 100, q, 8, 10);
+	size = packed_buffer_delta_mask(&df, old->buffer, new->buffer, mask);
+	if (size != df.mask_bytes + 4 + 4 + 1 || mask[0] != 0x24 || mask[1] != 0x02) {
+		printf("FAIL: delta mask, size = %d, mask = %02x %02x\n", size, mask[0], mask[1]);
+		return -1;
+	}
+	delta = packed_buffer_allocate(size);
+	packed_buffer_append_delta(delta, &df, mask, new->buffer);
+	if (delta->buffer_cursor != size ||
+		packed_buffer_delta_payload_length(&df, delta->buffer) != size - df.mask_bytes) {
+		printf("FAIL: delta size\n");
+		return -1;
+	}
+	memcpy(record, old->buffer, old->buffer_cursor);
+	packed_buffer_apply_delta(&df, record, delta->buffer, delta->buffer + df.mask_bytes);
+	if (memcmp(record, new->buffer, new->buffer_cursor) != 0) {
+		printf("FAIL: delta apply\n");
+		return -1;
+	}
+	packed_buffer_free(old);
+	packed_buffer_free(new);
+	packed_buffer_free(delta);
+	return 0;
+}
+
+static int test_compact_encoding(void)
+{
+	const uint32_t varints[] = { 0, 1, 127, 128, 16383, 16384, 0x0fffffff, UINT32_MAX };
+	const int32_t zigzags[] = { 0, -1, 1, -64, 64, INT32_MIN, INT32_MAX };
+	const char *format = "bwwhSSSQwb";
+	const char *compact_format = "bvvhPPPCzb";
+	const int32_t origin[3] = { 1000000, -2000000000, 0 };
+	unsigned char buffer[64], record[64];
+	struct packed_buffer b, *pb, *compact;
+	float q[4] = { 0.5, -0.5, 0.5, 0.5 }, q2[4];
+	double x;
+	uint32_t w;
+	int32_t s;
+	int i;
+
+	packed_buffer_init(&b, buffer, sizeof(buffer));
+	for (i = 0; i < sizeof(varints) / sizeof(varints[0]); i++)
+		packed_buffer_append_varint(&b, varints[i]);
+	if (b.buffer_cursor != 1 + 1 + 1 + 2 + 2 + 3 + 4 + 5) {
+		printf("FAIL: varint size %d\n", b.buffer_cursor);
+		return -1;
+	}
+	packed_buffer_init(&b, buffer, b.buffer_cursor);
+	for (i = 0; i < sizeof(varints) / sizeof(varints[0]); i++)
+		if (packed_buffer_extract_varint(&b, &w) || w != varints[i]) {
+			printf("FAIL: varint %u\n", varints[i]);
+			return -1;
+		}
+	if (packed_buffer_extract_varint(&b, &w) == 0) {
+		printf("FAIL: varint overrun not detected\n");
+		return -1;
+	}
+	for (i = 0; i < sizeof(zigzags) / sizeof(zigzags[0]); i++)
+		if (zigzag_decode(zigzag_encode(zigzags[i])) != zigzags[i]) {
+			printf("FAIL: zigzag %d\n", zigzags[i]);
+			return -1;
+		}
+	if (zigzag_encode(-1) != 1 || zigzag_encode(1) != 2) {
+		printf("FAIL: zigzag encoding\n");
+		return -1;
+	}
+
+	/* Nearby positions come back within half a unit, far ones exactly */
+	packed_buffer_init(&b, buffer, sizeof(buffer));
+	packed_buffer_append_relative(&b, origin[0] + 12345, origin[0]);
+	packed_buffer_append_relative(&b, origin[1] - 12345, origin[1]);
+	packed_buffer_append_relative(&b, INT32_MAX, origin[2]);
+	if (b.buffer_cursor != 2 + 2 + 6) {
+		printf("FAIL: relative position size %d\n", b.buffer_cursor);
+		return -1;
+	}
+	packed_buffer_init(&b, buffer, b.buffer_cursor);
+	packed_buffer_extract_relative(&b, origin[0], &s);
+	if (abs(s - (origin[0] + 12345)) > (1 << (PACKED_POSITION_SHIFT - 1))) {
+		printf("FAIL: relative position %d\n", s - origin[0]);
+		return -1;
+	}
+	packed_buffer_extract_relative(&b, origin[1], &s);
+	if (abs(s - (origin[1] - 12345)) > (1 << (PACKED_POSITION_SHIFT - 1))) {
+		printf("FAIL: relative position %d\n", s - origin[1]);
+		return -1;
+	}
+	if (packed_buffer_extract_relative(&b, origin[2], &s) || s != INT32_MAX) {
+		printf("FAIL: escaped relative position %d\n", s);
+		return -1;
+	}
+
+	/* The same through append/extract, as doubles */
+	packed_buffer_init(&b, buffer, sizeof(buffer));
+	packed_buffer_append(&b, "P", 1234.5, 1000.0, (int32_t) 2400000);
+	packed_buffer_init(&b, buffer, b.buffer_cursor);
+	packed_buffer_extract(&b, "P", &x, 1000.0, (int32_t) 2400000);
+	if (fabs(x - 1234.5) > 1.0) {
+		printf("FAIL: relative position as double %f\n", x);
+		return -1;
+	}
+
+	/* A whole record, to compact form and back */
+	pb = packed_buffer_new(format, 1, 2, 3, 4, 5.0, 2400000, 6.0, 2400000,
+				-7.0, 2400000, q, (uint32_t) -1, 9);
+	compact = packed_buffer_allocate(calculate_buffer_size(compact_format));
+	if (packed_buffer_compact(compact, compact_format, pb->buffer, format, origin) ||
+		compact->buffer_cursor != 1 + 1 + 1 + 2 + 2 + 6 + 2 + 4 + 1 + 1) {
+		printf("FAIL: compact record, %d bytes\n", compact->buffer_cursor);
+		return -1;
+	}
+	compact->buffer_size = compact->buffer_cursor;
+	compact->buffer_cursor = 0;
+	if (packed_buffer_expand(record, sizeof(record), format, compact, compact_format, origin)) {
+		printf("FAIL: expand record\n");
+		return -1;
+	}
+	if (memcmp(record, pb->buffer, 1 + 4 + 4 + 2) != 0 ||
+		memcmp(record + 39, pb->buffer + 39, 5) != 0) {
+		printf("FAIL: expanded record differs\n");
+		return -1;
+	}
+	packed_buffer_init(&b, record, sizeof(record));
+	b.buffer_cursor = 19;
+	packed_buffer_extract(&b, "SQ", &x, (int32_t) 2400000, q2);
+	if (fabs(x + 7.0) > 1.0) {
+		printf("FAIL: expanded position %f\n", x);
+		return -1;
+	}
+	for (i = 0; i < 4; i++)
+		if (fabs(q[i] - q2[i]) > 0.002) {
+			printf("FAIL: smallest three quaternion %f %f %f %f\n",
+				q2[0], q2[1], q2[2], q2[3]);
+			return -1;
+		}
+	packed_buffer_free(pb);
+	packed_buffer_free(compact);
+	return 0;
+}
+
+/* Combining and detaching a queue must cope with more than 64K of data */
+static int test_large_queue(void)
+{
+	struct packed_buffer_queue_entry *list, *i;
+	struct packed_buffer *pb;
+	uint32_t total, value;
+	int n, nbuffers = 30000; /* 150000 bytes */
+
+	for (n = 0; n < nbuffers; n++)
+		packed_buffer_queue_add(&test_queue, packed_buffer_new("bw", 1, (uint32_t) n),
+					&test_queue_mutex);
+	pb = packed_buffer_queue_combine(&test_queue, &test_queue_mutex);
+	if (!pb || pb->buffer_size != nbuffers * 5 || pb->buffer_cursor != nbuffers * 5) {
+		printf("FAIL: combined large queue, size = %u\n", pb ? pb->buffer_size : 0);
+		return -1;
+	}
+	pb->buffer_cursor = 0;
+	for (n = 0; n < nbuffers; n++) {
+		if (packed_buffer_extract_u8(pb) != 1 ||
+			packed_buffer_extract_u32(pb) != (uint32_t) n) {
+			printf("FAIL: combined large queue corrupted at %d\n", n);
+			return -1;
+		}
+	}
+	packed_buffer_free(pb);
+
+	for (n = 0; n < nbuffers; n++)
+		packed_buffer_queue_add(&test_queue, packed_buffer_new("bw", 1, (uint32_t) n),
+					&test_queue_mutex);
+	list = packed_buffer_queue_detach(&test_queue, &test_queue_mutex);
+	total = 0;
+	n = 0;
+	for (i = list; i; i = i->next) {
+		total += i->buffer->buffer_cursor;
+		memcpy(&value, &i->buffer->buffer[1], 4);
+		if (ntohl(value) != (uint32_t) n++) {
+			printf("FAIL: detached large queue out of order\n");
+			return -1;
+		}
+	}
+	packed_buffer_queue_entries_free(list);
+	if (total != nbuffers * 5) {
+		printf("FAIL: detached large queue, %u bytes\n", total);
+		return -1;
+	}
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 
 	float x;
 
+	if (test_packed_buffer_pool())
+		return -1;
+	if (test_delta_encoding())
+		return -1;
+	if (test_large_queue())
+		return -1;
+	if (test_compact_encoding())
+		return -1;
+
 	for (x = -1.0; x <= 1.0; x += 0.0001) {
 		printf("Qtos32(%f) = %d\n", x, Qtos32(x));
 		printf("s32toQ(%f) = %f\n", x, s32toQ(x));
@@ -12,8 +12,9 @@ struct packed_double
 struct packed_buffer
 {
 	unsigned char *buffer;
-	uint16_t buffer_size; /* size of space allocated for buffer */
+	uint32_t buffer_size; /* size of space allocated for buffer */
 	int buffer_cursor;
+	int refcount; /* a buffer with more than one reference must not be modified */
 };
 
 struct packed_buffer_queue_entry {
@@ -25,6 +26,27 @@ struct packed_buffer_queue {
 	struct packed_buffer_queue_entry *head, *tail;
 };
 
+/* Packed buffers and queue entries come from a pool with a few size classes,
+ * the last class being for queue entries.
+ */
+#define POOL_NCLASSES 8
+struct packed_buffer_pool_stats {
+	uint64_t hits[POOL_NCLASSES]; /* allocations satisfied from the pool */
+	uint64_t misses[POOL_NCLASSES]; /* allocations which had to malloc */
+	uint64_t unpooled; /* buffers too big (or empty) for any size class */
+};
+
+/* Field layout of a fixed size record format, for field level delta encoding.
+ * A delta is a bitmask of changed fields (bit n of byte n / 8 for field n)
+ * followed by the new contents of just those fields.
+ */
+#define PACKED_BUFFER_MAX_DELTA_FIELDS 64
+struct packed_buffer_delta_format {
+	int nfields;
+	int mask_bytes;
+	uint16_t offset[PACKED_BUFFER_MAX_DELTA_FIELDS + 1];
+};
+
 #ifdef DEFINE_SNIS_MARSHAL_GLOBALS
 #define GLOBAL
 #else
@@ -33,6 +55,9 @@ struct packed_buffer_queue {
 
 GLOBAL struct packed_buffer * packed_buffer_allocate(int size); 
 GLOBAL void packed_buffer_free(struct packed_buffer *pb);
+GLOBAL struct packed_buffer *packed_buffer_get(struct packed_buffer *pb);
+GLOBAL void packed_buffer_pool_stats(struct packed_buffer_pool_stats *stats);
+GLOBAL void packed_buffer_pool_print_stats(FILE *f);
 
 /* For packed_buffer_append/extract, format is like:
  * "b" = u8 (byte)
@@ -47,7 +72,19 @@ GLOBAL void packed_buffer_free(struct packed_buffer *pb);
  * "Q" = 4 32-bit signed integer encoded floats representing a quaternion axis + angle
  * "R" = 32-bit signed integer encoded double radians representing an angle
  *       (-2 * M_PI <= angle <= 2 * M_PI must hold.)
+ *
+ * Compact, variable length codes (calculate_buffer_size() gives the worst case):
+ * "v" = u32 as a varint, 7 bits per byte, low bits first, 1 to 5 bytes
+ * "z" = s32 as a zigzag encoded varint, so small negative numbers are small too
+ * "P" = position relative to an origin (takes 3 params, double + origin + scale,
+ *       extract takes double * + origin + scale). The difference of the "S"
+ *       encodings of value and origin, in units of 1 << PACKED_POSITION_SHIFT,
+ *       in 16 bits, or if too far away, 0x8000 followed by the "S" encoding.
+ * "C" = quaternion as its three smallest elements, 10 bits each, plus 2 bits
+ *       saying which element was left out (takes a float *, like "Q")
  */
+#define PACKED_POSITION_SHIFT 9
+#define PACKED_POSITION_ESCAPE 0x8000
 
 GLOBAL int packed_buffer_append(struct packed_buffer *pb, const char *format, ...);
 GLOBAL int packed_buffer_append_va(struct packed_buffer *pb, const char *format,
@@ -74,6 +111,9 @@ GLOBAL int packed_buffer_extract_string(struct packed_buffer *pb, char *buffer,
 GLOBAL int packed_buffer_append_raw(struct packed_buffer *pb, const char *buffer, unsigned short len);
 GLOBAL int packed_buffer_extract_raw(struct packed_buffer *pb, char *buffer, unsigned short len);
 GLOBAL struct packed_buffer *packed_buffer_queue_combine(struct packed_buffer_queue *pbqh, pthread_mutex_t *mutex);
+GLOBAL struct packed_buffer_queue_entry *packed_buffer_queue_detach(struct packed_buffer_queue *pbq,
+		pthread_mutex_t *mutex);
+GLOBAL void packed_buffer_queue_entries_free(struct packed_buffer_queue_entry *list);
 GLOBAL void packed_buffer_queue_add(struct packed_buffer_queue *pbqh, struct packed_buffer *pb,
 		pthread_mutex_t *mutex);
 GLOBAL void packed_buffer_queue_prepend(struct packed_buffer_queue *pbqh, struct packed_buffer *pb,
@@ -95,9 +135,43 @@ GLOBAL int packed_buffer_append_ds32(struct packed_buffer *pb, double d, int32_t
 GLOBAL double packed_buffer_extract_du32(struct packed_buffer *pb, uint32_t scale);
 GLOBAL double packed_buffer_extract_ds32(struct packed_buffer *pb, int32_t scale);
 GLOBAL int calculate_buffer_size(const char *format);
+
+GLOBAL int packed_buffer_append_varint(struct packed_buffer *pb, uint32_t value);
+GLOBAL int packed_buffer_extract_varint(struct packed_buffer *pb, uint32_t *value);
+GLOBAL uint32_t zigzag_encode(int32_t value);
+GLOBAL int32_t zigzag_decode(uint32_t value);
+GLOBAL int packed_buffer_append_relative(struct packed_buffer *pb, int32_t value, int32_t origin);
+GLOBAL int packed_buffer_extract_relative(struct packed_buffer *pb, int32_t origin, int32_t *value);
+GLOBAL int packed_buffer_append_quat3(struct packed_buffer *pb, float q[]);
+GLOBAL int packed_buffer_extract_quat3(struct packed_buffer *pb, float q[]);
+
+/* Convert between a fixed size record and a compact encoding of it.  The two
+ * formats must have the same number of fields, and each compact field must be
+ * either the same code as the record's, or "v" or "z" for a "w", "z" for an
+ * "S", "U" or "R", "P" for an "S" (the origins of successive "P"s being
+ * origin[0], origin[1], origin[2], origin[0], ... as "S" encoded positions),
+ * or "C" for a "Q".  "v", "z" and "S" to "z" are lossless, "P" and "C" are not.
+ * The lossy conversions happen on the integer encodings, so server and client
+ * agree on the exact result.  Both return 0 on success, or -1 if the formats
+ * don't match up or the data runs out.
+ */
+GLOBAL int packed_buffer_compact(struct packed_buffer *pb, const char *compact_format,
+		const unsigned char *record, const char *format, const int32_t origin[3]);
+GLOBAL int packed_buffer_expand(unsigned char *record, int recordsize, const char *format,
+		struct packed_buffer *pb, const char *compact_format, const int32_t origin[3]);
 GLOBAL int packed_buffer_queue_length(struct packed_buffer_queue *pbq, pthread_mutex_t *mutex);
 GLOBAL int packed_buffer_length(struct packed_buffer *pb);
 
+GLOBAL int packed_buffer_delta_format_init(struct packed_buffer_delta_format *df, const char *format);
+GLOBAL int packed_buffer_delta_mask(struct packed_buffer_delta_format *df,
+		const unsigned char *old, const unsigned char *new, unsigned char *mask);
+GLOBAL int packed_buffer_append_delta(struct packed_buffer *pb, struct packed_buffer_delta_format *df,
+		const unsigned char *mask, const unsigned char *new);
+GLOBAL int packed_buffer_delta_payload_length(struct packed_buffer_delta_format *df,
+		const unsigned char *mask);
+GLOBAL void packed_buffer_apply_delta(struct packed_buffer_delta_format *df, unsigned char *record,
+		const unsigned char *mask, const unsigned char *payload);
+
 #undef GLOBAL
 #endif
 
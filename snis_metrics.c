@@ -0,0 +1,450 @@
+/*
+        Copyright (C) 2010 Stephen M. Cameron
+        Author: Stephen M. Cameron
+
+        This file is part of Spacenerds In Space.
+
+        Spacenerds in Space is free software; you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+        (at your option) any later version.
+
+        Spacenerds in Space is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with Spacenerds in Space; if not, write to the Free Software
+        Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DEFINE_SNIS_METRICS_GLOBALS
+#include "snis_metrics.h"
+
+struct snis_metrics_slab {
+	struct snis_metrics_slab *next;
+	struct snis_metrics *m;
+	int in_use;
+	uint64_t counter[];
+};
+
+struct snis_metrics {
+	int ncounters;
+	pthread_key_t key;
+	pthread_mutex_t lock;
+	struct snis_metrics_slab *slab; /* every slab ever handed out */
+};
+
+struct snis_metrics_server {
+	int fd;
+	snis_metrics_emitter emit;
+	void *cookie;
+};
+
+#define REQUEST_WAIT_MSEC 100
+
+static void release_slab(void *arg)
+{
+	struct snis_metrics_slab *s = arg;
+
+	pthread_mutex_lock(&s->m->lock);
+	s->in_use = 0;
+	pthread_mutex_unlock(&s->m->lock);
+}
+
+struct snis_metrics *snis_metrics_new(int ncounters)
+{
+	struct snis_metrics *m;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+	if (pthread_key_create(&m->key, release_slab)) {
+		free(m);
+		return NULL;
+	}
+	pthread_mutex_init(&m->lock, NULL);
+	m->ncounters = ncounters;
+	return m;
+}
+
+/* Give the calling thread a slab, reusing one left by an exited thread if possible */
+static struct snis_metrics_slab *claim_slab(struct snis_metrics *m)
+{
+	struct snis_metrics_slab *s;
+
+	pthread_mutex_lock(&m->lock);
+	for (s = m->slab; s; s = s->next)
+		if (!s->in_use)
+			break;
+	if (!s) {
+		s = calloc(1, sizeof(*s) + sizeof(s->counter[0]) * m->ncounters);
+		if (!s) {
+			pthread_mutex_unlock(&m->lock);
+			return NULL;
+		}
+		s->m = m;
+		s->next = m->slab;
+		m->slab = s;
+	}
+	s->in_use = 1;
+	pthread_mutex_unlock(&m->lock);
+	pthread_setspecific(m->key, s);
+	return s;
+}
+
+void snis_metrics_add(struct snis_metrics *m, int counter, uint64_t value)
+{
+	struct snis_metrics_slab *s;
+
+	if (!m || counter < 0 || counter >= m->ncounters)
+		return;
+	s = pthread_getspecific(m->key);
+	if (!s) {
+		s = claim_slab(m);
+		if (!s)
+			return;
+	}
+	/* Only this thread ever writes this slab, the store need only be untorn */
+	__atomic_store_n(&s->counter[counter], s->counter[counter] + value, __ATOMIC_RELAXED);
+}
+
+void snis_metrics_sum(struct snis_metrics *m, uint64_t *total)
+{
+	struct snis_metrics_slab *s;
+	int i;
+
+	memset(total, 0, sizeof(*total) * m->ncounters);
+	pthread_mutex_lock(&m->lock);
+	for (s = m->slab; s; s = s->next)
+		for (i = 0; i < m->ncounters; i++)
+			total[i] += __atomic_load_n(&s->counter[i], __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&m->lock);
+}
+
+void snis_metrics_describe(FILE *f, const char *name, const char *type, const char *help)
+{
+	fprintf(f, "# HELP %s %s\n", name, help);
+	fprintf(f, "# TYPE %s %s\n", name, type);
+}
+
+static int write_all(int fd, const char *buffer, size_t len)
+{
+	ssize_t rc;
+
+	while (len > 0) {
+		rc = write(fd, buffer, len);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buffer += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+static void serve_one(struct snis_metrics_server *s, int fd)
+{
+	struct pollfd pfd;
+	char request[1024];
+	char *text = NULL;
+	size_t len = 0;
+	int http = 0;
+	ssize_t n;
+	FILE *f;
+
+	/* Something like nc might just connect and listen, so only wait a moment
+	 * to see if this is an HTTP request.
+	 */
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, REQUEST_WAIT_MSEC) == 1) {
+		n = read(fd, request, sizeof(request) - 1);
+		if (n >= 4 && strncmp(request, "GET ", 4) == 0)
+			http = 1;
+	}
+
+	/* Format everything first, so emit() is not holding any locks while
+	 * we wait on a slow reader.
+	 */
+	f = open_memstream(&text, &len);
+	if (!f)
+		return;
+	s->emit(f, s->cookie);
+	fclose(f);
+
+	if (http) {
+		char header[200];
+
+		snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n", len);
+		if (write_all(fd, header, strlen(header)))
+			goto out;
+	}
+	write_all(fd, text, len);
+out:
+	free(text);
+}
+
+static void *metrics_server_thread(void *arg)
+{
+	struct snis_metrics_server *s = arg;
+	int fd;
+
+	for (;;) {
+		fd = accept(s->fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		serve_one(s, fd);
+		shutdown(fd, SHUT_RDWR);
+		close(fd);
+	}
+	close(s->fd);
+	free(s);
+	return NULL;
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path); /* left over from last time */
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 5) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int listen_tcp(const char *port)
+{
+	struct sockaddr_in addr;
+	int fd, p, one = 1;
+
+	if (sscanf(port, "%d", &p) != 1 || p <= 0 || p > 65535) {
+		errno = EINVAL;
+		return -1;
+	}
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(p);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 5) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int snis_metrics_serve(const char *where, snis_metrics_emitter emit, void *cookie)
+{
+	struct snis_metrics_server *s;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int rc;
+
+	s = malloc(sizeof(*s));
+	if (!s)
+		return -1;
+	s->emit = emit;
+	s->cookie = cookie;
+	if (strchr(where, '/'))
+		s->fd = listen_unix(where);
+	else
+		s->fd = listen_tcp(where);
+	if (s->fd < 0) {
+		free(s);
+		return -1;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&thread, &attr, metrics_server_thread, s);
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		close(s->fd);
+		free(s);
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef TEST_METRICS
+#define TEST_THREADS 8
+#define TEST_ADDS 100000
+
+static struct snis_metrics *test_metrics;
+
+static void *test_adder(void *arg)
+{
+	int i, n = (int) (intptr_t) arg;
+
+	for (i = 0; i < TEST_ADDS; i++) {
+		snis_metrics_add(test_metrics, 0, 1);
+		snis_metrics_add(test_metrics, 1, n);
+	}
+	return NULL;
+}
+
+static int run_adders(void)
+{
+	pthread_t thread[TEST_THREADS];
+	int i;
+
+	for (i = 0; i < TEST_THREADS; i++)
+		if (pthread_create(&thread[i], NULL, test_adder, (void *) (intptr_t) i))
+			return -1;
+	for (i = 0; i < TEST_THREADS; i++)
+		pthread_join(thread[i], NULL);
+	return 0;
+}
+
+static int count_slabs(struct snis_metrics *m)
+{
+	struct snis_metrics_slab *s;
+	int n = 0;
+
+	for (s = m->slab; s; s = s->next)
+		n++;
+	return n;
+}
+
+static int test_counters(void)
+{
+	uint64_t total[3];
+	int round;
+
+	test_metrics = snis_metrics_new(3);
+	for (round = 1; round <= 2; round++) {
+		if (run_adders()) {
+			printf("pthread_create failed\n");
+			return 1;
+		}
+		snis_metrics_sum(test_metrics, total);
+		if (total[0] != (uint64_t) round * TEST_THREADS * TEST_ADDS ||
+			total[1] != (uint64_t) round * TEST_ADDS * (TEST_THREADS * (TEST_THREADS - 1) / 2) ||
+			total[2] != 0) {
+			printf("round %d, wrong totals %llu %llu %llu\n", round,
+				(unsigned long long) total[0], (unsigned long long) total[1],
+				(unsigned long long) total[2]);
+			return 1;
+		}
+	}
+	/* The second round of threads should have reused the first round's slabs */
+	if (count_slabs(test_metrics) > TEST_THREADS) {
+		printf("%d slabs for %d threads\n", count_slabs(test_metrics), TEST_THREADS);
+		return 1;
+	}
+	snis_metrics_add(test_metrics, 3, 1); /* out of range, ignored */
+	return 0;
+}
+
+static void test_emit(FILE *f, void *cookie)
+{
+	uint64_t total[3];
+
+	snis_metrics_sum(cookie, total);
+	snis_metrics_describe(f, "test_adds_total", "counter", "Number of adds.");
+	fprintf(f, "test_adds_total %llu\n", (unsigned long long) total[0]);
+}
+
+static int fetch(const char *path, const char *request, char *buffer, int buflen)
+{
+	struct sockaddr_un addr;
+	int fd, n, len = 0;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (request && write_all(fd, request, strlen(request))) {
+		close(fd);
+		return -1;
+	}
+	while (len < buflen - 1 && (n = read(fd, buffer + len, buflen - 1 - len)) > 0)
+		len += n;
+	buffer[len] = '\0';
+	close(fd);
+	return len;
+}
+
+static int test_serve(void)
+{
+	char path[100], text[4096];
+	char *expect = "test_adds_total 1600000\n";
+
+	snprintf(path, sizeof(path), "/tmp/test-metrics.%d", (int) getpid());
+	if (snis_metrics_serve(path, test_emit, test_metrics)) {
+		printf("snis_metrics_serve failed: %s\n", strerror(errno));
+		return 1;
+	}
+	if (fetch(path, NULL, text, sizeof(text)) < 0 ||
+		strncmp(text, "# HELP test_adds_total", 22) != 0 || !strstr(text, expect)) {
+		printf("unexpected plain text response:\n%s\n", text);
+		unlink(path);
+		return 1;
+	}
+	if (fetch(path, "GET /metrics HTTP/1.0\r\n\r\n", text, sizeof(text)) < 0 ||
+		strncmp(text, "HTTP/1.0 200 OK\r\n", 17) != 0 || !strstr(text, expect)) {
+		printf("unexpected HTTP response:\n%s\n", text);
+		unlink(path);
+		return 1;
+	}
+	unlink(path);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+
+	rc = test_counters();
+	printf("test_counters %s\n", rc ? "failed" : "passed");
+	if (rc)
+		return rc;
+	rc = test_serve();
+	printf("test_serve %s\n", rc ? "failed" : "passed");
+	return rc;
+}
+#endif
@@ -0,0 +1,64 @@
+#ifndef __SNIS_METRICS_H__
+#define __SNIS_METRICS_H__
+/*
+        Copyright (C) 2010 Stephen M. Cameron
+        Author: Stephen M. Cameron
+
+        This file is part of Spacenerds In Space.
+
+        Spacenerds in Space is free software; you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+        (at your option) any later version.
+
+        Spacenerds in Space is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with Spacenerds in Space; if not, write to the Free Software
+        Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Runtime counters, cheap enough to leave on all the time.
+ *
+ * Each thread which bumps a counter gets its own slab of counters, so
+ * snis_metrics_add() takes no lock and touches no shared cache line.
+ * snis_metrics_sum() adds up every slab when somebody asks.  Slabs of
+ * threads which have exited are kept, and handed to the next new thread,
+ * so totals never go backwards however many client threads come and go.
+ */
+
+#ifdef DEFINE_SNIS_METRICS_GLOBALS
+#define GLOBAL
+#else
+#define GLOBAL extern
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct snis_metrics;
+
+/* Writes the text of the metrics to f, called for each connection. */
+typedef void (*snis_metrics_emitter)(FILE *f, void *cookie);
+
+GLOBAL struct snis_metrics *snis_metrics_new(int ncounters);
+GLOBAL void snis_metrics_add(struct snis_metrics *m, int counter, uint64_t value);
+GLOBAL void snis_metrics_sum(struct snis_metrics *m, uint64_t *total);
+
+/* Prints the "# HELP" and "# TYPE" lines for a metric, Prometheus style */
+GLOBAL void snis_metrics_describe(FILE *f, const char *name, const char *type, const char *help);
+
+/* Serve the metrics on a unix socket if where contains a '/', otherwise on
+ * TCP port "where" of the loopback interface.  Anything connecting gets the
+ * text from emit() and is disconnected; if it sends an HTTP GET first, the
+ * text is wrapped in an HTTP response, so a Prometheus server can scrape it.
+ * Returns 0 if the listener thread was started, -1 otherwise.
+ */
+GLOBAL int snis_metrics_serve(const char *where, snis_metrics_emitter emit, void *cookie);
+
+#undef GLOBAL
+#endif
@@ -0,0 +1,246 @@
+#ifndef __SNIS_PACKER_H__
+#define __SNIS_PACKER_H__
+/*
+        Copyright (C) 2010 Stephen M. Cameron
+        Author: Stephen M. Cameron
+
+        This file is part of Spacenerds In Space.
+
+        Spacenerds in Space is free software; you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+        (at your option) any later version.
+
+        Spacenerds in Space is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with Spacenerds in Space; if not, write to the Free Software
+        Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Straight line packers for fixed size packets.
+ *
+ * packed_buffer_append() and packed_buffer_extract() interpret their format
+ * string a character at a time.  For the packets sent most often, the fields
+ * are instead described once by an X-macro table like:
+ *
+ *	#define EXAMPLE_FIELDS(X) \
+ *		X(b, opcode, 0) \
+ *		X(w, id, 0) \
+ *		X(S, x, UNIVERSE_DIM)
+ *
+ * with the same codes as packed_buffer_append() (only the fixed size ones,
+ * b, h, w, S, U, R and Q), a field name, and the scale for S and U.  From
+ * which:
+ *
+ *	EXAMPLE_FIELDS(PACKER_FORMAT) is the format string, "bwS",
+ *	DECLARE_PACKER(example, EXAMPLE_FIELDS) declares struct example_values,
+ *		example_size, and example_pack(), example_new() and example_unpack(),
+ *	DEFINE_PACKER(example, EXAMPLE_FIELDS) defines the functions, which do
+ *		no more than the stores and loads needed.
+ *
+ * The encoding is byte for byte that of packed_buffer_append().
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "snis_marshal.h"
+#include "quat.h"
+
+#define PACKER_FORMAT(code, name, scale) #code
+
+#define PACKER_SIZE_b 1
+#define PACKER_SIZE_h 2
+#define PACKER_SIZE_w 4
+#define PACKER_SIZE_S 4
+#define PACKER_SIZE_U 4
+#define PACKER_SIZE_R 4
+#define PACKER_SIZE_Q 16
+#define PACKER_SIZE(code, name, scale) + PACKER_SIZE_##code
+
+#define PACKER_TYPE_b uint8_t
+#define PACKER_TYPE_h uint16_t
+#define PACKER_TYPE_w uint32_t
+#define PACKER_TYPE_S double
+#define PACKER_TYPE_U double
+#define PACKER_TYPE_R double
+#define PACKER_TYPE_Q union quat
+#define PACKER_MEMBER(code, name, scale) PACKER_TYPE_##code name;
+
+#define PACKER_PUT(code, name, scale) p = packer_put_##code(p, &v->name, scale);
+#define PACKER_GET(code, name, scale) p = packer_get_##code(p, &v->name, scale);
+
+static inline unsigned char *packer_put_b(unsigned char *p, const uint8_t *v,
+		__attribute__((unused)) int32_t scale)
+{
+	*p = *v;
+	return p + 1;
+}
+
+static inline unsigned char *packer_put_h(unsigned char *p, const uint16_t *v,
+		__attribute__((unused)) int32_t scale)
+{
+	uint16_t h = htons(*v);
+
+	memcpy(p, &h, sizeof(h));
+	return p + sizeof(h);
+}
+
+static inline unsigned char *packer_put_w(unsigned char *p, const uint32_t *v,
+		__attribute__((unused)) int32_t scale)
+{
+	uint32_t w = htonl(*v);
+
+	memcpy(p, &w, sizeof(w));
+	return p + sizeof(w);
+}
+
+static inline unsigned char *packer_put_S(unsigned char *p, const double *v, int32_t scale)
+{
+	uint32_t w = (uint32_t) dtos32(*v, scale);
+
+	return packer_put_w(p, &w, 0);
+}
+
+static inline unsigned char *packer_put_U(unsigned char *p, const double *v, int32_t scale)
+{
+	uint32_t w = dtou32(*v, (uint32_t) scale);
+
+	return packer_put_w(p, &w, 0);
+}
+
+static inline unsigned char *packer_put_R(unsigned char *p, const double *v,
+		__attribute__((unused)) int32_t scale)
+{
+	uint32_t w = (uint32_t) dtos32(*v, INT32_MAX / 100);
+
+	return packer_put_w(p, &w, 0);
+}
+
+static inline unsigned char *packer_put_Q(unsigned char *p, const union quat *v,
+		__attribute__((unused)) int32_t scale)
+{
+	uint32_t w;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		w = (uint32_t) Qtos32(v->vec[i]);
+		p = packer_put_w(p, &w, 0);
+	}
+	return p;
+}
+
+static inline const unsigned char *packer_get_b(const unsigned char *p, uint8_t *v,
+		__attribute__((unused)) int32_t scale)
+{
+	*v = *p;
+	return p + 1;
+}
+
+static inline const unsigned char *packer_get_h(const unsigned char *p, uint16_t *v,
+		__attribute__((unused)) int32_t scale)
+{
+	uint16_t h;
+
+	memcpy(&h, p, sizeof(h));
+	*v = ntohs(h);
+	return p + sizeof(h);
+}
+
+static inline const unsigned char *packer_get_w(const unsigned char *p, uint32_t *v,
+		__attribute__((unused)) int32_t scale)
+{
+	uint32_t w;
+
+	memcpy(&w, p, sizeof(w));
+	*v = ntohl(w);
+	return p + sizeof(w);
+}
+
+static inline const unsigned char *packer_get_S(const unsigned char *p, double *v, int32_t scale)
+{
+	uint32_t w;
+
+	p = packer_get_w(p, &w, 0);
+	*v = s32tod((int32_t) w, scale);
+	return p;
+}
+
+static inline const unsigned char *packer_get_U(const unsigned char *p, double *v, int32_t scale)
+{
+	uint32_t w;
+
+	p = packer_get_w(p, &w, 0);
+	*v = u32tod(w, (uint32_t) scale);
+	return p;
+}
+
+static inline const unsigned char *packer_get_R(const unsigned char *p, double *v,
+		__attribute__((unused)) int32_t scale)
+{
+	uint32_t w;
+
+	p = packer_get_w(p, &w, 0);
+	*v = s32tod((int32_t) w, INT32_MAX / 100);
+	return p;
+}
+
+static inline const unsigned char *packer_get_Q(const unsigned char *p, union quat *v,
+		__attribute__((unused)) int32_t scale)
+{
+	uint32_t w;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		p = packer_get_w(p, &w, 0);
+		v->vec[i] = s32toQ((int32_t) w);
+	}
+	return p;
+}
+
+#define DECLARE_PACKER(name, FIELDS) \
+	struct name##_values { \
+		FIELDS(PACKER_MEMBER) \
+	}; \
+	enum { name##_size = 0 FIELDS(PACKER_SIZE) }; \
+	int name##_pack(struct packed_buffer *pb, const struct name##_values *v); \
+	struct packed_buffer *name##_new(const struct name##_values *v); \
+	void name##_unpack(const unsigned char *record, struct name##_values *v);
+
+#define DEFINE_PACKER(name, FIELDS) \
+	int name##_pack(struct packed_buffer *pb, const struct name##_values *v) \
+	{ \
+		unsigned char *p = pb->buffer + pb->buffer_cursor; \
+	\
+		if (pb->buffer_cursor + name##_size > pb->buffer_size) \
+			return -1; /* no room */ \
+		FIELDS(PACKER_PUT) \
+		pb->buffer_cursor += name##_size; \
+		return 0; \
+	} \
+	\
+	struct packed_buffer *name##_new(const struct name##_values *v) \
+	{ \
+		struct packed_buffer *pb = packed_buffer_allocate(name##_size); \
+	\
+		if (pb && name##_pack(pb, v)) { \
+			packed_buffer_free(pb); \
+			return NULL; \
+		} \
+		return pb; \
+	} \
+	\
+	void name##_unpack(const unsigned char *record, struct name##_values *v) \
+	{ \
+		const unsigned char *p = record; \
+	\
+		FIELDS(PACKER_GET) \
+	}
+
+#endif
@@ -22,6 +22,7 @@
 */
 
 #include "snis_marshal.h"
+#include "snis_packer.h"
 
 #define OPCODE_UPDATE_SHIP		100
 #define OPCODE_UPDATE_STARBASE	101
@@ -147,6 +148,12 @@
 #define OPCODE_DOCKING_MAGNETS			223
 #define OPCODE_CYCLE_NAV_POINT_OF_VIEW		224
 #define OPCODE_REQUEST_MINING_BOT		225
+#define OPCODE_UPDATE_DELTA			226
+#define OPCODE_UPDATE_COMPACT			227
+#define OPCODE_UPDATE_ORIGIN			228
+#define OPCODE_UDP_CHANNEL			229
+#define OPCODE_REQUEST_TICK_PROFILE		230
+#define OPCODE_TICK_PROFILE			231
 
 #define OPCODE_NOOP		0xff
 
@@ -157,6 +164,176 @@
 
 #define NAMESIZE 20
 
+/*
+ * Field tables of the object updates, from which the format strings and
+ * straight line packers are generated, see snis_packer.h.  S fields are
+ * scaled by UNIVERSE_DIM unless noted otherwise.
+ */
+#define UPDATE_SHIP_FIELDS(X) \
+	X(b, opcode, 0) X(w, id, 0) X(w, timestamp, 0) X(h, alive, 0) \
+	X(S, x, UNIVERSE_DIM) X(S, y, UNIVERSE_DIM) X(S, z, UNIVERSE_DIM) \
+	X(R, yaw_velocity, 0) X(R, pitch_velocity, 0) X(R, roll_velocity, 0) \
+	X(w, torpedoes, 0) X(w, power, 0) \
+	X(R, gun_yaw_velocity, 0) X(R, sci_heading, 0) X(R, sci_beam_width, 0) \
+	X(b, torpedoes_loading, 0) /* loaded in the high 4 bits */ \
+	X(b, throttle, 0) X(b, rpm, 0) X(w, fuel, 0) X(b, temp, 0) \
+	X(b, scizoom, 0) X(b, weapzoom, 0) X(b, navzoom, 0) X(b, mainzoom, 0) \
+	X(b, warpdrive, 0) X(b, requested_warpdrive, 0) X(b, requested_shield, 0) \
+	X(b, phaser_charge, 0) X(b, phaser_wavelength, 0) X(b, shiptype, 0) \
+	X(b, reverse, 0) X(b, trident, 0) X(w, victim_id, 0) \
+	X(Q, orientation, 0) X(Q, sciball_orientation, 0) X(Q, weap_orientation, 0) \
+	X(b, in_secure_area, 0) X(b, docking_magnets, 0)
+
+#define UPDATE_ECON_SHIP_FIELDS(X) \
+	X(b, opcode, 0) X(w, id, 0) X(w, timestamp, 0) X(h, alive, 0) \
+	X(S, x, UNIVERSE_DIM) X(S, y, UNIVERSE_DIM) X(S, z, UNIVERSE_DIM) \
+	X(Q, orientation, 0) X(w, victim_id, 0) X(b, shiptype, 0)
+
+#define UPDATE_ASTEROID_FIELDS(X) \
+	X(b, opcode, 0) X(w, id, 0) X(w, timestamp, 0) \
+	X(S, x, UNIVERSE_DIM) X(S, y, UNIVERSE_DIM) X(S, z, UNIVERSE_DIM) \
+	X(S, vx, UNIVERSE_DIM) X(S, vy, UNIVERSE_DIM) X(S, vz, UNIVERSE_DIM) \
+	X(b, carbon, 0) X(b, nickeliron, 0) X(b, silicates, 0) X(b, preciousmetals, 0)
+
+#define UPDATE_POSITION_FIELDS(X) \
+	X(b, opcode, 0) X(w, id, 0) X(w, timestamp, 0) \
+	X(S, x, UNIVERSE_DIM) X(S, y, UNIVERSE_DIM) X(S, z, UNIVERSE_DIM)
+
+#define UPDATE_DERELICT_FIELDS(X) \
+	UPDATE_POSITION_FIELDS(X) X(b, shiptype, 0)
+
+#define UPDATE_PLANET_FIELDS(X) \
+	UPDATE_POSITION_FIELDS(X) \
+	X(S, radius, UNIVERSE_DIM) /* negative if the planet has a ring */ \
+	X(w, description_seed, 0) X(b, government, 0) X(b, tech_level, 0) \
+	X(b, economy, 0) X(b, security, 0) X(h, contraband, 0) \
+	X(b, atmosphere_r, 0) X(b, atmosphere_g, 0) X(b, atmosphere_b, 0) \
+	X(S, atmosphere_scale, UNIVERSE_DIM)
+
+#define UPDATE_STARBASE_FIELDS(X) \
+	UPDATE_POSITION_FIELDS(X) X(Q, orientation, 0)
+
+#define UPDATE_NEBULA_FIELDS(X) \
+	UPDATE_POSITION_FIELDS(X) X(S, r, UNIVERSE_DIM) \
+	X(Q, angular_velocity, 0) X(Q, unrotated_orientation, 0) \
+	X(S, phase_angle, 360) X(S, phase_speed, 100)
+
+#define UPDATE_EXPLOSION_FIELDS(X) \
+	UPDATE_POSITION_FIELDS(X) \
+	X(h, nsparks, 0) X(h, velocity, 0) X(h, time, 0) X(b, victim_type, 0)
+
+#define UPDATE_TORPEDO_FIELDS(X) \
+	X(b, opcode, 0) X(w, id, 0) X(w, timestamp, 0) X(w, ship_id, 0) \
+	X(S, x, UNIVERSE_DIM) X(S, y, UNIVERSE_DIM) X(S, z, UNIVERSE_DIM)
+
+#define UPDATE_LASER_FIELDS(X) \
+	X(b, opcode, 0) X(w, id, 0) X(w, timestamp, 0) X(w, ship_id, 0) X(b, power, 0) \
+	X(S, x, UNIVERSE_DIM) X(S, y, UNIVERSE_DIM) X(S, z, UNIVERSE_DIM) \
+	X(Q, orientation, 0)
+
+#define UPDATE_LASERBEAM_FIELDS(X) \
+	X(b, opcode, 0) X(w, id, 0) X(w, timestamp, 0) X(w, origin, 0) X(w, target, 0)
+
+#define UPDATE_DOCKING_PORT_FIELDS(X) \
+	X(b, opcode, 0) X(w, id, 0) X(w, timestamp, 0) X(S, scale, 1000) \
+	X(S, x, UNIVERSE_DIM) X(S, y, UNIVERSE_DIM) X(S, z, UNIVERSE_DIM) \
+	X(Q, orientation, 0) X(b, model, 0)
+
+DECLARE_PACKER(update_ship_packer, UPDATE_SHIP_FIELDS)
+DECLARE_PACKER(update_econ_ship_packer, UPDATE_ECON_SHIP_FIELDS)
+DECLARE_PACKER(update_asteroid_packer, UPDATE_ASTEROID_FIELDS)
+DECLARE_PACKER(update_position_packer, UPDATE_POSITION_FIELDS)
+DECLARE_PACKER(update_derelict_packer, UPDATE_DERELICT_FIELDS)
+DECLARE_PACKER(update_planet_packer, UPDATE_PLANET_FIELDS)
+DECLARE_PACKER(update_starbase_packer, UPDATE_STARBASE_FIELDS)
+DECLARE_PACKER(update_nebula_packer, UPDATE_NEBULA_FIELDS)
+DECLARE_PACKER(update_explosion_packer, UPDATE_EXPLOSION_FIELDS)
+DECLARE_PACKER(update_torpedo_packer, UPDATE_TORPEDO_FIELDS)
+DECLARE_PACKER(update_laser_packer, UPDATE_LASER_FIELDS)
+DECLARE_PACKER(update_laserbeam_packer, UPDATE_LASERBEAM_FIELDS)
+DECLARE_PACKER(update_docking_port_packer, UPDATE_DOCKING_PORT_FIELDS)
+
+/* Formats of the object updates which may be sent as OPCODE_UPDATE_DELTA:
+ * opcode (OPCODE_UPDATE_DELTA), original opcode, object id, then the bitmask
+ * of changed fields and those fields, relative to the last update of the
+ * object sent to (and reconstructed by) the client.  See snis_marshal.h.
+ */
+#define UPDATE_SHIP_PACKET_FORMAT UPDATE_SHIP_FIELDS(PACKER_FORMAT)
+#define UPDATE_ECON_SHIP_PACKET_FORMAT UPDATE_ECON_SHIP_FIELDS(PACKER_FORMAT)
+
+/* Formats of the object updates which may be sent as OPCODE_UPDATE_COMPACT:
+ * opcode (OPCODE_UPDATE_COMPACT), length of what follows (uint8_t), then the
+ * update in its compact format, which the client expands back to the normal
+ * one with packed_buffer_expand().  Positions ("P") are relative to the origin
+ * last sent with OPCODE_UPDATE_ORIGIN, "bwww", the x, y, z of the origin as
+ * "S" encoded (UNIVERSE_DIM) positions.
+ */
+#define UPDATE_ASTEROID_PACKET_FORMAT UPDATE_ASTEROID_FIELDS(PACKER_FORMAT)
+#define UPDATE_ASTEROID_COMPACT_FORMAT "bvvPPPzzzbbbb"
+#define UPDATE_CARGO_CONTAINER_PACKET_FORMAT UPDATE_POSITION_FIELDS(PACKER_FORMAT)
+#define UPDATE_CARGO_CONTAINER_COMPACT_FORMAT "bvvPPP"
+#define UPDATE_DERELICT_PACKET_FORMAT UPDATE_DERELICT_FIELDS(PACKER_FORMAT)
+#define UPDATE_DERELICT_COMPACT_FORMAT "bvvPPPb"
+#define UPDATE_PLANET_PACKET_FORMAT UPDATE_PLANET_FIELDS(PACKER_FORMAT)
+#define UPDATE_PLANET_COMPACT_FORMAT "bvvPPPSwbbbbhbbbS"
+#define UPDATE_WORMHOLE_PACKET_FORMAT UPDATE_POSITION_FIELDS(PACKER_FORMAT)
+#define UPDATE_WORMHOLE_COMPACT_FORMAT "bvvPPP"
+#define UPDATE_STARBASE_PACKET_FORMAT UPDATE_STARBASE_FIELDS(PACKER_FORMAT)
+#define UPDATE_STARBASE_COMPACT_FORMAT "bvvPPPC"
+#define UPDATE_NEBULA_PACKET_FORMAT UPDATE_NEBULA_FIELDS(PACKER_FORMAT)
+#define UPDATE_NEBULA_COMPACT_FORMAT "bvvPPPSQQSS" /* slow rotations need all of "Q" */
+#define UPDATE_EXPLOSION_PACKET_FORMAT UPDATE_EXPLOSION_FIELDS(PACKER_FORMAT)
+#define UPDATE_EXPLOSION_COMPACT_FORMAT "bvvPPPhhhb"
+#define UPDATE_TORPEDO_PACKET_FORMAT UPDATE_TORPEDO_FIELDS(PACKER_FORMAT)
+#define UPDATE_TORPEDO_COMPACT_FORMAT "bvvvPPP"
+#define UPDATE_LASER_PACKET_FORMAT UPDATE_LASER_FIELDS(PACKER_FORMAT)
+#define UPDATE_LASER_COMPACT_FORMAT "bvvvbPPPC"
+#define UPDATE_LASERBEAM_PACKET_FORMAT UPDATE_LASERBEAM_FIELDS(PACKER_FORMAT)
+#define UPDATE_LASERBEAM_COMPACT_FORMAT "bvvvv"
+#define UPDATE_DOCKING_PORT_PACKET_FORMAT UPDATE_DOCKING_PORT_FIELDS(PACKER_FORMAT)
+#define UPDATE_DOCKING_PORT_COMPACT_FORMAT "bvvSPPPCb"
+#define UPDATE_ECON_SHIP_COMPACT_FORMAT "bvvhPPPCzb"
+
+/* The update types above, paired with their compact formats, in
+ * snis_packet_packers.c so that server and client share the one table.
+ * The table ends with an entry with a NULL format.
+ */
+struct compact_update_format {
+	uint8_t opcode;
+	const char *format;
+	const char *compact_format;
+};
+extern const struct compact_update_format compact_update_format[];
+const struct compact_update_format *lookup_compact_update_format(uint8_t opcode);
+
+/* OPCODE_ECON_UPDATE_SHIP_DEBUG_AI is an econ ship update, then the AI stack,
+ * threat level and number of patrol points, then the patrol points.
+ */
+#define UPDATE_ECON_SHIP_DEBUG_AI_FORMAT "bbbbbSb"
+#define UPDATE_ECON_SHIP_DEBUG_AI_POINT_FORMAT "SSS"
+
+/* Lengths of the server's messages, not counting the opcode, given the
+ * capabilities agreed.  Messages which carry their own length, or which
+ * aren't sent to clients, are marked as such.
+ */
+#define MESSAGE_LENGTH_UNKNOWN (-1)
+#define MESSAGE_LENGTH_VARIABLE (-2)
+void init_message_lengths(int length[256], uint32_t capabilities);
+
+/* OPCODE_UDP_CHANNEL, sent to a client which negotiated SNIS_CAP_UDP: the
+ * server's UDP port and the token the client's hellos must carry.  See snis_udp.h.
+ */
+#define UDP_CHANNEL_PACKET_FORMAT "bhw"
+
+/* OPCODE_TICK_PROFILE, the answer to a demon screen's OPCODE_REQUEST_TICK_PROFILE:
+ * the number of entries, then for each a length byte and that many bytes of
+ * name, followed by TICK_PROFILE_ENTRY_FORMAT: calls and microseconds spent
+ * over the last SNIS_TICK_PROFILE_WINDOW ticks, the longest call in that time,
+ * and the 50th, 90th and 99th percentiles of microseconds per tick.
+ */
+#define TICK_PROFILE_PACKET_FORMAT "bb"
+#define TICK_PROFILE_ENTRY_FORMAT "wwwwww"
+
 #pragma pack(1)
 struct update_ship_packet {
 	uint8_t opcode;
@@ -461,6 +638,8 @@ struct netstats_packet {
 	uint32_t nships, nobjects;
 	uint32_t elapsed_seconds;
 	uint32_t faction_population[5];
+	uint64_t bytes_deflated_in, bytes_deflated_out;
+	uint64_t compression_usec;
 };
 
 struct comms_transmission_packet {
@@ -0,0 +1,321 @@
+/*
+        Copyright (C) 2010 Stephen M. Cameron
+        Author: Stephen M. Cameron
+
+        This file is part of Spacenerds In Space.
+
+        Spacenerds in Space is free software; you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+        (at your option) any later version.
+
+        Spacenerds in Space is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with Spacenerds in Space; if not, write to the Free Software
+        Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* The straight line packers declared in snis_packet.h */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "quat.h"
+#include "snis.h"
+#include "snis_marshal.h"
+#include "snis_packet.h"
+#include "build_bug_on.h"
+
+DEFINE_PACKER(update_ship_packer, UPDATE_SHIP_FIELDS)
+DEFINE_PACKER(update_econ_ship_packer, UPDATE_ECON_SHIP_FIELDS)
+DEFINE_PACKER(update_asteroid_packer, UPDATE_ASTEROID_FIELDS)
+DEFINE_PACKER(update_position_packer, UPDATE_POSITION_FIELDS)
+DEFINE_PACKER(update_derelict_packer, UPDATE_DERELICT_FIELDS)
+DEFINE_PACKER(update_planet_packer, UPDATE_PLANET_FIELDS)
+DEFINE_PACKER(update_starbase_packer, UPDATE_STARBASE_FIELDS)
+DEFINE_PACKER(update_nebula_packer, UPDATE_NEBULA_FIELDS)
+DEFINE_PACKER(update_explosion_packer, UPDATE_EXPLOSION_FIELDS)
+DEFINE_PACKER(update_torpedo_packer, UPDATE_TORPEDO_FIELDS)
+DEFINE_PACKER(update_laser_packer, UPDATE_LASER_FIELDS)
+DEFINE_PACKER(update_laserbeam_packer, UPDATE_LASERBEAM_FIELDS)
+DEFINE_PACKER(update_docking_port_packer, UPDATE_DOCKING_PORT_FIELDS)
+
+const struct compact_update_format compact_update_format[] = {
+	{ OPCODE_UPDATE_ASTEROID, UPDATE_ASTEROID_PACKET_FORMAT, UPDATE_ASTEROID_COMPACT_FORMAT, },
+	{ OPCODE_UPDATE_CARGO_CONTAINER, UPDATE_CARGO_CONTAINER_PACKET_FORMAT,
+		UPDATE_CARGO_CONTAINER_COMPACT_FORMAT, },
+	{ OPCODE_UPDATE_DERELICT, UPDATE_DERELICT_PACKET_FORMAT, UPDATE_DERELICT_COMPACT_FORMAT, },
+	{ OPCODE_UPDATE_PLANET, UPDATE_PLANET_PACKET_FORMAT, UPDATE_PLANET_COMPACT_FORMAT, },
+	{ OPCODE_UPDATE_WORMHOLE, UPDATE_WORMHOLE_PACKET_FORMAT, UPDATE_WORMHOLE_COMPACT_FORMAT, },
+	{ OPCODE_UPDATE_STARBASE, UPDATE_STARBASE_PACKET_FORMAT, UPDATE_STARBASE_COMPACT_FORMAT, },
+	{ OPCODE_UPDATE_NEBULA, UPDATE_NEBULA_PACKET_FORMAT, UPDATE_NEBULA_COMPACT_FORMAT, },
+	{ OPCODE_UPDATE_EXPLOSION, UPDATE_EXPLOSION_PACKET_FORMAT, UPDATE_EXPLOSION_COMPACT_FORMAT, },
+	{ OPCODE_UPDATE_TORPEDO, UPDATE_TORPEDO_PACKET_FORMAT, UPDATE_TORPEDO_COMPACT_FORMAT, },
+	{ OPCODE_UPDATE_LASER, UPDATE_LASER_PACKET_FORMAT, UPDATE_LASER_COMPACT_FORMAT, },
+	{ OPCODE_UPDATE_LASERBEAM, UPDATE_LASERBEAM_PACKET_FORMAT, UPDATE_LASERBEAM_COMPACT_FORMAT, },
+	{ OPCODE_UPDATE_TRACTORBEAM, UPDATE_LASERBEAM_PACKET_FORMAT, UPDATE_LASERBEAM_COMPACT_FORMAT, },
+	{ OPCODE_UPDATE_DOCKING_PORT, UPDATE_DOCKING_PORT_PACKET_FORMAT,
+		UPDATE_DOCKING_PORT_COMPACT_FORMAT, },
+	{ OPCODE_ECON_UPDATE_SHIP, UPDATE_ECON_SHIP_PACKET_FORMAT, UPDATE_ECON_SHIP_COMPACT_FORMAT, },
+	{ 0, NULL, NULL, },
+};
+
+const struct compact_update_format *lookup_compact_update_format(uint8_t opcode)
+{
+	const struct compact_update_format *f;
+
+	for (f = compact_update_format; f->format; f++)
+		if (f->opcode == opcode)
+			return f;
+	return NULL;
+}
+
+void init_message_lengths(int length[256], uint32_t capabilities)
+{
+	int i;
+
+	/*
+	 * The generated sizes are sizes on the wire, so a change to a field
+	 * table changes the protocol.  test-packers checks the formats agree.
+	 */
+	BUILD_ASSERT(update_ship_packer_size == 129);
+	BUILD_ASSERT(sizeof(struct update_ship_packet) == update_ship_packer_size);
+	BUILD_ASSERT(update_econ_ship_packer_size == 44);
+	BUILD_ASSERT(update_asteroid_packer_size == 37);
+	BUILD_ASSERT(update_position_packer_size == 21);
+	BUILD_ASSERT(update_derelict_packer_size == 22);
+	BUILD_ASSERT(update_planet_packer_size == 42);
+	BUILD_ASSERT(update_starbase_packer_size == 37);
+	BUILD_ASSERT(update_nebula_packer_size == 65);
+	BUILD_ASSERT(update_explosion_packer_size == 28);
+	BUILD_ASSERT(update_torpedo_packer_size == 25);
+	BUILD_ASSERT(update_laser_packer_size == 42);
+	BUILD_ASSERT(update_laserbeam_packer_size == 17);
+	BUILD_ASSERT(update_docking_port_packer_size == 42);
+
+	for (i = 0; i < 256; i++)
+		length[i] = MESSAGE_LENGTH_UNKNOWN;
+
+#define FIXED(opcode, size) length[opcode] = (size)
+#define FORMAT(opcode, format) length[opcode] = calculate_buffer_size(format)
+	FIXED(OPCODE_UPDATE_SHIP, update_ship_packer_size - 1);
+	FIXED(OPCODE_UPDATE_SHIP2, update_ship_packer_size - 1);
+	FIXED(OPCODE_ECON_UPDATE_SHIP, update_econ_ship_packer_size - 1);
+	FIXED(OPCODE_UPDATE_ASTEROID, update_asteroid_packer_size - 1);
+	FIXED(OPCODE_UPDATE_CARGO_CONTAINER, update_position_packer_size - 1);
+	FIXED(OPCODE_UPDATE_WORMHOLE, update_position_packer_size - 1);
+	FIXED(OPCODE_UPDATE_DERELICT, update_derelict_packer_size - 1);
+	FIXED(OPCODE_UPDATE_PLANET, update_planet_packer_size - 1);
+	FIXED(OPCODE_UPDATE_STARBASE, update_starbase_packer_size - 1);
+	FIXED(OPCODE_UPDATE_NEBULA, update_nebula_packer_size - 1);
+	FIXED(OPCODE_UPDATE_EXPLOSION, update_explosion_packer_size - 1);
+	FIXED(OPCODE_UPDATE_TORPEDO, update_torpedo_packer_size - 1);
+	FIXED(OPCODE_UPDATE_LASER, update_laser_packer_size - 1);
+	FIXED(OPCODE_UPDATE_LASERBEAM, update_laserbeam_packer_size - 1);
+	FIXED(OPCODE_UPDATE_TRACTORBEAM, update_laserbeam_packer_size - 1);
+	FIXED(OPCODE_UPDATE_DOCKING_PORT, update_docking_port_packer_size - 1);
+	FIXED(OPCODE_UPDATE_POWER_DATA, sizeof(uint32_t) + sizeof(struct power_model_data));
+	FIXED(OPCODE_UPDATE_COOLANT_DATA, sizeof(uint32_t) + sizeof(struct power_model_data) +
+						sizeof(struct ship_damage_data));
+	FIXED(OPCODE_SHIP_SDATA, sizeof(struct ship_sdata_packet) - 1);
+	FIXED(OPCODE_UPDATE_DAMAGE, sizeof(struct ship_damage_packet) - 1);
+	FIXED(OPCODE_SILENT_UPDATE_DAMAGE, sizeof(struct ship_damage_packet) - 1);
+	FORMAT(OPCODE_UPDATE_ORIGIN, "www");
+	FORMAT(OPCODE_ID_CLIENT_SHIP, "w");
+	FORMAT(OPCODE_WARP_LIMBO, "h");
+	FORMAT(OPCODE_WORMHOLE_LIMBO, "h");
+	FORMAT(OPCODE_INITIATE_WARP, "b");
+	FORMAT(OPCODE_DELETE_OBJECT, "w");
+	FORMAT(OPCODE_PLAY_SOUND, "h");
+	FORMAT(OPCODE_ROLE_ONSCREEN, "b");
+	FORMAT(OPCODE_SCI_SELECT_TARGET, "w");
+	FORMAT(OPCODE_SCI_DETAILS, "b");
+	FORMAT(OPCODE_SCI_SELECT_COORDS, "SS");
+	FORMAT(OPCODE_UPDATE_RESPAWN_TIME, "b");
+	FORMAT(OPCODE_UPDATE_PLAYER, "");
+	FORMAT(OPCODE_ACK_PLAYER, "");
+	FORMAT(OPCODE_NOOP, "");
+	if (capabilities & SNIS_CAP_COMPRESSION_STATS)
+		FORMAT(OPCODE_UPDATE_NETSTATS, "qqwwwwwwwwqqq");
+	else
+		FORMAT(OPCODE_UPDATE_NETSTATS, "qqwwwwwwww");
+	FORMAT(OPCODE_DAMCON_OBJ_UPDATE, "wwwSSSRb");
+	FORMAT(OPCODE_DAMCON_SOCKET_UPDATE, "wwwSSwbb");
+	FORMAT(OPCODE_DAMCON_PART_UPDATE, "wwwSSRbbb");
+	FORMAT(OPCODE_MAINSCREEN_VIEW_MODE, "Rb");
+	FORMAT(OPCODE_UPDATE_SPACEMONSTER, "wwSSS");
+	FORMAT(OPCODE_REQUEST_REDALERT, "b");
+	FORMAT(OPCODE_COMMS_MAINSCREEN, "b");
+	FORMAT(OPCODE_PROXIMITY_ALERT, "");
+	FORMAT(OPCODE_ATMOSPHERIC_FRICTION, "");
+	FORMAT(OPCODE_COLLISION_NOTIFICATION, "");
+	FORMAT(OPCODE_CYCLE_MAINSCREEN_POINT_OF_VIEW, "b");
+	FORMAT(OPCODE_CYCLE_NAV_POINT_OF_VIEW, "b");
+	FORMAT(OPCODE_ADD_WARP_EFFECT, "wSSSSSS");
+	FORMAT(OPCODE_UPDATE_UNIVERSE_TIMESTAMP, "bwS");
+	FORMAT(OPCODE_DETONATE, "wSSSwU");
+	FIXED(OPCODE_UDP_CHANNEL, calculate_buffer_size(UDP_CHANNEL_PACKET_FORMAT) - 1);
+#undef FIXED
+#undef FORMAT
+	/* an econ ship update, then a variable number of patrol points */
+	length[OPCODE_ECON_UPDATE_SHIP_DEBUG_AI] = MESSAGE_LENGTH_VARIABLE;
+	length[OPCODE_UPDATE_DELTA] = MESSAGE_LENGTH_VARIABLE;
+	length[OPCODE_UPDATE_COMPACT] = MESSAGE_LENGTH_VARIABLE;
+	length[OPCODE_COMMS_TRANSMISSION] = MESSAGE_LENGTH_VARIABLE;
+	length[OPCODE_LOAD_SKYBOX] = MESSAGE_LENGTH_VARIABLE;
+}
+
+#ifdef TEST_PACKERS
+
+/* The generated sizes must agree with what the format interpreter thinks */
+#define CHECK_SIZE(name, FIELDS) \
+	if (calculate_buffer_size(FIELDS(PACKER_FORMAT)) != name##_size) { \
+		printf("FAIL: " #name " is %d bytes, format " #FIELDS " is %d\n", \
+			name##_size, calculate_buffer_size(FIELDS(PACKER_FORMAT))); \
+		return -1; \
+	}
+
+static int check_sizes(void)
+{
+	CHECK_SIZE(update_ship_packer, UPDATE_SHIP_FIELDS)
+	CHECK_SIZE(update_econ_ship_packer, UPDATE_ECON_SHIP_FIELDS)
+	CHECK_SIZE(update_asteroid_packer, UPDATE_ASTEROID_FIELDS)
+	CHECK_SIZE(update_position_packer, UPDATE_POSITION_FIELDS)
+	CHECK_SIZE(update_derelict_packer, UPDATE_DERELICT_FIELDS)
+	CHECK_SIZE(update_planet_packer, UPDATE_PLANET_FIELDS)
+	CHECK_SIZE(update_starbase_packer, UPDATE_STARBASE_FIELDS)
+	CHECK_SIZE(update_nebula_packer, UPDATE_NEBULA_FIELDS)
+	CHECK_SIZE(update_explosion_packer, UPDATE_EXPLOSION_FIELDS)
+	CHECK_SIZE(update_torpedo_packer, UPDATE_TORPEDO_FIELDS)
+	CHECK_SIZE(update_laser_packer, UPDATE_LASER_FIELDS)
+	CHECK_SIZE(update_laserbeam_packer, UPDATE_LASERBEAM_FIELDS)
+	CHECK_SIZE(update_docking_port_packer, UPDATE_DOCKING_PORT_FIELDS)
+	if (sizeof(struct update_ship_packet) != update_ship_packer_size) {
+		printf("FAIL: struct update_ship_packet doesn't match the fields\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* init_message_lengths() must agree with the formats the updates are compacted from */
+static int check_message_lengths(void)
+{
+	const struct compact_update_format *f;
+	int length[256];
+
+	init_message_lengths(length, 0);
+	for (f = compact_update_format; f->format; f++)
+		if (length[f->opcode] != calculate_buffer_size(f->format) - 1) {
+			printf("FAIL: message length of opcode %hhu is %d, format is %d\n",
+				f->opcode, length[f->opcode], calculate_buffer_size(f->format) - 1);
+			return -1;
+		}
+	return 0;
+}
+
+static int compare(const char *what, struct packed_buffer *a, struct packed_buffer *b)
+{
+	if (a->buffer_cursor != b->buffer_cursor ||
+		memcmp(a->buffer, b->buffer, a->buffer_cursor) != 0) {
+		printf("FAIL: %s differs from packed_buffer_append()\n", what);
+		return -1;
+	}
+	return 0;
+}
+
+/* The packers must produce exactly what packed_buffer_append() does */
+static int check_encoding(void)
+{
+	struct update_ship_packer_values s, s2;
+	struct update_nebula_packer_values n;
+	struct packed_buffer *a, *b;
+	int rc;
+
+	memset(&s, 0, sizeof(s));
+	s.opcode = OPCODE_UPDATE_SHIP;
+	s.id = 1234;
+	s.timestamp = 5678;
+	s.alive = 1;
+	s.x = 1000.5;
+	s.y = -2000.25;
+	s.z = 123456.0;
+	s.yaw_velocity = 0.1;
+	s.pitch_velocity = -0.2;
+	s.roll_velocity = 3.0;
+	s.torpedoes = 7;
+	s.power = 100000;
+	s.sci_heading = -M_PI;
+	s.fuel = 12345678;
+	s.temp = 200;
+	s.shiptype = 3;
+	s.victim_id = (uint32_t) -1;
+	quat_init_axis(&s.orientation, 0.0, 1.0, 0.0, 0.5);
+	quat_init_axis(&s.weap_orientation, 1.0, 0.0, 0.0, -0.5);
+	s.sciball_orientation = identity_quat;
+	s.docking_magnets = 1;
+
+	a = update_ship_packer_new(&s);
+	b = packed_buffer_new(UPDATE_SHIP_PACKET_FORMAT, s.opcode, s.id, s.timestamp, s.alive,
+			s.x, (int32_t) UNIVERSE_DIM, s.y, (int32_t) UNIVERSE_DIM,
+			s.z, (int32_t) UNIVERSE_DIM,
+			s.yaw_velocity, s.pitch_velocity, s.roll_velocity,
+			s.torpedoes, s.power, s.gun_yaw_velocity, s.sci_heading, s.sci_beam_width,
+			s.torpedoes_loading, s.throttle, s.rpm, s.fuel, s.temp,
+			s.scizoom, s.weapzoom, s.navzoom, s.mainzoom,
+			s.warpdrive, s.requested_warpdrive, s.requested_shield,
+			s.phaser_charge, s.phaser_wavelength, s.shiptype, s.reverse, s.trident,
+			s.victim_id, &s.orientation, &s.sciball_orientation, &s.weap_orientation,
+			s.in_secure_area, s.docking_magnets);
+	rc = compare("update_ship_packer", a, b);
+	update_ship_packer_unpack(a->buffer, &s2);
+	if (!rc && (s2.id != s.id || s2.victim_id != s.victim_id || s2.fuel != s.fuel ||
+		fabs(s2.x - s.x) > 0.01 || fabs(s2.sci_heading - s.sci_heading) > 0.01 ||
+		fabs(s2.orientation.v.y - s.orientation.v.y) > 0.0001)) {
+		printf("FAIL: update_ship_packer_unpack\n");
+		rc = -1;
+	}
+	packed_buffer_free(a);
+	packed_buffer_free(b);
+	if (rc)
+		return rc;
+
+	/* one with S fields not scaled by UNIVERSE_DIM */
+	memset(&n, 0, sizeof(n));
+	n.opcode = OPCODE_UPDATE_NEBULA;
+	n.id = 99;
+	n.x = -5.0;
+	n.r = 3000.0;
+	n.angular_velocity = identity_quat;
+	n.unrotated_orientation = identity_quat;
+	n.phase_angle = 45.0;
+	n.phase_speed = 0.5;
+	a = update_nebula_packer_new(&n);
+	b = packed_buffer_new(UPDATE_NEBULA_PACKET_FORMAT, n.opcode, n.id, n.timestamp,
+			n.x, (int32_t) UNIVERSE_DIM, n.y, (int32_t) UNIVERSE_DIM,
+			n.z, (int32_t) UNIVERSE_DIM, n.r, (int32_t) UNIVERSE_DIM,
+			&n.angular_velocity, &n.unrotated_orientation,
+			n.phase_angle, (int32_t) 360, n.phase_speed, (int32_t) 100);
+	rc = compare("update_nebula_packer", a, b);
+	packed_buffer_free(a);
+	packed_buffer_free(b);
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	if (check_sizes())
+		return 1;
+	if (check_message_lengths())
+		return 1;
+	if (check_encoding())
+		return 1;
+	return 0;
+}
+#endif
@@ -25,12 +25,14 @@
 #include <string.h>
 #include <sys/time.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <errno.h>
 #include <time.h>
@@ -41,6 +43,13 @@
 #else
 #include <netinet/tcp.h>
 #endif
+#if !defined(__APPLE__) && !defined(__FreeBSD__)
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#define HAVE_EPOLL 1
+#else
+#define HAVE_EPOLL 0
+#endif
 #include <stddef.h>
 #include <stdarg.h>
 #include <limits.h>
@@ -59,6 +68,7 @@
 #include "snis_ship_type.h"
 #include "snis_faction.h"
 #include "space-part.h"
+#include "snis_id_map.h"
 #include "quat.h"
 #include "arbitrary_spin.h"
 #include "snis.h"
@@ -84,6 +94,9 @@
 #include "docking_port.h"
 #include "build_info.h"
 #include "starbase_metadata.h"
+#include "snis_metrics.h"
+#include "snis_udp.h"
+#include "snis_tick_profile.h"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 #define CLIENT_UPDATE_PERIOD_NSECS 500000000
@@ -92,6 +105,7 @@
 static uint32_t mtwist_seed = COMMON_MTWIST_SEED;
 
 static int lua_enscript_enabled = 0;
+static char *record_prefix = NULL; /* --record, each client's stream goes to prefix.N */
 
 struct network_stats netstats;
 static int faction_population[5];
@@ -103,18 +117,85 @@ static struct docking_port_attachment_point **docking_port_info;
 static struct passenger_data passenger[MAX_PASSENGERS];
 static int npassengers;
 
-#define GATHER_OPCODE_STATS 0
+/* Traffic counters, always gathered, served if SNIS_SERVER_METRICS is set */
+#define TICK_DURATION_BUCKETS 8
+static const double tick_duration_bucket[TICK_DURATION_BUCKETS] = {
+	0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2,
+};
 
-#if GATHER_OPCODE_STATS
+enum server_metric {
+	METRIC_OPCODE_PACKETS = 0,
+	METRIC_OPCODE_BYTES = METRIC_OPCODE_PACKETS + 256,
+	METRIC_OPCODE_NOT_SENT = METRIC_OPCODE_BYTES + 256,
+	METRIC_CLIENT_PACKETS = METRIC_OPCODE_NOT_SENT + 256,
+	METRIC_CLIENT_BYTES = METRIC_CLIENT_PACKETS + MAXCLIENTS,
+	METRIC_CLIENT_BYTES_WRITTEN = METRIC_CLIENT_BYTES + MAXCLIENTS,
+	METRIC_CLIENT_COALESCED = METRIC_CLIENT_BYTES_WRITTEN + MAXCLIENTS,
+	METRIC_CLIENT_UDP_BYTES = METRIC_CLIENT_COALESCED + MAXCLIENTS,
+	METRIC_BRIDGE_PACKETS = METRIC_CLIENT_UDP_BYTES + MAXCLIENTS,
+	METRIC_BRIDGE_BYTES = METRIC_BRIDGE_PACKETS + MAXCLIENTS,
+	METRIC_CLIENTS_EVICTED = METRIC_BRIDGE_BYTES + MAXCLIENTS,
+	METRIC_TICKS,
+	METRIC_TICK_USEC,
+	METRIC_TICK_BUCKET,
+	NUM_SERVER_METRICS = METRIC_TICK_BUCKET + TICK_DURATION_BUCKETS,
+};
 
-static struct opcode_stat {
-	uint8_t opcode;
-	uint64_t count;
-	uint64_t bytes;
-	uint64_t count_not_sent;
-} write_opcode_stats[256];
+static struct snis_metrics *metrics;
+static uint64_t last_tick_usec;
+
+/* Where each tick's time goes, asked for from the demon screen */
+enum tick_profile_slot {
+	PROFILE_OBJTYPE = 0, /* + OBJTYPE_*, time spent in o->move() */
+	PROFILE_AI_MODE = PROFILE_OBJTYPE + OBJTYPE_DOCKING_PORT + 1, /* + AI_MODE_* */
+	PROFILE_DAMCON = PROFILE_AI_MODE + AI_MODE_MINING_BOT + 1,
+	PROFILE_LUA_TIMERS,
+	PROFILE_LUA_CALLBACKS,
+	PROFILE_LUA_COMMANDS,
+	PROFILE_TICK,
+	NUM_PROFILE_SLOTS,
+};
 
-#endif
+static const char *tick_profile_slot_name[NUM_PROFILE_SLOTS] = {
+	[PROFILE_OBJTYPE + OBJTYPE_SHIP1] = "player ship",
+	[PROFILE_OBJTYPE + OBJTYPE_SHIP2] = "npc ship",
+	[PROFILE_OBJTYPE + OBJTYPE_ASTEROID] = "asteroid",
+	[PROFILE_OBJTYPE + OBJTYPE_STARBASE] = "starbase",
+	[PROFILE_OBJTYPE + OBJTYPE_DEBRIS] = "debris",
+	[PROFILE_OBJTYPE + OBJTYPE_SPARK] = "spark",
+	[PROFILE_OBJTYPE + OBJTYPE_TORPEDO] = "torpedo",
+	[PROFILE_OBJTYPE + OBJTYPE_LASER] = "laser",
+	[PROFILE_OBJTYPE + OBJTYPE_EXPLOSION] = "explosion",
+	[PROFILE_OBJTYPE + OBJTYPE_NEBULA] = "nebula",
+	[PROFILE_OBJTYPE + OBJTYPE_WORMHOLE] = "wormhole",
+	[PROFILE_OBJTYPE + OBJTYPE_SPACEMONSTER] = "space monster",
+	[PROFILE_OBJTYPE + OBJTYPE_PLANET] = "planet",
+	[PROFILE_OBJTYPE + OBJTYPE_LASERBEAM] = "laserbeam",
+	[PROFILE_OBJTYPE + OBJTYPE_DERELICT] = "derelict",
+	[PROFILE_OBJTYPE + OBJTYPE_TRACTORBEAM] = "tractor beam",
+	[PROFILE_OBJTYPE + OBJTYPE_CARGO_CONTAINER] = "cargo container",
+	[PROFILE_OBJTYPE + OBJTYPE_WARP_EFFECT] = "warp effect",
+	[PROFILE_OBJTYPE + OBJTYPE_SHIELD_EFFECT] = "shield effect",
+	[PROFILE_OBJTYPE + OBJTYPE_DOCKING_PORT] = "docking port",
+	[PROFILE_AI_MODE + AI_MODE_IDLE] = "ai idle",
+	[PROFILE_AI_MODE + AI_MODE_ATTACK] = "ai attack",
+	[PROFILE_AI_MODE + AI_MODE_TRAVEL] = "ai travel",
+	[PROFILE_AI_MODE + AI_MODE_FLEE] = "ai flee",
+	[PROFILE_AI_MODE + AI_MODE_PATROL] = "ai patrol",
+	[PROFILE_AI_MODE + AI_MODE_FLEET_MEMBER] = "ai fleet member",
+	[PROFILE_AI_MODE + AI_MODE_FLEET_LEADER] = "ai fleet leader",
+	[PROFILE_AI_MODE + AI_MODE_HANGOUT] = "ai hangout",
+	[PROFILE_AI_MODE + AI_MODE_COP] = "ai cop",
+	[PROFILE_AI_MODE + AI_MODE_MINING_BOT] = "ai mining bot",
+	[PROFILE_DAMCON] = "damcon",
+	[PROFILE_LUA_TIMERS] = "lua timers",
+	[PROFILE_LUA_CALLBACKS] = "lua callbacks",
+	[PROFILE_LUA_COMMANDS] = "lua commands",
+	[PROFILE_TICK] = "whole tick",
+};
+
+static struct snis_tick_profile *tick_profile;
+static double tick_profile_log_interval; /* SNIS_SERVER_TICK_PROFILE_LOG, seconds */
 
 struct npc_bot_state;
 struct npc_menu_item;
@@ -219,11 +300,17 @@ static struct npc_menu_item mining_bot_main_menu[] = {
 
 struct snis_entity_client_info {
 	uint32_t last_timestamp_sent;
+	struct packed_buffer *baseline; /* last update sent, for delta encoding */
+	uint8_t deltas_since_baseline_sent;
+	uint16_t update_deferrals; /* times the update scheduler has put this off */
+	uint32_t last_sdata_sent; /* universe timestamp */
 };
 struct snis_damcon_entity_client_info {
 	unsigned int last_version_sent;
 };
 
+#define CLIENT_INPUT_BUFFER_SIZE (16 * 1024)
+
 struct game_client {
 	int socket;
 	pthread_t read_thread;
@@ -241,6 +328,33 @@ struct game_client {
 	struct snis_entity_client_info *go_clients; /* ptr to array of size MAXGAMEOBJS */
 	struct snis_damcon_entity_client_info *damcon_data_clients; /* ptr to array of size MAXDAMCONENTITIES */
 	uint8_t refcount; /* how many threads currently using this client structure. */
+	int event_loop; /* index of event loop servicing this client, or -1 if using threads */
+	struct packed_buffer_queue_entry *pending_write; /* partially written buffers, event loop mode only */
+	int pending_offset; /* bytes of pending_write->buffer already written */
+	int pollout_armed;
+	int delta_updates; /* client is sent OPCODE_UPDATE_DELTA */
+	int compact_updates; /* client is sent OPCODE_UPDATE_COMPACT */
+	int32_t update_origin[3]; /* as last sent with OPCODE_UPDATE_ORIGIN */
+	int update_origin_sent;
+	uint32_t bytes_queued; /* total bytes ever queued to this client */
+	struct update_candidate *candidate; /* scratch space for the update scheduler */
+	struct snis_socket_reader *input;
+	uint32_t capabilities; /* SNIS_CAP_*, as negotiated in verify_client_protocol() */
+	struct snis_deflater *deflater; /* if client negotiated SNIS_CAP_COMPRESSION */
+	struct snis_stream_recorder *recorder; /* if recording, with --record */
+	int write_queue_bytes; /* bytes in client_write_queue, under its mutex */
+	uint32_t write_queue_generation; /* bumped each time client_write_queue is emptied */
+	uint32_t update_origin_epoch; /* count of OPCODE_UPDATE_ORIGIN queued */
+	struct coalesce_slot *coalesce; /* latest queued update of objects, see coalesce_update() */
+	int evicted; /* disconnected for falling too far behind */
+	uint32_t udp_token; /* if client negotiated SNIS_CAP_UDP, its hellos carry this */
+	struct sockaddr_in udp_addr; /* where its hellos came from, once udp_addr_known */
+	int udp_addr_known;
+	unsigned char *udp_datagram; /* state updates waiting to go by UDP, under universe_mutex */
+	int udp_datagram_len;
+	int32_t udp_datagram_origin[3]; /* compact updates in udp_datagram are relative to this */
+	uint32_t udp_seq; /* of the last datagram sent */
+	uint8_t no_write_count;
 	int request_universe_timestamp;
 	char *build_info[2];
 #define COMPUTE_AVERAGE_TO_CLIENT_BUFFER_SIZE 0
@@ -270,7 +384,7 @@ struct bridge_data {
 	uint32_t science_selection;
 } bridgelist[MAXCLIENTS];
 int nbridges = 0;
-static pthread_mutex_t universe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t universe_mutex; /* recursive, see init_universe_mutex() */
 
 static pthread_mutex_t listener_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t listener_started;
@@ -310,6 +424,13 @@ static inline void client_unlock()
         (void) pthread_mutex_unlock(&client_mutex);
 }
 
+static void reset_client_object_info(struct snis_entity_client_info *info)
+{
+	if (info->baseline)
+		packed_buffer_free(info->baseline);
+	memset(info, 0, sizeof(*info));
+}
+
 /* remove a client from the client array.  Assumes universe and client
  * locks held.
  */
@@ -322,9 +443,38 @@ static void remove_client(int client_index)
 
 	c = &client[client_index];
 	if (c->go_clients) {
+		for (int i = 0; i < MAXGAMEOBJS; i++)
+			if (c->go_clients[i].baseline)
+				packed_buffer_free(c->go_clients[i].baseline);
 		free(c->go_clients);
 		c->go_clients = NULL;
 	}
+	if (c->candidate) {
+		free(c->candidate);
+		c->candidate = NULL;
+	}
+	if (c->input) {
+		snis_socket_reader_free(c->input);
+		c->input = NULL;
+	}
+	if (c->deflater) {
+		snis_deflater_free(c->deflater);
+		c->deflater = NULL;
+	}
+	if (c->recorder) {
+		snis_stream_recorder_free(c->recorder);
+		c->recorder = NULL;
+	}
+	if (c->coalesce) {
+		free(c->coalesce);
+		c->coalesce = NULL;
+	}
+	if (c->udp_datagram) {
+		free(c->udp_datagram);
+		c->udp_datagram = NULL;
+	}
+	c->udp_token = 0;
+	c->udp_addr_known = 0;
 	if (c->damcon_data_clients) {
 		free(c->damcon_data_clients);
 		c->damcon_data_clients = NULL;
@@ -551,7 +701,17 @@ struct timeval start_time, end_time;
 static struct snis_object_pool *pool;
 static struct snis_entity go[MAXGAMEOBJS];
 #define go_index(snis_entity_ptr) ((snis_entity_ptr) - &go[0])
+static struct snis_id_map *id_map; /* object id to index in go[] */
 static struct space_partition *space_partition = NULL;
+/*
+ * space_partition_process() visits everything within SPACE_PARTITION_NEIGHBORHOOD
+ * along each axis, which is what the old 2D grid's cells of 60000 guaranteed.
+ * Cells of 60000 are the quickest for the default universe in bench-space-part.c,
+ * and keep the server's ticks as quick as they were with the old grid.  Smaller
+ * cells only pay off when the universe is several times denser.
+ */
+#define SPACE_PARTITION_NEIGHBORHOOD (XKNOWN_DIM / 20.0)
+#define SPACE_PARTITION_CELL_SIZE (XKNOWN_DIM / 10.0)
 
 static uint32_t get_new_object_id(void)
 {
@@ -593,7 +753,7 @@ static void set_object_location(struct snis_entity *o, double x, double y, doubl
 	o->y = y;
 	o->z = z;
 	normalize_coords(o);
-	space_partition_update(space_partition, o, x, z);
+	space_partition_update(space_partition, o, o->x, o->y, o->z);
 } 
 
 static void get_peer_name(int connection, char *buffer)
@@ -700,7 +860,7 @@ static void derelict_move(struct snis_entity *o)
 		}
 		o->alive = 0; /* assume it is time to die and nobody's nearby */
 		/* check if anybody's nearby ... */
-		space_partition_process(space_partition, o, o->x, o->z, o,
+		space_partition_process(space_partition, o->x, o->y, o->z, o,
 					derelict_collision_detection);
 	}
 	if (!o->alive) {
@@ -743,12 +903,11 @@ static void wormhole_collision_detection(void *wormhole, void *object)
 
 static void wormhole_move(struct snis_entity *o)
 {
-	space_partition_process(space_partition, o, o->x, o->z, o,
+	space_partition_process(space_partition, o->x, o->y, o->z, o,
 				wormhole_collision_detection);
 }
 
-#if GATHER_OPCODE_STATS
-static void gather_opcode_stats(struct packed_buffer *pb)
+static void gather_opcode_stats(struct game_client *c, struct packed_buffer *pb)
 {
 	int length;
 	uint8_t opcode;
@@ -756,9 +915,14 @@ static void gather_opcode_stats(struct packed_buffer *pb)
 	/* assumption, first byte is opcode. */
 	memcpy(&opcode, pb->buffer, sizeof(opcode));
 	length = packed_buffer_length(pb);
-	write_opcode_stats[opcode].opcode = opcode;
-	write_opcode_stats[opcode].count++;
-	write_opcode_stats[opcode].bytes += (uint64_t) length;
+	snis_metrics_add(metrics, METRIC_OPCODE_PACKETS + opcode, 1);
+	snis_metrics_add(metrics, METRIC_OPCODE_BYTES + opcode, length);
+	snis_metrics_add(metrics, METRIC_CLIENT_PACKETS + client_index(c), 1);
+	snis_metrics_add(metrics, METRIC_CLIENT_BYTES + client_index(c), length);
+	if (c->bridge >= 0 && c->bridge < MAXCLIENTS) {
+		snis_metrics_add(metrics, METRIC_BRIDGE_PACKETS + c->bridge, 1);
+		snis_metrics_add(metrics, METRIC_BRIDGE_BYTES + c->bridge, length);
+	}
 }
 
 static void gather_opcode_not_sent_stats(struct snis_entity *o)
@@ -822,12 +986,135 @@ static void gather_opcode_not_sent_stats(struct snis_entity *o)
 	}
 	for (int i = 0; i < ARRAY_SIZE(opcode); i++)
 		if (opcode[i] > 0)
-			write_opcode_stats[opcode[i]].count_not_sent++;
+			snis_metrics_add(metrics, METRIC_OPCODE_NOT_SENT + opcode[i], 1);
+}
+
+/*
+ * Coalescing of superseded updates.  Once a client's write queue holds more
+ * than client_queue_high_water bytes (its socket has stalled, or it just
+ * can't keep up) an update for an object which already has an update of the
+ * same kind waiting in the queue takes the place of that one, so when the
+ * socket drains the client gets the latest state of each object rather than
+ * seconds of history.  Only updates carrying an object's whole state are
+ * coalesced; deletes, sounds, comms and the like keep their place, as do
+ * delta updates, which depend on the updates before them.  A compact update
+ * depends on the OPCODE_UPDATE_ORIGIN before it, so it only takes an older
+ * update's place if no new origin has been queued in between.  Queued
+ * buffers may be shared with other clients, so entries are repointed, the
+ * buffers themselves are never touched.  A client whose queue still grows
+ * past client_queue_limit bytes is disconnected.
+ */
+#define COALESCE_SLOTS 16384 /* enough for an update or two of every object */
+#define COALESCE_WAYS 4 /* slots an update may go in; if all are taken, one is forgotten */
+#define COALESCE_ALWAYS 1
+#define COALESCE_UNLESS_DELTA 2 /* full updates are delta baselines for delta clients */
+
+struct coalesce_slot {
+	struct packed_buffer_queue_entry *entry;
+	uint32_t generation; /* of the client's write queue when entry was queued */
+	uint32_t origin_epoch; /* OPCODE_UPDATE_ORIGINs queued before entry */
+	uint32_t id;
+	uint8_t opcode;
+};
+
+static uint32_t client_queue_high_water = 256 * 1024;
+static uint32_t client_queue_limit = 8 * 1024 * 1024;
+static uint8_t coalescable_update[256];
+
+/* Find the object and kind of update pb is, if it's one which may be coalesced */
+static int coalesce_key(struct game_client *c, struct packed_buffer *pb,
+			uint8_t *opcode, uint32_t *id, int *compact)
+{
+	struct packed_buffer view;
+
+	if (pb->buffer_cursor < 5)
+		return 0;
+	*compact = pb->buffer[0] == OPCODE_UPDATE_COMPACT;
+	if (*compact) {
+		*opcode = pb->buffer[2];
+		packed_buffer_init(&view, pb->buffer + 3, pb->buffer_cursor - 3);
+		if (packed_buffer_extract_varint(&view, id))
+			return 0;
+	} else {
+		*opcode = pb->buffer[0];
+		memcpy(id, pb->buffer + 1, sizeof(*id));
+	}
+	switch (coalescable_update[*opcode]) {
+	case COALESCE_ALWAYS:
+		return 1;
+	case COALESCE_UNLESS_DELTA:
+		return !c->delta_updates;
+	default:
+		return 0;
+	}
+}
+
+/* Queue pb, in place of an older queued update of the same object if there is
+ * one.  Returns 0, having done nothing, if pb isn't an update which may be
+ * coalesced.  Assumes the client's write queue mutex is held.
+ */
+static int coalesce_update(struct game_client *c, struct packed_buffer *pb)
+{
+	struct coalesce_slot *set, *slot = NULL;
+	struct packed_buffer *old;
+	uint32_t id;
+	uint8_t opcode;
+	int i, compact;
+
+	if (!coalesce_key(c, pb, &opcode, &id, &compact))
+		return 0;
+	if (!c->coalesce) {
+		c->coalesce = calloc(COALESCE_SLOTS, sizeof(*c->coalesce));
+		if (!c->coalesce)
+			return 0;
+	}
+	set = &c->coalesce[((id * 2654435761u) ^ opcode) % (COALESCE_SLOTS / COALESCE_WAYS)
+				* COALESCE_WAYS];
+	for (i = 0; i < COALESCE_WAYS; i++) {
+		if (!set[i].entry || set[i].generation != c->write_queue_generation) {
+			if (!slot)
+				slot = &set[i]; /* free */
+			continue;
+		}
+		if (set[i].id == id && set[i].opcode == opcode) {
+			slot = &set[i];
+			break;
+		}
+	}
+	if (!slot)
+		slot = &set[id % COALESCE_WAYS];
+	if (i < COALESCE_WAYS && (!compact || slot->origin_epoch == c->update_origin_epoch)) {
+		old = slot->entry->buffer;
+		c->write_queue_bytes += pb->buffer_cursor - old->buffer_cursor;
+		slot->entry->buffer = pb;
+		packed_buffer_free(old);
+		snis_metrics_add(metrics, METRIC_CLIENT_COALESCED + client_index(c), 1);
+		return 1;
+	}
+	/* Not queued, or queued where pb can't go; pb is the one to replace next time */
+	packed_buffer_queue_add(&c->client_write_queue, pb, NULL);
+	c->write_queue_bytes += pb->buffer_cursor;
+	slot->entry = c->client_write_queue.tail;
+	slot->generation = c->write_queue_generation;
+	slot->origin_epoch = c->update_origin_epoch;
+	slot->id = id;
+	slot->opcode = opcode;
+	return 1;
+}
+
+/* Disconnect a client which has fallen hopelessly behind.  The client's
+ * threads, or event loop, notice the socket has gone and clean up as usual.
+ * Assumes the client's write queue mutex is held.
+ */
+static void evict_client(struct game_client *c)
+{
+	c->evicted = 1;
+	snis_metrics_add(metrics, METRIC_CLIENTS_EVICTED, 1);
+	snis_log(SNIS_WARN, "evicting client %d, %d bytes waiting to be written\n",
+		(int) client_index(c), c->write_queue_bytes);
+	if (c->socket >= 0)
+		shutdown(c->socket, SHUT_RDWR);
 }
-#else
-#define gather_opcode_stats(x)
-#define gather_opcode_not_sent_stats(x)
-#endif
 
 static inline void pb_queue_to_client(struct game_client *c, struct packed_buffer *pb)
 {
@@ -836,8 +1123,24 @@ static inline void pb_queue_to_client(struct game_client *c, struct packed_buffe
 		stacktrace("snis_server: NULL packed_buffer in pb_queue_to_client()");
 		return;
 	}
-	gather_opcode_stats(pb);
-	packed_buffer_queue_add(&c->client_write_queue, pb, &c->client_write_queue_mutex);
+	gather_opcode_stats(c, pb);
+	__sync_fetch_and_add(&c->bytes_queued, pb->buffer_cursor);
+	pthread_mutex_lock(&c->client_write_queue_mutex);
+	if (c->evicted) {
+		pthread_mutex_unlock(&c->client_write_queue_mutex);
+		packed_buffer_free(pb);
+		return;
+	}
+	if (pb->buffer_cursor > 0 && pb->buffer[0] == OPCODE_UPDATE_ORIGIN)
+		c->update_origin_epoch++;
+	if (!client_queue_high_water || c->write_queue_bytes < client_queue_high_water ||
+		!coalesce_update(c, pb)) {
+		packed_buffer_queue_add(&c->client_write_queue, pb, NULL);
+		c->write_queue_bytes += pb->buffer_cursor;
+	}
+	if (client_queue_limit && c->write_queue_bytes > client_queue_limit)
+		evict_client(c);
+	pthread_mutex_unlock(&c->client_write_queue_mutex);
 }
 
 static inline void pb_prepend_queue_to_client(struct game_client *c, struct packed_buffer *pb)
@@ -847,8 +1150,25 @@ static inline void pb_prepend_queue_to_client(struct game_client *c, struct pack
 		stacktrace("snis_server: NULL packed_buffer in pb_prepend_queue_to_client()");
 		return;
 	}
-	gather_opcode_stats(pb);
-	packed_buffer_queue_prepend(&c->client_write_queue, pb, &c->client_write_queue_mutex);
+	gather_opcode_stats(c, pb);
+	__sync_fetch_and_add(&c->bytes_queued, pb->buffer_cursor);
+	pthread_mutex_lock(&c->client_write_queue_mutex);
+	packed_buffer_queue_prepend(&c->client_write_queue, pb, NULL);
+	c->write_queue_bytes += pb->buffer_cursor;
+	pthread_mutex_unlock(&c->client_write_queue_mutex);
+}
+
+/* Take everything queued for a client, to be written to its socket */
+static struct packed_buffer_queue_entry *detach_client_queue(struct game_client *c)
+{
+	struct packed_buffer_queue_entry *list;
+
+	pthread_mutex_lock(&c->client_write_queue_mutex);
+	list = packed_buffer_queue_detach(&c->client_write_queue, NULL);
+	c->write_queue_bytes = 0;
+	c->write_queue_generation++; /* so the coalescing slots forget these entries */
+	pthread_mutex_unlock(&c->client_write_queue_mutex);
+	return list;
 }
 
 static void queue_delete_oid(struct game_client *c, uint32_t oid)
@@ -891,10 +1211,13 @@ static void respawn_object(struct snis_entity *o)
 	return;
 }
 
+static void forget_encoded_updates(struct snis_entity *o);
 static void delete_object(struct snis_entity *o)
 {
 	remove_space_partition_entry(space_partition, &o->partition);
+	forget_encoded_updates(o);
 	snis_object_pool_free_object(pool, go_index(o));
+	snis_id_map_remove(id_map, o->id);
 	o->id = -1;
 	o->alive = 0;
 }
@@ -999,7 +1322,6 @@ static void send_packet_to_all_clients_on_a_bridge(uint32_t shipid, struct packe
 
 	client_lock();
 	for (i = 0; i < nclients; i++) {
-		struct packed_buffer *pbc;
 		struct game_client *c = &client[i];
 
 		if (!c->refcount)
@@ -1011,8 +1333,7 @@ static void send_packet_to_all_clients_on_a_bridge(uint32_t shipid, struct packe
 		if (!(c->role & roles))
 			continue;
 
-		pbc = packed_buffer_copy(pb);
-		pb_queue_to_client(c, pbc);
+		pb_queue_to_client(c, packed_buffer_get(pb));
 	}
 	packed_buffer_free(pb);
 	client_unlock();
@@ -1025,7 +1346,6 @@ static void send_packet_to_all_bridges_on_channel(uint32_t channel,
 
 	client_lock();
 	for (i = 0; i < nclients; i++) {
-		struct packed_buffer *pbc;
 		struct game_client *c = &client[i];
 
 		if (!c->refcount)
@@ -1037,8 +1357,7 @@ static void send_packet_to_all_bridges_on_channel(uint32_t channel,
 		if (bridgelist[c->bridge].comms_channel != channel)
 			continue;
 
-		pbc = packed_buffer_copy(pb);
-		pb_queue_to_client(c, pbc);
+		pb_queue_to_client(c, packed_buffer_get(pb));
 	}
 	packed_buffer_free(pb);
 	client_unlock();
@@ -1060,7 +1379,6 @@ static void send_packet_to_requestor_plus_role_on_a_bridge(struct game_client *r
 
 	client_lock();
 	for (i = 0; i < nclients; i++) {
-		struct packed_buffer *pbc;
 		struct game_client *c = &client[i];
 
 		if (!c->refcount)
@@ -1072,8 +1390,7 @@ static void send_packet_to_requestor_plus_role_on_a_bridge(struct game_client *r
 		if (!(c->role & roles) && c != requestor)
 			continue;
 
-		pbc = packed_buffer_copy(pb);
-		pb_queue_to_client(c, pbc);
+		pb_queue_to_client(c, packed_buffer_get(pb));
 	}
 	packed_buffer_free(pb);
 	client_unlock();
@@ -1623,6 +1940,8 @@ static int make_derelict(struct snis_entity *o)
 	return rc;
 }
 
+#define VICTIM_RANGE (XKNOWN_DIM / 10.0)
+
 struct potential_victim_info {
 	struct snis_entity *o;
 	double fightiness;
@@ -1655,7 +1974,7 @@ static void process_potential_victim(void *context, void *entity)
 		if (o->tsd.ship.ai[0].ai_mode != AI_MODE_COP) { /* I'm not a cop... */
 			if (v->tsd.ship.in_secure_area) /* already know secure? */
 				return;
-			space_partition_process(space_partition, v, v->x, v->z, v,
+			space_partition_process(space_partition, v->x, v->y, v->z, v,
 					ship_security_avoidance);
 			if (v->tsd.ship.in_secure_area) /* check again... */
 				return;
@@ -1665,9 +1984,6 @@ static void process_potential_victim(void *context, void *entity)
 	hostility = faction_hostility(o->sdata.faction, v->sdata.faction);
 	dist = dist3d(o->x - v->x, o->y - v->y, o->z - v->z);
 
-	if (dist > XKNOWN_DIM / 10.0) /* too far away */
-		return;
-
 	/* nearby friendlies reduce threat level */
 	if (o->sdata.faction == v->sdata.faction)
 		o->tsd.ship.threat_level -= 10000.0 / (dist + 1.0);
@@ -1697,8 +2013,8 @@ static int find_nearest_victim(struct snis_entity *o)
 	info.o = o;
 	o->tsd.ship.threat_level = 0.0;
 
-	space_partition_process(space_partition, o, o->x, o->z, &info,
-				process_potential_victim);
+	space_partition_process_in_sphere(space_partition, o->x, o->y, o->z,
+				VICTIM_RANGE, &info, process_potential_victim);
 	return info.victim_id;
 }
 
@@ -1932,7 +2248,7 @@ static void notify_the_cops(struct snis_entity *weapon)
 	if (perp_index < 0)
 		return;
 	perp = &go[perp_index];
-	space_partition_process(space_partition, perp, perp->x, perp->z, perp, notify_a_cop);
+	space_partition_process(space_partition, perp->x, perp->y, perp->z, perp, notify_a_cop);
 }
 
 static int projectile_collides(double x1, double y1, double z1,
@@ -2078,7 +2394,7 @@ static void torpedo_move(struct snis_entity *o)
 	}
 	o->timestamp = universe_timestamp;
 	set_object_location(o, o->x + o->vx, o->y + o->vy, o->z + o->vz);
-	space_partition_process(space_partition, o, o->x, o->z, o,
+	space_partition_process(space_partition, o->x, o->y, o->z, o,
 			torpedo_collision_detection);
 	if (!o->alive)
 		delete_from_clients_and_server(o);
@@ -2247,7 +2563,7 @@ static void laser_move(struct snis_entity *o)
 	}
 	o->timestamp = universe_timestamp;
 	set_object_location(o, o->x + o->vx, o->y + o->vy, o->z + o->vz);
-	space_partition_process(space_partition, o, o->x, o->z, o,
+	space_partition_process(space_partition, o->x, o->y, o->z, o,
 			laser_collision_detection);
 	if (!o->alive)
 		delete_from_clients_and_server(o);
@@ -2475,43 +2791,56 @@ static void check_for_nearby_targets(struct snis_entity *o)
 	}
 }
 
+struct planet_in_the_way_info {
+	union vec3 ray_origin, ray_direction;
+	float target_dist;
+	int blocked;
+};
+
+static void check_planet_in_the_way(void *context, void *entity)
+{
+	struct planet_in_the_way_info *info = context;
+	struct snis_entity *planet = entity;
+	union vec3 sphere_origin;
+	float planet_dist;
+
+	if (planet->type != OBJTYPE_PLANET || info->blocked)
+		return;
+	sphere_origin.v.x = planet->x;
+	sphere_origin.v.y = planet->y;
+	sphere_origin.v.z = planet->z;
+	if (!ray_intersects_sphere(&info->ray_origin, &info->ray_direction,
+					&sphere_origin, planet->tsd.planet.radius))
+		return;
+	planet_dist = dist3d(sphere_origin.v.x - info->ray_origin.v.x,
+				sphere_origin.v.y - info->ray_origin.v.y,
+				sphere_origin.v.z - info->ray_origin.v.z);
+	if (planet_dist < info->target_dist) /* planet blocks... */
+		info->blocked = 1;
+}
+
 /* check if a planet is in the way of a shot */
 static int planet_in_the_way(struct snis_entity *origin,
 				struct snis_entity *target)
 {
-	int i;
-	union vec3 ray_origin, ray_direction, sphere_origin;
-	const float radius = 800.0; /* FIXME: nuke this hardcoded crap */
-	float target_dist;
-	float planet_dist;
+	struct planet_in_the_way_info info;
 
-	ray_origin.v.x = origin->x;
-	ray_origin.v.y = origin->y;
-	ray_origin.v.z = origin->z;
+	info.ray_origin.v.x = origin->x;
+	info.ray_origin.v.y = origin->y;
+	info.ray_origin.v.z = origin->z;
 
-	ray_direction.v.x = target->x - ray_origin.v.x;
-	ray_direction.v.y = target->y - ray_origin.v.y;
-	ray_direction.v.z = target->z - ray_origin.v.z;
+	info.ray_direction.v.x = target->x - info.ray_origin.v.x;
+	info.ray_direction.v.y = target->y - info.ray_origin.v.y;
+	info.ray_direction.v.z = target->z - info.ray_origin.v.z;
 
-	target_dist = vec3_magnitude(&ray_direction);
-	vec3_normalize_self(&ray_direction);
+	info.target_dist = vec3_magnitude(&info.ray_direction);
+	vec3_normalize_self(&info.ray_direction);
+	info.blocked = 0;
 
-	for (i = 0; i <= snis_object_pool_highest_object(pool); i++) {
-		if (go[i].type != OBJTYPE_PLANET)
-			continue;
-		sphere_origin.v.x = go[i].x;
-		sphere_origin.v.y = go[i].y;
-		sphere_origin.v.z = go[i].z;
-		if (!ray_intersects_sphere(&ray_origin, &ray_direction,
-						&sphere_origin, radius))
-			continue;
-		planet_dist = dist3d(sphere_origin.v.x - ray_origin.v.x,
-					sphere_origin.v.y - ray_origin.v.y,
-					sphere_origin.v.z - ray_origin.v.z);
-		if (planet_dist < target_dist) /* planet blocks... */
-			return 1;
-	}
-	return 0; /* no planets blocking */
+	space_partition_process_segment(space_partition, origin->x, origin->y, origin->z,
+				target->x, target->y, target->z, MAX_PLANET_RADIUS,
+				&info, check_planet_in_the_way);
+	return info.blocked;
 }
 
 static float calculate_threat_level(struct snis_entity *o)
@@ -2542,7 +2871,7 @@ static void count_nearby_cops(void *context, void *entity)
 
 static int too_many_cops_around(struct snis_entity *o)
 {
-	space_partition_process(space_partition, o, o->x, o->z, o, count_nearby_cops);
+	space_partition_process(space_partition, o->x, o->y, o->z, o, count_nearby_cops);
 	return o->tsd.ship.in_secure_area;
 }
 
@@ -2796,7 +3125,7 @@ static void ai_flee_mode_brain(struct snis_entity *o)
 	info.friendly.v.x = 0.0;
 	info.friendly.v.y = 0.0;
 	info.friendly.v.z = 0.0;
-	space_partition_process(space_partition, o, o->x, o->z, &info,
+	space_partition_process(space_partition, o->x, o->y, o->z, &info,
 				compute_danger_vectors);
 	vec3_mul_self(&info.danger, 2.0);
 	vec3_add(&thataway, &info.danger, &info.friendly);
@@ -2863,23 +3192,33 @@ static void ai_fleet_member_mode_brain(struct snis_entity *o)
 	}
 }
 
-static int inside_planet(float x, float y, float z)
+struct inside_planet_info {
+	float x, y, z;
+	int inside;
+};
+
+static void check_inside_planet(void *context, void *entity)
 {
-	int i;
+	struct inside_planet_info *info = context;
+	struct snis_entity *o = entity;
 	float d2;
-	struct snis_entity *o;
 
-	for (i = 0; i <= snis_object_pool_highest_object(pool); i++) {
-		o = &go[i];
-		if (o->type == OBJTYPE_PLANET && o->alive) {
-			d2 =	(x - o->x) * (x - o->x) +
-				(y - o->y) * (y - o->y) +
-				(z - o->z) * (z - o->z);
-			if (d2 < (o->tsd.planet.radius * o->tsd.planet.radius) * 1.05)
-				return 1;
-		}
-	}
-	return 0;
+	if (o->type != OBJTYPE_PLANET || !o->alive)
+		return;
+	d2 =	(info->x - o->x) * (info->x - o->x) +
+		(info->y - o->y) * (info->y - o->y) +
+		(info->z - o->z) * (info->z - o->z);
+	if (d2 < (o->tsd.planet.radius * o->tsd.planet.radius) * 1.05)
+		info->inside = 1;
+}
+
+static int inside_planet(float x, float y, float z)
+{
+	struct inside_planet_info info = { x, y, z, 0 };
+
+	space_partition_process_in_sphere(space_partition, x, y, z,
+				MAX_PLANET_RADIUS * 1.05, &info, check_inside_planet);
+	return info.inside;
 }
 
 static void ai_add_ship_movement_variety(struct snis_entity *o,
@@ -2909,7 +3248,7 @@ static void ai_ship_warp_to(struct snis_entity *o, float destx, float desty, flo
 	v.v.y = desty - o->y;
 	v.v.z = destz - o->z;
 	vec3_mul_self(&v, 0.90 + 0.05 * (float) snis_randn(100) / 100.0);
-	if (!inside_planet(v.v.x, v.v.y, v.v.z)) {
+	if (!inside_planet(o->x + v.v.x, o->y + v.v.y, o->z + v.v.z)) {
 		add_warp_effect(o->id, o->x, o->y, o->z,
 			o->x + v.v.x, o->y + v.v.y, o->z + v.v.z);
 		set_object_location(o, o->x + v.v.x, o->y + v.v.y, o->z + v.v.z);
@@ -3141,9 +3480,7 @@ static void ai_mining_mode_land_on_asteroid(struct snis_entity *o, struct ai_min
 	dy = asteroid->y + offset.v.y - o->y;
 	dz = asteroid->z + offset.v.z - o->z;
 
-	o->x += 0.1 * dx;
-	o->y += 0.1 * dy;
-	o->z += 0.1 * dz;
+	set_object_location(o, o->x + 0.1 * dx, o->y + 0.1 * dy, o->z + 0.1 * dz);
 
 	quat_slerp(&new_orientation, &o->orientation, &asteroid->orientation, slerp_rate);
 	o->orientation = new_orientation;
@@ -3205,9 +3542,7 @@ static void ai_mining_mode_mine_asteroid(struct snis_entity *o, struct ai_mining
 	dy = asteroid->y + offset.v.y - o->y;
 	dz = asteroid->z + offset.v.z - o->z;
 
-	o->x += 0.1 * dx;
-	o->y += 0.1 * dy;
-	o->z += 0.1 * dz;
+	set_object_location(o, o->x + 0.1 * dx, o->y + 0.1 * dy, o->z + 0.1 * dz);
 
 	quat_slerp(&new_orientation, &o->orientation, &asteroid->orientation, slerp_rate);
 	o->orientation = new_orientation;
@@ -3356,7 +3691,8 @@ static void maybe_leave_fleet(struct snis_entity *o)
 
 static void ai_brain(struct snis_entity *o)
 {
-	int n;
+	int n, ai_mode;
+	uint64_t start;
 
 	n = o->tsd.ship.nai_entries - 1;
 	if (n < 0) {
@@ -3365,7 +3701,9 @@ static void ai_brain(struct snis_entity *o)
 	}
 		
 	/* main AI brain code is here... */
-	switch (o->tsd.ship.ai[n].ai_mode) {
+	start = snis_tick_profile_clock();
+	ai_mode = o->tsd.ship.ai[n].ai_mode;
+	switch (ai_mode) {
 	case AI_MODE_ATTACK:
 		ai_attack_mode_brain(o);
 		break;
@@ -3393,7 +3731,7 @@ static void ai_brain(struct snis_entity *o)
 		o->tsd.ship.ai[n].u.hangout.time_to_go--;
 		if (o->tsd.ship.ai[n].u.hangout.time_to_go <= 0) {
 			pop_ai_stack(o);
-			return;
+			break;
 		}
 		o->vx *= 0.8;
 		o->vy *= 0.8;
@@ -3407,6 +3745,7 @@ static void ai_brain(struct snis_entity *o)
 	default:
 		break;
 	}
+	snis_tick_profile_add(tick_profile, PROFILE_AI_MODE + ai_mode, snis_tick_profile_clock() - start);
 }
 
 static void ship_security_avoidance(void *context, void *entity)
@@ -3526,7 +3865,7 @@ static void ship_move(struct snis_entity *o)
 
 	/* Check if we are in a secure area */
 	o->tsd.ship.in_secure_area = 0;
-	space_partition_process(space_partition, o, o->x, o->z, o, ship_security_avoidance);
+	space_partition_process(space_partition, o->x, o->y, o->z, o, ship_security_avoidance);
 	ai_brain(o);
 
 	/* try to avoid collisions by computing steering and braking adjustments */
@@ -3537,7 +3876,7 @@ static void ship_move(struct snis_entity *o)
 		ca.worrythreshold = 150.0 * 150.0;
 	else
 		ca.worrythreshold = 400.0 * 400.0;
-	space_partition_process(space_partition, o, o->x, o->z, &ca, ship_collision_avoidance);
+	space_partition_process(space_partition, o->x, o->y, o->z, &ca, ship_collision_avoidance);
 	if (!o->alive) {
 		(void) add_explosion(o->x, o->y, o->z, 50, 150, 50, o->type);
 		respawn_object(o);
@@ -4542,7 +4881,7 @@ static void update_player_position_and_velocity(struct snis_entity *o)
 
 	previous_security = o->tsd.ship.in_secure_area;
 	o->tsd.ship.in_secure_area = 0;  /* player_collision_detection fills this in. */
-	space_partition_process(space_partition, o, o->x, o->z, o,
+	space_partition_process(space_partition, o->x, o->y, o->z, o,
 				player_collision_detection);
 	if (o->tsd.ship.in_secure_area == 0 && previous_security > 0)
 		snis_queue_add_sound(LEAVING_SECURE_AREA, ROLE_SOUNDSERVER, o->id);
@@ -5073,6 +5412,7 @@ static int add_generic_object(double x, double y, double z,
 		return -1;
 	memset(&go[i], 0, sizeof(go[i]));
 	go[i].id = get_new_object_id();
+	snis_id_map_add(id_map, go[i].id, i);
 	go[i].alive = 1;
 	set_object_location(&go[i], x, y, z);
 	go[i].vx = vx;
@@ -5086,8 +5426,7 @@ static int add_generic_object(double x, double y, double z,
 	/* clear out the client update state */
 	for (j = 0; j < nclients; j++)
 		if (client[j].refcount)
-			/* gcc produces identical code for this memset as for a straight assignment */
-			memset(&client[j].go_clients[i], 0, sizeof(client[j].go_clients[i]));
+			reset_client_object_info(&client[j].go_clients[i]);
 
 	switch (type) {
 	case OBJTYPE_SHIP1:
@@ -5605,9 +5944,7 @@ static int add_mining_bot(struct snis_entity *parent_ship, uint32_t asteroid_id)
 	strncpy(o->sdata.name, parent_ship->tsd.ship.mining_bot_name, sizeof(o->sdata.name));
 
 	/* TODO make this better: */
-	go[rc].x = parent_ship->x + 30;
-	go[rc].y = parent_ship->y + 30;
-	go[rc].z = parent_ship->z + 30;
+	set_object_location(&go[rc], parent_ship->x + 30, parent_ship->y + 30, parent_ship->z + 30);
 
 	return rc;
 }
@@ -6194,12 +6531,7 @@ static int add_explosion(double x, double y, double z, uint16_t velocity,
 /* must hold universe mutex */
 static int lookup_by_id(uint32_t id)
 {
-	int i;
-
-	for (i = 0; i <= snis_object_pool_highest_object(pool); i++)
-		if (go[i].id == id)
-			return i;
-	return -1;
+	return snis_id_map_lookup(id_map, id);
 }
 
 static int lookup_by_damcon_id(struct damcon_data *d, int id) 
@@ -6711,9 +7043,10 @@ static int add_planet(double x, double y, double z, float radius, uint8_t securi
 		return i;
 	if (fabsl(y) < 0.01) {
 		if (snis_randn(100) < 50)
-			go[i].y = (double) snis_randn(3000) - 1500;
+			y = (double) snis_randn(3000) - 1500;
 		else
-			go[i].y = (double) snis_randn(70) - 35;
+			y = (double) snis_randn(70) - 35;
+		set_object_location(&go[i], x, y, z);
 	}
 	go[i].sdata.shield_strength = 0;
 	go[i].sdata.shield_wavelength = 0;
@@ -6771,30 +7104,25 @@ static int l_add_planet(lua_State *l)
 	return 1;
 }
 
-static int too_close_to_other_planet_or_sun(double x, double y, double z, double limit)
+static int is_planet(void *context, void *entity)
 {
-	int i;
-	double mindist = -1.0;
-	double dist;
+	struct snis_entity *o = entity;
 
-	for (i = 0; i <= snis_object_pool_highest_object(pool); i++) {
-		struct snis_entity *o = &go[i];
-		if (o->type != OBJTYPE_PLANET)
-			continue;
-		dist = dist3d(o->x - x, o->y - y, o->z - z);
-		if (mindist < 0 || dist < mindist)
-			mindist = dist;
-	}
+	return o->type == OBJTYPE_PLANET;
+}
+
+static int too_close_to_other_planet_or_sun(double x, double y, double z, double limit)
+{
+	void *planet;
+	double dist, dist2;
 
 	dist = dist3d(x - SUNX, y - SUNY, z - SUNZ);
 	if (dist < SUN_DIST_LIMIT) /* Too close to sun? */
 		return 1;
 
-	if (mindist < 0)
-		return 0;
-	if (mindist > limit)
-		return 0;
-	return 1;
+	/* Is there a planet within limit? */
+	return space_partition_nearest(space_partition, x, y, z, limit, 1,
+					is_planet, NULL, &planet, &dist2);
 }
 
 static void add_planets(void)
@@ -7010,6 +7338,7 @@ static void make_universe(void)
 	initialize_random_orientations_and_spins(COMMON_MTWIST_SEED);
 	pthread_mutex_lock(&universe_mutex);
 	snis_object_pool_setup(&pool, MAXGAMEOBJS);
+	id_map = snis_id_map_new(MAXGAMEOBJS);
 
 	add_nebulae(); /* do nebula first */
 	add_asteroids();
@@ -7351,7 +7680,7 @@ static int read_and_unpack_buffer(struct game_client *c, unsigned char *buffer,
         struct packed_buffer pb;
         int rc, size = calculate_buffer_size(format);
 
-	rc = snis_readsocket(c->socket, buffer, size);
+	rc = snis_socket_reader_read(c->input, buffer, size);
 	if (rc != 0)
 		return rc;
         packed_buffer_init(&pb, buffer, size);
@@ -7484,17 +7813,7 @@ static void pack_and_send_ship_sdata_packet(struct game_client *c, struct snis_e
 		p.lifeform_count = o->tsd.starbase.lifeform_count;
 	else
 		p.lifeform_count = 0;
-	pthread_mutex_unlock(&universe_mutex);
 	send_ship_sdata_packet(c, &p);
-	pthread_mutex_lock(&universe_mutex);
-}
-
-static int save_sdata_bandwidth(void)
-{
-	/* TODO: something clever here. */
-	if (snis_randn(100) > 25)
-		return 1;
-	return 0;
 }
 
 static int should_send_sdata(struct game_client *c, struct snis_entity *ship,
@@ -7567,31 +7886,34 @@ static int should_send_sdata(struct game_client *c, struct snis_entity *ship,
 	return in_beam;
 }
 
-static void send_update_sdata_packets(struct game_client *c, struct snis_entity *o)
+/* Returns true if client c, on ship, should be sent the sdata of o.
+ * Assumes universe mutex held.
+ */
+static int sdata_wanted(struct game_client *c, struct snis_entity *ship, struct snis_entity *o)
 {
-	struct snis_entity *ship;
-	int i;
-
-	/* Assume universe mutex held. */
-	if (!o->alive)
-		return;
-	i = lookup_by_id(c->shipid);
-	if (i < 0)
-		return;
-	ship = &go[i];
-	if (save_sdata_bandwidth()) {
-#if GATHER_OPCODE_STATS
-		write_opcode_stats[OPCODE_SHIP_SDATA].count_not_sent++;
-#endif
-		return;
+	switch (o->type) {
+	case OBJTYPE_SHIP1:
+	case OBJTYPE_SHIP2:
+	case OBJTYPE_ASTEROID:
+	case OBJTYPE_CARGO_CONTAINER:
+	case OBJTYPE_DERELICT:
+	case OBJTYPE_PLANET:
+	case OBJTYPE_WORMHOLE:
+	case OBJTYPE_STARBASE:
+	case OBJTYPE_TORPEDO:
+	case OBJTYPE_LASER:
+	case OBJTYPE_SPACEMONSTER:
+		break;
+	default:
+		return 0;
 	}
+	if (!o->alive)
+		return 0;
 	if (!should_send_sdata(c, ship, o)) {
-#if GATHER_OPCODE_STATS
-		write_opcode_stats[OPCODE_SHIP_SDATA].count_not_sent++;
-#endif
-		return;
+		snis_metrics_add(metrics, METRIC_OPCODE_NOT_SENT + OPCODE_SHIP_SDATA, 1);
+		return 0;
 	}
-	pack_and_send_ship_sdata_packet(c, o);
+	return 1;
 }
 
 static int process_role_onscreen(struct game_client *c)
@@ -9148,7 +9470,7 @@ static int process_comms_transmission(struct game_client *c, int use_real_name)
 	rc = read_and_unpack_buffer(c, buffer, "bw", &len, &id);
 	if (rc)
 		return rc;
-	rc = snis_readsocket(c->socket, txt, len);
+	rc = snis_socket_reader_read(c->input, txt, len);
 	if (rc)
 		return rc;
 	txt[len] = '\0';
@@ -9340,7 +9662,7 @@ static int process_enscript_command(struct game_client *c)
 	rc = read_and_unpack_buffer(c, buffer, "b", &len);
 	if (rc)
 		return rc;
-	rc = snis_readsocket(c->socket, txt, len);
+	rc = snis_socket_reader_read(c->input, txt, len);
 	if (rc)
 		return rc;
 	txt[len] = '\0';
@@ -9381,7 +9703,7 @@ static int process_exec_lua_script(struct game_client *c)
 	rc = read_and_unpack_buffer(c, buffer, "b", &len);
 	if (rc)
 		return rc;
-	rc = snis_readsocket(c->socket, txt, len);
+	rc = snis_socket_reader_read(c->input, txt, len);
 	if (rc)
 		return rc;
 	txt[len] = '\0';
@@ -9394,6 +9716,7 @@ static int process_exec_lua_script(struct game_client *c)
 	return 0;
 }
 
+/* Must be called with universe_mutex held */
 static void update_command_data(uint32_t id, struct command_data *cmd_data)
 {
 	struct snis_entity *o;
@@ -9423,7 +9746,6 @@ static void update_command_data(uint32_t id, struct command_data *cmd_data)
 	}
 
 out:
-	pthread_mutex_unlock(&universe_mutex);
 	return;
 }
 
@@ -9962,25 +10284,22 @@ static int process_comms_mainscreen(struct game_client *c)
 
 static int process_demon_command(struct game_client *c)
 {
-	unsigned char buffer[sizeof(struct demon_cmd_packet) + 255 * sizeof(uint32_t)];
+	const int hdrlen = 11; /* "bwwbb", as the client packs it */
+	unsigned char buffer[11 + 2 * 255 * sizeof(uint32_t)];
 	struct packed_buffer pb;
 	int i, rc;
 	uint32_t ix, iz;
-	int offset;
 	struct command_data cmd_data;
 	uint32_t id1[255];
 	uint32_t id2[255];
 	uint8_t nids1, nids2;
 
-	offset = offsetof(struct demon_cmd_packet, id) - sizeof(uint8_t);
-
-	rc = snis_readsocket(c->socket, buffer,
-		sizeof(struct demon_cmd_packet) - sizeof(uint32_t) - sizeof(uint8_t));
+	rc = snis_socket_reader_read(c->input, buffer, hdrlen);
 	if (rc)
 		return rc;
 	packed_buffer_init(&pb, buffer, sizeof(buffer));
 	packed_buffer_extract(&pb, "bwwbb", &cmd_data.command, &ix, &iz, &nids1, &nids2);
-	rc = snis_readsocket(c->socket, buffer + offset, (nids1 + nids2) * sizeof(uint32_t));
+	rc = snis_socket_reader_read(c->input, buffer + hdrlen, (nids1 + nids2) * sizeof(uint32_t));
 	if (rc)
 		return rc;
 
@@ -10009,8 +10328,10 @@ static int process_demon_command(struct game_client *c)
 	cmd_data.nids1 = nids1;
 	cmd_data.nids2 = nids2;
 
+	pthread_mutex_lock(&universe_mutex);
 	for (i = 0; i < nids1; i++)
 		update_command_data(id1[i], &cmd_data);
+	pthread_mutex_unlock(&universe_mutex);
 	
 	return 0;
 }
@@ -10058,7 +10379,7 @@ static int process_build_info(struct game_client *c)
 		return rc;
 	if (x != 0 && x != 1)
 		return -1;
-	rc = snis_readsocket(c->socket, data, buflen);
+	rc = snis_socket_reader_read(c->input, data, buflen);
 	if (rc != 0)
 		return rc;
 	data[255] = '\0';
@@ -10074,6 +10395,43 @@ static int process_toggle_demon_safe_mode(void)
 	return 0;
 }
 
+static void log_tick_profile(void);
+static int process_request_tick_profile(struct game_client *c)
+{
+	struct snis_tick_profile_stats st[NUM_PROFILE_SLOTS];
+	struct packed_buffer *pb;
+	int i, n = 0, size = 2;
+
+	log_tick_profile();
+	for (i = 0; i < NUM_PROFILE_SLOTS; i++) {
+		if (!tick_profile_slot_name[i]) {
+			st[i].calls = 0;
+			continue;
+		}
+		snis_tick_profile_stats(tick_profile, i, &st[i]);
+		if (!st[i].calls)
+			continue;
+		n++;
+		size += 1 + strlen(tick_profile_slot_name[i]) +
+			calculate_buffer_size(TICK_PROFILE_ENTRY_FORMAT);
+	}
+	pb = packed_buffer_allocate(size);
+	packed_buffer_append(pb, TICK_PROFILE_PACKET_FORMAT, OPCODE_TICK_PROFILE, (uint8_t) n);
+	for (i = 0; i < NUM_PROFILE_SLOTS; i++) {
+		if (!st[i].calls)
+			continue;
+		packed_buffer_append(pb, "b", (uint8_t) strlen(tick_profile_slot_name[i]));
+		packed_buffer_append_raw(pb, tick_profile_slot_name[i],
+					strlen(tick_profile_slot_name[i]));
+		packed_buffer_append(pb, TICK_PROFILE_ENTRY_FORMAT,
+			(uint32_t) st[i].window_calls, (uint32_t) (st[i].window_ns / 1000),
+			(uint32_t) (st[i].window_max_ns / 1000), (uint32_t) (st[i].p50_ns / 1000),
+			(uint32_t) (st[i].p90_ns / 1000), (uint32_t) (st[i].p99_ns / 1000));
+	}
+	pb_queue_to_client(c, pb);
+	return 0;
+}
+
 static int l_clear_all(__attribute__((unused)) lua_State *l)
 {
 	process_demon_clear_all();
@@ -10881,14 +11239,180 @@ out:
 	return 0;
 }
 
-static void process_instructions_from_client(struct game_client *c)
+/* Formats of the requests clients may send us, less the opcode byte.
+ * Those marked REQUEST_VARIABLE_LENGTH carry a length in a header, see
+ * variable_request_length().  Opcodes not listed are protocol errors.
+ */
+#define REQUEST_VARIABLE_LENGTH "*"
+static const char *request_format[256] = {
+	[OPCODE_NOOP] = "",
+	[OPCODE_REQUEST_TORPEDO] = "",
+	[OPCODE_REQUEST_TRACTORBEAM] = "w",
+	[OPCODE_REQUEST_MINING_BOT] = "w",
+	[OPCODE_DEMON_FIRE_TORPEDO] = "w",
+	[OPCODE_DEMON_POSSESS] = "w",
+	[OPCODE_DEMON_DISPOSSESS] = "w",
+	[OPCODE_REQUEST_LASER] = "",
+	[OPCODE_REQUEST_MANUAL_LASER] = "",
+	[OPCODE_DEMON_FIRE_PHASER] = "w",
+	[OPCODE_LOAD_TORPEDO] = "",
+	[OPCODE_REQUEST_YAW] = "b",
+	[OPCODE_REQUEST_PITCH] = "b",
+	[OPCODE_REQUEST_ROLL] = "b",
+	[OPCODE_REQUEST_SCIBALL_YAW] = "b",
+	[OPCODE_REQUEST_SCIBALL_PITCH] = "b",
+	[OPCODE_REQUEST_SCIBALL_ROLL] = "b",
+	[OPCODE_DEMON_YAW] = "wb",
+	[OPCODE_REQUEST_THROTTLE] = "wb",
+	[OPCODE_REQUEST_WARPDRIVE] = "wb",
+	[OPCODE_REQUEST_SHIELD] = "wb",
+	[OPCODE_ENGAGE_WARP] = "wb",
+	[OPCODE_DOCKING_MAGNETS] = "wb",
+	[OPCODE_REQUEST_LASER_WAVELENGTH] = "wb",
+	[OPCODE_REQUEST_MANEUVERING_PWR] = "wb",
+	[OPCODE_REQUEST_TRACTOR_PWR] = "wb",
+	[OPCODE_REQUEST_WARP_PWR] = "wb",
+	[OPCODE_REQUEST_IMPULSE_PWR] = "wb",
+	[OPCODE_REQUEST_SHIELDS_PWR] = "wb",
+	[OPCODE_REQUEST_SENSORS_PWR] = "wb",
+	[OPCODE_REQUEST_COMMS_PWR] = "wb",
+	[OPCODE_REQUEST_PHASERBANKS_PWR] = "wb",
+	[OPCODE_REQUEST_MANEUVERING_COOLANT] = "wb",
+	[OPCODE_REQUEST_TRACTOR_COOLANT] = "wb",
+	[OPCODE_REQUEST_WARP_COOLANT] = "wb",
+	[OPCODE_REQUEST_IMPULSE_COOLANT] = "wb",
+	[OPCODE_REQUEST_SHIELDS_COOLANT] = "wb",
+	[OPCODE_REQUEST_SENSORS_COOLANT] = "wb",
+	[OPCODE_REQUEST_COMMS_COOLANT] = "wb",
+	[OPCODE_REQUEST_PHASERBANKS_COOLANT] = "wb",
+	[OPCODE_REQUEST_GUNYAW] = "b",
+	[OPCODE_REQUEST_MANUAL_GUNYAW] = "b",
+	[OPCODE_REQUEST_MANUAL_GUNPITCH] = "b",
+	[OPCODE_REQUEST_SCIYAW] = "b",
+	[OPCODE_REQUEST_ROBOT_YAW] = "b",
+	[OPCODE_REQUEST_SCIZOOM] = "wb",
+	[OPCODE_REQUEST_NAVZOOM] = "wb",
+	[OPCODE_REQUEST_MAINZOOM] = "wb",
+	[OPCODE_REQUEST_WEAPZOOM] = "wb",
+	[OPCODE_REQUEST_SCIBEAMWIDTH] = "b",
+	[OPCODE_REQUEST_REVERSE] = "wb",
+	[OPCODE_NAV_TRIDENT_MODE] = "wb",
+	[OPCODE_DEMON_THRUST] = "wb",
+	[OPCODE_REQUEST_ROBOT_THRUST] = "b",
+	[OPCODE_DEMON_MOVE_OBJECT] = "wSS",
+	[OPCODE_ROLE_ONSCREEN] = "b",
+	[OPCODE_SCI_SELECT_TARGET] = "w",
+	[OPCODE_SCI_DETAILS] = "b",
+	[OPCODE_SCI_ALIGN_TO_SHIP] = "",
+	[OPCODE_REQUEST_WEAPONS_YAW_PITCH] = "RR",
+	[OPCODE_WEAP_SELECT_TARGET] = "w",
+	[OPCODE_SCI_SELECT_COORDS] = "ww",
+	[OPCODE_COMMS_TRANSMISSION] = REQUEST_VARIABLE_LENGTH,
+	[OPCODE_DEMON_COMMS_XMIT] = REQUEST_VARIABLE_LENGTH,
+	[OPCODE_DEMON_COMMAND] = REQUEST_VARIABLE_LENGTH,
+	[OPCODE_REQUEST_ROBOT_GRIPPER] = "",
+	[OPCODE_MAINSCREEN_VIEW_MODE] = "Rb",
+	[OPCODE_REQUEST_REDALERT] = "b",
+	[OPCODE_COMMS_MAINSCREEN] = "b",
+	[OPCODE_CREATE_ITEM] = "bSS",
+	[OPCODE_DELETE_OBJECT] = "w",
+	[OPCODE_DEMON_CLEAR_ALL] = "",
+	[OPCODE_TOGGLE_DEMON_AI_DEBUG_MODE] = "",
+	[OPCODE_TOGGLE_DEMON_SAFE_MODE] = "",
+	[OPCODE_REQUEST_TICK_PROFILE] = "",
+	[OPCODE_EXEC_LUA_SCRIPT] = REQUEST_VARIABLE_LENGTH,
+	[OPCODE_ENSCRIPT] = REQUEST_VARIABLE_LENGTH,
+	[OPCODE_ROBOT_AUTO_MANUAL] = "b",
+	[OPCODE_CYCLE_MAINSCREEN_POINT_OF_VIEW] = "b",
+	[OPCODE_CYCLE_NAV_POINT_OF_VIEW] = "b",
+	[OPCODE_REQUEST_UNIVERSE_TIMESTAMP] = "",
+	[OPCODE_UPDATE_BUILD_INFO] = REQUEST_VARIABLE_LENGTH,
+};
+
+/* Length of each request including the opcode, -1 if variable, 0 if invalid */
+static int request_length[256];
+
+/* The universe mutex is recursive, so that a batch of client requests can be
+ * processed under a single acquisition even though each request handler
+ * takes the mutex itself, see process_instructions_from_client().
+ *
+ * The batch is the only place the mutex is ever held more than once, and
+ * nothing called from it drops the mutex to let other threads in, since such
+ * an unlock would then quietly do nothing.  The places that do drop it for a
+ * while (process_lua_commands(), service_connection() and the batch itself,
+ * around variable length requests) are only ever called without it held.
+ * Keep it that way: code called with the mutex held must not unlock it.
+ */
+static void init_universe_mutex(void)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&universe_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void init_request_lengths(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(request_format); i++) {
+		if (!request_format[i])
+			request_length[i] = 0;
+		else if (strcmp(request_format[i], REQUEST_VARIABLE_LENGTH) == 0)
+			request_length[i] = -1;
+		else
+			request_length[i] = 1 + calculate_buffer_size((char *) request_format[i]);
+	}
+}
+
+/* Length, including the opcode, of the variable length request at the
+ * front of c's input, going by its header.  Returns 0 if the header hasn't
+ * all arrived yet, or -1 if the request is invalid.
+ */
+static int variable_request_length(struct game_client *c, uint8_t opcode)
+{
+	unsigned char hdr[1 + 11]; /* opcode and the longest header, see below */
+	uint32_t len;
+
+	switch (opcode) {
+	case OPCODE_COMMS_TRANSMISSION:
+	case OPCODE_DEMON_COMMS_XMIT: /* "bw", length and id, then the text */
+		if (snis_socket_reader_peek(c->input, hdr, 1 + 5))
+			return 0;
+		return 1 + 5 + hdr[1];
+	case OPCODE_EXEC_LUA_SCRIPT:
+	case OPCODE_ENSCRIPT: /* "b", length, then the text */
+		if (snis_socket_reader_peek(c->input, hdr, 1 + 1))
+			return 0;
+		return 1 + 1 + hdr[1];
+	case OPCODE_DEMON_COMMAND: /* "bwwbb", ending with two counts of ids, then the ids */
+		if (snis_socket_reader_peek(c->input, hdr, 1 + 11))
+			return 0;
+		return 1 + 11 + (hdr[10] + hdr[11]) * sizeof(uint32_t);
+	case OPCODE_UPDATE_BUILD_INFO: /* "bw", which and length, then the text */
+		if (snis_socket_reader_peek(c->input, hdr, 1 + 5))
+			return 0;
+		memcpy(&len, &hdr[2], sizeof(len));
+		len = ntohl(len);
+		if (len > 255)
+			return -1;
+		return 1 + 5 + len;
+	default:
+		return -1;
+	}
+}
+
+static uint8_t last_successful_opcode = OPCODE_NOOP;
+
+static void process_instruction_from_client(struct game_client *c)
 {
 	int rc;
 	uint8_t opcode;
-	static uint8_t last_successful_opcode = OPCODE_NOOP;
 
 	opcode = OPCODE_NOOP;
-	rc = snis_readsocket(c->socket, &opcode, sizeof(opcode));
+	rc = snis_socket_reader_read(c->input, &opcode, sizeof(opcode));
 	if (rc != 0)
 		goto protocol_error;
 
@@ -11241,6 +11765,9 @@ static void process_instructions_from_client(struct game_client *c)
 		case OPCODE_TOGGLE_DEMON_SAFE_MODE:
 			process_toggle_demon_safe_mode();
 			break;
+		case OPCODE_REQUEST_TICK_PROFILE:
+			process_request_tick_profile(c);
+			break;
 		case OPCODE_EXEC_LUA_SCRIPT:
 			rc = process_exec_lua_script(c);
 			if (rc)
@@ -11250,6 +11777,7 @@ static void process_instructions_from_client(struct game_client *c)
 			rc = process_enscript_command(c);
 			if (rc)
 				goto protocol_error;
+			break;
 		case OPCODE_ROBOT_AUTO_MANUAL:
 			rc = process_robot_auto_manual(c);
 			if (rc)
@@ -11293,6 +11821,65 @@ protocol_error:
 	return;
 }
 
+/* Read whatever the client has sent, then process every complete request
+ * in the input buffer in one batch, holding the universe mutex just once
+ * rather than once per request.  No request is started until it has fully
+ * arrived, so none ever waits on the client.  A partial request is left in
+ * the buffer until next time.  Variable length requests, which may run lua
+ * or write files, are processed with the mutex dropped.
+ */
+static void process_instructions_from_client(struct game_client *c)
+{
+	int len, buffered, variable, locked = 0;
+	uint8_t opcode;
+
+	if (snis_socket_reader_fill(c->input) != 0) {
+		log_client_info(SNIS_INFO, c->socket, "disconnected\n");
+		shutdown(c->socket, SHUT_RDWR);
+		close(c->socket);
+		c->socket = -1;
+		return;
+	}
+	while (c->socket >= 0 && snis_socket_reader_peek(c->input, &opcode, 1) == 0) {
+		len = request_length[opcode];
+		variable = len < 0;
+		if (variable) {
+			len = variable_request_length(c, opcode);
+			if (len == 0) /* the rest of the header is yet to come */
+				break;
+			if (len < 0) {
+				snis_log(SNIS_ERROR, "bad variable length request, opcode %hhu\n", opcode);
+				log_client_info(SNIS_ERROR, c->socket, "disconnected, protocol error\n");
+				shutdown(c->socket, SHUT_RDWR);
+				close(c->socket);
+				c->socket = -1;
+				break;
+			}
+		}
+		buffered = snis_socket_reader_buffered(c->input);
+		if (buffered < len)
+			break;
+		if (variable && locked) {
+			pthread_mutex_unlock(&universe_mutex);
+			locked = 0;
+		} else if (!variable && !locked) {
+			pthread_mutex_lock(&universe_mutex);
+			locked = 1;
+		}
+		process_instruction_from_client(c); /* rejects invalid opcodes */
+		if (c->socket >= 0 && buffered - snis_socket_reader_buffered(c->input) != len) {
+			snis_log(SNIS_ERROR, "opcode %hhu consumed %d bytes, expected %d\n",
+				opcode, buffered - snis_socket_reader_buffered(c->input), len);
+			log_client_info(SNIS_ERROR, c->socket, "disconnected, protocol error\n");
+			shutdown(c->socket, SHUT_RDWR);
+			close(c->socket);
+			c->socket = -1;
+		}
+	}
+	if (locked)
+		pthread_mutex_unlock(&universe_mutex);
+}
+
 static void *per_client_read_thread(void /* struct game_client */ *client)
 {
 	struct game_client *c = (struct game_client *) client;
@@ -11322,14 +11909,8 @@ static void queue_update_universe_timestamp(struct game_client *c, uint8_t code)
 		universe_timestamp, time_now_double() - universe_timestamp_absolute, 5));
 }
 
-static void write_queued_updates_to_client(struct game_client *c, uint8_t over_clock, uint8_t *no_write_count)
+static void queue_requested_universe_timestamp(struct game_client *c)
 {
-	/* write queued updates to client */
-	int rc;
-	uint8_t noop = 0xff;
-
-	struct packed_buffer *buffer;
-
 	/* timestamp request must be prepended to queue right before it is sent or the timestamp
 	   contained will be stale */
 	if (c->request_universe_timestamp > 0) {
@@ -11348,30 +11929,147 @@ static void write_queued_updates_to_client(struct game_client *c, uint8_t over_c
 		queue_update_universe_timestamp(c, code);
 		c->request_universe_timestamp--;
 	}
+}
 
-	/*  packed_buffer_queue_print(&c->client_write_queue); */
-	buffer = packed_buffer_queue_combine(&c->client_write_queue, &c->client_write_queue_mutex);
-	if (buffer) {
-#if COMPUTE_AVERAGE_TO_CLIENT_BUFFER_SIZE
-		/* Last I checked, average buffer size was in the 14.5kbyte range. */
-		c->write_sum += buffer->buffer_size;
-		c->write_count++;
-		if ((universe_timestamp % 50) == 0)
-			printf("avg = %llu\n", c->write_sum / c->write_count);
-#endif
-		rc = snis_writesocket(c->socket, buffer->buffer, buffer->buffer_size);
-		packed_buffer_free(buffer);
-		if (rc != 0) {
-			snis_log(SNIS_ERROR, "writesocket failed, rc= %d, errno = %d(%s)\n", 
-				rc, errno, strerror(errno));
-			goto badclient;
+/* Fill in iov[] from a list of queued buffers, skipping the first offset bytes
+ * of the first buffer.  Returns the number of iovec entries used, and the total
+ * number of bytes they cover in *nbytes.
+ */
+static int queue_entries_to_iovec(struct packed_buffer_queue_entry *list, int offset,
+		struct iovec *iov, int maxiov, int *nbytes)
+{
+	struct packed_buffer_queue_entry *i;
+	int n = 0;
+
+	*nbytes = 0;
+	for (i = list; i && n < maxiov; i = i->next) {
+		iov[n].iov_base = i->buffer->buffer + offset;
+		iov[n].iov_len = i->buffer->buffer_cursor - offset;
+		*nbytes += iov[n].iov_len;
+		offset = 0;
+		n++;
+	}
+	return n;
+}
+
+#define CLIENT_WRITE_IOV_BATCH 64
+
+/* Copy a list of queued buffers, as yet uncompressed, to the client's recording */
+static void record_queue_entries(struct game_client *c, struct packed_buffer_queue_entry *list)
+{
+	struct iovec iov[CLIENT_WRITE_IOV_BATCH];
+	int i, n, nbytes;
+
+	while (list) {
+		n = queue_entries_to_iovec(list, 0, iov, ARRAY_SIZE(iov), &nbytes);
+		if (snis_stream_recordv(c->recorder, iov, n)) {
+			snis_log(SNIS_ERROR, "failed recording client stream, stopping: %s\n",
+				strerror(errno));
+			snis_stream_recorder_free(c->recorder);
+			c->recorder = NULL;
+			return;
 		}
-		*no_write_count = 0;
-	} else if (*no_write_count > over_clock) {
+		for (i = 0; i < n; i++)
+			list = list->next;
+	}
+}
+
+/* Replace a list of queued buffers with a single buffer holding their
+ * contents compressed, ending with a sync flush so the client can decode
+ * all of it straight away.  Returns NULL on error.
+ */
+static struct packed_buffer_queue_entry *deflate_queue_entries(struct game_client *c,
+						struct packed_buffer_queue_entry *list)
+{
+	struct packed_buffer_queue_entry *i;
+	struct packed_buffer_queue q;
+	struct packed_buffer *pb;
+	unsigned char *out;
+	int len;
+
+	for (i = list; i; i = i->next)
+		if (snis_deflate(c->deflater, i->buffer->buffer, i->buffer->buffer_cursor, !i->next))
+			break;
+	packed_buffer_queue_entries_free(list);
+	if (i)
+		return NULL;
+	out = snis_deflater_take_output(c->deflater, &len);
+	pb = packed_buffer_allocate(len);
+	memcpy(pb->buffer, out, len);
+	pb->buffer_cursor = len;
+	packed_buffer_queue_init(&q);
+	packed_buffer_queue_add(&q, pb, NULL);
+	return packed_buffer_queue_detach(&q, NULL);
+}
+
+/* Count the bytes about to go to a client's socket, after any compression */
+static void count_client_bytes_written(struct game_client *c, struct packed_buffer_queue_entry *list)
+{
+	uint64_t bytes = 0;
+
+	for (; list; list = list->next)
+		bytes += list->buffer->buffer_cursor;
+	snis_metrics_add(metrics, METRIC_CLIENT_BYTES_WRITTEN + client_index(c), bytes);
+}
+
+/* Gather write a list of queued buffers to a blocking socket. */
+static int write_queue_entries(int socket, struct packed_buffer_queue_entry *list)
+{
+	struct iovec iov[CLIENT_WRITE_IOV_BATCH];
+	int i, n, nbytes;
+
+	while (list) {
+		n = queue_entries_to_iovec(list, 0, iov, ARRAY_SIZE(iov), &nbytes);
+		if (snis_writevsocket(socket, iov, n))
+			return -1;
+		for (i = 0; i < n; i++)
+			list = list->next;
+	}
+	return 0;
+}
+
+static void write_queued_updates_to_client(struct game_client *c, uint8_t over_clock, uint8_t *no_write_count)
+{
+	/* write queued updates to client */
+	int rc;
+
+	struct packed_buffer_queue_entry *list;
+
+	queue_requested_universe_timestamp(c);
+
+	/*  packed_buffer_queue_print(&c->client_write_queue); */
+	/* Hand the queued buffers straight to the socket rather than copying them into one */
+	list = detach_client_queue(c);
+	if (!list && *no_write_count > over_clock) {
 		/* no-op, just so we know if client is still there */
-		rc = snis_writesocket(c->socket, &noop, sizeof(noop));
+		pb_queue_to_client(c, packed_buffer_new("b", OPCODE_NOOP));
+		list = detach_client_queue(c);
+	}
+	if (list && c->recorder)
+		record_queue_entries(c, list);
+	if (list && c->deflater) {
+		list = deflate_queue_entries(c, list);
+		if (!list) {
+			snis_log(SNIS_ERROR, "failed to compress client updates\n");
+			goto badclient;
+		}
+	}
+	if (list) {
+#if COMPUTE_AVERAGE_TO_CLIENT_BUFFER_SIZE
+		/* Last I checked, average buffer size was in the 14.5kbyte range. */
+		struct packed_buffer_queue_entry *i;
+
+		for (i = list; i; i = i->next)
+			c->write_sum += i->buffer->buffer_cursor;
+		c->write_count++;
+		if ((universe_timestamp % 50) == 0)
+			printf("avg = %llu\n", c->write_sum / c->write_count);
+#endif
+		count_client_bytes_written(c, list);
+		rc = write_queue_entries(c->socket, list);
+		packed_buffer_queue_entries_free(list);
 		if (rc != 0) {
-			snis_log(SNIS_ERROR, "(noop) writesocket failed, rc= %d, errno = %d(%s)\n", 
+			snis_log(SNIS_ERROR, "writesocket failed, rc= %d, errno = %d(%s)\n", 
 				rc, errno, strerror(errno));
 			goto badclient;
 		}
@@ -11387,60 +12085,535 @@ badclient:
 	c->socket = -1;
 }
 
-static void send_update_ship_packet(struct game_client *c,
-	struct snis_entity *o, uint8_t opcode);
+/* Object updates are encoded once and shared by every client which needs them */
+typedef struct packed_buffer *(*update_encoder)(struct snis_entity *o, uint8_t opcode);
+
+static struct packed_buffer *encode_update_ship_packet(struct snis_entity *o, uint8_t opcode);
+static struct packed_buffer *encode_econ_update_ship_packet(struct snis_entity *o, uint8_t opcode);
 static void send_econ_update_ship_packet(struct game_client *c,
 	struct snis_entity *o);
-static void send_update_asteroid_packet(struct game_client *c,
-	struct snis_entity *o);
-static void send_update_docking_port_packet(struct game_client *c,
-	struct snis_entity *o);
-static void send_update_cargo_container_packet(struct game_client *c,
-	struct snis_entity *o);
-static void send_update_derelict_packet(struct game_client *c,
-	struct snis_entity *o);
-static void send_update_planet_packet(struct game_client *c,
-	struct snis_entity *o);
-static void send_update_wormhole_packet(struct game_client *c,
-	struct snis_entity *o);
-static void send_update_starbase_packet(struct game_client *c,
-	struct snis_entity *o);
-static void send_update_explosion_packet(struct game_client *c,
-	struct snis_entity *o);
-static void send_update_torpedo_packet(struct game_client *c,
-	struct snis_entity *o);
-static void send_update_laser_packet(struct game_client *c,
-	struct snis_entity *o);
-static void send_update_laserbeam_packet(struct game_client *c,
-	struct snis_entity *o);
-static void send_update_tractorbeam_packet(struct game_client *c,
-	struct snis_entity *o);
-static void send_update_spacemonster_packet(struct game_client *c,
-	struct snis_entity *o);
-static void send_update_nebula_packet(struct game_client *c,
-	struct snis_entity *o);
+static struct packed_buffer *encode_update_asteroid_packet(struct snis_entity *o, uint8_t opcode);
+static struct packed_buffer *encode_update_cargo_container_packet(struct snis_entity *o, uint8_t opcode);
+static struct packed_buffer *encode_update_derelict_packet(struct snis_entity *o, uint8_t opcode);
+static struct packed_buffer *encode_update_planet_packet(struct snis_entity *o, uint8_t opcode);
+static struct packed_buffer *encode_update_wormhole_packet(struct snis_entity *o, uint8_t opcode);
+static struct packed_buffer *encode_update_starbase_packet(struct snis_entity *o, uint8_t opcode);
+static struct packed_buffer *encode_update_nebula_packet(struct snis_entity *o, uint8_t opcode);
+static struct packed_buffer *encode_update_explosion_packet(struct snis_entity *o, uint8_t opcode);
+static struct packed_buffer *encode_update_torpedo_packet(struct snis_entity *o, uint8_t opcode);
+static struct packed_buffer *encode_update_laser_packet(struct snis_entity *o, uint8_t opcode);
+static struct packed_buffer *encode_update_laserbeam_packet(struct snis_entity *o, uint8_t opcode);
+static struct packed_buffer *encode_update_tractorbeam_packet(struct snis_entity *o, uint8_t opcode);
+static struct packed_buffer *encode_update_docking_port_packet(struct snis_entity *o, uint8_t opcode);
+static struct packed_buffer *encode_update_spacemonster_packet(struct snis_entity *o, uint8_t opcode);
 static void send_update_damcon_obj_packet(struct game_client *c,
 	struct snis_damcon_entity *o);
 static void send_update_damcon_socket_packet(struct game_client *c,
 	struct snis_damcon_entity *o);
 static void send_update_damcon_part_packet(struct game_client *c,
 	struct snis_damcon_entity *o);
-static void send_update_power_model_data(struct game_client *c,
-		struct snis_entity *o);
-static void send_update_coolant_model_data(struct game_client *c,
-		struct snis_entity *o);
+static struct packed_buffer *encode_update_power_model_data(struct snis_entity *o, uint8_t opcode);
+static struct packed_buffer *encode_update_coolant_model_data(struct snis_entity *o, uint8_t opcode);
 
 static void send_respawn_time(struct game_client *c, struct snis_entity *o);
 
+/*
+ * Cache of encoded object updates.  Most clients are sent the very same bytes
+ * for a given object, so each update is encoded once, per object, timestamp
+ * and opcode, and the resulting buffer is shared among the client queues which
+ * need it.  Protected by universe_mutex.
+ */
+#define ENCODED_UPDATES_PER_OBJECT 3 /* e.g. ship, power data, coolant data */
+static struct encoded_update {
+	uint32_t id;
+	uint32_t timestamp;
+	uint8_t opcode;
+	struct packed_buffer *pb;
+	struct packed_buffer *compact; /* OPCODE_UPDATE_COMPACT form of pb, relative to origin */
+	int32_t origin[3];
+} encoded_update[MAXGAMEOBJS][ENCODED_UPDATES_PER_OBJECT];
+
+/*
+ * Compact encoding of object updates.  For clients which understand it, the
+ * update types in compact_update_format[] (see snis_packet.h) are sent with
+ * ids and timestamps as varints, positions relative to an origin near the
+ * client's ship, and orientations as smallest three quaternions (see
+ * snis_marshal.h).  The origin is the client's ship's
+ * position rounded to a coarse grid, so clients on the same bridge, and often
+ * other nearby ships, still share the compacted buffers.  Player ship updates
+ * are left alone, they're few, and delta encoded.
+ */
+#define UPDATE_ORIGIN_GRID_SHIFT (PACKED_POSITION_SHIFT + 13)
+static int compact_updates_enabled;
+
+static void init_compact_updates(void)
+{
+	char *c = getenv("SNIS_SERVER_COMPACT_UPDATES");
+
+	compact_updates_enabled = !c || strcmp(c, "0") != 0;
+}
+
+/* Move the client's origin for relative positions along with its ship, if need be */
+static void update_client_origin(struct game_client *c)
+{
+	struct snis_entity *ship;
+	int32_t origin[3];
+	const int32_t grid = ~((1 << UPDATE_ORIGIN_GRID_SHIFT) - 1);
+
+	if (!c->compact_updates)
+		return;
+	if (c->ship_index >= 0 && c->ship_index <= snis_object_pool_highest_object(pool)) {
+		ship = &go[c->ship_index];
+		origin[0] = dtos32(ship->x, (int32_t) UNIVERSE_DIM) & grid;
+		origin[1] = dtos32(ship->y, (int32_t) UNIVERSE_DIM) & grid;
+		origin[2] = dtos32(ship->z, (int32_t) UNIVERSE_DIM) & grid;
+	} else {
+		memset(origin, 0, sizeof(origin));
+	}
+	if (c->update_origin_sent && memcmp(origin, c->update_origin, sizeof(origin)) == 0)
+		return;
+	memcpy(c->update_origin, origin, sizeof(origin));
+	c->update_origin_sent = 1;
+	pb_queue_to_client(c, packed_buffer_new("bwww", OPCODE_UPDATE_ORIGIN,
+				(uint32_t) origin[0], (uint32_t) origin[1], (uint32_t) origin[2]));
+}
+
+/* Compact form of an encoded update relative to origin, or NULL if there isn't one */
+static struct packed_buffer *compact_update(struct packed_buffer *pb, const int32_t origin[3])
+{
+	const struct compact_update_format *f = lookup_compact_update_format(pb->buffer[0]);
+	struct packed_buffer *compact;
+	int size;
+
+	if (!f || pb->buffer_cursor != calculate_buffer_size(f->format))
+		return NULL;
+	size = calculate_buffer_size(f->compact_format);
+	compact = packed_buffer_allocate(size + 2);
+	if (!compact)
+		return NULL;
+	packed_buffer_append(compact, "bb", OPCODE_UPDATE_COMPACT, 0);
+	if (packed_buffer_compact(compact, f->compact_format, pb->buffer, f->format, origin) ||
+		compact->buffer_cursor - 2 > UINT8_MAX) {
+		packed_buffer_free(compact);
+		return NULL;
+	}
+	compact->buffer[1] = compact->buffer_cursor - 2;
+	return compact;
+}
+
+/*
+ * Delta encoding of object updates.  For the update types below, instead of
+ * the full update, a client may be sent just the fields which differ from the
+ * last update of that object it was sent.  Every so often the full update is
+ * sent anyway, so a client which somehow lost track can't stay lost for long.
+ */
+#define DELTA_UPDATE_FULL_INTERVAL 50
+static int delta_updates_enabled;
+static struct delta_update_format {
+	uint8_t opcode;
+	const char *format;
+	struct packed_buffer_delta_format df;
+} delta_update_format[] = {
+	{ OPCODE_UPDATE_SHIP, UPDATE_SHIP_PACKET_FORMAT, },
+	{ OPCODE_ECON_UPDATE_SHIP, UPDATE_ECON_SHIP_PACKET_FORMAT, },
+};
+
+static void init_delta_updates(void)
+{
+	char *d = getenv("SNIS_SERVER_DELTA_UPDATES");
+	int i;
+
+	delta_updates_enabled = d && strcmp(d, "0") != 0;
+	for (i = 0; i < ARRAY_SIZE(delta_update_format); i++)
+		if (packed_buffer_delta_format_init(&delta_update_format[i].df,
+						delta_update_format[i].format))
+			snis_log(SNIS_ERROR, "Bad delta update format for opcode %hhu\n",
+				delta_update_format[i].opcode);
+}
+
+static struct packed_buffer_delta_format *lookup_delta_format(uint8_t opcode)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(delta_update_format); i++)
+		if (delta_update_format[i].opcode == opcode)
+			return &delta_update_format[i].df;
+	return NULL;
+}
+
+static void init_queue_coalescing(void)
+{
+	const uint8_t opcode[] = {
+		OPCODE_UPDATE_SHIP, OPCODE_UPDATE_POWER_DATA, OPCODE_UPDATE_COOLANT_DATA,
+		OPCODE_ECON_UPDATE_SHIP, OPCODE_UPDATE_ASTEROID, OPCODE_UPDATE_CARGO_CONTAINER,
+		OPCODE_UPDATE_DERELICT, OPCODE_UPDATE_PLANET, OPCODE_UPDATE_WORMHOLE,
+		OPCODE_UPDATE_STARBASE, OPCODE_UPDATE_NEBULA, OPCODE_UPDATE_EXPLOSION,
+		OPCODE_UPDATE_TORPEDO, OPCODE_UPDATE_LASER, OPCODE_UPDATE_SPACEMONSTER,
+		OPCODE_UPDATE_LASERBEAM, OPCODE_UPDATE_TRACTORBEAM, OPCODE_UPDATE_DOCKING_PORT,
+		OPCODE_SHIP_SDATA, OPCODE_DAMCON_OBJ_UPDATE, OPCODE_DAMCON_SOCKET_UPDATE,
+		OPCODE_DAMCON_PART_UPDATE,
+	};
+	char *h = getenv("SNIS_CLIENT_QUEUE_HIGH_WATER");
+	char *l = getenv("SNIS_CLIENT_QUEUE_LIMIT");
+	int i;
+
+	/* All of these begin with the opcode and the object id */
+	for (i = 0; i < ARRAY_SIZE(opcode); i++)
+		coalescable_update[opcode[i]] = lookup_delta_format(opcode[i]) ?
+					COALESCE_UNLESS_DELTA : COALESCE_ALWAYS;
+	if (h)
+		sscanf(h, "%u", &client_queue_high_water);
+	if (l)
+		sscanf(l, "%u", &client_queue_limit);
+	snis_log(SNIS_INFO, "Client queues coalesced past %u bytes, clients evicted past %u bytes\n",
+		client_queue_high_water, client_queue_limit);
+}
+
+/*
+ * The UDP side channel (see snis_udp.h).  Object state updates which carry
+ * the whole state of an object, so that losing one only means waiting for
+ * the next, go to clients which negotiated SNIS_CAP_UDP by UDP, once we know
+ * where to send them.  Everything else, deletes, explosions, sounds, comms,
+ * delta updates and the rest, stays on TCP.  Updates are gathered into a
+ * datagram per client, sent when it's full and each time the client's
+ * updates have all been queued.  Datagrams which can't be sent right away
+ * are just dropped.
+ */
+static int udp_socket = -1;
+static uint16_t udp_port;
+static uint8_t udp_state_update[256];
+
+static void *udp_receive_thread(__attribute__((unused)) void *arg)
+{
+	unsigned char buffer[SNIS_UDP_HELLO_SIZE + 1];
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	uint32_t token;
+	int i, n;
+
+	while (1) {
+		fromlen = sizeof(from);
+		n = recvfrom(udp_socket, buffer, sizeof(buffer), 0, (struct sockaddr *) &from, &fromlen);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			snis_log(SNIS_ERROR, "UDP recvfrom failed: %s\n", strerror(errno));
+			break;
+		}
+		if (snis_udp_hello_unpack(buffer, n, &token) || token == 0)
+			continue;
+		pthread_mutex_lock(&universe_mutex);
+		client_lock();
+		for (i = 0; i < nclients; i++) {
+			struct game_client *c = &client[i];
+			struct sockaddr_in peer;
+			socklen_t peerlen = sizeof(peer);
+
+			if (!c->refcount || c->udp_token != token)
+				continue;
+			/* Only ever send a client's datagrams back to the host it connected from */
+			if (getpeername(c->socket, (struct sockaddr *) &peer, &peerlen) != 0 ||
+				peer.sin_family != AF_INET ||
+				peer.sin_addr.s_addr != from.sin_addr.s_addr)
+				break;
+			if (!c->udp_addr_known)
+				log_client_info(SNIS_INFO, c->socket, "UDP channel open\n");
+			c->udp_addr = from; /* the latest hello wins, should the client's address change */
+			c->udp_addr_known = 1;
+			break;
+		}
+		client_unlock();
+		pthread_mutex_unlock(&universe_mutex);
+	}
+	return NULL;
+}
+
+static void init_udp_channel(void)
+{
+	const uint8_t opcode[] = {
+		OPCODE_UPDATE_SHIP, OPCODE_ECON_UPDATE_SHIP, OPCODE_UPDATE_ASTEROID,
+		OPCODE_UPDATE_CARGO_CONTAINER, OPCODE_UPDATE_DERELICT, OPCODE_UPDATE_PLANET,
+		OPCODE_UPDATE_WORMHOLE, OPCODE_UPDATE_STARBASE, OPCODE_UPDATE_NEBULA,
+		OPCODE_UPDATE_TORPEDO, OPCODE_UPDATE_LASER, OPCODE_UPDATE_LASERBEAM,
+		OPCODE_UPDATE_TRACTORBEAM, OPCODE_UPDATE_DOCKING_PORT,
+	};
+	char *u = getenv("SNIS_SERVER_UDP");
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i, rc;
+
+	if (u && strcmp(u, "0") == 0)
+		return;
+	for (i = 0; i < ARRAY_SIZE(opcode); i++)
+		udp_state_update[opcode[i]] = 1;
+	udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+	if (udp_socket < 0)
+		goto fail;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = 0; /* any free port, clients are told which */
+	if (bind(udp_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+		getsockname(udp_socket, (struct sockaddr *) &addr, &addrlen) < 0)
+		goto fail;
+	udp_port = ntohs(addr.sin_port);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&thread, &attr, udp_receive_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		errno = rc;
+		goto fail;
+	}
+	snis_log(SNIS_INFO, "UDP channel on port %hu\n", udp_port);
+	return;
+
+fail:
+	snis_log(SNIS_ERROR, "No UDP channel: %s\n", strerror(errno));
+	if (udp_socket >= 0)
+		close(udp_socket);
+	udp_socket = -1;
+}
+
+/* The token a client's hellos must carry is all that ties its datagrams to
+ * it, so it comes from the system's random source rather than snis_randn(),
+ * which is predictable and which the simulation depends on being repeatable.
+ */
+static int random_udp_token(uint32_t *token)
+{
+	int fd, rc;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0)
+		return -1;
+	do {
+		rc = read(fd, token, sizeof(*token));
+	} while (rc == sizeof(*token) && *token == 0);
+	close(fd);
+	return rc == sizeof(*token) ? 0 : -1;
+}
+
+/* Set up the UDP channel for a client, if it asked for one */
+static void offer_udp_channel(struct game_client *c)
+{
+	c->udp_token = 0;
+	c->udp_addr_known = 0;
+	c->udp_datagram_len = 0;
+	c->udp_seq = 0;
+	if (!(c->capabilities & SNIS_CAP_UDP) || udp_socket < 0)
+		return;
+	if (!c->udp_datagram)
+		c->udp_datagram = malloc(SNIS_UDP_DATAGRAM_MAX);
+	if (!c->udp_datagram)
+		return;
+	if (random_udp_token(&c->udp_token) != 0) {
+		snis_log(SNIS_ERROR, "No UDP channel for client, cannot read /dev/urandom\n");
+		c->udp_token = 0;
+		return;
+	}
+	pb_queue_to_client(c, packed_buffer_new(UDP_CHANNEL_PACKET_FORMAT, OPCODE_UDP_CHANNEL,
+				udp_port, c->udp_token));
+}
+
+/* Send whatever updates are waiting in the client's datagram.  Assumes universe_mutex held. */
+static void flush_udp_datagram(struct game_client *c)
+{
+	int rc;
+
+	if (c->udp_datagram_len <= SNIS_UDP_HEADER_SIZE)
+		return;
+	c->udp_seq++;
+	snis_udp_header_pack(c->udp_datagram, c->udp_seq, c->udp_datagram_origin);
+	rc = sendto(udp_socket, c->udp_datagram, c->udp_datagram_len, MSG_DONTWAIT,
+			(struct sockaddr *) &c->udp_addr, sizeof(c->udp_addr));
+	if (rc > 0)
+		snis_metrics_add(metrics, METRIC_CLIENT_UDP_BYTES + client_index(c), rc);
+	c->udp_datagram_len = 0;
+}
+
+/* Queue an object state update, by UDP if the client has a UDP channel and it's
+ * the sort of update which may go that way, otherwise by TCP.  Consumes the
+ * caller's reference to pb.  Assumes universe_mutex held.
+ */
+static void queue_state_update(struct game_client *c, struct packed_buffer *pb)
+{
+	int compact, len = pb->buffer_cursor;
+
+	if (!c->udp_addr_known || len < 3 || len > SNIS_UDP_DATAGRAM_MAX - SNIS_UDP_HEADER_SIZE) {
+		pb_queue_to_client(c, pb);
+		return;
+	}
+	compact = pb->buffer[0] == OPCODE_UPDATE_COMPACT;
+	if (!udp_state_update[compact ? pb->buffer[2] : pb->buffer[0]]) {
+		pb_queue_to_client(c, pb);
+		return;
+	}
+	if (c->udp_datagram_len + len > SNIS_UDP_DATAGRAM_MAX ||
+		(compact && c->udp_datagram_len > SNIS_UDP_HEADER_SIZE &&
+		memcmp(c->udp_datagram_origin, c->update_origin, sizeof(c->update_origin)) != 0))
+		flush_udp_datagram(c);
+	if (c->udp_datagram_len == 0) {
+		c->udp_datagram_len = SNIS_UDP_HEADER_SIZE;
+		memcpy(c->udp_datagram_origin, c->update_origin, sizeof(c->update_origin));
+	}
+	gather_opcode_stats(c, pb);
+	__sync_fetch_and_add(&c->bytes_queued, len);
+	memcpy(c->udp_datagram + c->udp_datagram_len, pb->buffer, len);
+	c->udp_datagram_len += len;
+	packed_buffer_free(pb);
+}
+
+/* Queue either pb, or if it's smaller, the delta between the client's baseline
+ * for this object and pb.  Consumes the caller's reference to pb.
+ */
+static void queue_update_or_delta(struct game_client *c, struct snis_entity *o,
+		struct packed_buffer *pb)
+{
+	struct snis_entity_client_info *info = &c->go_clients[go_index(o)];
+	struct packed_buffer_delta_format *df = lookup_delta_format(pb->buffer[0]);
+	struct packed_buffer *base = info->baseline;
+	struct packed_buffer *delta;
+	unsigned char mask[PACKED_BUFFER_MAX_DELTA_FIELDS / 8];
+	int size;
+
+	if (!df || pb->buffer_cursor != df->offset[df->nfields]) {
+		pb_queue_to_client(c, pb);
+		return;
+	}
+	info->baseline = packed_buffer_get(pb);
+	if (!base || base->buffer[0] != pb->buffer[0] ||
+		memcmp(base->buffer + 1, pb->buffer + 1, 4) != 0 || /* different object id */
+		info->deltas_since_baseline_sent >= DELTA_UPDATE_FULL_INTERVAL)
+		goto send_full;
+	size = packed_buffer_delta_mask(df, base->buffer, pb->buffer, mask);
+	if (size + 6 >= pb->buffer_cursor)
+		goto send_full;
+	delta = packed_buffer_allocate(size + 6);
+	packed_buffer_append(delta, "bb", OPCODE_UPDATE_DELTA, pb->buffer[0]);
+	packed_buffer_append_raw(delta, (char *) pb->buffer + 1, 4);
+	packed_buffer_append_delta(delta, df, mask, pb->buffer);
+	pb_queue_to_client(c, delta);
+	packed_buffer_free(pb);
+	packed_buffer_free(base);
+	info->deltas_since_baseline_sent++;
+	return;
+
+send_full:
+	if (base)
+		packed_buffer_free(base);
+	info->deltas_since_baseline_sent = 0;
+	pb_queue_to_client(c, pb);
+}
+
+/* Queue an update which couldn't be compacted.  An update of a type which the
+ * client is otherwise sent compacted is never delta encoded: the client keeps
+ * the compact updates it expands as its baseline, which the server doesn't have.
+ */
+static void queue_uncompacted_update(struct game_client *c, struct snis_entity *o,
+		struct packed_buffer *pb)
+{
+	if (c->delta_updates && !(c->compact_updates && lookup_compact_update_format(pb->buffer[0])))
+		queue_update_or_delta(c, o, pb);
+	else
+		queue_state_update(c, pb);
+}
+
+static void queue_encoded_update(struct game_client *c, struct snis_entity *o,
+		uint8_t opcode, update_encoder encode)
+{
+	struct encoded_update *e, *slot = NULL;
+	struct packed_buffer *pb;
+	int i;
+
+	for (i = 0; i < ENCODED_UPDATES_PER_OBJECT; i++) {
+		e = &encoded_update[go_index(o)][i];
+		if (e->pb && e->opcode == opcode) {
+			slot = e;
+			if (e->id == o->id && e->timestamp == o->timestamp)
+				goto hit;
+			break;
+		}
+		if (!e->pb && !slot)
+			slot = e;
+	}
+	if (!slot) /* should not happen, just don't cache it */
+		goto uncached;
+	e = slot;
+	if (e->pb)
+		packed_buffer_free(e->pb);
+	if (e->compact)
+		packed_buffer_free(e->compact);
+	e->compact = NULL;
+	e->pb = encode(o, opcode);
+	if (!e->pb)
+		return;
+	e->id = o->id;
+	e->timestamp = o->timestamp;
+	e->opcode = opcode;
+hit:
+	if (c->compact_updates) {
+		update_client_origin(c);
+		if (e->compact && memcmp(e->origin, c->update_origin, sizeof(e->origin)) != 0) {
+			packed_buffer_free(e->compact);
+			e->compact = NULL;
+		}
+		if (!e->compact) {
+			e->compact = compact_update(e->pb, c->update_origin);
+			memcpy(e->origin, c->update_origin, sizeof(e->origin));
+		}
+		if (e->compact) {
+			queue_state_update(c, packed_buffer_get(e->compact));
+			return;
+		}
+	}
+	queue_uncompacted_update(c, o, packed_buffer_get(e->pb));
+	return;
+
+uncached:
+	pb = encode(o, opcode);
+	if (!pb)
+		return;
+	if (c->compact_updates) {
+		struct packed_buffer *compact;
+
+		update_client_origin(c);
+		compact = compact_update(pb, c->update_origin);
+		if (compact) {
+			packed_buffer_free(pb);
+			queue_state_update(c, compact);
+			return;
+		}
+	}
+	queue_uncompacted_update(c, o, pb);
+}
+
+static void forget_encoded_updates(struct snis_entity *o)
+{
+	struct encoded_update *e;
+	int i;
+
+	for (i = 0; i < ENCODED_UPDATES_PER_OBJECT; i++) {
+		e = &encoded_update[go_index(o)][i];
+		if (e->pb)
+			packed_buffer_free(e->pb);
+		if (e->compact)
+			packed_buffer_free(e->compact);
+		e->pb = NULL;
+		e->compact = NULL;
+	}
+}
+
 static void queue_up_client_object_update(struct game_client *c, struct snis_entity *o)
 {
 	switch(o->type) {
 	case OBJTYPE_SHIP1:
-		send_update_ship_packet(c, o, OPCODE_UPDATE_SHIP);
+		queue_encoded_update(c, o, OPCODE_UPDATE_SHIP, encode_update_ship_packet);
 		if (!o->alive)
 			send_respawn_time(c, o);
-		send_update_power_model_data(c, o);
-		send_update_coolant_model_data(c, o);
+		queue_encoded_update(c, o, OPCODE_UPDATE_POWER_DATA, encode_update_power_model_data);
+		queue_encoded_update(c, o, OPCODE_UPDATE_COOLANT_DATA, encode_update_coolant_model_data);
 		if (o->tsd.ship.overheating_damage_done)
 			send_silent_ship_damage_packet(o); /* sends to all clients. */
 		break;
@@ -11448,81 +12621,56 @@ static void queue_up_client_object_update(struct game_client *c, struct snis_ent
 		send_econ_update_ship_packet(c, o);
 		break;
 	case OBJTYPE_ASTEROID:
-		send_update_asteroid_packet(c, o);
+		queue_encoded_update(c, o, OPCODE_UPDATE_ASTEROID, encode_update_asteroid_packet);
 		break;
 	case OBJTYPE_CARGO_CONTAINER:
-		send_update_cargo_container_packet(c, o);
+		queue_encoded_update(c, o, OPCODE_UPDATE_CARGO_CONTAINER, encode_update_cargo_container_packet);
 		break;
 	case OBJTYPE_DERELICT:
-		send_update_derelict_packet(c, o);
+		queue_encoded_update(c, o, OPCODE_UPDATE_DERELICT, encode_update_derelict_packet);
 		break;
 	case OBJTYPE_PLANET:
-		send_update_planet_packet(c, o);
+		queue_encoded_update(c, o, OPCODE_UPDATE_PLANET, encode_update_planet_packet);
 		break;
 	case OBJTYPE_WORMHOLE:
-		send_update_wormhole_packet(c, o);
+		queue_encoded_update(c, o, OPCODE_UPDATE_WORMHOLE, encode_update_wormhole_packet);
 		break;
 	case OBJTYPE_STARBASE:
-		send_update_starbase_packet(c, o);
+		queue_encoded_update(c, o, OPCODE_UPDATE_STARBASE, encode_update_starbase_packet);
 		break;
 	case OBJTYPE_NEBULA:
-		send_update_nebula_packet(c, o);
+		queue_encoded_update(c, o, OPCODE_UPDATE_NEBULA, encode_update_nebula_packet);
 		break;
 	case OBJTYPE_EXPLOSION:
-		send_update_explosion_packet(c, o);
+		queue_encoded_update(c, o, OPCODE_UPDATE_EXPLOSION, encode_update_explosion_packet);
 		break;
 	case OBJTYPE_DEBRIS:
 		break;
 	case OBJTYPE_SPARK:
 		break;
 	case OBJTYPE_TORPEDO:
-		send_update_torpedo_packet(c, o);
+		queue_encoded_update(c, o, OPCODE_UPDATE_TORPEDO, encode_update_torpedo_packet);
 		break;
 	case OBJTYPE_LASER:
-		send_update_laser_packet(c, o);
+		queue_encoded_update(c, o, OPCODE_UPDATE_LASER, encode_update_laser_packet);
 		break;
 	case OBJTYPE_SPACEMONSTER:
-		send_update_spacemonster_packet(c, o);
+		queue_encoded_update(c, o, OPCODE_UPDATE_SPACEMONSTER, encode_update_spacemonster_packet);
 		break;
 	case OBJTYPE_LASERBEAM:
-		send_update_laserbeam_packet(c, o);
+		queue_encoded_update(c, o, OPCODE_UPDATE_LASERBEAM, encode_update_laserbeam_packet);
 		break;
 	case OBJTYPE_TRACTORBEAM:
-		send_update_tractorbeam_packet(c, o);
+		queue_encoded_update(c, o, OPCODE_UPDATE_TRACTORBEAM, encode_update_tractorbeam_packet);
 		break;
 	case OBJTYPE_DOCKING_PORT:
-		send_update_docking_port_packet(c, o);
+		queue_encoded_update(c, o, OPCODE_UPDATE_DOCKING_PORT, encode_update_docking_port_packet);
 		break;
 	default:
 		break;
 	}
 }
 
-static void queue_up_client_object_sdata_update(struct game_client *c, struct snis_entity *o)
-{
-	switch (o->type) {
-	case OBJTYPE_SHIP1:
-		send_update_sdata_packets(c, o);
-		/* TODO: remove the next two lines when send_update_sdata_packets does it already */
-		if (o == &go[c->ship_index])
-			pack_and_send_ship_sdata_packet(c, o);
-		break;
-	case OBJTYPE_SHIP2:
-	case OBJTYPE_ASTEROID:
-	case OBJTYPE_CARGO_CONTAINER:
-	case OBJTYPE_DERELICT:
-	case OBJTYPE_PLANET:
-	case OBJTYPE_WORMHOLE:
-	case OBJTYPE_STARBASE:
-	case OBJTYPE_TORPEDO:
-	case OBJTYPE_LASER:
-	case OBJTYPE_SPACEMONSTER:
-		send_update_sdata_packets(c, o);
-		break;
-	default:
-		break;
-	}
-}
 static int too_far_away_to_care(struct game_client *c, struct snis_entity *o)
 {
 	struct snis_entity *ship = &go[c->ship_index];
@@ -11544,7 +12692,9 @@ static void queue_netstats(struct game_client *c)
 		return;
 	gettimeofday(&now, NULL);
 	elapsed_seconds = now.tv_sec - netstats.start.tv_sec;
-	pb_queue_to_client(c, packed_buffer_new("bqqwwwwwwww", OPCODE_UPDATE_NETSTATS,
+	/* Older clients, which don't ask for the compression figures, get the old format */
+	if (!(c->capabilities & SNIS_CAP_COMPRESSION_STATS)) {
+		pb_queue_to_client(c, packed_buffer_new("bqqwwwwwwww", OPCODE_UPDATE_NETSTATS,
 					netstats.bytes_sent, netstats.bytes_recd,
 					netstats.nobjects, netstats.nships,
 					elapsed_seconds,
@@ -11553,6 +12703,19 @@ static void queue_netstats(struct game_client *c)
 					faction_population[2],
 					faction_population[3],
 					faction_population[4]));
+		return;
+	}
+	pb_queue_to_client(c, packed_buffer_new("bqqwwwwwwwwqqq", OPCODE_UPDATE_NETSTATS,
+					netstats.bytes_sent, netstats.bytes_recd,
+					netstats.nobjects, netstats.nships,
+					elapsed_seconds,
+					faction_population[0],
+					faction_population[1],
+					faction_population[2],
+					faction_population[3],
+					faction_population[4],
+					netstats.bytes_deflated_in, netstats.bytes_deflated_out,
+					netstats.compression_usec));
 }
 
 static void queue_up_client_damcon_object_update(struct game_client *c,
@@ -11585,137 +12748,669 @@ static void queue_up_client_damcon_update(struct game_client *c)
 
 #define GO_TOO_FAR_UPDATE_PER_NTICKS 7
 
+/*
+ * Interest management.  Rather than considering every object for every client
+ * every tick, objects are considered at a rate depending on their distance from
+ * the client's ship.  Nearby objects are found via the space partition, and the
+ * rest of the universe is visited one slice of the partition's cells per tick,
+ * so building a client's updates costs in proportion to what is nearby.
+ */
+static const struct interest_band {
+	double radius; /* objects within this distance of the client's ship... */
+	int update_period; /* ...are considered every this many ticks */
+} interest_band[] = {
+	{ XKNOWN_DIM / 2.0, 1 },
+	{ XKNOWN_DIM, GO_TOO_FAR_UPDATE_PER_NTICKS },
+	{ -1.0, 2 * GO_TOO_FAR_UPDATE_PER_NTICKS }, /* everything further away */
+};
+#define INTEREST_NEAR_RADIUS (interest_band[ARRAY_SIZE(interest_band) - 2].radius)
+#define INTEREST_FAR_PERIOD (interest_band[ARRAY_SIZE(interest_band) - 1].update_period)
+
+/*
+ * Update scheduler.  The object updates and sdata a client needs this tick are
+ * gathered up as candidates, ranked by priority, and sent most valuable first
+ * until the client's byte budget for the tick (SNIS_CLIENT_BYTES_PER_TICK,
+ * unlimited by default) is used up.  Whatever doesn't make the cut stays
+ * pending, and the longer it is put off, the higher its priority becomes.
+ * Updates involving the client's own ship are always sent.
+ */
+#define SDATA_UPDATE_PERIOD 4 /* ticks between sdata updates for an object */
+#define UPDATE_PRIORITY_AGING 10.0f /* priority added per tick deferred */
+#define UPDATE_PRIORITY_ALWAYS 1.0e30f
+static uint32_t client_bytes_per_tick;
+
+enum update_kind { UPDATE_OBJECT, UPDATE_SDATA };
+
+struct update_candidate {
+	float priority;
+	int16_t kind;
+	uint16_t index;
+};
+
+struct interest_context {
+	struct game_client *c;
+	struct snis_entity *ship;
+	double x, y, z;
+	int count;
+	int ncandidates;
+};
+
+static void init_update_scheduler(void)
+{
+	char *b = getenv("SNIS_CLIENT_BYTES_PER_TICK");
+
+	if (!b || sscanf(b, "%u", &client_bytes_per_tick) != 1)
+		client_bytes_per_tick = 0;
+	if (client_bytes_per_tick)
+		snis_log(SNIS_INFO, "Client updates limited to %u bytes per tick\n",
+				client_bytes_per_tick);
+}
+
+/* Does o belong to, or act upon, the given ship? */
+static int involves_ship(struct snis_entity *o, uint32_t shipid)
+{
+	switch (o->type) {
+	case OBJTYPE_TORPEDO:
+		return o->tsd.torpedo.ship_id == shipid;
+	case OBJTYPE_LASER:
+		return o->tsd.laser.ship_id == shipid;
+	case OBJTYPE_LASERBEAM:
+	case OBJTYPE_TRACTORBEAM:
+		return o->tsd.laserbeam.origin == shipid || o->tsd.laserbeam.target == shipid;
+	default:
+		return o->id == shipid;
+	}
+}
+
+static float update_priority(struct interest_context *ic, struct snis_entity *o,
+				enum update_kind kind, uint32_t age)
+{
+	struct game_client *c = ic->c;
+	double dx, dz, dist;
+	float priority;
+
+	if (involves_ship(o, c->shipid))
+		return UPDATE_PRIORITY_ALWAYS;
+
+	dx = o->x - ic->x;
+	dz = o->z - ic->z;
+	dist = sqrt(dx * dx + dz * dz) / XKNOWN_DIM;
+	if (dist > 1.0)
+		dist = 1.0;
+
+	if (kind == UPDATE_OBJECT) {
+		priority = 100.0f * (1.0f - dist);
+		/* Stations without a view of space care little about other objects */
+		if (!(c->role & (ROLE_MAIN | ROLE_NAVIGATION | ROLE_WEAPONS |
+				ROLE_SCIENCE | ROLE_DEMON)))
+			priority *= 0.25f;
+	} else {
+		priority = 50.0f * (1.0f - dist);
+		if (c->role & ROLE_SCIENCE)
+			priority += 25.0f;
+	}
+	return priority + UPDATE_PRIORITY_AGING * age;
+}
+
+static void add_update_candidate(struct interest_context *ic, struct snis_entity *o,
+				enum update_kind kind, uint32_t age)
+{
+	struct update_candidate *uc = &ic->c->candidate[ic->ncandidates++];
+
+	uc->priority = update_priority(ic, o, kind, age);
+	uc->kind = kind;
+	uc->index = go_index(o);
+}
+
+static void queue_up_client_object(struct interest_context *ic, struct snis_entity *o)
+{
+	struct game_client *c = ic->c;
+	struct snis_entity_client_info *info = &c->go_clients[go_index(o)];
+
+	/* printf("obj %d: a=%d, ts=%u, uts%u, type=%hhu\n",
+		go_index(o), o->alive, o->timestamp, universe_timestamp, o->type); */
+	if (!o->alive && o->type != OBJTYPE_SHIP1)
+		return;
+
+	if (o->timestamp != info->last_timestamp_sent)
+		add_update_candidate(ic, o, UPDATE_OBJECT, info->update_deferrals);
+	if (!ic->ship)
+		return;
+	if (o == ic->ship || (universe_timestamp - info->last_sdata_sent >= SDATA_UPDATE_PERIOD &&
+				sdata_wanted(c, ic->ship, o)))
+		add_update_candidate(ic, o, UPDATE_SDATA,
+			(universe_timestamp - info->last_sdata_sent) / SDATA_UPDATE_PERIOD);
+}
+
+static int compare_update_candidates(const void *a, const void *b)
+{
+	const struct update_candidate *u1 = a, *u2 = b;
+
+	if (u1->priority > u2->priority)
+		return -1;
+	if (u1->priority < u2->priority)
+		return 1;
+	return 0;
+}
+
+static void send_update_candidates(struct interest_context *ic)
+{
+	struct game_client *c = ic->c;
+	uint32_t start = c->bytes_queued;
+	struct update_candidate *uc;
+	struct snis_entity_client_info *info;
+	struct snis_entity *o;
+	int i;
+
+	if (client_bytes_per_tick)
+		qsort(c->candidate, ic->ncandidates, sizeof(c->candidate[0]),
+			compare_update_candidates);
+	for (i = 0; i < ic->ncandidates; i++) {
+		uc = &c->candidate[i];
+		o = &go[uc->index];
+		info = &c->go_clients[uc->index];
+		if (client_bytes_per_tick && c->bytes_queued - start >= client_bytes_per_tick &&
+			uc->priority < UPDATE_PRIORITY_ALWAYS) {
+			/* Over budget, put it off until next time around */
+			if (uc->kind == UPDATE_OBJECT && info->update_deferrals < 0xffff)
+				info->update_deferrals++;
+			continue;
+		}
+		if (uc->kind == UPDATE_OBJECT) {
+			queue_up_client_object_update(c, o);
+			info->last_timestamp_sent = o->timestamp;
+			info->update_deferrals = 0;
+			ic->count++;
+		} else {
+			pack_and_send_ship_sdata_packet(c, o);
+			info->last_sdata_sent = universe_timestamp;
+		}
+	}
+}
+
+static void queue_up_nearby_client_object(void *context, void *entity)
+{
+	struct interest_context *ic = context;
+	struct snis_entity *o = entity;
+	double dx, dz, dist2;
+	int band;
+
+	dx = o->x - ic->x;
+	dz = o->z - ic->z;
+	dist2 = dx * dx + dz * dz;
+	for (band = 0; band < ARRAY_SIZE(interest_band) - 1; band++)
+		if (dist2 <= interest_band[band].radius * interest_band[band].radius)
+			break;
+	if ((universe_timestamp + go_index(o)) % interest_band[band].update_period != 0) {
+		gather_opcode_not_sent_stats(o);
+		return;
+	}
+	queue_up_client_object(ic, o);
+}
+
+static void queue_up_distant_client_object(void *context, void *entity)
+{
+	queue_up_client_object(context, entity);
+}
+
 static void queue_up_client_updates(struct game_client *c)
 {
+	struct interest_context ic;
 	int i;
-	int count;
 
-	count = 0;
 	pthread_mutex_lock(&universe_mutex);
 	if (universe_timestamp != c->timestamp) {
 		queue_netstats(c);
-		for (i = 0; i <= snis_object_pool_highest_object(pool); i++) {
-			/* printf("obj %d: a=%d, ts=%u, uts%u, type=%hhu\n",
-				i, go[i].alive, go[i].timestamp, universe_timestamp, go[i].type); */
-			if (!go[i].alive && go[i].type != OBJTYPE_SHIP1)
-				continue;
+		ic.c = c;
+		ic.count = 0;
+		ic.ncandidates = 0;
+		i = lookup_by_id(c->shipid);
+		ic.ship = i < 0 ? NULL : &go[i];
+		if (c->ship_index >= 0 && c->ship_index <= snis_object_pool_highest_object(pool)) {
+			ic.x = go[c->ship_index].x;
+			ic.y = go[c->ship_index].y;
+			ic.z = go[c->ship_index].z;
+			space_partition_process_in_radius(space_partition, ic.x, ic.y, ic.z,
+					INTEREST_NEAR_RADIUS, &ic, queue_up_nearby_client_object);
+			space_partition_process_slice(space_partition,
+					universe_timestamp % INTEREST_FAR_PERIOD, INTEREST_FAR_PERIOD,
+					ic.x, ic.y, ic.z, INTEREST_NEAR_RADIUS,
+					&ic, queue_up_distant_client_object);
+		} else {
+			ic.x = 0.0;
+			ic.y = 0.0;
+			ic.z = 0.0;
+			for (i = 0; i <= snis_object_pool_highest_object(pool); i++)
+				queue_up_client_object(&ic, &go[i]);
+		}
+		update_client_origin(c);
+		send_update_candidates(&ic);
+		queue_up_client_damcon_update(c);
+		flush_udp_datagram(c);
+		/* printf("queued up %d updates for client\n", ic.count); */
+
+		c->timestamp = universe_timestamp;
+	}
+	pthread_mutex_unlock(&universe_mutex);
+}
+
+static void queue_up_to_clients_that_care(struct snis_entity *o)
+{
+	int i;
+	for (i = 0; i < nclients; i++) {
+		struct game_client *c = &client[i];
+
+		if (!c->refcount)
+			continue;
+
+		if (too_far_away_to_care(c, o))
+			return;
+
+		if (o->timestamp != c->go_clients[go_index(o)].last_timestamp_sent) {
+			queue_up_client_object_update(c, o);
+			c->go_clients[go_index(o)].last_timestamp_sent = o->timestamp;
+		}
+	}
+}
+
+static void queue_up_client_id(struct game_client *c)
+{
+	/* tell the client what his ship id is. */
+	pb_queue_to_client(c, packed_buffer_new("bw", OPCODE_ID_CLIENT_SHIP, c->shipid));
+}
+
+#define SIMULATE_SLOW_SERVER 0
+#if SIMULATE_SLOW_SERVER
+static void simulate_slow_server(__attribute__((unused)) int x)
+{
+	/* sleep an extra amount between 2/10th and 4/10ths seconds */
+	sleep_double(0.02 + 0.2 * ((double) snis_randn(100) / 100.0));
+}
+#else
+#define simulate_slow_server(x)
+#endif
+	
+/* client updates are written this many times per universe tick */
+#define CLIENT_UPDATE_OVERCLOCK 4
+
+static void *per_client_write_thread(__attribute__((unused)) void /* struct game_client */ *client)
+{
+	struct game_client *c = (struct game_client *) client;
+
+	/* Wait for client[] array to get fully updated before proceeding. */
+	client_lock();
+	get_client(c);
+	client_unlock();
+
+	const uint8_t over_clock = CLIENT_UPDATE_OVERCLOCK;
+	const double maxTimeBehind = 0.5;
+	double delta = 1.0/10.0/(double)over_clock;
+
+	uint8_t no_write_count = 0;
+	double currentTime = time_now_double();
+	double nextTime = currentTime + delta;
+	while (1) {
+		if (c->socket < 0)
+			break;
+
+		currentTime = time_now_double();
+
+		if (currentTime - nextTime > maxTimeBehind)
+			nextTime = currentTime;
+
+		if (currentTime >= nextTime) {
+			queue_up_client_updates(c);
+			write_queued_updates_to_client(c, over_clock, &no_write_count);
+
+			nextTime += delta;
+		} else {
+			double timeToSleep = nextTime-currentTime;
+			if (timeToSleep > 0)
+				sleep_double(timeToSleep);
+		}
+		simulate_slow_server(0);
+	}
+	log_client_info(SNIS_INFO, c->socket, "client writer thread exiting.\n");
+	pthread_mutex_lock(&universe_mutex);
+	client_lock();
+	put_client(c);
+	client_unlock();
+	pthread_mutex_unlock(&universe_mutex);
+	return NULL;
+}
+
+#if HAVE_EPOLL
+/*
+ * Optionally, instead of a reader thread and a writer thread per client,
+ * a small fixed number of epoll based event loops own all the client
+ * sockets.  Each loop reads client requests as they arrive, and on a
+ * timer, queues up and writes client updates.  Writes never block the loop,
+ * whatever the socket won't take right now is kept in c->pending_write and
+ * flushed when the socket becomes writable.  Set SNIS_SERVER_EVENT_LOOPS
+ * to the number of loops wanted to enable this.
+ */
+#define MAX_EVENT_LOOPS 16
+static int nevent_loops = 0;
+static struct event_loop {
+	int epfd;
+	int timerfd;
+	pthread_t thread;
+} event_loop[MAX_EVENT_LOOPS];
+
+static void event_loop_set_pollout(struct event_loop *loop, struct game_client *c, int on)
+{
+	struct epoll_event ev;
+
+	if (c->pollout_armed == on)
+		return;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, c->socket, &ev) < 0) {
+		snis_log(SNIS_ERROR, "epoll_ctl(EPOLL_CTL_MOD) failed: %s\n", strerror(errno));
+		return;
+	}
+	c->pollout_armed = on;
+}
+
+/* returns 0 if everything pending has been written, 1 if some remains, -1 on error */
+static int event_loop_write_pending(struct game_client *c)
+{
+	struct iovec iov[CLIENT_WRITE_IOV_BATCH];
+	struct packed_buffer_queue_entry *i;
+	int n, rc, nbytes, written;
+
+	while (c->pending_write) {
+		n = queue_entries_to_iovec(c->pending_write, c->pending_offset,
+						iov, ARRAY_SIZE(iov), &nbytes);
+		written = snis_try_writevsocket(c->socket, iov, n);
+		if (written < 0)
+			return -1;
+
+		/* Release whatever has been completely written */
+		rc = written + c->pending_offset;
+		while ((i = c->pending_write) && rc >= i->buffer->buffer_cursor) {
+			rc -= i->buffer->buffer_cursor;
+			c->pending_write = i->next;
+			i->next = NULL;
+			packed_buffer_queue_entries_free(i);
+		}
+		c->pending_offset = rc;
+		if (written < nbytes) /* socket is full */
+			return 1;
+	}
+	c->pending_offset = 0;
+	return 0;
+}
+
+static void event_loop_flush_client(struct event_loop *loop, struct game_client *c)
+{
+	int rc;
+
+	if (c->pending_write) {
+		rc = event_loop_write_pending(c);
+		if (rc < 0)
+			goto badclient;
+		if (rc > 0) /* socket still backed up, keep queueing. */
+			return;
+	}
+
+	queue_requested_universe_timestamp(c);
+	if (c->no_write_count > CLIENT_UPDATE_OVERCLOCK) {
+		/* no-op, just so we know if client is still there */
+		pb_queue_to_client(c, packed_buffer_new("b", OPCODE_NOOP));
+	}
+	c->pending_write = detach_client_queue(c);
+	c->pending_offset = 0;
+	if (!c->pending_write) {
+		c->no_write_count++;
+		event_loop_set_pollout(loop, c, 0);
+		return;
+	}
+	if (c->recorder)
+		record_queue_entries(c, c->pending_write);
+	if (c->deflater) {
+		c->pending_write = deflate_queue_entries(c, c->pending_write);
+		if (!c->pending_write) {
+			snis_log(SNIS_ERROR, "failed to compress client updates\n");
+			goto badclient;
+		}
+	}
+	c->no_write_count = 0;
+	count_client_bytes_written(c, c->pending_write);
+	rc = event_loop_write_pending(c);
+	if (rc < 0)
+		goto badclient;
+	event_loop_set_pollout(loop, c, rc > 0);
+	return;
+
+badclient:
+	snis_log(SNIS_ERROR, "writesocket failed, errno = %d(%s)\n", errno, strerror(errno));
+	log_client_info(SNIS_WARN, c->socket, "disconnected, failed writing socket\n");
+	shutdown(c->socket, SHUT_RDWR);
+	close(c->socket);
+	c->socket = -1;
+}
+
+static void event_loop_read_client(struct game_client *c)
+{
+	/* Process everything the client has sent us so far.  A fixed length
+	 * request which has only partially arrived stays buffered until the
+	 * rest of it shows up.
+	 */
+	process_instructions_from_client(c);
+}
+
+static void event_loop_drop_client(struct game_client *c)
+{
+	/* closing the socket has already removed it from the epoll set */
+	packed_buffer_queue_entries_free(c->pending_write);
+	c->pending_write = NULL;
+	log_client_info(SNIS_INFO, c->socket, "client event loop dropping client\n");
+	pthread_mutex_lock(&universe_mutex);
+	client_lock();
+	c->event_loop = -1;
+	put_client(c);
+	client_unlock();
+	pthread_mutex_unlock(&universe_mutex);
+}
+
+static void event_loop_tick(struct event_loop *loop)
+{
+	struct game_client *mine[MAXCLIENTS];
+	int i, n, loop_index = loop - event_loop;
+
+	n = 0;
+	client_lock();
+	for (i = 0; i < nclients; i++)
+		if (client[i].refcount && client[i].event_loop == loop_index)
+			mine[n++] = &client[i];
+	client_unlock();
+
+	for (i = 0; i < n; i++) {
+		struct game_client *c = mine[i];
+
+		if (c->socket >= 0) {
+			queue_up_client_updates(c);
+			event_loop_flush_client(loop, c);
+		}
+		if (c->socket < 0)
+			event_loop_drop_client(c);
+	}
+}
 
-			if (too_far_away_to_care(c, &go[i]) &&
-				(universe_timestamp + i) % GO_TOO_FAR_UPDATE_PER_NTICKS != 0) {
+static void *event_loop_thread(void *arg)
+{
+	struct event_loop *loop = arg;
+	struct epoll_event ev[64];
+	uint64_t expirations;
+	int i, n;
 
-				gather_opcode_not_sent_stats(&go[i]);
-				continue;
+	while (1) {
+		n = epoll_wait(loop->epfd, ev, ARRAY_SIZE(ev), -1);
+		if (n < 0) {
+			if (errno != EINTR) {
+				snis_log(SNIS_ERROR, "epoll_wait failed: %s\n", strerror(errno));
+				sleep_double(0.1);
 			}
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			struct game_client *c = ev[i].data.ptr;
 
-			if (go[i].timestamp != c->go_clients[i].last_timestamp_sent) {
-				queue_up_client_object_update(c, &go[i]);
-				c->go_clients[i].last_timestamp_sent = go[i].timestamp;
-				count++;
+			if (!c) { /* timer */
+				if (read(loop->timerfd, &expirations, sizeof(expirations)) > 0)
+					event_loop_tick(loop);
+				continue;
 			}
-			queue_up_client_object_sdata_update(c, &go[i]);
+			if (c->event_loop < 0 || c->socket < 0)
+				continue;
+			if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				event_loop_read_client(c);
+			if (c->socket >= 0 && (ev[i].events & EPOLLOUT))
+				event_loop_flush_client(loop, c);
+			if (c->socket < 0)
+				event_loop_drop_client(c);
 		}
-		queue_up_client_damcon_update(c);
-		/* printf("queued up %d updates for client\n", count); */
-
-		c->timestamp = universe_timestamp;
 	}
-	pthread_mutex_unlock(&universe_mutex);
+	return NULL;
 }
 
-static void queue_up_to_clients_that_care(struct snis_entity *o)
+static void start_event_loops(void)
 {
-	int i;
-	for (i = 0; i < nclients; i++) {
-		struct game_client *c = &client[i];
+	struct itimerspec its;
+	struct epoll_event ev;
+	char *n = getenv("SNIS_SERVER_EVENT_LOOPS");
+	int i, rc;
 
-		if (!c->refcount)
-			continue;
+	if (!n || sscanf(n, "%d", &nevent_loops) != 1 || nevent_loops <= 0) {
+		nevent_loops = 0;
+		return;
+	}
+	if (nevent_loops > MAX_EVENT_LOOPS)
+		nevent_loops = MAX_EVENT_LOOPS;
 
-		if (too_far_away_to_care(c, o))
-			return;
+	memset(&its, 0, sizeof(its));
+	its.it_interval.tv_nsec = 1000000000 / (10 * CLIENT_UPDATE_OVERCLOCK);
+	its.it_value = its.it_interval;
 
-		if (o->timestamp != c->go_clients[go_index(o)].last_timestamp_sent) {
-			queue_up_client_object_update(c, o);
-			c->go_clients[go_index(o)].last_timestamp_sent = o->timestamp;
+	for (i = 0; i < nevent_loops; i++) {
+		struct event_loop *loop = &event_loop[i];
+
+		loop->epfd = epoll_create1(0);
+		loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if (loop->epfd < 0 || loop->timerfd < 0)
+			goto fail;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev) < 0)
+			goto fail;
+		if (timerfd_settime(loop->timerfd, 0, &its, NULL) < 0)
+			goto fail;
+		rc = pthread_create(&loop->thread, NULL, event_loop_thread, loop);
+		if (rc) {
+			errno = rc;
+			goto fail;
 		}
+		pthread_detach(loop->thread);
 	}
-}
+	snis_log(SNIS_INFO, "Using %d event loops to service clients\n", nevent_loops);
+	return;
 
-static void queue_up_client_id(struct game_client *c)
-{
-	/* tell the client what his ship id is. */
-	pb_queue_to_client(c, packed_buffer_new("bw", OPCODE_ID_CLIENT_SHIP, c->shipid));
+fail:
+	snis_log(SNIS_ERROR, "Failed to start client event loop %d: %s\n", i, strerror(errno));
+	fprintf(stderr, "Failed to start client event loop %d: %s\n", i, strerror(errno));
+	exit(1);
 }
 
-#define SIMULATE_SLOW_SERVER 0
-#if SIMULATE_SLOW_SERVER
-static void simulate_slow_server(__attribute__((unused)) int x)
-{
-	/* sleep an extra amount between 2/10th and 4/10ths seconds */
-	sleep_double(0.02 + 0.2 * ((double) snis_randn(100) / 100.0));
+/* Hand a freshly connected client over to one of the event loops. Assumes
+ * universe and client locks are held.
+ */
+static int event_loop_add_client(struct game_client *c)
+{
+	struct event_loop *loop;
+	struct epoll_event ev;
+	int flags;
+
+	c->event_loop = client_index(c) % nevent_loops;
+	loop = &event_loop[c->event_loop];
+	c->pending_write = NULL;
+	c->pending_offset = 0;
+	c->pollout_armed = 0;
+	c->no_write_count = 0;
+	flags = fcntl(c->socket, F_GETFL, 0);
+	if (flags < 0 || fcntl(c->socket, F_SETFL, flags | O_NONBLOCK) < 0)
+		goto fail;
+	get_client(c); /* the event loop's reference */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, c->socket, &ev) < 0) {
+		c->refcount--;
+		goto fail;
+	}
+	return 0;
+
+fail:
+	snis_log(SNIS_ERROR, "Failed to add client to event loop: %s\n", strerror(errno));
+	c->event_loop = -1;
+	return -1;
 }
 #else
-#define simulate_slow_server(x)
+#define nevent_loops 0
+#define start_event_loops()
+#define event_loop_add_client(c) (-1)
 #endif
-	
-static void *per_client_write_thread(__attribute__((unused)) void /* struct game_client */ *client)
-{
-	struct game_client *c = (struct game_client *) client;
-
-	/* Wait for client[] array to get fully updated before proceeding. */
-	client_lock();
-	get_client(c);
-	client_unlock();
-
-	const uint8_t over_clock = 4;
-	const double maxTimeBehind = 0.5;
-	double delta = 1.0/10.0/(double)over_clock;
-
-	uint8_t no_write_count = 0;
-	double currentTime = time_now_double();
-	double nextTime = currentTime + delta;
-	while (1) {
-		if (c->socket < 0)
-			break;
-
-		currentTime = time_now_double();
 
-		if (currentTime - nextTime > maxTimeBehind)
-			nextTime = currentTime;
+static uint32_t server_capabilities;
 
-		if (currentTime >= nextTime) {
-			queue_up_client_updates(c);
-			write_queued_updates_to_client(c, over_clock, &no_write_count);
+static void init_server_capabilities(void)
+{
+	char *z = getenv("SNIS_SERVER_COMPRESSION");
 
-			nextTime += delta;
-		} else {
-			double timeToSleep = nextTime-currentTime;
-			if (timeToSleep > 0)
-				sleep_double(timeToSleep);
-		}
-		simulate_slow_server(0);
-	}
-	log_client_info(SNIS_INFO, c->socket, "client writer thread exiting.\n");
-	pthread_mutex_lock(&universe_mutex);
-	client_lock();
-	put_client(c);
-	client_unlock();
-	pthread_mutex_unlock(&universe_mutex);
-	return NULL;
+	server_capabilities = SNIS_CAP_COMPRESSION_STATS;
+	if (!z || strcmp(z, "0") != 0)
+		server_capabilities |= SNIS_CAP_COMPRESSION;
+	if (delta_updates_enabled)
+		server_capabilities |= SNIS_CAP_DELTA_UPDATES;
+	if (compact_updates_enabled)
+		server_capabilities |= SNIS_CAP_COMPACT_UPDATES;
+	if (udp_socket >= 0)
+		server_capabilities |= SNIS_CAP_UDP;
 }
 
-static int verify_client_protocol(int connection)
+/* Check the client speaks our protocol, and settle on the capabilities
+ * the connection will use: whichever of those the client asks for that
+ * we also support.  Older clients don't ask for anything.
+ */
+static int verify_client_protocol(int connection, uint32_t *capabilities)
 {
 	int rc;
 	char protocol_version[10];
+	uint32_t wanted;
+
+	*capabilities = 0;
 	rc = snis_readsocket(connection, protocol_version, strlen(SNIS_PROTOCOL_VERSION));
 	if (rc < 0)
 		return rc;
 	protocol_version[7] = '\0';
 	snis_log(SNIS_INFO, "protocol read...'%s'\n", protocol_version);
+	if (strcmp(protocol_version, SNIS_PROTOCOL_VERSION_1) == 0) {
+		snis_log(SNIS_INFO, "protocol verified.\n");
+		return 0;
+	}
 	if (strcmp(protocol_version, SNIS_PROTOCOL_VERSION) != 0)
 		return -1;
-	snis_log(SNIS_INFO, "protocol verified.\n");
+	rc = snis_readsocket(connection, &wanted, sizeof(wanted));
+	if (rc < 0)
+		return rc;
+	*capabilities = ntohl(wanted) & server_capabilities;
+	wanted = htonl(*capabilities);
+	rc = snis_writesocket(connection, &wanted, sizeof(wanted));
+	if (rc < 0)
+		return rc;
+	snis_log(SNIS_INFO, "protocol verified, capabilities 0x%08x.\n", *capabilities);
 	return 0;
 }
 
@@ -11748,11 +13443,36 @@ static int insane(unsigned char *word, int len)
 	return 0;
 }
 
+static struct packed_buffer *encode_econ_update_ship_packet(struct snis_entity *o, uint8_t opcode)
+{
+	int n;
+	int32_t victim_id;
+
+	n = o->tsd.ship.nai_entries - 1;
+	if (n < 0 || o->tsd.ship.ai[n].ai_mode != AI_MODE_ATTACK)
+		victim_id = -1;
+	else
+		victim_id = o->tsd.ship.ai[n].u.attack.victim_id;
+
+	struct update_econ_ship_packer_values v = {
+		.opcode = opcode,
+		.id = o->id,
+		.timestamp = o->timestamp,
+		.alive = o->alive,
+		.x = o->x,
+		.y = o->y,
+		.z = o->z,
+		.orientation = o->orientation,
+		.victim_id = victim_id,
+		.shiptype = o->tsd.ship.shiptype,
+	};
+	return update_econ_ship_packer_new(&v);
+}
+
 static void send_econ_update_ship_packet(struct game_client *c,
 	struct snis_entity *o)
 {
 	int n;
-	int32_t victim_id;
 	uint8_t ai[MAX_AI_STACK_ENTRIES];
 	int i;
 	uint8_t opcode = OPCODE_ECON_UPDATE_SHIP;
@@ -11792,16 +13512,7 @@ static void send_econ_update_ship_packet(struct game_client *c,
 			}
 		}
 	}
-	n = o->tsd.ship.nai_entries - 1;
-	if (n < 0 || o->tsd.ship.ai[n].ai_mode != AI_MODE_ATTACK)
-		victim_id = -1;
-	else
-		victim_id = o->tsd.ship.ai[n].u.attack.victim_id;
-
-	pb_queue_to_client(c, packed_buffer_new("bwwhSSSQwb", opcode,
-			o->id, o->timestamp, o->alive, o->x, (int32_t) UNIVERSE_DIM,
-			o->y, (int32_t) UNIVERSE_DIM, o->z, (int32_t) UNIVERSE_DIM,
-			&o->orientation, victim_id, o->tsd.ship.shiptype));
+	queue_encoded_update(c, o, opcode, encode_econ_update_ship_packet);
 
 	if (!c->debug_ai)
 		return;
@@ -11833,12 +13544,12 @@ static void send_econ_update_ship_packet(struct game_client *c,
 		return;
 
 	BUILD_ASSERT(MAX_AI_STACK_ENTRIES == 5);
-	packed_buffer_append(pb, "bbbbbSb",
+	packed_buffer_append(pb, UPDATE_ECON_SHIP_DEBUG_AI_FORMAT,
 			ai[0], ai[1], ai[2], ai[3], ai[4],
 			(double) o->tsd.ship.threat_level, (int32_t) UNIVERSE_DIM, npoints);
 
 	for (i = 0; i < npoints; i++) {
-		packed_buffer_append(pb, "SSS",
+		packed_buffer_append(pb, UPDATE_ECON_SHIP_DEBUG_AI_POINT_FORMAT,
 			v[i].v.x, (int32_t) UNIVERSE_DIM,
 			v[i].v.y, (int32_t) UNIVERSE_DIM,
 			v[i].v.z, (int32_t) UNIVERSE_DIM);
@@ -11916,75 +13627,80 @@ static void send_respawn_time(struct game_client *c,
 	pb_queue_to_client(c, packed_buffer_new("bb", OPCODE_UPDATE_RESPAWN_TIME, seconds));
 }
 
-static void send_update_power_model_data(struct game_client *c,
-		struct snis_entity *o)
+static struct packed_buffer *encode_update_power_model_data(struct snis_entity *o, uint8_t opcode)
 {
 	struct packed_buffer *pb;
 
 	pb = packed_buffer_allocate(sizeof(uint8_t) +
 			sizeof(o->tsd.ship.power_data) + sizeof(uint32_t));
-	packed_buffer_append(pb, "bwr", OPCODE_UPDATE_POWER_DATA, o->id,
+	packed_buffer_append(pb, "bwr", opcode, o->id,
 		(char *) &o->tsd.ship.power_data, (unsigned short) sizeof(o->tsd.ship.power_data)); 
-	pb_queue_to_client(c, pb);
+	return pb;
 }
 	
-static void send_update_coolant_model_data(struct game_client *c,
-		struct snis_entity *o)
+static struct packed_buffer *encode_update_coolant_model_data(struct snis_entity *o, uint8_t opcode)
 {
 	struct packed_buffer *pb;
 
 	pb = packed_buffer_allocate(sizeof(uint8_t) +
 			sizeof(o->tsd.ship.coolant_data) + sizeof(uint32_t) +
 			sizeof(o->tsd.ship.temperature_data));
-	packed_buffer_append(pb, "bwr", OPCODE_UPDATE_COOLANT_DATA, o->id,
+	packed_buffer_append(pb, "bwr", opcode, o->id,
 		(char *) &o->tsd.ship.coolant_data, (unsigned short) sizeof(o->tsd.ship.coolant_data));
 	packed_buffer_append(pb, "r",
 		(char *) &o->tsd.ship.temperature_data,
 			(unsigned short) sizeof(o->tsd.ship.temperature_data)); 
-	pb_queue_to_client(c, pb);
+	return pb;
 }
 
-static void send_update_ship_packet(struct game_client *c,
-	struct snis_entity *o, uint8_t opcode)
+static struct packed_buffer *encode_update_ship_packet(struct snis_entity *o, uint8_t opcode)
 {
-	struct packed_buffer *pb;
-	uint32_t fuel;
-	uint8_t tloading, tloaded, throttle, rpm;
-
-	throttle = o->tsd.ship.throttle;
-	rpm = o->tsd.ship.rpm;
-	fuel = o->tsd.ship.fuel;
+	uint8_t tloading, tloaded;
 
 	tloading = (uint8_t) (o->tsd.ship.torpedoes_loading & 0x0f);
 	tloaded = (uint8_t) (o->tsd.ship.torpedoes_loaded & 0x0f);
-	tloading = tloading | (tloaded << 4);
 
-	pb = packed_buffer_allocate(sizeof(struct update_ship_packet));
-	packed_buffer_append(pb, "bwwhSSS", opcode, o->id, o->timestamp, o->alive,
-			o->x, (int32_t) UNIVERSE_DIM, o->y, (int32_t) UNIVERSE_DIM,
-			o->z, (int32_t) UNIVERSE_DIM);
-	packed_buffer_append(pb, "RRRwwRRRbbbwbbbbbbbbbbbbbwQQQbb",
-			o->tsd.ship.yaw_velocity,
-			o->tsd.ship.pitch_velocity,
-			o->tsd.ship.roll_velocity,
-			o->tsd.ship.torpedoes, o->tsd.ship.power,
-			o->tsd.ship.gun_yaw_velocity,
-			o->tsd.ship.sci_heading,
-			o->tsd.ship.sci_beam_width,
-			tloading, throttle, rpm, fuel, o->tsd.ship.temp,
-			o->tsd.ship.scizoom, o->tsd.ship.weapzoom, o->tsd.ship.navzoom,
-			o->tsd.ship.mainzoom,
-			o->tsd.ship.warpdrive, o->tsd.ship.requested_warpdrive,
-			o->tsd.ship.requested_shield, o->tsd.ship.phaser_charge,
-			o->tsd.ship.phaser_wavelength, o->tsd.ship.shiptype,
-			o->tsd.ship.reverse, o->tsd.ship.trident,
-			o->tsd.ship.ai[0].u.attack.victim_id,
-			&o->orientation.vec[0],
-			&o->tsd.ship.sciball_orientation.vec[0],
-			&o->tsd.ship.weap_orientation.vec[0],
-			o->tsd.ship.in_secure_area,
-			o->tsd.ship.docking_magnets);
-	pb_queue_to_client(c, pb);
+	struct update_ship_packer_values v = {
+		.opcode = opcode,
+		.id = o->id,
+		.timestamp = o->timestamp,
+		.alive = o->alive,
+		.x = o->x,
+		.y = o->y,
+		.z = o->z,
+		.yaw_velocity = o->tsd.ship.yaw_velocity,
+		.pitch_velocity = o->tsd.ship.pitch_velocity,
+		.roll_velocity = o->tsd.ship.roll_velocity,
+		.torpedoes = o->tsd.ship.torpedoes,
+		.power = o->tsd.ship.power,
+		.gun_yaw_velocity = o->tsd.ship.gun_yaw_velocity,
+		.sci_heading = o->tsd.ship.sci_heading,
+		.sci_beam_width = o->tsd.ship.sci_beam_width,
+		.torpedoes_loading = tloading | (tloaded << 4),
+		.throttle = o->tsd.ship.throttle,
+		.rpm = o->tsd.ship.rpm,
+		.fuel = o->tsd.ship.fuel,
+		.temp = o->tsd.ship.temp,
+		.scizoom = o->tsd.ship.scizoom,
+		.weapzoom = o->tsd.ship.weapzoom,
+		.navzoom = o->tsd.ship.navzoom,
+		.mainzoom = o->tsd.ship.mainzoom,
+		.warpdrive = o->tsd.ship.warpdrive,
+		.requested_warpdrive = o->tsd.ship.requested_warpdrive,
+		.requested_shield = o->tsd.ship.requested_shield,
+		.phaser_charge = o->tsd.ship.phaser_charge,
+		.phaser_wavelength = o->tsd.ship.phaser_wavelength,
+		.shiptype = o->tsd.ship.shiptype,
+		.reverse = o->tsd.ship.reverse,
+		.trident = o->tsd.ship.trident,
+		.victim_id = o->tsd.ship.ai[0].u.attack.victim_id,
+		.orientation = o->orientation,
+		.sciball_orientation = o->tsd.ship.sciball_orientation,
+		.weap_orientation = o->tsd.ship.weap_orientation,
+		.in_secure_area = o->tsd.ship.in_secure_area,
+		.docking_magnets = o->tsd.ship.docking_magnets,
+	};
+	return update_ship_packer_new(&v);
 }
 
 static void send_update_damcon_obj_packet(struct game_client *c,
@@ -12028,44 +13744,55 @@ static void send_update_damcon_part_packet(struct game_client *c,
 					o->tsd.part.damage));
 }
 
-static void send_update_asteroid_packet(struct game_client *c,
-	struct snis_entity *o)
-{
-	pb_queue_to_client(c, packed_buffer_new("bwwSSSSSSbbbb", OPCODE_UPDATE_ASTEROID, o->id, o->timestamp,
-					o->x, (int32_t) UNIVERSE_DIM,
-					o->y, (int32_t) UNIVERSE_DIM,
-					o->z, (int32_t) UNIVERSE_DIM,
-					o->vx, (int32_t) UNIVERSE_DIM,
-					o->vy, (int32_t) UNIVERSE_DIM,
-					o->vz, (int32_t) UNIVERSE_DIM,
-					o->tsd.asteroid.carbon,
-					o->tsd.asteroid.nickeliron,
-					o->tsd.asteroid.silicates,
-					o->tsd.asteroid.preciousmetals));
+static struct packed_buffer *encode_update_asteroid_packet(struct snis_entity *o, uint8_t opcode)
+{
+	struct update_asteroid_packer_values v = {
+		.opcode = opcode,
+		.id = o->id,
+		.timestamp = o->timestamp,
+		.x = o->x,
+		.y = o->y,
+		.z = o->z,
+		.vx = o->vx,
+		.vy = o->vy,
+		.vz = o->vz,
+		.carbon = o->tsd.asteroid.carbon,
+		.nickeliron = o->tsd.asteroid.nickeliron,
+		.silicates = o->tsd.asteroid.silicates,
+		.preciousmetals = o->tsd.asteroid.preciousmetals,
+	};
+	return update_asteroid_packer_new(&v);
 }
 
-static void send_update_cargo_container_packet(struct game_client *c,
-	struct snis_entity *o)
+static struct packed_buffer *encode_update_cargo_container_packet(struct snis_entity *o, uint8_t opcode)
 {
-	pb_queue_to_client(c, packed_buffer_new("bwwSSS", OPCODE_UPDATE_CARGO_CONTAINER, o->id, o->timestamp,
-					o->x, (int32_t) UNIVERSE_DIM,
-					o->y, (int32_t) UNIVERSE_DIM,
-					o->z, (int32_t) UNIVERSE_DIM));
+	struct update_position_packer_values v = {
+		.opcode = opcode,
+		.id = o->id,
+		.timestamp = o->timestamp,
+		.x = o->x,
+		.y = o->y,
+		.z = o->z,
+	};
+	return update_position_packer_new(&v);
 }
 
-static void send_update_derelict_packet(struct game_client *c,
-	struct snis_entity *o)
+static struct packed_buffer *encode_update_derelict_packet(struct snis_entity *o, uint8_t opcode)
 {
-	pb_queue_to_client(c, packed_buffer_new("bwwSSSb", OPCODE_UPDATE_DERELICT, o->id, o->timestamp,
-					o->x, (int32_t) UNIVERSE_DIM,
-					o->y, (int32_t) UNIVERSE_DIM,
-					o->z, (int32_t) UNIVERSE_DIM,
-					o->tsd.derelict.shiptype));
+	struct update_derelict_packer_values v = {
+		.opcode = opcode,
+		.id = o->id,
+		.timestamp = o->timestamp,
+		.x = o->x,
+		.y = o->y,
+		.z = o->z,
+		.shiptype = o->tsd.derelict.shiptype,
+	};
+	return update_derelict_packer_new(&v);
 }
 
 
-static void send_update_planet_packet(struct game_client *c,
-	struct snis_entity *o)
+static struct packed_buffer *encode_update_planet_packet(struct snis_entity *o, uint8_t opcode)
 {
 	double ring;
 
@@ -12075,134 +13802,171 @@ static void send_update_planet_packet(struct game_client *c,
 	else
 		ring = 1.0;
 
-	pb_queue_to_client(c, packed_buffer_new("bwwSSSSwbbbbhbbbS", OPCODE_UPDATE_PLANET, o->id, o->timestamp,
-					o->x, (int32_t) UNIVERSE_DIM,
-					o->y, (int32_t) UNIVERSE_DIM,
-					o->z, (int32_t) UNIVERSE_DIM,
-					ring * (double) o->tsd.planet.radius, (int32_t) UNIVERSE_DIM,
-					o->tsd.planet.description_seed,
-					o->tsd.planet.government,
-					o->tsd.planet.tech_level,
-					o->tsd.planet.economy,
-					o->tsd.planet.security,
-					o->tsd.planet.contraband,
-					o->tsd.planet.atmosphere_r,
-					o->tsd.planet.atmosphere_g,
-					o->tsd.planet.atmosphere_b,
-					o->tsd.planet.atmosphere_scale, (int32_t) UNIVERSE_DIM));
-}
-
-static void send_update_wormhole_packet(struct game_client *c,
-	struct snis_entity *o)
-{
-	pb_queue_to_client(c, packed_buffer_new("bwwSSS", OPCODE_UPDATE_WORMHOLE,
-					o->id, o->timestamp,
-					o->x, (int32_t) UNIVERSE_DIM,
-					o->y, (int32_t) UNIVERSE_DIM,
-					o->z, (int32_t) UNIVERSE_DIM));
+	struct update_planet_packer_values v = {
+		.opcode = opcode,
+		.id = o->id,
+		.timestamp = o->timestamp,
+		.x = o->x,
+		.y = o->y,
+		.z = o->z,
+		.radius = ring * (double) o->tsd.planet.radius,
+		.description_seed = o->tsd.planet.description_seed,
+		.government = o->tsd.planet.government,
+		.tech_level = o->tsd.planet.tech_level,
+		.economy = o->tsd.planet.economy,
+		.security = o->tsd.planet.security,
+		.contraband = o->tsd.planet.contraband,
+		.atmosphere_r = o->tsd.planet.atmosphere_r,
+		.atmosphere_g = o->tsd.planet.atmosphere_g,
+		.atmosphere_b = o->tsd.planet.atmosphere_b,
+		.atmosphere_scale = o->tsd.planet.atmosphere_scale,
+	};
+	return update_planet_packer_new(&v);
 }
 
-static void send_update_starbase_packet(struct game_client *c,
-	struct snis_entity *o)
+static struct packed_buffer *encode_update_wormhole_packet(struct snis_entity *o, uint8_t opcode)
 {
-	pb_queue_to_client(c, packed_buffer_new("bwwSSSQ", OPCODE_UPDATE_STARBASE,
-					o->id, o->timestamp,
-					o->x, (int32_t) UNIVERSE_DIM,
-					o->y, (int32_t) UNIVERSE_DIM,
-					o->z, (int32_t) UNIVERSE_DIM,
-					&o->orientation));
+	struct update_position_packer_values v = {
+		.opcode = opcode,
+		.id = o->id,
+		.timestamp = o->timestamp,
+		.x = o->x,
+		.y = o->y,
+		.z = o->z,
+	};
+	return update_position_packer_new(&v);
 }
 
-static void send_update_nebula_packet(struct game_client *c,
-	struct snis_entity *o)
+static struct packed_buffer *encode_update_starbase_packet(struct snis_entity *o, uint8_t opcode)
 {
-	union quat q;
+	struct update_starbase_packer_values v = {
+		.opcode = opcode,
+		.id = o->id,
+		.timestamp = o->timestamp,
+		.x = o->x,
+		.y = o->y,
+		.z = o->z,
+		.orientation = o->orientation,
+	};
+	return update_starbase_packer_new(&v);
+}
+
+static struct packed_buffer *encode_update_nebula_packet(struct snis_entity *o, uint8_t opcode)
+{
+	struct update_nebula_packer_values v = {
+		.opcode = opcode,
+		.id = o->id,
+		.timestamp = o->timestamp,
+		.x = o->x,
+		.y = o->y,
+		.z = o->z,
+		.r = o->tsd.nebula.r,
+		.unrotated_orientation = o->tsd.nebula.unrotated_orientation,
+		.phase_angle = o->tsd.nebula.phase_angle,
+		.phase_speed = o->tsd.nebula.phase_speed,
+	};
 
-	quat_init_axis(&q, o->tsd.nebula.avx, o->tsd.nebula.avy, o->tsd.nebula.avz,
-			o->tsd.nebula.ava);
-	pb_queue_to_client(c, packed_buffer_new("bwwSSSSQQSS", OPCODE_UPDATE_NEBULA, o->id, o->timestamp,
-					o->x, (int32_t) UNIVERSE_DIM,
-					o->y, (int32_t) UNIVERSE_DIM,
-					o->z, (int32_t) UNIVERSE_DIM,
-					o->tsd.nebula.r, (int32_t) UNIVERSE_DIM,
-					&q,
-					&o->tsd.nebula.unrotated_orientation,
-					o->tsd.nebula.phase_angle, (int32_t) 360,
-					o->tsd.nebula.phase_speed, (int32_t) 100));
+	quat_init_axis(&v.angular_velocity, o->tsd.nebula.avx, o->tsd.nebula.avy,
+			o->tsd.nebula.avz, o->tsd.nebula.ava);
+	return update_nebula_packer_new(&v);
 }
 
-static void send_update_explosion_packet(struct game_client *c,
-	struct snis_entity *o)
+static struct packed_buffer *encode_update_explosion_packet(struct snis_entity *o, uint8_t opcode)
 {
-	pb_queue_to_client(c, packed_buffer_new("bwwSSShhhb", OPCODE_UPDATE_EXPLOSION, o->id, o->timestamp,
-				o->x, (int32_t) UNIVERSE_DIM, o->y, (int32_t) UNIVERSE_DIM,
-				o->z, (int32_t) UNIVERSE_DIM,
-				o->tsd.explosion.nsparks, o->tsd.explosion.velocity,
-				o->tsd.explosion.time, o->tsd.explosion.victim_type));
+	struct update_explosion_packer_values v = {
+		.opcode = opcode,
+		.id = o->id,
+		.timestamp = o->timestamp,
+		.x = o->x,
+		.y = o->y,
+		.z = o->z,
+		.nsparks = o->tsd.explosion.nsparks,
+		.velocity = o->tsd.explosion.velocity,
+		.time = o->tsd.explosion.time,
+		.victim_type = o->tsd.explosion.victim_type,
+	};
+	return update_explosion_packer_new(&v);
 }
 
-static void send_update_torpedo_packet(struct game_client *c,
-	struct snis_entity *o)
+static struct packed_buffer *encode_update_torpedo_packet(struct snis_entity *o, uint8_t opcode)
 {
-	pb_queue_to_client(c, packed_buffer_new("bwwwSSS", OPCODE_UPDATE_TORPEDO, o->id, o->timestamp,
-					o->tsd.torpedo.ship_id,
-					o->x, (int32_t) UNIVERSE_DIM,
-					o->y, (int32_t) UNIVERSE_DIM,
-					o->z, (int32_t) UNIVERSE_DIM));
+	struct update_torpedo_packer_values v = {
+		.opcode = opcode,
+		.id = o->id,
+		.timestamp = o->timestamp,
+		.ship_id = o->tsd.torpedo.ship_id,
+		.x = o->x,
+		.y = o->y,
+		.z = o->z,
+	};
+	return update_torpedo_packer_new(&v);
 }
 
-static void send_update_laser_packet(struct game_client *c,
-	struct snis_entity *o)
+static struct packed_buffer *encode_update_laser_packet(struct snis_entity *o, uint8_t opcode)
 {
-	pb_queue_to_client(c, packed_buffer_new("bwwwbSSSQ", OPCODE_UPDATE_LASER,
-					o->id, o->timestamp, o->tsd.laser.ship_id, o->tsd.laser.power,
-					o->x, (int32_t) UNIVERSE_DIM,
-					o->y, (int32_t) UNIVERSE_DIM,
-					o->z, (int32_t) UNIVERSE_DIM,
-					&o->orientation));
+	struct update_laser_packer_values v = {
+		.opcode = opcode,
+		.id = o->id,
+		.timestamp = o->timestamp,
+		.ship_id = o->tsd.laser.ship_id,
+		.power = o->tsd.laser.power,
+		.x = o->x,
+		.y = o->y,
+		.z = o->z,
+		.orientation = o->orientation,
+	};
+	return update_laser_packer_new(&v);
 }
 
-static void send_update_laserbeam_packet(struct game_client *c,
-	struct snis_entity *o)
+static struct packed_buffer *encode_update_laserbeam_packet(struct snis_entity *o, uint8_t opcode)
 {
-	pb_queue_to_client(c, packed_buffer_new("bwwww", OPCODE_UPDATE_LASERBEAM,
-					o->id, o->timestamp, o->tsd.laserbeam.origin,
-					o->tsd.laserbeam.target));
+	struct update_laserbeam_packer_values v = {
+		.opcode = opcode,
+		.id = o->id,
+		.timestamp = o->timestamp,
+		.origin = o->tsd.laserbeam.origin,
+		.target = o->tsd.laserbeam.target,
+	};
+	return update_laserbeam_packer_new(&v);
 }
 
-static void send_update_tractorbeam_packet(struct game_client *c,
-	struct snis_entity *o)
+static struct packed_buffer *encode_update_tractorbeam_packet(struct snis_entity *o, uint8_t opcode)
 {
-	pb_queue_to_client(c, packed_buffer_new("bwwww", OPCODE_UPDATE_TRACTORBEAM,
-					o->id, o->timestamp, o->tsd.laserbeam.origin,
-					o->tsd.laserbeam.target));
+	struct update_laserbeam_packer_values v = {
+		.opcode = opcode,
+		.id = o->id,
+		.timestamp = o->timestamp,
+		.origin = o->tsd.laserbeam.origin,
+		.target = o->tsd.laserbeam.target,
+	};
+	return update_laserbeam_packer_new(&v);
 }
 
-static void send_update_docking_port_packet(struct game_client *c,
-	struct snis_entity *o)
+static struct packed_buffer *encode_update_docking_port_packet(struct snis_entity *o, uint8_t opcode)
 {
-	double scale;
 	int model = o->tsd.docking_port.model;
 	int port = o->tsd.docking_port.portnumber;
 
-	scale = docking_port_info[model]->port[port].scale;
-	pb_queue_to_client(c, packed_buffer_new("bwwSSSSQb", OPCODE_UPDATE_DOCKING_PORT,
-					o->id, o->timestamp,
-					scale, (int32_t) 1000,
-					o->x, (int32_t) UNIVERSE_DIM,
-					o->y, (int32_t) UNIVERSE_DIM,
-					o->z, (int32_t) UNIVERSE_DIM,
-					&o->orientation,
-					o->tsd.docking_port.model));
+	struct update_docking_port_packer_values v = {
+		.opcode = opcode,
+		.id = o->id,
+		.timestamp = o->timestamp,
+		.scale = docking_port_info[model]->port[port].scale,
+		.x = o->x,
+		.y = o->y,
+		.z = o->z,
+		.orientation = o->orientation,
+		.model = o->tsd.docking_port.model,
+	};
+	return update_docking_port_packer_new(&v);
 }
 
-static void send_update_spacemonster_packet(struct game_client *c,
-	struct snis_entity *o)
+static struct packed_buffer *encode_update_spacemonster_packet(struct snis_entity *o, uint8_t opcode)
 {
-	pb_queue_to_client(c, packed_buffer_new("bwwSSS", OPCODE_UPDATE_SPACEMONSTER, o->id, o->timestamp,
+	return packed_buffer_new("bwwSSS", opcode, o->id, o->timestamp,
 					o->x, (int32_t) UNIVERSE_DIM,
 					o->z, (int32_t) UNIVERSE_DIM,
-					o->tsd.spacemonster.zz, (int32_t) UNIVERSE_DIM));
+					o->tsd.spacemonster.zz, (int32_t) UNIVERSE_DIM);
 }
 
 static int add_new_player(struct game_client *c)
@@ -12210,7 +13974,26 @@ static int add_new_player(struct game_client *c)
 	int rc;
 	struct add_player_packet app;
 
-	rc = snis_readsocket(c->socket, &app, sizeof(app));
+	c->input = snis_socket_reader_new(c->socket, CLIENT_INPUT_BUFFER_SIZE);
+	if (!c->input)
+		goto protocol_error;
+	if (record_prefix) {
+		char filename[PATH_MAX];
+
+		snprintf(filename, sizeof(filename), "%s.%d", record_prefix, (int) client_index(c));
+		c->recorder = snis_stream_recorder_new(filename);
+		if (!c->recorder)
+			snis_log(SNIS_ERROR, "can't record client stream to %s: %s\n",
+				filename, strerror(errno));
+		else
+			snis_log(SNIS_INFO, "recording client stream to %s\n", filename);
+	}
+	if (c->capabilities & SNIS_CAP_COMPRESSION) {
+		c->deflater = snis_deflater_new();
+		if (!c->deflater || snis_socket_reader_inflate(c->input))
+			goto protocol_error;
+	}
+	rc = snis_socket_reader_read(c->input, &app, sizeof(app));
 	if (rc)
 		return rc;
 	app.role = ntohl(app.role);
@@ -12259,11 +14042,17 @@ static int add_new_player(struct game_client *c)
 		c->ship_index = lookup_by_id(c->shipid);
 	}
 	c->debug_ai = 0;
+	c->delta_updates = !!(c->capabilities & SNIS_CAP_DELTA_UPDATES);
+	c->compact_updates = !!(c->capabilities & SNIS_CAP_COMPACT_UPDATES);
+	c->update_origin_sent = 0;
 	c->request_universe_timestamp = 0;
 	queue_up_client_id(c);
+	offer_udp_channel(c);
 
 	c->go_clients = malloc(sizeof(*c->go_clients) * MAXGAMEOBJS);
 	memset(c->go_clients, 0, sizeof(*c->go_clients) * MAXGAMEOBJS);
+	/* each object may have both an update and sdata pending */
+	c->candidate = malloc(sizeof(*c->candidate) * MAXGAMEOBJS * 2);
 	c->damcon_data_clients = malloc(sizeof(*c->damcon_data_clients) * MAXDAMCONENTITIES);
 	memset(c->damcon_data_clients, 0, sizeof(*c->damcon_data_clients) * MAXDAMCONENTITIES);
 
@@ -12281,6 +14070,7 @@ static void service_connection(int connection)
 	int i, j, rc, flag = 1;
 	int bridgenum, client_count;
 	int thread_count, iterations;
+	uint32_t capabilities;
 
 	log_client_info(SNIS_INFO, connection, "snis_server: servicing snis_client connection\n");
         /* get connection moved off the stack so that when the thread needs it,
@@ -12291,7 +14081,7 @@ static void service_connection(int connection)
 	if (i < 0)
 		snis_log(SNIS_ERROR, "setsockopt failed: %s.\n", strerror(errno));
 
-	if (verify_client_protocol(connection)) {
+	if (verify_client_protocol(connection, &capabilities)) {
 		log_client_info(SNIS_ERROR, connection, "disconnected, protocol violation\n");
 		close(connection);
 		return;
@@ -12315,22 +14105,31 @@ static void service_connection(int connection)
 
 	client[i].socket = connection;
 	client[i].timestamp = 0;  /* newborn client, needs everything */
+	client[i].capabilities = capabilities;
 
 	log_client_info(SNIS_INFO, connection, "add new player\n");
 
 	pthread_mutex_init(&client[i].client_write_queue_mutex, NULL);
 	packed_buffer_queue_init(&client[i].client_write_queue);
+	client[i].write_queue_bytes = 0;
+	client[i].write_queue_generation = 0;
+	client[i].update_origin_epoch = 0;
+	client[i].evicted = 0;
 
 	add_new_player(&client[i]);
 
+	/* initialize refcount to 1 to keep client[i] from getting reaped. */
+	client[i].refcount = 1;
+	client[i].event_loop = -1;
+
+	if (nevent_loops > 0 && event_loop_add_client(&client[i]) == 0)
+		goto client_added;
+
 	pthread_attr_init(&client[i].read_attr);
 	pthread_attr_setdetachstate(&client[i].read_attr, PTHREAD_CREATE_DETACHED);
 	pthread_attr_init(&client[i].write_attr);
 	pthread_attr_setdetachstate(&client[i].write_attr, PTHREAD_CREATE_DETACHED);
 
-	/* initialize refcount to 1 to keep client[i] from getting reaped. */
-	client[i].refcount = 1;
-
 	/* create threads... */
         rc = pthread_create(&client[i].read_thread,
 		&client[i].read_attr, per_client_read_thread, (void *) &client[i]);
@@ -12344,6 +14143,7 @@ static void service_connection(int connection)
 		snis_log(SNIS_ERROR, "per client write thread, pthread_create failed: %d %s %s\n",
 			rc, strerror(rc), strerror(errno));
 	}
+client_added:
 	client_count = 0;
 	bridgenum = client[i].bridge;
 	for (j = 0; j < nclients; j++) {
@@ -12360,7 +14160,9 @@ static void service_connection(int connection)
 		snis_queue_add_sound(CREWMEMBER_JOINED, ROLE_ALL,
 					bridgelist[bridgenum].shipid);
 
-	/* Wait for at least one of the threads to prevent premature reaping */
+	/* Wait for at least one of the threads to prevent premature reaping.
+	 * (An event loop has already taken its reference.)
+	 */
 	iterations = 0;
 	do {
 		pthread_mutex_lock(&universe_mutex);
@@ -12606,48 +14408,219 @@ static void move_damcon_entities(void)
 		move_damcon_entities_on_bridge(i);
 }
 
-#if GATHER_OPCODE_STATS
-int compare_opcode_stats(const void *a, const void *b)
+static void log_tick_profile(void)
+{
+	struct snis_tick_profile_stats st;
+	int i;
+
+	snis_tick_profile_stats(tick_profile, PROFILE_TICK, &st);
+	snis_log(SNIS_INFO, "Tick profile over the last %d ticks (usec):\n", st.window_ticks);
+	snis_log(SNIS_INFO, "%-16s %10s %10s %8s %8s %8s %8s %12s\n", "", "calls", "usec",
+			"max", "p50", "p90", "p99", "total usec");
+	for (i = 0; i < NUM_PROFILE_SLOTS; i++) {
+		if (!tick_profile_slot_name[i])
+			continue;
+		snis_tick_profile_stats(tick_profile, i, &st);
+		if (st.calls == 0)
+			continue;
+		snis_log(SNIS_INFO, "%-16s %10" PRIu64 " %10" PRIu64 " %8" PRIu64 " %8" PRIu64
+			" %8" PRIu64 " %8" PRIu64 " %12" PRIu64 "\n",
+			tick_profile_slot_name[i], st.window_calls, st.window_ns / 1000,
+			st.window_max_ns / 1000, st.p50_ns / 1000, st.p90_ns / 1000,
+			st.p99_ns / 1000, st.total_ns / 1000);
+	}
+}
+
+static void init_tick_profile(void)
 {
-	const struct opcode_stat *A = a;
-	const struct opcode_stat *B = b;
+	char *interval = getenv("SNIS_SERVER_TICK_PROFILE_LOG");
 
-	return B->bytes - A->bytes;
+	tick_profile = snis_tick_profile_new(NUM_PROFILE_SLOTS);
+	if (!tick_profile) {
+		fprintf(stderr, "Failed to allocate tick profile\n");
+		exit(1);
+	}
+	if (interval && sscanf(interval, "%lf", &tick_profile_log_interval) != 1)
+		tick_profile_log_interval = 0.0;
 }
 
-static void dump_opcode_stats(struct opcode_stat *data)
+static void record_tick_duration(double seconds)
 {
+	static double last_logged;
+	uint64_t usec = (uint64_t) (seconds * 1000000.0);
 	int i;
 
-	struct opcode_stat s[256];
+	__atomic_store_n(&last_tick_usec, usec, __ATOMIC_RELAXED);
+	snis_metrics_add(metrics, METRIC_TICKS, 1);
+	snis_metrics_add(metrics, METRIC_TICK_USEC, usec);
+	for (i = 0; i < TICK_DURATION_BUCKETS; i++)
+		if (seconds <= tick_duration_bucket[i])
+			snis_metrics_add(metrics, METRIC_TICK_BUCKET + i, 1);
 
-	if ((universe_timestamp % 50) != 0)
-		return;
+	snis_tick_profile_add(tick_profile, PROFILE_TICK, usec * 1000);
+	snis_tick_profile_end_tick(tick_profile);
+	if (tick_profile_log_interval > 0 &&
+		universe_timestamp_absolute - last_logged >= tick_profile_log_interval) {
+		last_logged = universe_timestamp_absolute;
+		log_tick_profile();
+	}
+}
 
-	memcpy(s, data, sizeof(s));
-	qsort(s, 256, sizeof(s[0]), compare_opcode_stats);
+static void emit_opcode_metric(FILE *f, uint64_t *total, int first, const char *name,
+				const char *help)
+{
+	int i;
 
-	printf("\n");
-	printf("%3s  %10s %15s %9s %10s %15s\n",
-		"Op", "Count", "total bytes", "bytes/op", "not sent", "saved bytes");
-	for (i = 0; i < 20; i++)
-		if (s[i].count != 0)
-			printf("%3hu: %10llu %15llu %9llu %10llu %15llu\n",
-				s[i].opcode, s[i].count, s[i].bytes, s[i].bytes / s[i].count,
-				s[i].count_not_sent,
-				s[i].count_not_sent * s[i].bytes / s[i].count);
-		else
-			printf("%3hu: %20llu %20llu %20s\n",
-				s[i].opcode, s[i].count, s[i].bytes, "n/a");
-	printf("\n");
+	snis_metrics_describe(f, name, "counter", help);
+	for (i = 0; i < 256; i++)
+		if (total[first + i])
+			fprintf(f, "%s{opcode=\"%d\"} %" PRIu64 "\n", name, i, total[first + i]);
+}
+
+static void emit_client_queue_depth(FILE *f, int buffers, const char *name, const char *help)
+{
+	struct packed_buffer_queue_entry *e;
+	uint64_t depth;
+	int i;
+
+	snis_metrics_describe(f, name, "gauge", help);
+	for (i = 0; i < nclients; i++) {
+		if (!client[i].refcount)
+			continue;
+		depth = 0;
+		pthread_mutex_lock(&client[i].client_write_queue_mutex);
+		for (e = client[i].client_write_queue.head; e; e = e->next)
+			depth += buffers ? 1 : e->buffer->buffer_cursor;
+		pthread_mutex_unlock(&client[i].client_write_queue_mutex);
+		fprintf(f, "%s{client=\"%d\",bridge=\"%d\"} %" PRIu64 "\n",
+			name, i, client[i].bridge, depth);
+	}
+}
+
+static void emit_client_metric(FILE *f, uint64_t *total, int first, const char *name,
+				const char *help)
+{
+	int i;
+
+	snis_metrics_describe(f, name, "counter", help);
+	for (i = 0; i < nclients; i++)
+		if (client[i].refcount)
+			fprintf(f, "%s{client=\"%d\",bridge=\"%d\"} %" PRIu64 "\n",
+				name, i, client[i].bridge, total[first + i]);
+}
+
+static void emit_bridge_metric(FILE *f, uint64_t *total, int first, const char *name,
+				const char *help, int nbridge, uint32_t *shipid)
+{
+	int i;
+
+	snis_metrics_describe(f, name, "counter", help);
+	for (i = 0; i < nbridge; i++)
+		fprintf(f, "%s{bridge=\"%d\",shipid=\"%u\"} %" PRIu64 "\n",
+			name, i, shipid[i], total[first + i]);
+}
+
+/* Write the traffic counters out, Prometheus text format, for the metrics listener */
+static void emit_server_metrics(FILE *f, __attribute__((unused)) void *cookie)
+{
+	uint64_t total[NUM_SERVER_METRICS];
+	uint32_t shipid[MAXCLIENTS];
+	int i, connected = 0, nbridge;
+
+	/* This runs on the metrics listener's thread, so copy the bridges out under the lock */
+	pthread_mutex_lock(&universe_mutex);
+	nbridge = nbridges;
+	for (i = 0; i < nbridge; i++)
+		shipid[i] = bridgelist[i].shipid;
+	pthread_mutex_unlock(&universe_mutex);
+
+	snis_metrics_sum(metrics, total);
+
+	emit_opcode_metric(f, total, METRIC_OPCODE_PACKETS, "snis_opcode_packets_total",
+		"Packets queued to clients, by opcode of their first byte.");
+	emit_opcode_metric(f, total, METRIC_OPCODE_BYTES, "snis_opcode_bytes_total",
+		"Bytes queued to clients, before compression, by opcode of their first byte.");
+	emit_opcode_metric(f, total, METRIC_OPCODE_NOT_SENT, "snis_opcode_not_sent_total",
+		"Updates skipped by the interest bands and science filtering, by opcode.");
+	snis_metrics_describe(f, "snis_opcode_not_sent_bytes", "gauge",
+		"Estimated bytes saved by skipped updates, at the average size of those sent.");
+	for (i = 0; i < 256; i++)
+		if (total[METRIC_OPCODE_NOT_SENT + i] && total[METRIC_OPCODE_PACKETS + i])
+			fprintf(f, "snis_opcode_not_sent_bytes{opcode=\"%d\"} %" PRIu64 "\n", i,
+				total[METRIC_OPCODE_NOT_SENT + i] * total[METRIC_OPCODE_BYTES + i] /
+				total[METRIC_OPCODE_PACKETS + i]);
+
+	client_lock();
+	snis_metrics_describe(f, "snis_clients", "gauge", "Connected clients.");
+	for (i = 0; i < nclients; i++)
+		if (client[i].refcount)
+			connected++;
+	fprintf(f, "snis_clients %d\n", connected);
+	emit_client_metric(f, total, METRIC_CLIENT_PACKETS, "snis_client_packets_total",
+		"Packets queued to each client.");
+	emit_client_metric(f, total, METRIC_CLIENT_BYTES, "snis_client_bytes_total",
+		"Bytes queued to each client, before compression.");
+	emit_client_metric(f, total, METRIC_CLIENT_BYTES_WRITTEN, "snis_client_bytes_written_total",
+		"Bytes written to each client's socket, after compression.");
+	emit_client_metric(f, total, METRIC_CLIENT_COALESCED, "snis_client_updates_coalesced_total",
+		"Queued updates replaced by newer ones while the client was behind.");
+	emit_client_metric(f, total, METRIC_CLIENT_UDP_BYTES, "snis_client_udp_bytes_sent_total",
+		"Bytes of object state updates sent to each client by UDP, headers included.");
+	emit_client_queue_depth(f, 0, "snis_client_queue_bytes",
+		"Bytes waiting in each client's write queue.");
+	emit_client_queue_depth(f, 1, "snis_client_queue_buffers",
+		"Buffers waiting in each client's write queue.");
+	emit_bridge_metric(f, total, METRIC_BRIDGE_PACKETS, "snis_bridge_packets_total",
+		"Packets queued to all the clients of each bridge.", nbridge, shipid);
+	emit_bridge_metric(f, total, METRIC_BRIDGE_BYTES, "snis_bridge_bytes_total",
+		"Bytes queued to all the clients of each bridge, before compression.",
+		nbridge, shipid);
+	client_unlock();
+
+	snis_metrics_describe(f, "snis_clients_evicted_total", "counter",
+		"Clients disconnected for falling too far behind.");
+	fprintf(f, "snis_clients_evicted_total %" PRIu64 "\n", total[METRIC_CLIENTS_EVICTED]);
+	snis_metrics_describe(f, "snis_tick_duration_seconds", "histogram",
+		"Time taken to move the universe along one tick.");
+	for (i = 0; i < TICK_DURATION_BUCKETS; i++)
+		fprintf(f, "snis_tick_duration_seconds_bucket{le=\"%g\"} %" PRIu64 "\n",
+			tick_duration_bucket[i], total[METRIC_TICK_BUCKET + i]);
+	fprintf(f, "snis_tick_duration_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n",
+		total[METRIC_TICKS]);
+	fprintf(f, "snis_tick_duration_seconds_sum %f\n", total[METRIC_TICK_USEC] / 1000000.0);
+	fprintf(f, "snis_tick_duration_seconds_count %" PRIu64 "\n", total[METRIC_TICKS]);
+	snis_metrics_describe(f, "snis_last_tick_duration_seconds", "gauge",
+		"Time taken by the most recent tick.");
+	fprintf(f, "snis_last_tick_duration_seconds %f\n",
+		__atomic_load_n(&last_tick_usec, __ATOMIC_RELAXED) / 1000000.0);
+}
+
+/* The counters are always kept; SNIS_SERVER_METRICS, a TCP port on the
+ * loopback interface or the path of a unix socket, says where to serve them.
+ */
+static void init_metrics(void)
+{
+	char *where = getenv("SNIS_SERVER_METRICS");
+
+	metrics = snis_metrics_new(NUM_SERVER_METRICS);
+	if (!metrics) {
+		fprintf(stderr, "Failed to allocate server metrics\n");
+		exit(1);
+	}
+	if (!where || !*where)
+		return;
+	if (snis_metrics_serve(where, emit_server_metrics, NULL)) {
+		snis_log(SNIS_ERROR, "Failed to serve metrics on %s: %s\n", where, strerror(errno));
+		fprintf(stderr, "Failed to serve metrics on %s: %s\n", where, strerror(errno));
+		return;
+	}
+	snis_log(SNIS_INFO, "Serving metrics on %s\n", where);
 }
-#else
-#define dump_opcode_stats(x)
-#endif
 
 static void move_objects(double absolute_time, int discontinuity)
 {
 	int i;
+	uint64_t start, now;
 
 	pthread_mutex_lock(&universe_mutex);
 	memset(faction_population, 0, sizeof(faction_population));
@@ -12661,10 +14634,12 @@ static void move_objects(double absolute_time, int discontinuity)
 			client[i].request_universe_timestamp = UPDATE_UNIVERSE_TIMESTAMP_COUNT;
 	}
 
-	dump_opcode_stats(write_opcode_stats);
-	for (i = 0; i <= snis_object_pool_highest_object(pool); i++) {
+	for_each_allocated_object(pool, i) {
 		if (go[i].alive) {
+			start = snis_tick_profile_clock();
 			go[i].move(&go[i]);
+			now = snis_tick_profile_clock();
+			snis_tick_profile_add(tick_profile, PROFILE_OBJTYPE + go[i].type, now - start);
 			if (go[i].type == OBJTYPE_SHIP2 &&
 				go[i].sdata.faction < ARRAY_SIZE(faction_population)) {
 				faction_population[go[i].sdata.faction]++;
@@ -12684,10 +14659,18 @@ static void move_objects(double absolute_time, int discontinuity)
 	for (i = 0; i < nfactions(); i++)
 		if (i == 0 || faction_population[lowest_faction] > faction_population[i])
 			lowest_faction = i;
+	start = snis_tick_profile_clock();
 	move_damcon_entities();
+	now = snis_tick_profile_clock();
+	snis_tick_profile_add(tick_profile, PROFILE_DAMCON, now - start);
 	pthread_mutex_unlock(&universe_mutex);
+	start = now;
 	fire_lua_timers();
+	now = snis_tick_profile_clock();
+	snis_tick_profile_add(tick_profile, PROFILE_LUA_TIMERS, now - start);
+	start = now;
 	fire_lua_callbacks(&callback_schedule);
+	snis_tick_profile_add(tick_profile, PROFILE_LUA_CALLBACKS, snis_tick_profile_clock() - start);
 }
 
 static void register_with_game_lobby(char *lobbyhost, int port,
@@ -12718,8 +14701,10 @@ static void register_with_game_lobby(char *lobbyhost, int port,
 
 void usage(void)
 {
-	fprintf(stderr, "snis_server lobbyserver gameinstance servernick location\n");
+	fprintf(stderr, "snis_server lobbyserver gameinstance servernick location \\\n"
+			"            [--enable-enscript] [--record file]\n");
 	fprintf(stderr, "For example: snis_server lobbyserver 'steves game' zuul Houston\n");
+	fprintf(stderr, "--record file records what is sent to the Nth client to file.N\n");
 	exit(0);
 }
 
@@ -12801,6 +14786,7 @@ static int run_initial_lua_scripts(void)
 static void process_lua_commands(void)
 {
 	char lua_command[PATH_MAX];
+	uint64_t start = snis_tick_profile_clock();
 	int rc;
 
 	pthread_mutex_lock(&universe_mutex);
@@ -12818,6 +14804,7 @@ static void process_lua_commands(void)
 		pthread_mutex_lock(&universe_mutex);
 	}
 	pthread_mutex_unlock(&universe_mutex);
+	snis_tick_profile_add(tick_profile, PROFILE_LUA_COMMANDS, snis_tick_profile_clock() - start);
 }
 
 static void lua_teardown(void)
@@ -12918,15 +14905,25 @@ int main(int argc, char *argv[])
 	struct timespec thirtieth_second;
 
 	take_your_locale_and_shove_it();
+	init_universe_mutex();
 	if (argc < 5) 
 		usage();
 
-	if (argc >= 6) {
-		if (strcmp(argv[5], "--enable-enscript") == 0) {
+	for (i = 5; i < argc; i++) {
+		if (strcmp(argv[i], "--enable-enscript") == 0) {
 			lua_enscript_enabled = 1;
 			fprintf(stderr, "WARNING: lua enscript enabled!\n");
 			fprintf(stderr, "THIS PERMITS USERS TO CREATE FILES ON THE SERVER\n");
+			continue;
+		}
+		if (strcmp(argv[i], "--record") == 0) {
+			if (i + 1 >= argc)
+				usage();
+			record_prefix = argv[++i];
+			continue;
 		}
+		/* Earlier versions took no options and ignored anything extra */
+		fprintf(stderr, "snis_server: ignoring unknown argument '%s'\n", argv[i]);
 	}
 
 	override_asset_dir();
@@ -12966,13 +14963,21 @@ int main(int argc, char *argv[])
 	memset(&thirtieth_second, 0, sizeof(thirtieth_second));
 	thirtieth_second.tv_nsec = 33333333; /* 1/30th second */
 
-	space_partition = space_partition_init(40, 40,
-			-UNIVERSE_LIMIT, UNIVERSE_LIMIT,
-			-UNIVERSE_LIMIT, UNIVERSE_LIMIT,
-			offsetof(struct snis_entity, partition));
-
+	space_partition = space_partition_init(SPACE_PARTITION_CELL_SIZE,
+			SPACE_PARTITION_NEIGHBORHOOD, offsetof(struct snis_entity, partition));
+
+	init_metrics();
+	init_delta_updates();
+	init_compact_updates();
+	init_update_scheduler();
+	init_queue_coalescing();
+	init_udp_channel();
+	init_tick_profile();
+	init_server_capabilities();
+	init_request_lengths();
 	make_universe();
 	run_initial_lua_scripts();
+	start_event_loops();
 	port = start_listener_thread();
 
 	ignore_sigpipe();	
@@ -13000,6 +15005,7 @@ int main(int argc, char *argv[])
 			i++;
 			move_objects(nextTime, discontinuity);
 			process_lua_commands();
+			record_tick_duration(time_now_double() - currentTime);
 
 			discontinuity = 0;
 			nextTime += delta;
@@ -28,12 +28,23 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
 #include <stdint.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 #define DEFINE_SNIS_SOCKET_IO_GLOBALS
 #include "snis_socket_io.h"
@@ -53,6 +64,19 @@ static struct network_stats *netstats = NULL;
  * don't hang the other end.
  */
 
+/* Non-blocking sockets may hand us EAGAIN part way through a buffer,
+ * in which case we just wait for the socket to become ready again.
+ */
+static void wait_for_socket(int fd, short events)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	(void) poll(&pfd, 1, -1);
+}
+
 /* Function to read from a socket, restarting if EINTR... */
 int snis_readsocket(int fd, void *buffer, int buflen)
 {
@@ -82,8 +106,11 @@ int snis_readsocket(int fd, void *buffer, int buflen)
 		if (rc < 0) {
 			if (errno == -EINTR)
 				continue;
-			else
-				return rc;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				wait_for_socket(fd, POLLIN);
+				continue;
+			}
+			return rc;
 		}
 		len -= rc;
 		c += rc;
@@ -92,6 +119,564 @@ int snis_readsocket(int fd, void *buffer, int buflen)
 	} while (1);
 }
 
+/* Stream compression.  Each side of a connection which negotiated
+ * compression runs everything it writes through a deflater, ending each
+ * write cycle with a sync flush so the far end can decode it all
+ * straight away, and everything it reads through an inflating socket
+ * reader.
+ */
+struct snis_deflater {
+	z_stream strm;
+	unsigned char *out;
+	int outsize, outlen;
+};
+
+struct snis_inflater {
+	z_stream strm;
+	int rawstart, rawcount; /* compressed bytes read but not yet inflated */
+	unsigned char raw[];
+};
+
+static uint64_t thread_cpu_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+struct snis_deflater *snis_deflater_new(void)
+{
+	struct snis_deflater *z;
+
+	z = calloc(1, sizeof(*z));
+	if (!z)
+		return NULL;
+	if (deflateInit(&z->strm, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		free(z);
+		return NULL;
+	}
+	z->outsize = 16384;
+	z->out = malloc(z->outsize);
+	z->outlen = 0;
+	return z;
+}
+
+void snis_deflater_free(struct snis_deflater *z)
+{
+	deflateEnd(&z->strm);
+	free(z->out);
+	free(z);
+}
+
+/* Compress buflen bytes from buffer, adding the result to the deflater's
+ * output.  If flush is set, finish with a sync flush so the far end can
+ * decode everything compressed so far.  Returns 0, or -1 on error.
+ */
+int snis_deflate(struct snis_deflater *z, const void *buffer, int buflen, int flush)
+{
+	uint64_t start = netstats ? thread_cpu_usec() : 0;
+	int rc, outlen = z->outlen;
+
+	z->strm.next_in = (Bytef *) buffer;
+	z->strm.avail_in = buflen;
+	do {
+		if (z->outlen == z->outsize) {
+			unsigned char *out = realloc(z->out, z->outsize * 2);
+
+			if (!out)
+				return -1;
+			z->out = out;
+			z->outsize *= 2;
+		}
+		z->strm.next_out = z->out + z->outlen;
+		z->strm.avail_out = z->outsize - z->outlen;
+		rc = deflate(&z->strm, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+		if (rc == Z_STREAM_ERROR)
+			return -1;
+		z->outlen = z->outsize - z->strm.avail_out;
+	} while (z->strm.avail_out == 0);
+	if (netstats) {
+		netstats->bytes_deflated_in += buflen;
+		netstats->bytes_deflated_out += z->outlen - outlen;
+		netstats->compression_usec += thread_cpu_usec() - start;
+	}
+	return 0;
+}
+
+/* Returns the compressed output accumulated so far, and its length in *len.
+ * The output is then discarded, though the data remains valid until the
+ * next call to snis_deflate().
+ */
+unsigned char *snis_deflater_take_output(struct snis_deflater *z, int *len)
+{
+	*len = z->outlen;
+	z->outlen = 0;
+	return z->out;
+}
+
+/* Stream recording.  Everything read through a socket reader (after
+ * decompression) or written to a client (before compression) can be
+ * copied to a file as a sequence of records, each a 64 bit timestamp,
+ * microseconds since the recording started, and a 32 bit length, both in
+ * network byte order, followed by that many bytes of the stream.  A
+ * recording can be fed back through a replaying socket reader.
+ */
+#define SNIS_RECORDING_MAGIC "SNISREC1"
+
+struct snis_stream_recorder {
+	FILE *f;
+	uint64_t start;
+};
+
+struct snis_replay {
+	FILE *f;
+	int realtime;
+	uint64_t start;
+	uint32_t remaining; /* bytes of the current record not yet read */
+	uint64_t wait_usec; /* time spent reading and waiting for records */
+};
+
+static uint64_t monotonic_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		p[i] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+struct snis_stream_recorder *snis_stream_recorder_new(const char *filename)
+{
+	struct snis_stream_recorder *rec;
+	FILE *f;
+
+	f = fopen(filename, "w");
+	if (!f)
+		return NULL;
+	if (fwrite(SNIS_RECORDING_MAGIC, 1, 8, f) != 8) {
+		fclose(f);
+		return NULL;
+	}
+	rec = malloc(sizeof(*rec));
+	if (!rec) {
+		fclose(f);
+		return NULL;
+	}
+	rec->f = f;
+	rec->start = monotonic_usec();
+	return rec;
+}
+
+void snis_stream_recorder_free(struct snis_stream_recorder *rec)
+{
+	if (!rec)
+		return;
+	fclose(rec->f);
+	free(rec);
+}
+
+/* Append one record made of iovcnt pieces.  Returns 0, or -1 on error. */
+int snis_stream_recordv(struct snis_stream_recorder *rec, struct iovec *iov, int iovcnt)
+{
+	unsigned char hdr[12];
+	uint32_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (len == 0)
+		return 0;
+	put_be64(hdr, monotonic_usec() - rec->start);
+	len = htonl(len);
+	memcpy(&hdr[8], &len, sizeof(len));
+	if (fwrite(hdr, 1, sizeof(hdr), rec->f) != sizeof(hdr))
+		return -1;
+	for (i = 0; i < iovcnt; i++)
+		if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, rec->f) != iov[i].iov_len)
+			return -1;
+	return 0;
+}
+
+int snis_stream_record(struct snis_stream_recorder *rec, const void *buffer, int len)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *) buffer;
+	iov.iov_len = len;
+	return snis_stream_recordv(rec, &iov, 1);
+}
+
+/* Buffered socket reader.  Rather than one recv() per field, the reader
+ * pulls in as much as the socket has ready in a single readv() into a
+ * ring buffer, and callers copy their packets out of memory.  A packet
+ * may straddle the end of the ring, in which case it's copied out in two
+ * pieces.
+ */
+struct snis_socket_reader {
+	int fd;
+	int size;
+	int start; /* offset of first unread byte in buffer */
+	int count; /* number of unread bytes in buffer */
+	struct snis_inflater *inflater;
+	struct snis_stream_recorder *recorder; /* copy of everything read goes here */
+	struct snis_replay *replay; /* if reading a recording rather than a socket */
+	unsigned char buffer[];
+};
+
+struct snis_socket_reader *snis_socket_reader_new(int fd, int size)
+{
+	struct snis_socket_reader *r;
+
+	r = malloc(sizeof(*r) + size);
+	if (!r)
+		return NULL;
+	r->fd = fd;
+	r->size = size;
+	r->start = 0;
+	r->count = 0;
+	r->inflater = NULL;
+	r->recorder = NULL;
+	r->replay = NULL;
+	return r;
+}
+
+/* A reader which, rather than a socket, reads a recording made by
+ * snis_stream_recorder, either as fast as it can be consumed, or if
+ * realtime is set, with each record held back until as long after the
+ * reader was created as it was recorded after the recording started.
+ */
+struct snis_socket_reader *snis_socket_reader_replay_new(const char *filename, int realtime, int size)
+{
+	struct snis_socket_reader *r;
+	struct snis_replay *rp;
+	char magic[8];
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f)
+		return NULL;
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+		memcmp(magic, SNIS_RECORDING_MAGIC, sizeof(magic)) != 0) {
+		fprintf(stderr, "%s is not a snis recording\n", filename);
+		fclose(f);
+		return NULL;
+	}
+	rp = calloc(1, sizeof(*rp));
+	r = snis_socket_reader_new(-1, size);
+	if (!rp || !r) {
+		free(rp);
+		free(r);
+		fclose(f);
+		return NULL;
+	}
+	rp->f = f;
+	rp->realtime = realtime;
+	rp->start = monotonic_usec();
+	r->replay = rp;
+	return r;
+}
+
+/* Copy everything read from now on to rec, which the reader then owns */
+void snis_socket_reader_record(struct snis_socket_reader *r, struct snis_stream_recorder *rec)
+{
+	snis_stream_recorder_free(r->recorder);
+	r->recorder = rec;
+}
+
+/* Microseconds a replaying reader has spent reading and waiting for records */
+uint64_t snis_socket_reader_replay_wait_usec(struct snis_socket_reader *r)
+{
+	return r->replay ? r->replay->wait_usec : 0;
+}
+
+void snis_socket_reader_free(struct snis_socket_reader *r)
+{
+	if (r->inflater) {
+		inflateEnd(&r->inflater->strm);
+		free(r->inflater);
+	}
+	if (r->replay) {
+		fclose(r->replay->f);
+		free(r->replay);
+	}
+	snis_stream_recorder_free(r->recorder);
+	free(r);
+}
+
+/* Everything read from the socket from now on is decompressed.  Anything
+ * already buffered must have been consumed.  Returns 0, or -1 on error.
+ */
+int snis_socket_reader_inflate(struct snis_socket_reader *r)
+{
+	struct snis_inflater *z;
+
+	if (r->inflater || r->count || r->replay)
+		return -1;
+	z = calloc(1, sizeof(*z) + r->size);
+	if (!z)
+		return -1;
+	if (inflateInit(&z->strm) != Z_OK) {
+		free(z);
+		return -1;
+	}
+	r->inflater = z;
+	return 0;
+}
+
+/* Returns the number of bytes already read from the socket but not yet
+ * consumed, i.e. the number of bytes snis_socket_reader_read() can
+ * return without a system call.
+ */
+int snis_socket_reader_buffered(struct snis_socket_reader *r)
+{
+	return r->count;
+}
+
+/* readv() at least one byte, waiting if need be.  Returns the number of
+ * bytes read, or -1 on error or EOF.
+ */
+static int readv_some(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t rc;
+
+	do {
+		rc = readv(fd, iov, iovcnt);
+		if (rc == 0) { /* other side closed conn */
+			fprintf(stderr, "readsocket other side closed conn\n");
+			return -1;
+		}
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				wait_for_socket(fd, POLLIN);
+				continue;
+			}
+			return -1;
+		}
+	} while (rc < 0);
+	if (netstats)
+		netstats->bytes_recd += rc;
+	return rc;
+}
+
+/* Inflate compressed data into the ring, reading more from the socket
+ * only when nothing could be produced from what we already have.
+ */
+static int snis_socket_reader_fill_inflated(struct snis_socket_reader *r)
+{
+	struct snis_inflater *z = r->inflater;
+	int tail, space, rc, produced, consumed, total = 0;
+	struct iovec iov;
+	uint64_t start;
+
+	do {
+		if (z->rawcount == 0) {
+			iov.iov_base = z->raw;
+			iov.iov_len = r->size;
+			rc = readv_some(r->fd, &iov, 1);
+			if (rc < 0)
+				return -1;
+			z->rawstart = 0;
+			z->rawcount = rc;
+		}
+		tail = (r->start + r->count) % r->size;
+		space = tail >= r->start ? r->size - tail : r->start - tail;
+		start = netstats ? thread_cpu_usec() : 0;
+		z->strm.next_in = z->raw + z->rawstart;
+		z->strm.avail_in = z->rawcount;
+		z->strm.next_out = &r->buffer[tail];
+		z->strm.avail_out = space;
+		rc = inflate(&z->strm, Z_SYNC_FLUSH);
+		if (rc != Z_OK && rc != Z_BUF_ERROR)
+			return -1;
+		produced = space - z->strm.avail_out;
+		consumed = z->rawcount - z->strm.avail_in;
+		if (produced == 0 && consumed == 0 && z->rawcount)
+			return -1;
+		r->count += produced;
+		z->rawstart += consumed;
+		z->rawcount -= consumed;
+		total += produced;
+		if (netstats) {
+			netstats->bytes_inflated_in += consumed;
+			netstats->bytes_inflated_out += produced;
+			netstats->compression_usec += thread_cpu_usec() - start;
+		}
+	} while (total == 0 || (z->rawcount && r->count < r->size));
+	return 0;
+}
+
+/* Like readv_some(), but from the next record(s) of a recording, waiting
+ * for the time the record was made if replaying in real time.
+ */
+static int replay_some(struct snis_replay *rp, struct iovec *iov, int iovcnt)
+{
+	unsigned char hdr[12];
+	uint64_t t0 = monotonic_usec(), now, when;
+	uint32_t len;
+	int i, n, total = 0;
+
+	if (rp->remaining == 0) {
+		if (fread(hdr, 1, sizeof(hdr), rp->f) != sizeof(hdr))
+			return -1; /* end of recording */
+		when = get_be64(hdr);
+		memcpy(&len, &hdr[8], sizeof(len));
+		rp->remaining = ntohl(len);
+		if (rp->realtime) {
+			now = monotonic_usec();
+			if (rp->start + when > now)
+				usleep(rp->start + when - now);
+		}
+	}
+	for (i = 0; i < iovcnt && rp->remaining; i++) {
+		n = iov[i].iov_len;
+		if ((uint32_t) n > rp->remaining)
+			n = rp->remaining;
+		if (fread(iov[i].iov_base, 1, n, rp->f) != (size_t) n)
+			return -1;
+		rp->remaining -= n;
+		total += n;
+	}
+	rp->wait_usec += monotonic_usec() - t0;
+	return total;
+}
+
+/* Record the n bytes the ring gained by a fill which began at offset tail */
+static void snis_socket_reader_record_ring(struct snis_socket_reader *r, int tail, int n)
+{
+	struct iovec iov[2];
+
+	iov[0].iov_base = &r->buffer[tail];
+	iov[0].iov_len = n;
+	iov[1].iov_base = &r->buffer[0];
+	iov[1].iov_len = 0;
+	if (tail + n > r->size) {
+		iov[0].iov_len = r->size - tail;
+		iov[1].iov_len = n - (r->size - tail);
+	}
+	if (snis_stream_recordv(r->recorder, iov, 2)) {
+		fprintf(stderr, "stream recording failed, stopping it: %s\n", strerror(errno));
+		snis_stream_recorder_free(r->recorder);
+		r->recorder = NULL;
+	}
+}
+
+/* Read whatever the socket has for us, up to the free space in the ring,
+ * blocking until at least one byte arrives.  Returns 0 or -1 on error or EOF.
+ */
+int snis_socket_reader_fill(struct snis_socket_reader *r)
+{
+	struct iovec iov[2];
+	int iovcnt, tail, rc, before = r->count;
+
+	if (r->count == r->size)
+		return 0;
+	tail = (r->start + r->count) % r->size;
+	if (r->inflater) {
+		rc = snis_socket_reader_fill_inflated(r);
+		if (rc == 0 && r->recorder)
+			snis_socket_reader_record_ring(r, tail, r->count - before);
+		return rc;
+	}
+	iov[0].iov_base = &r->buffer[tail];
+	if (tail >= r->start) {
+		iov[0].iov_len = r->size - tail;
+		iov[1].iov_base = &r->buffer[0];
+		iov[1].iov_len = r->start;
+		iovcnt = r->start ? 2 : 1;
+	} else {
+		iov[0].iov_len = r->start - tail;
+		iovcnt = 1;
+	}
+	if (r->replay)
+		rc = replay_some(r->replay, iov, iovcnt);
+	else
+		rc = readv_some(r->fd, iov, iovcnt);
+	if (rc < 0)
+		return -1;
+	r->count += rc;
+	if (r->recorder)
+		snis_socket_reader_record_ring(r, tail, rc);
+	return 0;
+}
+
+/* Copy n bytes out of the ring, which must hold at least n bytes */
+static void snis_socket_reader_copy(struct snis_socket_reader *r, unsigned char *buffer, int n)
+{
+	int first = r->size - r->start;
+
+	if (first > n)
+		first = n;
+	memcpy(buffer, &r->buffer[r->start], first);
+	memcpy(buffer + first, &r->buffer[0], n - first);
+	r->start = (r->start + n) % r->size;
+	r->count -= n;
+}
+
+/* Copy the next buflen bytes into buffer without consuming them.
+ * Returns 0, or -1 if fewer than buflen bytes are buffered.
+ */
+int snis_socket_reader_peek(struct snis_socket_reader *r, void *buffer, int buflen)
+{
+	int first;
+
+	if (r->count < buflen)
+		return -1;
+	first = r->size - r->start;
+	if (first > buflen)
+		first = buflen;
+	memcpy(buffer, &r->buffer[r->start], first);
+	memcpy((unsigned char *) buffer + first, &r->buffer[0], buflen - first);
+	return 0;
+}
+
+/* Like snis_readsocket(), but served from the reader's ring buffer,
+ * which is refilled from the socket only when it runs dry.
+ */
+int snis_socket_reader_read(struct snis_socket_reader *r, void *buffer, int buflen)
+{
+	unsigned char *c = buffer;
+	int n, len = buflen;
+
+	while (len > 0) {
+		if (r->count == 0 && snis_socket_reader_fill(r))
+			return -1;
+		n = r->count < len ? r->count : len;
+		snis_socket_reader_copy(r, c, n);
+		c += n;
+		len -= n;
+	}
+	if (protocol_debugging_enabled && r->fd >= 0 && r->fd < MAX_DEBUGGABLE_SOCKETS && dbgbuf[r->fd]) {
+		int dbglen = buflen;
+		if (dbglen > 100)
+			dbglen = 100;
+		memcpy(dbgbuf[r->fd]->buf, buffer, dbglen);
+		dbgbuf[r->fd]->len = dbglen;
+	}
+	return 0;
+}
+
 /* Function to write to a socket, restarting if EINTR... */
 int snis_writesocket(int fd, void *buffer, int buflen)
 {
@@ -108,8 +693,11 @@ int snis_writesocket(int fd, void *buffer, int buflen)
 		if (rc < 0) {
 			if (errno == -EINTR)
 				continue;
-			else
-				return rc;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				wait_for_socket(fd, POLLOUT);
+				continue;
+			}
+			return rc;
 		}
 		len -= rc;
 		c += rc;
@@ -118,6 +706,105 @@ int snis_writesocket(int fd, void *buffer, int buflen)
 	} while (1);
 }
 
+/* Write as much of buffer as the socket will take without blocking.
+ * Returns the number of bytes written (possibly 0), or -1 on error.
+ */
+int snis_try_writesocket(int fd, void *buffer, int buflen)
+{
+	int rc;
+
+	do {
+		rc = send(fd, buffer, buflen, MSG_DONTWAIT);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return -1;
+	}
+	if (netstats)
+		netstats->bytes_sent += rc;
+	return rc;
+}
+
+/* Skip the first n bytes of an iovec array, adjusting *iov and *iovcnt */
+static void iovec_advance(struct iovec **iov, int *iovcnt, size_t n)
+{
+	while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+		n -= (*iov)->iov_len;
+		(*iov)++;
+		(*iovcnt)--;
+	}
+	if (*iovcnt > 0) {
+		(*iov)->iov_base = (char *) (*iov)->iov_base + n;
+		(*iov)->iov_len -= n;
+	}
+}
+
+static ssize_t sendiov(int fd, struct iovec *iov, int iovcnt, int flags)
+{
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+	return sendmsg(fd, &msg, flags);
+}
+
+/* Gather write an iovec array to a socket, restarting if EINTR or
+ * on partial writes.  The iovec array is modified.
+ */
+int snis_writevsocket(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t rc;
+
+	iovec_advance(&iov, &iovcnt, 0); /* skip leading empty entries */
+	while (iovcnt > 0) {
+		rc = sendiov(fd, iov, iovcnt, 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				wait_for_socket(fd, POLLOUT);
+				continue;
+			}
+			return -1;
+		}
+		if (netstats)
+			netstats->bytes_sent += rc;
+		iovec_advance(&iov, &iovcnt, rc);
+	}
+	return 0;
+}
+
+/* Gather write as much of an iovec array as the socket will take without
+ * blocking.  Returns the number of bytes written (possibly 0), or -1 on error.
+ * The iovec array is not modified.
+ */
+int snis_try_writevsocket(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t rc;
+
+	do {
+		rc = sendiov(fd, iov, iovcnt, MSG_DONTWAIT);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return -1;
+	}
+	if (netstats)
+		netstats->bytes_sent += rc;
+	return rc;
+}
+
+/* Returns true if there is data waiting to be read on the socket */
+int snis_socket_has_data(int fd)
+{
+	unsigned char c;
+
+	return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
 void ignore_sigpipe(void)
 {
 	(void) signal(SIGPIPE, SIG_IGN);
@@ -128,6 +815,11 @@ void snis_collect_netstats(struct network_stats *ns)
 	netstats = ns;
 	netstats->bytes_sent = 0;
 	netstats->bytes_recd = 0;
+	netstats->bytes_deflated_in = 0;
+	netstats->bytes_deflated_out = 0;
+	netstats->bytes_inflated_in = 0;
+	netstats->bytes_inflated_out = 0;
+	netstats->compression_usec = 0;
 	gettimeofday(&netstats->start, NULL);
 }
 
@@ -161,3 +853,227 @@ void snis_print_last_buffer(int socket)
 		printf("%02x ", dbgbuf[socket]->buf[i]);
 	printf("\n");
 }
+
+#ifdef TEST_SOCKET_IO
+static int test_socket_reader(void)
+{
+	int sv[2], i, j, n, total = 4000;
+	unsigned char out[4000], in[64];
+	struct snis_socket_reader *r;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+	for (i = 0; i < total; i++)
+		out[i] = (unsigned char) (i * 7);
+	if (snis_writesocket(sv[0], out, total)) {
+		printf("snis_writesocket failed\n");
+		return 1;
+	}
+	close(sv[0]);
+
+	/* A small, odd sized ring so that reads straddle the end of it,
+	 * and some reads are bigger than the whole ring.
+	 */
+	r = snis_socket_reader_new(sv[1], 13);
+	for (i = 0, n = 1; i < total; i += n, n = n % 50 + 1) {
+		if (n > total - i)
+			n = total - i;
+		if (snis_socket_reader_read(r, in, n)) {
+			printf("snis_socket_reader_read failed at offset %d\n", i);
+			return 1;
+		}
+		for (j = 0; j < n; j++) {
+			if (in[j] != out[i + j]) {
+				printf("snis_socket_reader_read: mismatch at offset %d\n", i + j);
+				return 1;
+			}
+		}
+	}
+	if (snis_socket_reader_buffered(r) != 0) {
+		printf("snis_socket_reader: %d bytes left over\n", snis_socket_reader_buffered(r));
+		return 1;
+	}
+	if (snis_socket_reader_read(r, in, 1) == 0) {
+		printf("snis_socket_reader_read did not notice EOF\n");
+		return 1;
+	}
+	snis_socket_reader_free(r);
+	close(sv[1]);
+
+	/* Peeking must not consume anything, even across the end of the ring */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+	r = snis_socket_reader_new(sv[1], 13);
+	snis_writesocket(sv[0], out, 20);
+	if (snis_socket_reader_read(r, in, 10) || snis_socket_reader_fill(r) ||
+		snis_socket_reader_buffered(r) != 10) {
+		printf("snis_socket_reader_fill failed\n");
+		return 1;
+	}
+	if (snis_socket_reader_peek(r, in, 11) == 0 || snis_socket_reader_peek(r, in, 10) ||
+		memcmp(in, &out[10], 10) || snis_socket_reader_buffered(r) != 10) {
+		printf("snis_socket_reader_peek failed\n");
+		return 1;
+	}
+	snis_socket_reader_free(r);
+	close(sv[0]);
+	close(sv[1]);
+	return 0;
+}
+
+/* Compressed writes, each ending in a sync flush, must be readable through
+ * an inflating reader straight away, whatever the size of its ring.
+ */
+static int test_compressed_stream(void)
+{
+	int sv[2], i, j, n, len, total = 100000;
+	static unsigned char out[100000], in[100000];
+	struct snis_deflater *z;
+	struct snis_socket_reader *r;
+	static struct network_stats ns; /* netstats keeps pointing at it afterwards */
+	unsigned char *zout;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+	snis_collect_netstats(&ns);
+	for (i = 0; i < total; i++) /* something compressible, but not too */
+		out[i] = (unsigned char) ((i / 7) ^ (i % 13));
+	z = snis_deflater_new();
+	r = snis_socket_reader_new(sv[1], 97);
+	if (!z || !r || snis_socket_reader_inflate(r)) {
+		printf("snis_deflater_new or snis_socket_reader_inflate failed\n");
+		return 1;
+	}
+	for (i = 0, n = 1; i < total; i += n, n = n * 3 % 1000 + 1) {
+		if (n > total - i)
+			n = total - i;
+		/* one write cycle, in two pieces */
+		if (snis_deflate(z, &out[i], n / 2, 0) ||
+			snis_deflate(z, &out[i + n / 2], n - n / 2, 1)) {
+			printf("snis_deflate failed\n");
+			return 1;
+		}
+		zout = snis_deflater_take_output(z, &len);
+		if (snis_writesocket(sv[0], zout, len)) {
+			printf("snis_writesocket failed\n");
+			return 1;
+		}
+		/* everything written so far must be readable without more input */
+		if (snis_socket_reader_read(r, in, n)) {
+			printf("snis_socket_reader_read failed at offset %d\n", i);
+			return 1;
+		}
+		for (j = 0; j < n; j++) {
+			if (in[j] != out[i + j]) {
+				printf("compressed stream: mismatch at offset %d\n", i + j);
+				return 1;
+			}
+		}
+	}
+	if (ns.bytes_deflated_in != total || ns.bytes_inflated_out != total ||
+		ns.bytes_deflated_out != ns.bytes_inflated_in ||
+		ns.bytes_deflated_out >= ns.bytes_deflated_in) {
+		printf("compressed stream: bad stats %llu -> %llu, %llu -> %llu\n",
+			(unsigned long long) ns.bytes_deflated_in,
+			(unsigned long long) ns.bytes_deflated_out,
+			(unsigned long long) ns.bytes_inflated_in,
+			(unsigned long long) ns.bytes_inflated_out);
+		return 1;
+	}
+	snis_deflater_free(z);
+	snis_socket_reader_free(r);
+	close(sv[0]);
+	close(sv[1]);
+	return 0;
+}
+
+/* What a reader records must replay as the same stream, however the
+ * reads and the records are split up.
+ */
+static int test_record_replay(void)
+{
+	char filename[] = "/tmp/test-socket-io-XXXXXX";
+	int sv[2], i, n, fd, total = 5000;
+	unsigned char out[5000], in[5000];
+	struct snis_socket_reader *r;
+	struct snis_stream_recorder *rec;
+
+	fd = mkstemp(filename);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+	for (i = 0; i < total; i++)
+		out[i] = (unsigned char) (i * 13);
+	rec = snis_stream_recorder_new(filename);
+	if (!rec) {
+		printf("snis_stream_recorder_new failed\n");
+		return 1;
+	}
+	r = snis_socket_reader_new(sv[1], 97);
+	snis_socket_reader_record(r, rec);
+	for (i = 0; i < total; i += n) {
+		n = (i / 7) % 300 + 1;
+		if (n > total - i)
+			n = total - i;
+		snis_writesocket(sv[0], &out[i], n);
+		if (snis_socket_reader_read(r, in, n) || memcmp(in, &out[i], n)) {
+			printf("recording reader failed at offset %d\n", i);
+			return 1;
+		}
+	}
+	snis_socket_reader_free(r);
+	close(sv[0]);
+	close(sv[1]);
+
+	r = snis_socket_reader_replay_new(filename, 0, 61);
+	if (!r) {
+		printf("snis_socket_reader_replay_new failed\n");
+		return 1;
+	}
+	for (i = 0; i < total; i += n) {
+		n = i % 37 + 1;
+		if (n > total - i)
+			n = total - i;
+		if (snis_socket_reader_read(r, in, n) || memcmp(in, &out[i], n)) {
+			printf("replay differs at offset %d\n", i);
+			return 1;
+		}
+	}
+	if (snis_socket_reader_read(r, in, 1) == 0) {
+		printf("replay did not notice the end of the recording\n");
+		return 1;
+	}
+	snis_socket_reader_free(r);
+	unlink(filename);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+
+	rc = test_socket_reader();
+	printf("test_socket_reader %s\n", rc ? "failed" : "passed");
+	if (rc)
+		return rc;
+	rc = test_compressed_stream();
+	printf("test_compressed_stream %s\n", rc ? "failed" : "passed");
+	if (rc)
+		return rc;
+	rc = test_record_replay();
+	printf("test_record_replay %s\n", rc ? "failed" : "passed");
+	return rc;
+}
+#endif
@@ -33,16 +33,48 @@ OTHER DEALINGS IN THE SOFTWARE.
 #define GLOBAL extern
 #endif
 
+struct iovec;
+struct snis_socket_reader;
+struct snis_deflater;
+struct snis_stream_recorder;
+
 struct network_stats {
 	uint64_t bytes_sent;
 	uint64_t bytes_recd;
 	struct timeval start;
 	uint32_t nobjects, nships;
+	uint64_t bytes_deflated_in, bytes_deflated_out; /* before and after compression */
+	uint64_t bytes_inflated_in, bytes_inflated_out; /* before and after decompression */
+	uint64_t compression_usec; /* CPU time spent compressing and decompressing */
 };
 
 /* Functions to read/write from a socket, restarting if EINTR... */
 GLOBAL int snis_readsocket(int fd, void *buffer, int buflen);
 GLOBAL int snis_writesocket(int fd, void *buffer, int buflen);
+GLOBAL int snis_try_writesocket(int fd, void *buffer, int buflen);
+GLOBAL int snis_writevsocket(int fd, struct iovec *iov, int iovcnt);
+GLOBAL int snis_try_writevsocket(int fd, struct iovec *iov, int iovcnt);
+GLOBAL int snis_socket_has_data(int fd);
+GLOBAL struct snis_socket_reader *snis_socket_reader_new(int fd, int size);
+GLOBAL void snis_socket_reader_free(struct snis_socket_reader *r);
+GLOBAL int snis_socket_reader_read(struct snis_socket_reader *r, void *buffer, int buflen);
+GLOBAL int snis_socket_reader_peek(struct snis_socket_reader *r, void *buffer, int buflen);
+GLOBAL int snis_socket_reader_fill(struct snis_socket_reader *r);
+GLOBAL int snis_socket_reader_inflate(struct snis_socket_reader *r);
+GLOBAL struct snis_deflater *snis_deflater_new(void);
+GLOBAL void snis_deflater_free(struct snis_deflater *z);
+GLOBAL int snis_deflate(struct snis_deflater *z, const void *buffer, int buflen, int flush);
+GLOBAL unsigned char *snis_deflater_take_output(struct snis_deflater *z, int *len);
+GLOBAL int snis_socket_reader_buffered(struct snis_socket_reader *r);
+GLOBAL struct snis_socket_reader *snis_socket_reader_replay_new(const char *filename,
+						int realtime, int size);
+GLOBAL uint64_t snis_socket_reader_replay_wait_usec(struct snis_socket_reader *r);
+GLOBAL void snis_socket_reader_record(struct snis_socket_reader *r,
+						struct snis_stream_recorder *rec);
+GLOBAL struct snis_stream_recorder *snis_stream_recorder_new(const char *filename);
+GLOBAL void snis_stream_recorder_free(struct snis_stream_recorder *rec);
+GLOBAL int snis_stream_record(struct snis_stream_recorder *rec, const void *buffer, int len);
+GLOBAL int snis_stream_recordv(struct snis_stream_recorder *rec, struct iovec *iov, int iovcnt);
 GLOBAL void ignore_sigpipe(void);
 GLOBAL void snis_collect_netstats(struct network_stats *ns);
 GLOBAL void snis_protocol_debugging(int enable);
@@ -0,0 +1,235 @@
+/*
+        Copyright (C) 2010 Stephen M. Cameron
+        Author: Stephen M. Cameron
+
+        This file is part of Spacenerds In Space.
+
+        Spacenerds in Space is free software; you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+        (at your option) any later version.
+
+        Spacenerds in Space is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with Spacenerds in Space; if not, write to the Free Software
+        Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define DEFINE_SNIS_TICK_PROFILE_GLOBALS
+#include "snis_tick_profile.h"
+
+struct slot_tick {
+	uint64_t ns, max_ns;
+	uint32_t calls;
+};
+
+struct slot_total {
+	uint64_t calls, ns, max_ns;
+};
+
+struct snis_tick_profile {
+	int nslots;
+	struct slot_tick *current;	/* the tick in progress, tick thread only */
+	pthread_mutex_t lock;		/* protects the rest */
+	struct slot_total *total;
+	struct slot_tick *window;	/* SNIS_TICK_PROFILE_WINDOW rows of nslots */
+	int row;			/* next row of window to fill */
+	int nticks;
+};
+
+struct snis_tick_profile *snis_tick_profile_new(int nslots)
+{
+	struct snis_tick_profile *p;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+	p->nslots = nslots;
+	p->current = calloc(nslots, sizeof(*p->current));
+	p->total = calloc(nslots, sizeof(*p->total));
+	p->window = calloc((size_t) nslots * SNIS_TICK_PROFILE_WINDOW, sizeof(*p->window));
+	if (!p->current || !p->total || !p->window) {
+		snis_tick_profile_free(p);
+		return NULL;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	return p;
+}
+
+void snis_tick_profile_free(struct snis_tick_profile *p)
+{
+	if (!p)
+		return;
+	free(p->current);
+	free(p->total);
+	free(p->window);
+	free(p);
+}
+
+uint64_t snis_tick_profile_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void snis_tick_profile_add(struct snis_tick_profile *p, int slot, uint64_t ns)
+{
+	struct slot_tick *t;
+
+	if (slot < 0 || slot >= p->nslots)
+		return;
+	t = &p->current[slot];
+	t->ns += ns;
+	t->calls++;
+	if (ns > t->max_ns)
+		t->max_ns = ns;
+}
+
+void snis_tick_profile_end_tick(struct snis_tick_profile *p)
+{
+	struct slot_tick *row;
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	row = &p->window[p->row * p->nslots];
+	memcpy(row, p->current, p->nslots * sizeof(*row));
+	for (i = 0; i < p->nslots; i++) {
+		p->total[i].calls += row[i].calls;
+		p->total[i].ns += row[i].ns;
+		if (row[i].max_ns > p->total[i].max_ns)
+			p->total[i].max_ns = row[i].max_ns;
+	}
+	p->row = (p->row + 1) % SNIS_TICK_PROFILE_WINDOW;
+	if (p->nticks < SNIS_TICK_PROFILE_WINDOW)
+		p->nticks++;
+	pthread_mutex_unlock(&p->lock);
+	memset(p->current, 0, p->nslots * sizeof(*p->current));
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+/* nearest rank percentile of n sorted values, n > 0 */
+static uint64_t percentile(uint64_t *sorted, int n, int pct)
+{
+	int rank = (n * pct + 99) / 100;
+
+	if (rank < 1)
+		rank = 1;
+	return sorted[rank - 1];
+}
+
+void snis_tick_profile_stats(struct snis_tick_profile *p, int slot,
+				struct snis_tick_profile_stats *s)
+{
+	uint64_t ns[SNIS_TICK_PROFILE_WINDOW];
+	struct slot_tick *t;
+	int i;
+
+	memset(s, 0, sizeof(*s));
+	if (slot < 0 || slot >= p->nslots)
+		return;
+	pthread_mutex_lock(&p->lock);
+	s->calls = p->total[slot].calls;
+	s->total_ns = p->total[slot].ns;
+	s->max_ns = p->total[slot].max_ns;
+	s->window_ticks = p->nticks;
+	for (i = 0; i < p->nticks; i++) {
+		t = &p->window[i * p->nslots + slot];
+		s->window_calls += t->calls;
+		s->window_ns += t->ns;
+		if (t->max_ns > s->window_max_ns)
+			s->window_max_ns = t->max_ns;
+		ns[i] = t->ns;
+	}
+	pthread_mutex_unlock(&p->lock);
+	if (s->window_ticks == 0)
+		return;
+	qsort(ns, s->window_ticks, sizeof(ns[0]), compare_u64);
+	s->p50_ns = percentile(ns, s->window_ticks, 50);
+	s->p90_ns = percentile(ns, s->window_ticks, 90);
+	s->p99_ns = percentile(ns, s->window_ticks, 99);
+}
+
+#ifdef TEST_TICK_PROFILE
+static int check(const char *what, uint64_t value, uint64_t expected)
+{
+	if (value == expected)
+		return 0;
+	printf("%s is %llu, expected %llu\n", what,
+		(unsigned long long) value, (unsigned long long) expected);
+	return 1;
+}
+
+static int test_window(void)
+{
+	struct snis_tick_profile *p;
+	struct snis_tick_profile_stats s;
+	int i, errors = 0;
+
+	p = snis_tick_profile_new(2);
+	snis_tick_profile_stats(p, 0, &s);
+	errors += check("ticks before the first tick", s.window_ticks, 0);
+
+	/* slot 0 takes i * 1000ns in tick i, in two calls; slot 1 is idle */
+	for (i = 1; i <= 100; i++) {
+		snis_tick_profile_add(p, 0, i * 400);
+		snis_tick_profile_add(p, 0, i * 600);
+		snis_tick_profile_end_tick(p);
+	}
+	snis_tick_profile_add(p, 1, 5); /* not counted until the tick ends */
+	snis_tick_profile_stats(p, 0, &s);
+	errors += check("calls", s.calls, 200);
+	errors += check("total", s.total_ns, 5050 * 1000);
+	errors += check("max", s.max_ns, 60000);
+	errors += check("window ticks", s.window_ticks, 100);
+	errors += check("p50", s.p50_ns, 50000);
+	errors += check("p90", s.p90_ns, 90000);
+	errors += check("p99", s.p99_ns, 99000);
+	snis_tick_profile_stats(p, 1, &s);
+	errors += check("idle slot calls", s.calls, 0);
+	errors += check("idle slot p99", s.p99_ns, 0);
+
+	/* Once the window is full, old ticks fall out of it but not the totals */
+	for (i = 0; i < SNIS_TICK_PROFILE_WINDOW; i++)
+		snis_tick_profile_end_tick(p);
+	snis_tick_profile_stats(p, 0, &s);
+	errors += check("calls after the window", s.calls, 200);
+	errors += check("max after the window", s.max_ns, 60000);
+	errors += check("window calls after the window", s.window_calls, 0);
+	errors += check("window max after the window", s.window_max_ns, 0);
+	errors += check("p99 after the window", s.p99_ns, 0);
+	snis_tick_profile_stats(p, 1, &s);
+	errors += check("late slot calls", s.calls, 1);
+
+	snis_tick_profile_add(p, 2, 1); /* out of range, ignored */
+	snis_tick_profile_free(p);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+
+	rc = test_window();
+	printf("test_window %s\n", rc ? "failed" : "passed");
+	return rc;
+}
+#endif
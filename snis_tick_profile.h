@@ -0,0 +1,67 @@
+#ifndef __SNIS_TICK_PROFILE_H__
+#define __SNIS_TICK_PROFILE_H__
+/*
+        Copyright (C) 2010 Stephen M. Cameron
+        Author: Stephen M. Cameron
+
+        This file is part of Spacenerds In Space.
+
+        Spacenerds in Space is free software; you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+        (at your option) any later version.
+
+        Spacenerds in Space is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with Spacenerds in Space; if not, write to the Free Software
+        Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Where the time in each tick goes.  The caller numbers the things it wants
+ * timed (slots), and adds the time each one takes as it happens, from the one
+ * thread which runs the tick, without taking any lock.  At the end of each
+ * tick, what each slot took during the tick is folded into running totals
+ * and into a window of the last SNIS_TICK_PROFILE_WINDOW ticks, from which
+ * percentiles of the time per tick are worked out when somebody asks.
+ */
+
+#ifdef DEFINE_SNIS_TICK_PROFILE_GLOBALS
+#define GLOBAL
+#else
+#define GLOBAL extern
+#endif
+
+#include <stdint.h>
+
+#define SNIS_TICK_PROFILE_WINDOW 128
+
+struct snis_tick_profile;
+
+struct snis_tick_profile_stats {
+	uint64_t calls, total_ns, max_ns;		/* since the profile was made */
+	uint64_t window_calls, window_ns, window_max_ns;/* over the window */
+	uint64_t p50_ns, p90_ns, p99_ns;		/* of the time per tick, over the window */
+	int window_ticks;
+};
+
+GLOBAL struct snis_tick_profile *snis_tick_profile_new(int nslots);
+GLOBAL void snis_tick_profile_free(struct snis_tick_profile *p);
+
+/* Monotonic nanoseconds, for timing what is passed to snis_tick_profile_add() */
+GLOBAL uint64_t snis_tick_profile_clock(void);
+
+/* Only to be called by the thread which runs the tick */
+GLOBAL void snis_tick_profile_add(struct snis_tick_profile *p, int slot, uint64_t ns);
+GLOBAL void snis_tick_profile_end_tick(struct snis_tick_profile *p);
+
+/* May be called from any thread */
+GLOBAL void snis_tick_profile_stats(struct snis_tick_profile *p, int slot,
+					struct snis_tick_profile_stats *s);
+
+#undef GLOBAL
+#endif
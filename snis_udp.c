@@ -0,0 +1,418 @@
+/*
+        Copyright (C) 2010 Stephen M. Cameron
+        Author: Stephen M. Cameron
+
+        This file is part of Spacenerds In Space.
+
+        Spacenerds in Space is free software; you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+        (at your option) any later version.
+
+        Spacenerds in Space is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with Spacenerds in Space; if not, write to the Free Software
+        Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define DEFINE_SNIS_UDP_GLOBALS
+#include "snis_udp.h"
+
+static const char snis_udp_hello_magic[] = "SNISUDP1";
+
+#define SHIM_DEPTH 256 /* datagrams held back by the shim at most */
+
+struct snis_udp_held {
+	int64_t due; /* msec */
+	int len;
+	unsigned char data[SNIS_UDP_DATAGRAM_MAX];
+};
+
+struct snis_udp_freshness {
+	int nslots;
+	struct {
+		uint32_t id, seq;
+		int used;
+	} slot[];
+};
+
+struct snis_udp_shim {
+	int loss, delay, jitter;
+	unsigned int seed;
+	int nheld;
+	struct snis_udp_held held[SHIM_DEPTH];
+};
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+		((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+void snis_udp_header_pack(unsigned char *buffer, uint32_t seq, const int32_t origin[3])
+{
+	int i;
+
+	buffer[0] = SNIS_UDP_VERSION;
+	put_be32(buffer + 1, seq);
+	for (i = 0; i < 3; i++)
+		put_be32(buffer + 5 + 4 * i, (uint32_t) origin[i]);
+}
+
+int snis_udp_header_unpack(const unsigned char *buffer, int len,
+				uint32_t *seq, int32_t origin[3])
+{
+	int i;
+
+	if (len < SNIS_UDP_HEADER_SIZE || buffer[0] != SNIS_UDP_VERSION)
+		return -1;
+	*seq = get_be32(buffer + 1);
+	for (i = 0; i < 3; i++)
+		origin[i] = (int32_t) get_be32(buffer + 5 + 4 * i);
+	return 0;
+}
+
+void snis_udp_hello_pack(unsigned char *buffer, uint32_t token)
+{
+	memcpy(buffer, snis_udp_hello_magic, 8);
+	put_be32(buffer + 8, token);
+}
+
+int snis_udp_hello_unpack(const unsigned char *buffer, int len, uint32_t *token)
+{
+	if (len != SNIS_UDP_HELLO_SIZE || memcmp(buffer, snis_udp_hello_magic, 8) != 0)
+		return -1;
+	*token = get_be32(buffer + 8);
+	return 0;
+}
+
+int snis_udp_seq_after(uint32_t seq, uint32_t last)
+{
+	return (int32_t) (seq - last) > 0;
+}
+
+struct snis_udp_freshness *snis_udp_freshness_new(int nslots)
+{
+	struct snis_udp_freshness *f;
+
+	f = calloc(1, sizeof(*f) + nslots * sizeof(f->slot[0]));
+	if (f)
+		f->nslots = nslots;
+	return f;
+}
+
+void snis_udp_freshness_free(struct snis_udp_freshness *f)
+{
+	free(f);
+}
+
+int snis_udp_fresh(struct snis_udp_freshness *f, uint32_t id, uint32_t seq)
+{
+	int i = (id * 2654435761u) % f->nslots;
+
+	if (f->slot[i].used && f->slot[i].id == id && !snis_udp_seq_after(seq, f->slot[i].seq))
+		return 0;
+	f->slot[i].id = id;
+	f->slot[i].seq = seq;
+	f->slot[i].used = 1;
+	return 1;
+}
+
+struct snis_udp_shim *snis_udp_shim_new(const char *spec)
+{
+	struct snis_udp_shim *shim;
+	const char *s;
+	int value;
+
+	if (!spec || !*spec)
+		return NULL;
+	shim = calloc(1, sizeof(*shim));
+	if (!shim)
+		return NULL;
+	shim->seed = (unsigned int) time(NULL);
+	for (s = spec; s && *s; s = strchr(s, ',') ? strchr(s, ',') + 1 : NULL) {
+		if (sscanf(s, "loss=%d", &value) == 1)
+			shim->loss = value;
+		else if (sscanf(s, "delay=%d", &value) == 1)
+			shim->delay = value;
+		else if (sscanf(s, "jitter=%d", &value) == 1)
+			shim->jitter = value;
+		else
+			fprintf(stderr, "snis_udp: ignoring '%s' in shim spec '%s'\n", s, spec);
+	}
+	if (shim->loss < 0)
+		shim->loss = 0;
+	if (shim->delay < 0)
+		shim->delay = 0;
+	if (shim->jitter < 0)
+		shim->jitter = 0;
+	return shim;
+}
+
+void snis_udp_shim_free(struct snis_udp_shim *shim)
+{
+	free(shim);
+}
+
+static int64_t msec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int wait_readable(int fd, int timeout_ms)
+{
+	struct pollfd pfd;
+	int rc;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	do {
+		rc = poll(&pfd, 1, timeout_ms);
+	} while (rc < 0 && errno == EINTR);
+	return rc;
+}
+
+/* Deliver the held datagram which is due soonest, if it is due yet */
+static int shim_deliver(struct snis_udp_shim *shim, int64_t now,
+			unsigned char *buffer, int buflen, int64_t *next_due)
+{
+	int i, first = -1, len;
+
+	for (i = 0; i < shim->nheld; i++)
+		if (first < 0 || shim->held[i].due < shim->held[first].due)
+			first = i;
+	if (first < 0)
+		return 0;
+	if (shim->held[first].due > now) {
+		*next_due = shim->held[first].due;
+		return 0;
+	}
+	len = shim->held[first].len;
+	if (len > buflen)
+		len = buflen;
+	memcpy(buffer, shim->held[first].data, len);
+	shim->nheld--;
+	if (first != shim->nheld)
+		shim->held[first] = shim->held[shim->nheld];
+	return len;
+}
+
+static void shim_hold(struct snis_udp_shim *shim, int64_t now, const unsigned char *data, int len)
+{
+	struct snis_udp_held *h;
+
+	if (shim->loss && (int) (rand_r(&shim->seed) % 100) < shim->loss)
+		return;
+	if (shim->nheld >= SHIM_DEPTH || len > SNIS_UDP_DATAGRAM_MAX)
+		return; /* it's only a shim, overflowing is just more loss */
+	h = &shim->held[shim->nheld++];
+	h->due = now + shim->delay;
+	if (shim->jitter)
+		h->due += rand_r(&shim->seed) % (shim->jitter + 1);
+	h->len = len;
+	memcpy(h->data, data, len);
+}
+
+int snis_udp_recv(int fd, struct snis_udp_shim *shim, unsigned char *buffer,
+			int buflen, int timeout_ms)
+{
+	unsigned char datagram[SNIS_UDP_DATAGRAM_MAX];
+	int64_t now, deadline, next_due;
+	int rc, wait;
+
+	if (!shim) {
+		rc = wait_readable(fd, timeout_ms);
+		if (rc <= 0)
+			return rc;
+		return recv(fd, buffer, buflen, MSG_DONTWAIT);
+	}
+
+	now = msec_now();
+	deadline = now + timeout_ms;
+	for (;;) {
+		next_due = deadline;
+		rc = shim_deliver(shim, now, buffer, buflen, &next_due);
+		if (rc > 0)
+			return rc;
+		if (next_due > deadline)
+			next_due = deadline;
+		wait = (int) (next_due - now);
+		if (wait < 0)
+			wait = 0;
+		rc = wait_readable(fd, wait);
+		if (rc < 0)
+			return -1;
+		now = msec_now();
+		if (rc > 0) {
+			rc = recv(fd, datagram, sizeof(datagram), MSG_DONTWAIT);
+			if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			if (rc > 0)
+				shim_hold(shim, now, datagram, rc);
+			continue;
+		}
+		if (now >= deadline)
+			return shim_deliver(shim, now, buffer, buflen, &next_due);
+	}
+}
+
+#ifdef TEST_UDP
+#define TEST_DATAGRAMS 1000
+
+static int test_headers(void)
+{
+	unsigned char buffer[SNIS_UDP_HEADER_SIZE];
+	int32_t origin[3] = { -1, 123456789, -2000000000 }, o[3];
+	uint32_t seq, token;
+
+	snis_udp_header_pack(buffer, 0xfffffffe, origin);
+	if (snis_udp_header_unpack(buffer, sizeof(buffer), &seq, o) ||
+		seq != 0xfffffffe || memcmp(o, origin, sizeof(o)) != 0) {
+		printf("header did not survive packing\n");
+		return 1;
+	}
+	if (snis_udp_header_unpack(buffer, sizeof(buffer) - 1, &seq, o) == 0) {
+		printf("short header accepted\n");
+		return 1;
+	}
+	snis_udp_hello_pack(buffer, 0xdeadbeef);
+	if (snis_udp_hello_unpack(buffer, SNIS_UDP_HELLO_SIZE, &token) || token != 0xdeadbeef) {
+		printf("hello did not survive packing\n");
+		return 1;
+	}
+	buffer[0] = 'X';
+	if (snis_udp_hello_unpack(buffer, SNIS_UDP_HELLO_SIZE, &token) == 0) {
+		printf("bad hello accepted\n");
+		return 1;
+	}
+	if (!snis_udp_seq_after(1, 0) || snis_udp_seq_after(0, 1) || snis_udp_seq_after(5, 5) ||
+		!snis_udp_seq_after(2, 0xfffffffe) || snis_udp_seq_after(0xfffffffe, 2)) {
+		printf("snis_udp_seq_after is wrong\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int test_freshness(void)
+{
+	struct snis_udp_freshness *f = snis_udp_freshness_new(64);
+
+	if (!snis_udp_fresh(f, 1000, 5) || !snis_udp_fresh(f, 1001, 3) ||
+		snis_udp_fresh(f, 1000, 4) || snis_udp_fresh(f, 1000, 5) ||
+		!snis_udp_fresh(f, 1001, 4) || !snis_udp_fresh(f, 1000, 6)) {
+		printf("snis_udp_fresh is wrong\n");
+		return 1;
+	}
+	snis_udp_freshness_free(f);
+	return 0;
+}
+
+/* Send TEST_DATAGRAMS through the shim and count what comes out */
+static int shim_run(const char *spec, int *received, int *reordered)
+{
+	struct snis_udp_shim *shim = snis_udp_shim_new(spec);
+	unsigned char buffer[SNIS_UDP_DATAGRAM_MAX];
+	int32_t origin[3] = { 0, 0, 0 };
+	uint32_t seq, last = 0;
+	int sv[2], i, n;
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0)
+		return -1;
+	*received = 0;
+	*reordered = 0;
+	for (i = 1; i <= TEST_DATAGRAMS; i++) {
+		snis_udp_header_pack(buffer, i, origin);
+		if (send(sv[0], buffer, SNIS_UDP_HEADER_SIZE, 0) < 0)
+			return -1;
+		usleep(200); /* keep well under SHIM_DEPTH datagrams in flight */
+		/* drain as we go, so the socket buffer never drops anything */
+		while ((n = snis_udp_recv(sv[1], shim, buffer, sizeof(buffer), 0)) > 0) {
+			if (snis_udp_header_unpack(buffer, n, &seq, origin))
+				return -1;
+			(*received)++;
+			if (!snis_udp_seq_after(seq, last))
+				(*reordered)++;
+			else
+				last = seq;
+		}
+	}
+	while ((n = snis_udp_recv(sv[1], shim, buffer, sizeof(buffer), 100)) > 0) {
+		if (snis_udp_header_unpack(buffer, n, &seq, origin))
+			return -1;
+		(*received)++;
+		if (!snis_udp_seq_after(seq, last))
+			(*reordered)++;
+		else
+			last = seq;
+	}
+	close(sv[0]);
+	close(sv[1]);
+	snis_udp_shim_free(shim);
+	return 0;
+}
+
+static int test_shim(void)
+{
+	int received, reordered;
+
+	if (shim_run(NULL, &received, &reordered) ||
+		received != TEST_DATAGRAMS || reordered != 0) {
+		printf("without a shim: %d received, %d reordered\n", received, reordered);
+		return 1;
+	}
+	if (shim_run("loss=30", &received, &reordered) ||
+		received < TEST_DATAGRAMS / 2 || received > TEST_DATAGRAMS * 9 / 10) {
+		printf("with 30%% loss: %d of %d received\n", received, TEST_DATAGRAMS);
+		return 1;
+	}
+	if (shim_run("delay=5,jitter=20", &received, &reordered) ||
+		received != TEST_DATAGRAMS || reordered == 0) {
+		printf("with jitter: %d received, %d reordered\n", received, reordered);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+
+	rc = test_headers();
+	printf("test_headers %s\n", rc ? "failed" : "passed");
+	if (rc)
+		return rc;
+	rc = test_freshness();
+	printf("test_freshness %s\n", rc ? "failed" : "passed");
+	if (rc)
+		return rc;
+	rc = test_shim();
+	printf("test_shim %s\n", rc ? "failed" : "passed");
+	return rc;
+}
+#endif
@@ -0,0 +1,95 @@
+#ifndef __SNIS_UDP_H__
+#define __SNIS_UDP_H__
+/*
+        Copyright (C) 2010 Stephen M. Cameron
+        Author: Stephen M. Cameron
+
+        This file is part of Spacenerds In Space.
+
+        Spacenerds in Space is free software; you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 2 of the License, or
+        (at your option) any later version.
+
+        Spacenerds in Space is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with Spacenerds in Space; if not, write to the Free Software
+        Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * The UDP side channel.  A client which negotiates SNIS_CAP_UDP is told,
+ * over TCP with OPCODE_UDP_CHANNEL, the server's UDP port and a token.  It
+ * sends hello datagrams holding the token to that port until datagrams
+ * start arriving, so the server learns where to send them.  The token is
+ * random, and hellos are only believed if they come from the same host as
+ * the client's TCP connection.
+ *
+ * Each datagram from the server is a header followed by whole object state
+ * updates, full or compact, just as they would appear in the TCP stream.
+ * The header has a sequence number, so the client can ignore an update of
+ * an object which arrives after a later one (see snis_udp_fresh()), and the
+ * origin which the compact updates in the datagram are relative to, since
+ * the OPCODE_UPDATE_ORIGIN in the TCP stream can't be relied on to arrive
+ * first.  Nothing which must arrive goes this way.
+ */
+
+#ifdef DEFINE_SNIS_UDP_GLOBALS
+#define GLOBAL
+#else
+#define GLOBAL extern
+#endif
+
+#include <stdint.h>
+
+#define SNIS_UDP_VERSION 1
+#define SNIS_UDP_HEADER_SIZE 17 /* version, sequence, origin */
+#define SNIS_UDP_HELLO_SIZE 12 /* "SNISUDP1", token */
+#define SNIS_UDP_DATAGRAM_MAX 1200 /* stay well under a typical path MTU */
+
+struct snis_udp_shim;
+struct snis_udp_freshness;
+
+GLOBAL void snis_udp_header_pack(unsigned char *buffer, uint32_t seq, const int32_t origin[3]);
+GLOBAL int snis_udp_header_unpack(const unsigned char *buffer, int len,
+				uint32_t *seq, int32_t origin[3]);
+GLOBAL void snis_udp_hello_pack(unsigned char *buffer, uint32_t token);
+GLOBAL int snis_udp_hello_unpack(const unsigned char *buffer, int len, uint32_t *token);
+
+/* Is seq later than last, allowing for wrap around? */
+GLOBAL int snis_udp_seq_after(uint32_t seq, uint32_t last);
+
+/*
+ * The sequence number of the datagram which last updated each object, kept
+ * in a direct mapped table of nslots.  Datagrams are numbered per client,
+ * and hold different objects, so one arriving late may still hold the latest
+ * update of some object; only updates older than one already applied are
+ * stale.  Should two objects share a slot, an update is occasionally applied
+ * which could have been dropped, which is harmless.
+ */
+GLOBAL struct snis_udp_freshness *snis_udp_freshness_new(int nslots);
+GLOBAL void snis_udp_freshness_free(struct snis_udp_freshness *f);
+/* Should an update of object id from datagram seq be applied?  Notes it if so. */
+GLOBAL int snis_udp_fresh(struct snis_udp_freshness *f, uint32_t id, uint32_t seq);
+
+/*
+ * An artificial loss and latency shim for the receiving end, for trying the
+ * UDP channel out over loopback.  spec is e.g. "loss=10,delay=50,jitter=30",
+ * loss in percent, delay and jitter in milliseconds.  With jitter, datagrams
+ * are delivered out of order.  Returns NULL if spec is NULL or empty.
+ */
+GLOBAL struct snis_udp_shim *snis_udp_shim_new(const char *spec);
+GLOBAL void snis_udp_shim_free(struct snis_udp_shim *shim);
+
+/* Receive a datagram from fd, by way of shim if not NULL.  Waits up to
+ * timeout_ms.  Returns the length of the datagram, 0 on timeout, or -1.
+ */
+GLOBAL int snis_udp_recv(int fd, struct snis_udp_shim *shim, unsigned char *buffer,
+				int buflen, int timeout_ms);
+
+#undef GLOBAL
+#endif
@@ -26,249 +26,978 @@
 
 #include "space-part.h"
 
+#define INITIAL_BUCKETS 1024
+#define INITIAL_CELL_ROOM 4
+#define MAX_CELL_COORD (1 << 28)
+#define COLUMN_BUCKETS 4096
+#define MAX_SEGMENT_SPREAD 4
+#define MAX_SEGMENT_STEPS 1024
+#define SCAN_COST_RATIO 4 /* looking a cell up costs about this many cells scanned */
+
+/* Where each entity was last put, so queries needn't look at the entity */
+struct sp_item {
+	void *entity;
+	double x, y, z;
+};
+
+struct sp_cell {
+	int ix, iy, iz;
+	int next;	/* next cell in the same hash bucket, or on the free list */
+	int n, room;	/* entities held, and room for */
+	struct sp_item *item;
+};
+
 struct space_partition {
-	int xdim, ydim;
-	double minx, maxx, miny, maxy;
-	double cell_width, cell_height;
+	double cell_size, inv_cell_size, neighborhood;
 	int offset;
-	struct space_partition_entry **content;
-	struct space_partition_entry *common;
+	int nbuckets;	/* a power of 2 */
+	int *bucket;	/* first cell in each bucket, or -1 */
+	struct sp_cell *cell;
+	int ncells;	/* cells in use or on the free list */
+	int room;	/* room in cell[] */
+	int occupied;	/* cells in use */
+	int free_cell;	/* list of unused cells, kept for their arrays */
+	int column[COLUMN_BUCKETS];	/* occupied cells in columns with each hash */
 };
 
-static inline int get_cell(struct space_partition *p, int x, int y)
+static inline struct space_partition_entry *entry_of(struct space_partition *p, void *entity)
+{
+	return (struct space_partition_entry *) ((unsigned char *) entity + p->offset);
+}
+
+static inline int cell_coord(struct space_partition *p, double v)
+{
+	int i;
+
+	v *= p->inv_cell_size;
+	if (!(v > -MAX_CELL_COORD)) /* also catches NaN */
+		return -MAX_CELL_COORD;
+	if (v > MAX_CELL_COORD)
+		return MAX_CELL_COORD;
+	i = (int) v; /* rounds toward zero, and floor() is a libm call */
+	return i - (v < i);
+}
+
+/*
+ * The universe is much flatter than it is wide, so the hash is split into
+ * that of the column of cells along y at ix, iz, and the cell in the column,
+ * and how many cells are occupied in each column (give or take collisions)
+ * is counted, so that empty columns can be skipped without looking up each
+ * cell in them.
+ */
+#define HASH_Y 19349663u
+
+static inline unsigned int hash_column(int ix, int iz)
+{
+	return (unsigned int) ix * 73856093u ^ (unsigned int) iz * 83492791u;
+}
+
+static inline int *column_count(struct space_partition *p, unsigned int hxz)
+{
+	return &p->column[hxz & (COLUMN_BUCKETS - 1)];
+}
+
+static inline unsigned int hash_cell(struct space_partition *p, int ix, int iy, int iz)
+{
+	return (hash_column(ix, iz) ^ (unsigned int) iy * HASH_Y) & (p->nbuckets - 1);
+}
+
+static int lookup_cell(struct space_partition *p, int ix, int iy, int iz)
+{
+	int c;
+
+	for (c = p->bucket[hash_cell(p, ix, iy, iz)]; c >= 0; c = p->cell[c].next)
+		if (p->cell[c].ix == ix && p->cell[c].iy == iy && p->cell[c].iz == iz)
+			return c;
+	return -1;
+}
+
+static int rehash(struct space_partition *p, int nbuckets)
 {
-	if (x < 0 || x >= p->xdim || y < 0 || y >= p->ydim)
+	int *bucket, c, h;
+
+	bucket = malloc(sizeof(*bucket) * nbuckets);
+	if (!bucket)
 		return -1;
-	return x * p->ydim + y;
+	free(p->bucket);
+	p->bucket = bucket;
+	p->nbuckets = nbuckets;
+	for (h = 0; h < nbuckets; h++)
+		bucket[h] = -1;
+	for (c = 0; c < p->ncells; c++) {
+		if (p->cell[c].n == 0) /* on the free list */
+			continue;
+		h = hash_cell(p, p->cell[c].ix, p->cell[c].iy, p->cell[c].iz);
+		p->cell[c].next = bucket[h];
+		bucket[h] = c;
+	}
+	return 0;
 }
 
-struct space_partition *space_partition_init(int xdim, int ydim,
-	double minx, double maxx, double miny, double maxy,
-	int offset)
+static void free_cell(struct space_partition *p, int c);
+
+/* Find or make the cell for ix, iy, iz, with room for one more entity */
+static int get_cell(struct space_partition *p, int ix, int iy, int iz)
+{
+	struct sp_cell *cell;
+	struct sp_item *item;
+	int c, h;
+
+	c = lookup_cell(p, ix, iy, iz);
+	if (c < 0) {
+		if (p->occupied * 4 >= p->nbuckets)
+			(void) rehash(p, p->nbuckets * 2); /* if it fails, chains get longer */
+		if (p->free_cell >= 0) {
+			c = p->free_cell;
+			p->free_cell = p->cell[c].next;
+		} else {
+			if (p->ncells >= p->room) {
+				cell = realloc(p->cell, sizeof(*cell) * p->room * 2);
+				if (!cell)
+					return -1;
+				p->cell = cell;
+				p->room *= 2;
+			}
+			c = p->ncells++;
+			memset(&p->cell[c], 0, sizeof(p->cell[c]));
+		}
+		cell = &p->cell[c];
+		cell->ix = ix;
+		cell->iy = iy;
+		cell->iz = iz;
+		h = hash_cell(p, ix, iy, iz);
+		cell->next = p->bucket[h];
+		p->bucket[h] = c;
+		p->occupied++;
+		(*column_count(p, hash_column(ix, iz)))++;
+	}
+	cell = &p->cell[c];
+	if (cell->n >= cell->room) {
+		item = realloc(cell->item, sizeof(*item) *
+				(cell->room ? cell->room * 2 : INITIAL_CELL_ROOM));
+		if (!item) {
+			if (cell->n == 0)
+				free_cell(p, c);
+			return -1;
+		}
+		cell->item = item;
+		cell->room = cell->room ? cell->room * 2 : INITIAL_CELL_ROOM;
+	}
+	return c;
+}
+
+static void free_cell(struct space_partition *p, int c)
+{
+	struct sp_cell *cell = &p->cell[c];
+	int *link;
+
+	for (link = &p->bucket[hash_cell(p, cell->ix, cell->iy, cell->iz)];
+		*link != c; link = &p->cell[*link].next)
+		;
+	*link = cell->next;
+	cell->next = p->free_cell;
+	p->free_cell = c;
+	p->occupied--;
+	(*column_count(p, hash_column(cell->ix, cell->iz)))--;
+}
+
+struct space_partition *space_partition_init(double cell_size, double neighborhood, int offset)
 {
 	struct space_partition *p;
 
-	p = malloc(sizeof(*p));
+	p = calloc(1, sizeof(*p));
 	if (!p)
 		return p;
-	p->content = malloc(sizeof(*p->content) * xdim * ydim);
-	if (!p->content) {
-		free(p);
+	p->cell_size = cell_size;
+	p->inv_cell_size = 1.0 / cell_size;
+	p->neighborhood = neighborhood;
+	p->offset = offset;
+	p->free_cell = -1;
+	p->room = INITIAL_BUCKETS;
+	p->cell = malloc(sizeof(*p->cell) * p->room);
+	if (!p->cell || rehash(p, INITIAL_BUCKETS)) {
+		space_partition_free(p);
 		return NULL;
 	}
-	memset(p->content, 0, sizeof(void *) * xdim * ydim);
-	p->minx = minx;
-	p->maxx = maxx;
-	p->miny = miny;
-	p->maxy = maxy;
-	p->xdim = xdim;
-	p->ydim = ydim;
-	p->cell_width = (maxx - minx) / (double) xdim;
-	p->cell_height = (maxy - miny) / (double) ydim;
-	p->offset = offset; 
-	p->common = NULL;
 	return p;
 }
 
-void remove_space_partition_entry(struct space_partition *sp, struct space_partition_entry *e)
+void remove_space_partition_entry(struct space_partition *p, struct space_partition_entry *e)
 {
-	struct space_partition_entry *prev, *next;
-	struct space_partition_entry **head;
+	struct sp_cell *cell;
+	int c = e->cell - 1;
 
-	if (e->cell < 0)
-		head = &sp->common; 
-	else
-		head = &sp->content[e->cell]; 
+	if (c < 0)
+		return;
+	cell = &p->cell[c];
+	cell->n--;
+	if (e->slot < cell->n) {
+		cell->item[e->slot] = cell->item[cell->n];
+		entry_of(p, cell->item[e->slot].entity)->slot = e->slot;
+	}
+	e->cell = 0;
+	e->slot = 0;
+	if (cell->n == 0)
+		free_cell(p, c);
+}
 
-	prev = e->prev;
-	next = e->next;
+void space_partition_update(struct space_partition *p,
+		void *entity, double x, double y, double z)
+{
+	struct space_partition_entry *e = entry_of(p, entity);
+	struct sp_cell *cell;
+	struct sp_item *item;
+	int ix, iy, iz, c;
+
+	ix = cell_coord(p, x);
+	iy = cell_coord(p, y);
+	iz = cell_coord(p, z);
+	if (e->cell) {
+		cell = &p->cell[e->cell - 1];
+		if (cell->ix == ix && cell->iy == iy && cell->iz == iz) {
+			item = &cell->item[e->slot];
+			goto set_position;
+		}
+		remove_space_partition_entry(p, e);
+	}
+	c = get_cell(p, ix, iy, iz);
+	if (c < 0)
+		return; /* out of memory, the entity won't be found */
+	cell = &p->cell[c];
+	e->cell = c + 1;
+	e->slot = cell->n;
+	item = &cell->item[cell->n++];
+	item->entity = entity;
+set_position:
+	item->x = x;
+	item->y = y;
+	item->z = z;
+}
 
-	if (*head == e)
-		*head = next;
+void space_partition_free(struct space_partition *p)
+{
+	int c;
 
-	if (prev)
-		prev->next = next;
-	if (next)
-		next->prev = prev;
-	e->next = NULL;
-	e->prev = NULL;
+	if (!p)
+		return;
+	for (c = 0; c < p->ncells; c++)
+		free(p->cell[c].item);
+	free(p->cell);
+	free(p->bucket);
+	free(p);
 }
 
-static void add_sp_entry(struct space_partition *p, struct space_partition_entry *e, int cell)
+/*
+ * What an entity must be within to be processed: a sphere, or a capsule
+ * around a segment, or, for a negative r2, anywhere.
+ */
+struct sp_shape {
+	double x, y, z;		/* centre of the sphere, or start of the segment */
+	double dx, dy, dz;	/* from the start to the end of the segment */
+	double len2;		/* squared length of the segment, 0 for a sphere */
+	double r2;		/* squared radius */
+};
+
+static double shape_dist2(const struct sp_shape *s, const struct sp_item *item)
 {
-	struct space_partition_entry **c;
+	double px = item->x - s->x, py = item->y - s->y, pz = item->z - s->z;
+	double t;
+
+	if (s->len2 > 0.0) {
+		t = (px * s->dx + py * s->dy + pz * s->dz) / s->len2;
+		if (t > 1.0)
+			t = 1.0;
+		if (t > 0.0) {
+			px -= t * s->dx;
+			py -= t * s->dy;
+			pz -= t * s->dz;
+		}
+	}
+	return px * px + py * py + pz * pz;
+}
 
-	if (cell < 0)
-		c = &p->common;
-	else
-		c = &p->content[cell];
+/*
+ * fn may remove the entity it is called for, in which case the cell's last
+ * entity takes its slot, or add entities, which may move the cell's array and
+ * the cells themselves, so nothing is held onto across calls to fn.
+ */
+static void process_cell(struct space_partition *p, int c, const struct sp_shape *s,
+			void *context, space_partition_function fn)
+{
+	int i = 0;
+	void *guy;
 
-	e->cell = cell;
-	if (!(*c)) {
-		(*c) = e;
-		e->next = NULL;
-		e->prev = NULL;
-		return;
+	while (i < p->cell[c].n) {
+		if (s && shape_dist2(s, &p->cell[c].item[i]) > s->r2) {
+			i++;
+			continue;
+		}
+		guy = p->cell[c].item[i].entity;
+		fn(context, guy);
+		if (i < p->cell[c].n && p->cell[c].item[i].entity == guy)
+			i++;
 	}
-	(*c)->prev = e;
-	e->next = *c;
-	e->prev = NULL;
-	(*c) = e;
 }
 
-void space_partition_update(struct space_partition *p,
-		void *entity, double x, double y)
+/* Squared distance from v to the nearest point of cell i along one axis */
+static inline double axis_dist2(struct space_partition *p, int i, double v)
 {
-	int cellx, celly;
-	struct space_partition_entry *e;
-	int cell;
+	double lo = i * p->cell_size, d;
 
-	e = (struct space_partition_entry *) ((unsigned char *) entity + p->offset);
+	if (v < lo)
+		d = lo - v;
+	else if (v > lo + p->cell_size)
+		d = v - lo - p->cell_size;
+	else
+		return 0.0;
+	return d * d;
+}
 
-	cellx = ((x - p->minx) / (p->maxx - p->minx)) * p->xdim;
-	celly = ((y - p->miny) / (p->maxy - p->miny)) * p->ydim;
-	cell = get_cell(p, cellx, celly);
-	/* printf("%4.1f,%4.1f -> cellx, celly = %d, %d, cell = %d\n", x, y, cellx, celly, cell); */
+static inline double cell_dist2(struct space_partition *p, int ix, int iy, int iz,
+				double x, double y, double z)
+{
+	return axis_dist2(p, ix, x) + axis_dist2(p, iy, y) + axis_dist2(p, iz, z);
+}
 
-	if (e->cell == cell)
-		return;
+struct cell_range {
+	int x1, x2, y1, y2, z1, z2;
+};
 
-	remove_space_partition_entry(p, e);
-	add_sp_entry(p, e, cell);
+static void get_cell_range(struct space_partition *p, double x, double y, double z, double radius,
+			struct cell_range *r)
+{
+	r->x1 = cell_coord(p, x - radius);
+	r->x2 = cell_coord(p, x + radius);
+	r->y1 = cell_coord(p, y - radius);
+	r->y2 = cell_coord(p, y + radius);
+	r->z1 = cell_coord(p, z - radius);
+	r->z2 = cell_coord(p, z + radius);
 }
 
-void space_partition_free(struct space_partition *p)
+static inline int in_cell_range(struct sp_cell *cell, struct cell_range *r)
 {
-	free(p->content);
-	free(p);
+	return cell->ix >= r->x1 && cell->ix <= r->x2 &&
+		cell->iy >= r->y1 && cell->iy <= r->y2 &&
+		cell->iz >= r->z1 && cell->iz <= r->z2;
 }
 
-void nearby_space_partitions(struct space_partition *p, void *entity,
-				double x, double y, int cell[4])
+void space_partition_process_in_radius(struct space_partition *p, double x, double y, double z,
+				double radius, void *context, space_partition_function fn)
 {
-	int xo, yo, i, cellx, celly;
-	struct space_partition_entry *e = (struct space_partition_entry *)
-					((unsigned char *) entity + p->offset);
-	double cx, cy;
-
-	cellx = ((x - p->minx) / (p->maxx - p->minx)) * p->xdim;
-	celly = ((y - p->miny) / (p->maxy - p->miny)) * p->ydim;
-	cx = (double) cellx * p->cell_width + 0.5 * p->cell_width + p->minx;
-	cy = (double) celly * p->cell_height + 0.5 * p->cell_height + p->miny;
+	struct cell_range r;
+	struct sp_cell *cell;
+	double ncells;
+	unsigned int hxz, mask;
+	int ix, iy, iz, c, *bucket;
+
+	get_cell_range(p, x, y, z, radius, &r);
+	ncells = (double) (r.x2 - r.x1 + 1) * (double) (r.y2 - r.y1 + 1) * (double) (r.z2 - r.z1 + 1);
+	if (ncells > SCAN_COST_RATIO * p->occupied) {
+		/* few cells are occupied compared to those in range, so look at those */
+		for (c = 0; c < p->ncells; c++)
+			if (p->cell[c].n && in_cell_range(&p->cell[c], &r))
+				process_cell(p, c, NULL, context, fn);
+		return;
+	}
+	/*
+	 * This is where the time goes, so the lookups are done by hand.  fn may
+	 * make cells and rehash, so p->bucket and p->cell are re-read after it's
+	 * called.
+	 */
+	bucket = p->bucket;
+	cell = p->cell;
+	mask = p->nbuckets - 1;
+	for (ix = r.x1; ix <= r.x2; ix++)
+		for (iz = r.z1; iz <= r.z2; iz++) {
+			hxz = hash_column(ix, iz);
+			if (*column_count(p, hxz) == 0)
+				continue;
+			for (iy = r.y1; iy <= r.y2; iy++) {
+				c = bucket[(hxz ^ (unsigned int) iy * HASH_Y) & mask];
+				while (c >= 0 && (cell[c].ix != ix || cell[c].iy != iy || cell[c].iz != iz))
+					c = cell[c].next;
+				if (c < 0)
+					continue;
+				process_cell(p, c, NULL, context, fn);
+				bucket = p->bucket;
+				cell = p->cell;
+				mask = p->nbuckets - 1;
+			}
+		}
+}
 
-	/* printf("CXCY=%4.2f,%4.2f\n", cx, cy); */
+void space_partition_process(struct space_partition *p, double x, double y, double z,
+				void *context, space_partition_function fn)
+{
+	space_partition_process_in_radius(p, x, y, z, p->neighborhood, context, fn);
+}
 
-	xo = x < cx ? -p->ydim : p->ydim;	
-	yo = y < cy ? -1 : 1;	
+void space_partition_process_slice(struct space_partition *p, int slice, int nslices,
+				double x, double y, double z, double exclude_radius,
+				void *context, space_partition_function fn)
+{
+	struct cell_range r;
+	int c;
+
+	if (exclude_radius >= 0) {
+		get_cell_range(p, x, y, z, exclude_radius, &r);
+	} else {
+		r.x1 = r.y1 = r.z1 = 1;
+		r.x2 = r.y2 = r.z2 = 0; /* empty range */
+	}
+	for (c = slice; c < p->ncells; c += nslices)
+		if (p->cell[c].n && !in_cell_range(&p->cell[c], &r))
+			process_cell(p, c, NULL, context, fn);
+}
 
-	cell[0] = e->cell;
-	cell[1] = e->cell + xo; 
-	cell[2] = e->cell + yo; 
-	cell[3] = e->cell + xo + yo;
+/* Process the occupied cells of a block of cells, and what in them is within s */
+static void process_cell_block(struct space_partition *p, const struct cell_range *r,
+				const struct sp_shape *s, void *context, space_partition_function fn)
+{
+	int ix, iy, iz, c;
 
-	for (i = 0; i < 4; i++) 
-		if (cell[i] < 0 || cell[i] >= p->xdim * p->ydim)
-			cell[i] = -1;
+	for (ix = r->x1; ix <= r->x2; ix++)
+		for (iz = r->z1; iz <= r->z2; iz++) {
+			if (*column_count(p, hash_column(ix, iz)) == 0)
+				continue;
+			for (iy = r->y1; iy <= r->y2; iy++) {
+				c = lookup_cell(p, ix, iy, iz);
+				if (c >= 0)
+					process_cell(p, c, s, context, fn);
+			}
+		}
 }
 
-struct space_partition_entry *space_partition_neighbors(struct space_partition *p, int cell)
+void space_partition_process_in_sphere(struct space_partition *p, double x, double y, double z,
+				double radius, void *context, space_partition_function fn)
 {
-	if (cell < 0 || cell >= p->xdim * p->ydim)
-		return p->common;
-	return (struct space_partition_entry *) p->content[cell];
+	struct sp_shape s = { x, y, z, 0.0, 0.0, 0.0, 0.0, radius * radius };
+	struct cell_range r;
+	double ncells;
+	int ix, iy, iz, c;
+
+	get_cell_range(p, x, y, z, radius, &r);
+	ncells = (double) (r.x2 - r.x1 + 1) * (double) (r.y2 - r.y1 + 1) * (double) (r.z2 - r.z1 + 1);
+	if (ncells > SCAN_COST_RATIO * p->occupied) {
+		for (c = 0; c < p->ncells; c++) {
+			struct sp_cell *cell = &p->cell[c];
+
+			if (cell->n && in_cell_range(cell, &r) &&
+				cell_dist2(p, cell->ix, cell->iy, cell->iz, x, y, z) <= s.r2)
+				process_cell(p, c, &s, context, fn);
+		}
+		return;
+	}
+	for (ix = r.x1; ix <= r.x2; ix++)
+		for (iz = r.z1; iz <= r.z2; iz++) {
+			if (axis_dist2(p, ix, x) + axis_dist2(p, iz, z) > s.r2)
+				continue; /* a corner of the cube, outside the sphere */
+			if (*column_count(p, hash_column(ix, iz)) == 0)
+				continue;
+			for (iy = r.y1; iy <= r.y2; iy++) {
+				if (cell_dist2(p, ix, iy, iz, x, y, z) > s.r2)
+					continue;
+				c = lookup_cell(p, ix, iy, iz);
+				if (c >= 0)
+					process_cell(p, c, &s, context, fn);
+			}
+		}
 }
 
-static void process_cell(struct space_partition *p, void *entity, double x, double y,
-                                void *context, space_partition_function fn, int cell)
+/*
+ * Step from cell to cell along the segment (Amanatides and Woo's DDA), and
+ * look in the cube of cells within spread cells of each, which holds all
+ * that's within radius of the part of the segment in that cell.  The segment
+ * moves one cell along one axis at a time, and never back, so of each cube
+ * only the face ahead of the previous cube is new, and only that is looked in.
+ */
+void space_partition_process_segment(struct space_partition *p,
+				double x1, double y1, double z1, double x2, double y2, double z2,
+				double radius, void *context, space_partition_function fn)
 {
-	struct space_partition_entry *e, *i, *next;
-	void *guy;
+	struct sp_shape s = { x1, y1, z1, x2 - x1, y2 - y1, z2 - z1, 0.0, radius * radius };
+	double start[3] = { x1, y1, z1 }, d[3], t_max[3], t_delta[3];
+	int cell[3], end[3], step[3], spread, nsteps, i, a, axis;
+	struct cell_range r;
+
+	s.len2 = s.dx * s.dx + s.dy * s.dy + s.dz * s.dz;
+	d[0] = s.dx;
+	d[1] = s.dy;
+	d[2] = s.dz;
+	spread = (int) ceil(radius * p->inv_cell_size);
+	nsteps = 0;
+	for (a = 0; a < 3; a++) {
+		cell[a] = cell_coord(p, start[a]);
+		end[a] = cell_coord(p, start[a] + d[a]);
+		nsteps += abs(end[a] - cell[a]);
+		if (d[a] > 0.0) {
+			step[a] = 1;
+			t_max[a] = ((cell[a] + 1) * p->cell_size - start[a]) / d[a];
+			t_delta[a] = p->cell_size / d[a];
+		} else if (d[a] < 0.0) {
+			step[a] = -1;
+			t_max[a] = (cell[a] * p->cell_size - start[a]) / d[a];
+			t_delta[a] = -p->cell_size / d[a];
+		} else {
+			step[a] = 0;
+			t_max[a] = t_delta[a] = HUGE_VAL;
+		}
+	}
+	if (spread > MAX_SEGMENT_SPREAD || nsteps > MAX_SEGMENT_STEPS) {
+		/* a fat or very long segment, just look in the box around it */
+		r.x1 = cell_coord(p, fmin(x1, x2) - radius);
+		r.x2 = cell_coord(p, fmax(x1, x2) + radius);
+		r.y1 = cell_coord(p, fmin(y1, y2) - radius);
+		r.y2 = cell_coord(p, fmax(y1, y2) + radius);
+		r.z1 = cell_coord(p, fmin(z1, z2) - radius);
+		r.z2 = cell_coord(p, fmax(z1, z2) + radius);
+		if ((double) (r.x2 - r.x1 + 1) * (r.y2 - r.y1 + 1) * (r.z2 - r.z1 + 1) <=
+				SCAN_COST_RATIO * p->occupied) {
+			process_cell_block(p, &r, &s, context, fn);
+			return;
+		}
+		for (i = 0; i < p->ncells; i++)
+			if (p->cell[i].n && in_cell_range(&p->cell[i], &r))
+				process_cell(p, i, &s, context, fn);
+		return;
+	}
 
-	e = space_partition_neighbors(p, cell);
+	r.x1 = cell[0] - spread;
+	r.x2 = cell[0] + spread;
+	r.y1 = cell[1] - spread;
+	r.y2 = cell[1] + spread;
+	r.z1 = cell[2] - spread;
+	r.z2 = cell[2] + spread;
+	process_cell_block(p, &r, &s, context, fn);
+	for (i = 0; i < nsteps; i++) {
+		/* Step along whichever axis the segment leaves the cell by first,
+		 * of those not yet at the end cell, so rounding can't overshoot it.
+		 */
+		axis = -1;
+		for (a = 0; a < 3; a++)
+			if (cell[a] != end[a] && (axis < 0 || t_max[a] < t_max[axis]))
+				axis = a;
+		cell[axis] += step[axis];
+		t_max[axis] += t_delta[axis];
+		r.x1 = cell[0] - spread;
+		r.x2 = cell[0] + spread;
+		r.y1 = cell[1] - spread;
+		r.y2 = cell[1] + spread;
+		r.z1 = cell[2] - spread;
+		r.z2 = cell[2] + spread;
+		switch (axis) {
+		case 0:
+			r.x1 = r.x2 = cell[0] + step[0] * spread;
+			break;
+		case 1:
+			r.y1 = r.y2 = cell[1] + step[1] * spread;
+			break;
+		default:
+			r.z1 = r.z2 = cell[2] + step[2] * spread;
+			break;
+		}
+		process_cell_block(p, &r, &s, context, fn);
+	}
+}
 
-	for (i = e; i != NULL; i = next) {
-		next = i->next;
-		guy = ((unsigned char *) i) - p->offset;
-		fn(context, guy);
+struct nearest_search {
+	double x, y, z, max_dist2;
+	int k, n;
+	space_partition_filter filter;
+	void *context;
+	void **entity;
+	double *dist2;
+};
+
+/* Squared distance within which anything found must be to be of use */
+static inline double nearest_worst(struct nearest_search *ns)
+{
+	return ns->n < ns->k ? ns->max_dist2 : ns->dist2[ns->k - 1];
+}
+
+static void nearest_in_cell(struct space_partition *p, int c, struct nearest_search *ns)
+{
+	struct sp_cell *cell = &p->cell[c];
+	double dx, dy, dz, d2;
+	int i, j;
+
+	for (i = 0; i < cell->n; i++) {
+		dx = cell->item[i].x - ns->x;
+		dy = cell->item[i].y - ns->y;
+		dz = cell->item[i].z - ns->z;
+		d2 = dx * dx + dy * dy + dz * dz;
+		if (d2 > nearest_worst(ns) || (ns->n == ns->k && d2 == nearest_worst(ns)))
+			continue;
+		if (ns->filter && !ns->filter(ns->context, cell->item[i].entity))
+			continue;
+		/* insert it in order, dropping the furthest if there's no room */
+		j = ns->n < ns->k ? ns->n++ : ns->k - 1;
+		for (; j > 0 && ns->dist2[j - 1] > d2; j--) {
+			ns->dist2[j] = ns->dist2[j - 1];
+			ns->entity[j] = ns->entity[j - 1];
+		}
+		ns->dist2[j] = d2;
+		ns->entity[j] = cell->item[i].entity;
 	}
 }
 
-void space_partition_process(struct space_partition *p, void *entity, double x, double y,
-                                void *context, space_partition_function fn)
+static inline int ring_of(const struct sp_cell *cell, int cx, int cy, int cz)
 {
-	int cell[4];
-	int i;
-	int common_processed = 0;
+	int dx = abs(cell->ix - cx), dy = abs(cell->iy - cy), dz = abs(cell->iz - cz);
+	int d = dx > dy ? dx : dy;
 
-	nearby_space_partitions(p, entity, x, y, cell);
+	return d > dz ? d : dz;
+}
 
-	for (i = 0; i < 4; i++) {
-		if (cell[i] < 0) {
-			if (common_processed)
-				continue;
-			common_processed = 1;
+/*
+ * Look in rings of cells (the cells ring cells away along some axis) around
+ * the cell holding x, y, z, until everything within the k nearest found so
+ * far, or within max_radius, has been looked at.
+ */
+int space_partition_nearest(struct space_partition *p, double x, double y, double z,
+			double max_radius, int k, space_partition_filter filter, void *context,
+			void **entity, double *dist2)
+{
+	struct nearest_search ns = { x, y, z, max_radius * max_radius, k, 0,
+					filter, context, entity, dist2 };
+	int cx, cy, cz, ix, iy, iz, ring, last_ring, c;
+	double ring_cells, covered;
+
+	if (k <= 0)
+		return 0;
+	cx = cell_coord(p, x);
+	cy = cell_coord(p, y);
+	cz = cell_coord(p, z);
+	last_ring = (int) ceil(max_radius * p->inv_cell_size);
+	for (ring = 0; ring <= last_ring; ring++) {
+		ring_cells = pow(2.0 * ring + 1.0, 3.0) - pow(2.0 * ring - 1.0, 3.0);
+		if (ring > 0 && ring_cells > SCAN_COST_RATIO * p->occupied) {
+			/* The rings are getting bigger than the occupied cells, so
+			 * look at the occupied cells not already looked at instead.
+			 */
+			for (c = 0; c < p->ncells; c++)
+				if (p->cell[c].n && ring_of(&p->cell[c], cx, cy, cz) >= ring &&
+					cell_dist2(p, p->cell[c].ix, p->cell[c].iy, p->cell[c].iz,
+							x, y, z) <= nearest_worst(&ns))
+					nearest_in_cell(p, c, &ns);
+			break;
 		}
-		process_cell(p, entity, x, y, context, fn, cell[i]);
+		for (ix = cx - ring; ix <= cx + ring; ix++)
+			for (iz = cz - ring; iz <= cz + ring; iz++) {
+				if (*column_count(p, hash_column(ix, iz)) == 0)
+					continue;
+				for (iy = cy - ring; iy <= cy + ring; iy++) {
+					if (abs(ix - cx) != ring && abs(iz - cz) != ring &&
+						abs(iy - cy) != ring)
+						iy = cy + ring; /* skip the inside of the ring */
+					if (cell_dist2(p, ix, iy, iz, x, y, z) > nearest_worst(&ns))
+						continue;
+					c = lookup_cell(p, ix, iy, iz);
+					if (c >= 0)
+						nearest_in_cell(p, c, &ns);
+				}
+			}
+		/* Everything within covered of x, y, z has now been looked at */
+		covered = fmin(fmin(x - (cx - ring) * p->cell_size,
+				(cx + ring + 1) * p->cell_size - x),
+			fmin(fmin(y - (cy - ring) * p->cell_size,
+				(cy + ring + 1) * p->cell_size - y),
+			fmin(z - (cz - ring) * p->cell_size,
+				(cz + ring + 1) * p->cell_size - z)));
+		if (covered * covered >= nearest_worst(&ns))
+			break;
 	}
+	return ns.n;
 }
 
 #ifdef TEST_SPACE_PARTITION
 #include <stddef.h>
 
+#define NTHINGIES 2000
+
 struct thingy {
-	double x, y;
+	double x, y, z;
 	struct space_partition_entry e;
+	int visits;
 };
 
-struct spcontext {
-	struct thingy *t;
-};
+static struct thingy t[NTHINGIES];
 
-static void callback(void *context, void *whatever)
+static void count_visits(void *context, void *entity)
 {
-	struct spcontext *sp = context;
+	struct thingy *t = entity;
 
-	printf("callback called\n");
+	t->visits++;
 }
 
-int main(int argc, char *argv[])
+static void remove_visited(void *context, void *entity)
 {
+	struct thingy *t = entity;
 
-	struct space_partition *sp;
-	struct thingy t = { 0 };
-	struct thingy t2 = { 0 };
-	struct spcontext spc;
+	t->visits++;
+	remove_space_partition_entry(context, &t->e);
+}
+
+static void place_thingies(struct space_partition *sp)
+{
 	int i;
-	int cell[4];
-	
 
-	t.x = 0.0;
-	t.y = 0.0;
+	for (i = 0; i < NTHINGIES; i++) {
+		if (i % 4 == 0) { /* a dense cluster */
+			t[i].x = 20.0 + (rand() % 100) / 10.0;
+			t[i].y = -3.0 + (rand() % 60) / 10.0;
+			t[i].z = -50.0 + (rand() % 100) / 10.0;
+		} else {
+			t[i].x = (rand() % 2400) / 10.0 - 120.0;
+			t[i].y = (rand() % 600) / 10.0 - 30.0;
+			t[i].z = (rand() % 2400) / 10.0 - 120.0;
+		}
+		space_partition_update(sp, &t[i], t[i].x, t[i].y, t[i].z);
+	}
+}
+
+static void clear_visits(void)
+{
+	int i;
+
+	for (i = 0; i < NTHINGIES; i++)
+		t[i].visits = 0;
+}
+
+static int within(struct thingy *t, double x, double y, double z, double r)
+{
+	return fabs(t->x - x) <= r && fabs(t->y - y) <= r && fabs(t->z - z) <= r;
+}
+
+/* Every thingy must be visited exactly once, either by the radius query or by
+ * one of the slices, and everything within the radius by the radius query.
+ */
+static int test_in_radius_and_slices(struct space_partition *sp, double x, double y, double z,
+					double r)
+{
+	int i, slice, nslices = 7;
+
+	clear_visits();
+	space_partition_process_in_radius(sp, x, y, z, r, NULL, count_visits);
+	for (i = 0; i < NTHINGIES; i++) {
+		if (within(&t[i], x, y, z, r) && t[i].visits != 1) {
+			printf("FAIL: thingy %d within radius %f visited %d times\n",
+				i, r, t[i].visits);
+			return -1;
+		}
+	}
+	for (slice = 0; slice < nslices; slice++)
+		space_partition_process_slice(sp, slice, nslices, x, y, z, r, NULL, count_visits);
+	for (i = 0; i < NTHINGIES; i++) {
+		if (t[i].visits != 1) {
+			printf("FAIL: thingy %d at %f, %f, %f visited %d times\n",
+				i, t[i].x, t[i].y, t[i].z, t[i].visits);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int test_neighborhood(struct space_partition *sp, double neighborhood)
+{
+	int i, j;
+
+	for (j = 0; j < NTHINGIES; j += 97) {
+		clear_visits();
+		space_partition_process(sp, t[j].x, t[j].y, t[j].z, NULL, count_visits);
+		for (i = 0; i < NTHINGIES; i++) {
+			if (within(&t[i], t[j].x, t[j].y, t[j].z, neighborhood) && t[i].visits != 1) {
+				printf("FAIL: thingy %d near thingy %d visited %d times\n",
+					i, j, t[i].visits);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static double dist2_to(struct thingy *t, double x, double y, double z)
+{
+	return (t->x - x) * (t->x - x) + (t->y - y) * (t->y - y) + (t->z - z) * (t->z - z);
+}
 
-	t2.x = 20.0;
-	t2.y = 20.0;
+static double dist2_to_segment(struct thingy *t, double x1, double y1, double z1,
+				double x2, double y2, double z2)
+{
+	double dx = x2 - x1, dy = y2 - y1, dz = z2 - z1, len2, u;
+
+	len2 = dx * dx + dy * dy + dz * dz;
+	u = len2 > 0 ? ((t->x - x1) * dx + (t->y - y1) * dy + (t->z - z1) * dz) / len2 : 0;
+	if (u < 0)
+		u = 0;
+	if (u > 1)
+		u = 1;
+	return dist2_to(t, x1 + u * dx, y1 + u * dy, z1 + u * dz);
+}
 
-	sp = space_partition_init(20, 20, -100, 100, -100, 100, offsetof(struct thingy, e));
-	space_partition_update(sp, &t, t.x, t.y);
-	space_partition_update(sp, &t2, t2.x, t2.y);
+/* Exactly what's within the sphere must be visited, once */
+static int test_in_sphere(struct space_partition *sp, double x, double y, double z, double r)
+{
+	int i, expected;
+
+	clear_visits();
+	space_partition_process_in_sphere(sp, x, y, z, r, NULL, count_visits);
+	for (i = 0; i < NTHINGIES; i++) {
+		expected = dist2_to(&t[i], x, y, z) <= r * r;
+		if (t[i].visits != expected) {
+			printf("FAIL: thingy %d, %f from %f, %f, %f visited %d times, radius %f\n",
+				i, sqrt(dist2_to(&t[i], x, y, z)), x, y, z, t[i].visits, r);
+			return -1;
+		}
+	}
+	return 0;
+}
 
-	for (i = 0; i < 45; i++) {
-		t.x += 1.1;
-		t.y += 0.3;
-		space_partition_update(sp, &t, t.x, t.y);
-		nearby_space_partitions(sp, &t, t.x, t.y, cell);
-		printf("neighbor cells = %d, %d, %d, %d\n", cell[0], cell[1], cell[2], cell[3]);
+/* Exactly what's within r of the segment must be visited, once */
+static int test_segment(struct space_partition *sp, double x1, double y1, double z1,
+			double x2, double y2, double z2, double r)
+{
+	int i, expected;
+
+	clear_visits();
+	space_partition_process_segment(sp, x1, y1, z1, x2, y2, z2, r, NULL, count_visits);
+	for (i = 0; i < NTHINGIES; i++) {
+		expected = dist2_to_segment(&t[i], x1, y1, z1, x2, y2, z2) <= r * r;
+		if (t[i].visits != expected) {
+			printf("FAIL: thingy %d, %f from segment %f, %f, %f - %f, %f, %f visited %d times, radius %f\n",
+				i, sqrt(dist2_to_segment(&t[i], x1, y1, z1, x2, y2, z2)),
+				x1, y1, z1, x2, y2, z2, t[i].visits, r);
+			return -1;
+		}
 	}
-	t.x = 7;
-	t.y = 7;
-	space_partition_update(sp, &t, t.x, t.y);
-	nearby_space_partitions(sp, &t, t.x, t.y, cell);
-	printf("neighbor cells = %d, %d, %d, %d\n", cell[0], cell[1], cell[2], cell[3]);
+	return 0;
+}
 
-	spc.t = &t;
-	space_partition_process(sp, &t,  t.x, t.y, &spc, callback);
+static int odd_thingy(void *context, void *entity)
+{
+	return ((struct thingy *) entity - t) % 2;
+}
 
+/* Compare with the k nearest odd thingies found the slow way */
+static int test_nearest(struct space_partition *sp, double x, double y, double z,
+			double max_radius, int k)
+{
+	void *found[20];
+	double d2[20], slow[20], dd;
+	int i, j, n, nslow = 0;
+
+	for (i = 1; i < NTHINGIES; i += 2) {
+		dd = dist2_to(&t[i], x, y, z);
+		if (dd > max_radius * max_radius)
+			continue;
+		if (nslow == k && dd >= slow[k - 1])
+			continue;
+		j = nslow < k ? nslow++ : k - 1;
+		for (; j > 0 && slow[j - 1] > dd; j--)
+			slow[j] = slow[j - 1];
+		slow[j] = dd;
+	}
+	n = space_partition_nearest(sp, x, y, z, max_radius, k, odd_thingy, NULL, found, d2);
+	if (n != nslow) {
+		printf("FAIL: %d nearest found near %f, %f, %f, expected %d\n", n, x, y, z, nslow);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (d2[i] != slow[i] || dist2_to(found[i], x, y, z) != d2[i] || !odd_thingy(NULL, found[i])) {
+			printf("FAIL: nearest %d near %f, %f, %f is %f away, expected %f\n",
+				i, x, y, z, sqrt(d2[i]), sqrt(slow[i]));
+			return -1;
+		}
+	}
 	return 0;
 }
-#endif
 
+static int test_queries(struct space_partition *sp)
+{
+	int i;
+
+	if (test_in_sphere(sp, 33.0, 2.0, -41.0, 25.0) ||
+		test_in_sphere(sp, 25.0, 0.0, -45.0, 3.0) ||
+		test_in_sphere(sp, 0.0, 0.0, 0.0, 5000.0))
+		return -1;
+	if (test_segment(sp, -100.0, 0.0, -100.0, 100.0, 10.0, 90.0, 4.0) ||
+		test_segment(sp, 100.0, 20.0, 90.0, -100.0, -20.0, -100.0, 12.0) ||
+		test_segment(sp, 20.0, 0.0, -50.0, 30.0, 0.0, -50.0, 0.5) || /* along x */
+		test_segment(sp, 30.0, 0.0, -40.0, 30.0, 0.0, -40.0, 8.0) || /* a point */
+		test_segment(sp, 0.0, 0.0, 0.0, 100.0, 0.0, 0.0, 0.0) ||
+		test_segment(sp, -120.0, -30.0, -120.0, 120.0, 30.0, 120.0, 60.0)) /* fat */
+		return -1;
+	for (i = 0; i < 50; i++)
+		if (test_segment(sp, t[i].x, t[i].y, t[i].z, t[i + 50].x, t[i + 50].y, t[i + 50].z,
+				0.5 + (i % 5) * 3.0))
+			return -1;
+	if (test_nearest(sp, 25.0, 0.0, -45.0, 1000.0, 10) ||
+		test_nearest(sp, 0.0, 0.0, 0.0, 15.0, 20) ||
+		test_nearest(sp, 500.0, 0.0, 0.0, 1000.0, 3) || /* outside all of them */
+		test_nearest(sp, 500.0, 0.0, 0.0, 100.0, 3) ||	/* none in range */
+		test_nearest(sp, -60.0, 10.0, 60.0, 1e9, 1))
+		return -1;
+	for (i = 0; i < NTHINGIES; i += 101)
+		if (test_nearest(sp, t[i].x, t[i].y, t[i].z, 50.0, 1 + i % 20))
+			return -1;
+	return 0;
+}
+
+/* Move everything about, then remove everything from within callbacks */
+static int test_move_and_remove(struct space_partition *sp)
+{
+	int i, round;
+
+	for (round = 0; round < 10; round++)
+		for (i = 0; i < NTHINGIES; i++) {
+			t[i].x += (rand() % 200) / 10.0 - 10.0;
+			t[i].z += (rand() % 200) / 10.0 - 10.0;
+			space_partition_update(sp, &t[i], t[i].x, t[i].y, t[i].z);
+		}
+	if (test_in_radius_and_slices(sp, 0.0, 0.0, 0.0, 40.0))
+		return -1;
+	clear_visits();
+	space_partition_process_in_radius(sp, 0.0, 0.0, 0.0, 1000.0, sp, remove_visited);
+	for (i = 0; i < NTHINGIES; i++) {
+		if (t[i].visits != 1 || t[i].e.cell != 0) {
+			printf("FAIL: removed thingy %d visited %d times, cell %d\n",
+				i, t[i].visits, t[i].e.cell);
+			return -1;
+		}
+	}
+	clear_visits();
+	space_partition_process_in_radius(sp, 0.0, 0.0, 0.0, 1000.0, NULL, count_visits);
+	for (i = 0; i < NTHINGIES; i++)
+		if (t[i].visits) {
+			printf("FAIL: removed thingy %d still found\n", i);
+			return -1;
+		}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct space_partition *sp;
+
+	sp = space_partition_init(10.0, 15.0, offsetof(struct thingy, e));
+	place_thingies(sp);
+	if (test_in_radius_and_slices(sp, 33.0, 2.0, -41.0, 25.0))
+		return 1;
+	if (test_in_radius_and_slices(sp, 25.0, 0.0, -45.0, 5.0)) /* in the cluster */
+		return 1;
+	if (test_in_radius_and_slices(sp, 0.0, 0.0, 0.0, 5000.0)) /* more cells than are used */
+		return 1;
+	printf("radius and slice processing ok\n");
+	if (test_neighborhood(sp, 15.0))
+		return 1;
+	printf("neighborhood processing ok\n");
+	if (test_queries(sp))
+		return 1;
+	printf("sphere, segment and nearest queries ok\n");
+	if (test_move_and_remove(sp))
+		return 1;
+	printf("moving and removing ok\n");
+	space_partition_free(sp);
+	return 0;
+}
+#endif
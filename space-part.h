@@ -21,31 +21,83 @@
 	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+/*
+ * A hashed 3D grid.  Space is divided into cubic cells of a given size, and
+ * each cell holding anything has an array of what it holds, found by hashing
+ * the cell's coordinates, so only occupied cells take any memory however big
+ * space is.  Each entity embeds a struct space_partition_entry at the offset
+ * given to space_partition_init(), saying which cell, and where in its array.
+ * The cell's array also holds where each entity was last updated to, which the
+ * queries below which go by distance use rather than looking at the entity.
+ */
 struct space_partition;
 
 struct space_partition_entry {
-	struct space_partition_entry *next, *prev;
-	int cell;
+	int cell; /* 1 + index of the cell holding the entity, 0 if none */
+	int slot; /* where in that cell's array */
 };
 
-typedef void (*space_partition_function)(void *entity, void *context);
+typedef void (*space_partition_function)(void *context, void *entity);
+typedef int (*space_partition_filter)(void *context, void *entity);
 
-struct space_partition *space_partition_init(int xdim, int ydim,
-	double minx, double maxx, double miny, double maxy,
-	int offset);
+/* Cells are cell_size on a side.  space_partition_process() finds at least
+ * everything within neighborhood of a point in each of x, y and z.
+ */
+struct space_partition *space_partition_init(double cell_size, double neighborhood, int offset);
 
 void space_partition_update(struct space_partition *p,
-		void *entity, double x, double y);
+		void *entity, double x, double y, double z);
 
 void space_partition_free(struct space_partition *partition);
 
-void nearby_space_partitions(struct space_partition *p, void *entity, double x, double y, int cell[4]);
+/* Call fn for every entity in the cells within the neighborhood of x, y, z.
+ * fn may remove the entity it is called for, or add entities.
+ */
+void space_partition_process(struct space_partition *p, double x, double y, double z,
+				void *context, space_partition_function fn);
 
-struct space_partition_entry *space_partition_neighbors(struct space_partition *p, int cell);
+/* Call fn for every entity in the cells within radius of x, y, z.  Entities in
+ * those cells but further than radius away are included, so callers wanting
+ * an exact distance must check for themselves.
+ */
+void space_partition_process_in_radius(struct space_partition *p, double x, double y, double z,
+				double radius, void *context, space_partition_function fn);
 
-void space_partition_process(struct space_partition *p, void *entity, double x, double y,
+/* Call fn for every entity in one of nslices interleaved slices of the
+ * occupied cells, excluding those cells which space_partition_process_in_radius()
+ * would visit for x, y, z and exclude_radius (pass a negative exclude_radius
+ * to exclude nothing.)  Processing slices 0 through nslices - 1 visits every
+ * entity once.
+ */
+void space_partition_process_slice(struct space_partition *p, int slice, int nslices,
+				double x, double y, double z, double exclude_radius,
 				void *context, space_partition_function fn);
 
+/* Call fn for every entity within radius of x, y, z, looking only in the cells
+ * which the sphere touches.  fn may remove the entity it is called for, or add
+ * entities.
+ */
+void space_partition_process_in_sphere(struct space_partition *p, double x, double y, double z,
+				double radius, void *context, space_partition_function fn);
+
+/* Call fn for every entity within radius of the segment from x1, y1, z1 to
+ * x2, y2, z2, looking only in the cells within radius of the segment.  For a
+ * ray, make the segment as long as it needs to go.  fn may remove the entity
+ * it is called for, or add entities.
+ */
+void space_partition_process_segment(struct space_partition *p,
+				double x1, double y1, double z1, double x2, double y2, double z2,
+				double radius, void *context, space_partition_function fn);
+
+/* Find the k entities nearest x, y, z and within max_radius of it for which
+ * filter (if not NULL) returns non-zero.  They are put in entity[], nearest
+ * first, and their squared distances in dist2[], which both have room for k.
+ * Returns how many were found.
+ */
+int space_partition_nearest(struct space_partition *p, double x, double y, double z,
+			double max_radius, int k, space_partition_filter filter, void *context,
+			void **entity, double *dist2);
+
 void remove_space_partition_entry(struct space_partition *p, struct space_partition_entry *e);
 
 #endif